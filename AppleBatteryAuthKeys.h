@@ -9,5 +9,11 @@
 #define APPLE_BATTERYAUTH_RETRY_CERT_KEY        "GetCertificateRetryCnt"
 #define APPLE_BATTERYAUTH_RETRY_TRUST_KEY       "SetTrustStatusRetryCnt"
 #define APPLE_BATTERYAUTH_RETRY_GGRESET_KEY     "RetryWithGGResetCnt"
+#define APPLE_BATTERYAUTH_GGRESET_ABORT_KEY     "CertTransferGGResetAbortCnt"
+
+#define APPLE_BATTERYAUTH_LATENCY_INFO_KEY      "GetInfoLatencyMs"
+#define APPLE_BATTERYAUTH_LATENCY_CERT_KEY      "GetCertSegmentLatencyMs"
+#define APPLE_BATTERYAUTH_LATENCY_SIGNATURE_KEY "GetSignatureLatencyMs"
+#define APPLE_BATTERYAUTH_LATENCY_STATUS_KEY    "AuthStatusWaitMs"
 
 #endif /* TARGET_OS_IOS || TARGET_OS_WATCH || (TARGET_OS_OSX && TARGET_CPU_ARM64)*/
@@ -4,6 +4,7 @@
 #include "AppleBatteryAuth.h"
 #include "AppleBatteryAuthKeys.h"
 #include "AppleBatteryAuthKeysPrivate.h"
+#include "AppleBatteryAuthHistogram.h"
 #include "AppleSmartBatteryManager.h"
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/accessory/AppleAuthCP.h>
@@ -32,7 +33,8 @@ OSDefineMetaClassAndStructors(AppleBatteryAuth, AppleAuthCPRelayInterface)
 #define DIV_ROUND_UP(x, y)  (((x) + ((y) - 1)) / (y))
 
 #define MAX_TRIES               5
-#define POLL_DELAY_SECS         3
+#define POLL_MIN_DELAY_MS       10
+#define POLL_MAX_DELAY_MS       3000
 
 #define BATT_AUTH_CERTSERIAL_LEN    32
 #define BATT_AUTH_CHALLENGE_LEN     32
@@ -46,7 +48,7 @@ OSDefineMetaClassAndStructors(AppleBatteryAuth, AppleAuthCPRelayInterface)
 #define kAppleBatteryAuthBootArgDefault   (0)   // Default
 #define kAppleBatteryAuthBootArgForceAuth (1)   // Force publishing of trusted data as soon as we get nonce
 
-#define kIOReportNumberOfReporters  1
+#define kIOReportNumberOfReporters  (1 + kBattAuthLatencyCount)
 #define kIOReportBatteryAuthGroupName "BatteryAuth"
 #define kReportCategoryBatteryAuth (kIOReportCategoryPower | kIOReportCategoryField | kIOReportCategoryDebug)
 #define kAuthCommandIDGetCertSNID IOREPORT_MAKEID('c', 'e', 'r', 's', 'n', 'r', 'e', 't')
@@ -55,6 +57,26 @@ OSDefineMetaClassAndStructors(AppleBatteryAuth, AppleAuthCPRelayInterface)
 #define kAuthCommandIDGetCertID IOREPORT_MAKEID('c', 'e', 'r', 't', ' ', 'r', 'e', 't')
 #define kAuthCommandIDSetTrustStatusID IOREPORT_MAKEID('t', 'r', 'u', 's', 't', 'r', 'e', 't')
 #define kGGResetCountID IOREPORT_MAKEID('G', 'G', 'r', 's', 't', 'c', 'n', 't')
+#define kGGResetAbortID IOREPORT_MAKEID('G', 'G', 'r', 's', 't', 'a', 'b', 't')
+#define kInfoLatencyID IOREPORT_MAKEID('i', 'n', 'f', 'o', ' ', 'l', 'a', 't')
+#define kCertLatencyID IOREPORT_MAKEID('c', 'e', 'r', 't', ' ', 'l', 'a', 't')
+#define kSignatureLatencyID IOREPORT_MAKEID('s', 'i', 'g', 'n', ' ', 'l', 'a', 't')
+#define kStatusWaitID IOREPORT_MAKEID('s', 't', 'a', 't', 'w', 'a', 'i', 't')
+
+// Buckets are picked by AppleBatteryAuthHistogram; the reporters are only
+// given the same layout so that their legends match
+static const AppleBatteryAuthHistogram battAuthLatencyBuckets(kBattAuthLatencySegments,
+                                                              kBattAuthLatencySegmentCount);
+
+static const struct {
+    uint64_t    channelID;
+    const char  *name;
+} battAuthLatencyChannels[kBattAuthLatencyCount] = {
+    [kBattAuthLatencyInfo]          = { kInfoLatencyID,         APPLE_BATTERYAUTH_LATENCY_INFO_KEY },
+    [kBattAuthLatencyCertSegment]   = { kCertLatencyID,         APPLE_BATTERYAUTH_LATENCY_CERT_KEY },
+    [kBattAuthLatencySignature]     = { kSignatureLatencyID,    APPLE_BATTERYAUTH_LATENCY_SIGNATURE_KEY },
+    [kBattAuthLatencyStatusWait]    = { kStatusWaitID,          APPLE_BATTERYAUTH_LATENCY_STATUS_KEY },
+};
 
 #define SET_INTEGER_IN_DICT(dict, key, value, width) \
 do { \
@@ -225,30 +247,31 @@ IOReturn AppleBatteryAuth::_smcAuthNotifierHandlerThread(OSObject *param)
     return true;
 }
 
-uint16_t AppleBatteryAuth::_readGgResetCount(void)
+// Fails with kIOReturnUnsupported on gauges that don't keep a reset count
+IOReturn AppleBatteryAuth::_readGgResetCount(uint16_t *count)
 {
     uint16_t cnt = 0;
     uint16_t cmd = 0x0005;
 
     // This metric is only useful on D3x, bail if this is not D3x
     if (!isRoswell()) {
-        return 0;
+        return kIOReturnUnsupported;
     }
 
     SMCResult ret = _smcWriteKey('GCCM', sizeof(cmd), &cmd);
     if (ret != kSMCSuccess) {
         BA_ERR("Failed to read GG reset count. rc:0x%x=%s\n", ret, printSMCResult(ret));
-        goto error;
+        return kIOReturnIOError;
     }
 
     ret = _smcReadKey('GCRW', sizeof(cnt), &cnt);
     if (ret != kSMCSuccess) {
         BA_ERR("Failed to read GG reset count. rc:0x%x=%s\n", ret, printSMCResult(ret));
-        goto error;
+        return kIOReturnIOError;
     }
 
-error:
-    return cnt;
+    *count = cnt;
+    return kIOReturnSuccess;
 }
 
 IOReturn AppleBatteryAuth::_smcAuthNotifierHandler(
@@ -322,11 +345,15 @@ IOReturn AppleBatteryAuth::_getCertificate(struct batt_auth_cmd *cmd, OSData **r
     }
 
     // read GG reset count
-    uint16_t ggRstCntPre = _readGgResetCount();
+    uint16_t ggRstCntPre = 0;
+    bool ggRstCntPreValid = (_readGgResetCount(&ggRstCntPre) == kIOReturnSuccess);
+    uint16_t ggRstCntAttempt = ggRstCntPre;
+    bool ggRstCntAttemptValid = ggRstCntPreValid;
 
     uint8_t op = kBatteryAuthOpGetCert0;
     do {
         AbsoluteTime dl;
+        uint64_t segStart = 0;
         uint16_t offset = 0;
         len = clen;
         uint8_t cert[BATT_AUTH_MAX_CERT_LENGTH] __attribute__((__aligned__(64)));
@@ -340,6 +367,7 @@ IOReturn AppleBatteryAuth::_getCertificate(struct batt_auth_cmd *cmd, OSData **r
         }
 
         while (clen && op <= kBatteryAuthOpGetCert9) {
+            clock_get_uptime(&segStart);
             ret = _smcWriteKey('BATC', sizeof(op), &op);
             if (ret) {
                 ioret = kIOReturnIOError;
@@ -366,6 +394,9 @@ IOReturn AppleBatteryAuth::_getCertificate(struct batt_auth_cmd *cmd, OSData **r
                 goto ErrRetryCert;
             }
 
+            _tallyLatency(kBattAuthLatencyCertSegment, segStart);
+            segStart = 0;
+
             size_t sz = min(clen, BATT_AUTH_SMC_DATA_LEN);
             memcpy(&cert[offset], buf, sz);
 
@@ -379,21 +410,109 @@ IOReturn AppleBatteryAuth::_getCertificate(struct batt_auth_cmd *cmd, OSData **r
             return kIOReturnNoMemory;
         }
 
-ErrRetryCert:   ;
+ErrRetryCert:
+        if (segStart) {
+            _tallyLatency(kBattAuthLatencyCertSegment, segStart);
+        }
+        if (ret != kSMCSuccess || ioret != kIOReturnSuccess) {
+            // A gas gauge reset after some segments were read aborts the transfer
+            uint16_t ggRstCnt = 0;
+            bool ggRstCntValid = (_readGgResetCount(&ggRstCnt) == kIOReturnSuccess);
+            if (ggRstCntValid && ggRstCntAttemptValid &&
+                ggRstCnt != ggRstCntAttempt && op > kBatteryAuthOpGetCert0) {
+                BA_ERR("gas gauge reset during certificate transfer at op '%u'\n", op);
+                _reporter->incrementValue(kGGResetAbortID, 1);
+            }
+            ggRstCntAttempt = ggRstCnt;
+            ggRstCntAttemptValid = ggRstCntValid;
+        }
     } while ((ret != kSMCSuccess || ioret != kIOReturnSuccess) && retry++ < MAX_TRIES);
 
-    if (retry) {
+    if (retry && ggRstCntPreValid) {
         // read GG reset count
-        uint16_t ggRstCntPost = _readGgResetCount();
-        unsigned int diff = ggRstCntPost - ggRstCntPre;
-        if (diff) {
-            _reporter->incrementValue(kGGResetCountID, diff);
+        uint16_t ggRstCntPost = 0;
+        if (_readGgResetCount(&ggRstCntPost) == kIOReturnSuccess) {
+            unsigned int diff = (uint16_t)(ggRstCntPost - ggRstCntPre);
+            if (diff) {
+                _reporter->incrementValue(kGGResetCountID, diff);
+            }
         }
     }
 
     return ioret;
 }
 
+void AppleBatteryAuth::_flushCertCache(void)
+{
+    OSSafeReleaseNULL(_certCache);
+    OSSafeReleaseNULL(_certSNCache);
+    _certCacheKey.clear();
+}
+
+// The certificate and its serial only change when the battery is swapped or
+// the gauge resets. Check the cache key (battery serial + GG reset count)
+// against the current battery and drop the cache if it doesn't match, or if
+// the reset count can't be read.
+void AppleBatteryAuth::_validateCertCache(void)
+{
+    OSObject *installed = _provider->copyProperty(kIOPMPSBatteryInstalledKey);
+    OSObject *obj = _provider->copyProperty(kIOPMPSSerialKey);
+    OSString *serial = OSDynamicCast(OSString, obj);
+    const char *sn = (installed == kOSBooleanTrue && serial) ? serial->getCStringNoCopy() : NULL;
+    bool hadKey = _certCacheKey.valid();
+    uint16_t prevCnt = _certCacheKey.resetCount();
+    uint16_t ggRstCnt = 0;
+    bool ggRstCntValid = (_readGgResetCount(&ggRstCnt) == kIOReturnSuccess);
+
+    if (!_certCacheKey.validate(sn, ggRstCntValid, ggRstCnt)) {
+        if (hadKey) {
+            BA_DBG("battery removed, GG reset count changed (%u -> %u) or unreadable, flushing certificate cache",
+                   prevCnt, ggRstCnt);
+        }
+        OSSafeReleaseNULL(_certCache);
+        OSSafeReleaseNULL(_certSNCache);
+    }
+
+    OSSafeReleaseNULL(installed);
+    OSSafeReleaseNULL(obj);
+}
+
+// Returns a retained copy of the cached response to @cmd, if any
+OSData *AppleBatteryAuth::_copyCachedCert(uint8_t cmd)
+{
+    OSData *data;
+
+    _validateCertCache();
+
+    data = (cmd == kAuthCommandIDGetCert) ? _certCache : _certSNCache;
+    if (data) {
+        BA_DBG("Command %u served from certificate cache", cmd);
+        data->retain();
+    }
+
+    return data;
+}
+
+void AppleBatteryAuth::_cacheCert(uint8_t cmd, OSData *data)
+{
+    uint16_t ggRstCnt = 0;
+    bool ggRstCntValid = (_readGgResetCount(&ggRstCnt) == kIOReturnSuccess);
+
+    // a gauge reset during the transfer invalidates what we just read
+    if (!_certCacheKey.mayStore(ggRstCntValid, ggRstCnt)) {
+        return;
+    }
+
+    data->retain();
+    if (cmd == kAuthCommandIDGetCert) {
+        OSSafeReleaseNULL(_certCache);
+        _certCache = data;
+    } else {
+        OSSafeReleaseNULL(_certSNCache);
+        _certSNCache = data;
+    }
+}
+
 static OSDictionary *parseAuthInfoRoswell(uint8_t *buf, IOService *provider)
 {
     OSDictionary *dict = OSDictionary::withCapacity(6);
@@ -439,26 +558,36 @@ static OSDictionary *parseAuthInfoVeridian(uint8_t *buf)
     return dict;
 }
 
+// Signing typically completes well before the first of the old fixed 3s
+// polls; start polling after a few ms and back off exponentially up to
+// POLL_MAX_DELAY_MS so a slow signature doesn't flood the SMC.
 IOReturn AppleBatteryAuth::_veridianPollAuthStatus(unsigned int timeout_sec)
 {
     OSData *status = nullptr;
-    unsigned int iterations = DIV_ROUND_UP(timeout_sec, POLL_DELAY_SECS);
+    AppleBatteryAuthPollBackoff backoff(timeout_sec * 1000, POLL_MIN_DELAY_MS, POLL_MAX_DELAY_MS);
+    unsigned int delay_ms;
+    uint64_t start;
 
-    for (size_t i = 0; i < iterations; i++) {
-        IOSleep(POLL_DELAY_SECS * 1000);
+    clock_get_uptime(&start);
+    while (backoff.next(&delay_ms)) {
+        IOSleep(delay_ms);
 
         IOReturn ioret = _getInfo(kBatteryAuthOpGetStatus, &status);
         if (ioret != kIOReturnSuccess) {
+            _tallyLatency(kBattAuthLatencyStatusWait, start);
             return ioret;
         }
 
         uint16_t st = *(uint16_t *)status->getBytesNoCopy();
         OSSafeReleaseNULL(status);
         if (st == kVeridianAuthStatusOk) {
+            BA_DBG("auth status ok after %u ms", backoff.elapsed());
+            _tallyLatency(kBattAuthLatencyStatusWait, start);
             return kIOReturnSuccess;
         }
     }
 
+    _tallyLatency(kBattAuthLatencyStatusWait, start);
     return kIOReturnTimeout;
 }
 
@@ -475,10 +604,15 @@ IOReturn AppleBatteryAuth::_getInfo(uint8_t op, void *retdata)
     }
 
     // read GG reset count
-    uint16_t ggRstCntPre = _readGgResetCount();
+    uint16_t ggRstCntPre = 0;
+    bool ggRstCntPreValid = (_readGgResetCount(&ggRstCntPre) == kIOReturnSuccess);
+
+    int latency = (bauthOp2channelId(op) == kAuthCommandIDGetSignatureID) ?
+                    kBattAuthLatencySignature : kBattAuthLatencyInfo;
 
     do {
         AbsoluteTime dl;
+        uint64_t start;
         BA_DBG("_getInfo attempt %lu/%u", retry, MAX_TRIES);
         ioret = kIOReturnSuccess;
 
@@ -486,6 +620,7 @@ IOReturn AppleBatteryAuth::_getInfo(uint8_t op, void *retdata)
             _incrementChannel(op);
             IOSleep(700);
         }
+        clock_get_uptime(&start);
 
         // write input data
         if (op == kBatteryAuthOpSetChallenge ||
@@ -534,15 +669,18 @@ IOReturn AppleBatteryAuth::_getInfo(uint8_t op, void *retdata)
                 goto ErrRetry;
             }
         }
-ErrRetry:   ;
+ErrRetry:
+        _tallyLatency(latency, start);
     } while ((ret != kSMCSuccess || ioret != kIOReturnSuccess) && retry++ < MAX_TRIES);
 
-    if (retry) {
+    if (retry && ggRstCntPreValid) {
         // read GG reset count
-        uint16_t ggRstCntPost = _readGgResetCount();
-        unsigned int diff = ggRstCntPost - ggRstCntPre;
-        if (diff) {
-            _reporter->incrementValue(kGGResetCountID, diff);
+        uint16_t ggRstCntPost = 0;
+        if (_readGgResetCount(&ggRstCntPost) == kIOReturnSuccess) {
+            unsigned int diff = (uint16_t)(ggRstCntPost - ggRstCntPre);
+            if (diff) {
+                _reporter->incrementValue(kGGResetCountID, diff);
+            }
         }
     }
 
@@ -707,7 +845,12 @@ void AppleBatteryAuth::_battAuthThreadGated(struct batt_auth_cmd *cmd)
     }
 
     case kAuthCommandIDGetCertSN: {
-        OSData *data;
+        OSData *data = _copyCachedCert(cmd->cmd);
+        if (data) {
+            retdata = data;
+            break;
+        }
+
         BA_DBG("Send kBatteryAuthOpGetCertSerial Command to SMC");
         ioret = _getInfo(kBatteryAuthOpGetCertSerial, &data);
         BA_DBG("kBatteryAuthOpGetCertSerial resp: %d", ioret);
@@ -715,13 +858,19 @@ void AppleBatteryAuth::_battAuthThreadGated(struct batt_auth_cmd *cmd)
             goto ErrDone;
         }
 
+        _cacheCert(cmd->cmd, data);
         retdata = data;
 
         break;
     }
 
     case kAuthCommandIDGetCert: {
-        OSData *data;
+        OSData *data = _copyCachedCert(cmd->cmd);
+        if (data) {
+            retdata = data;
+            break;
+        }
+
         BA_DBG("Send kAuthCommandIDGetCert Command to SMC");
         ioret = _getCertificate(cmd, &data);
         BA_DBG("kAuthCommandIDGetCert resp: %d", ioret);
@@ -729,6 +878,7 @@ void AppleBatteryAuth::_battAuthThreadGated(struct batt_auth_cmd *cmd)
             goto ErrDone;
         }
 
+        _cacheCert(cmd->cmd, data);
         retdata = data;
 
         break;
@@ -828,44 +978,44 @@ ErrDone:
 
     OSSafeReleaseNULL(retdata);
     IOFreeType(cmd, struct batt_auth_cmd);
-
-    _interfacePut();
 }
 
+// Drain the command queue in submission order
 void AppleBatteryAuth::_battAuthThread(void * param1)
 {
-    struct batt_auth_cmd *cmd = static_cast<struct batt_auth_cmd *>(param1);
+    struct batt_auth_cmd *cmd;
 
-    _sbCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
-                &AppleBatteryAuth::_battAuthThreadGated), cmd);
+    while ((cmd = _dequeueCmd())) {
+        _sbCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
+                    &AppleBatteryAuth::_battAuthThreadGated), cmd);
+    }
 }
 
-bool AppleBatteryAuth::_interfaceTryGet(void)
+// Queue a command for the auth thread. Fails only when the queue is full.
+bool AppleBatteryAuth::_enqueueCmd(struct batt_auth_cmd *cmd)
 {
-    bool ret;
+    bool queued, kick;
 
-    if (!IOLockTryLock(_submitLock)) {
-        return false;
-    }
+    IOLockLock(_submitLock);
+    queued = _cmdQueue.push(cmd, &kick);
+    IOLockUnlock(_submitLock);
 
-    if (_battAuthBusy) {
-        ret = false;
-        goto unlock;
+    if (kick) {
+        thread_call_enter(_battAuthThreadCall);
     }
 
-    _battAuthBusy = true;
-    ret = true;
-
-unlock:
-    IOLockUnlock(_submitLock);
-
-    return ret;
+    return queued;
 }
 
-void AppleBatteryAuth::_interfacePut(void)
+struct batt_auth_cmd *AppleBatteryAuth::_dequeueCmd(void)
 {
-    assert(_battAuthBusy);
-    _battAuthBusy = false;
+    struct batt_auth_cmd *cmd;
+
+    IOLockLock(_submitLock);
+    cmd = _cmdQueue.pop();
+    IOLockUnlock(_submitLock);
+
+    return cmd;
 }
 
 IOReturn AppleBatteryAuth::authSendData(uint8_t cmdId, OSData *data)
@@ -905,15 +1055,16 @@ IOReturn AppleBatteryAuth::authSendData(uint8_t cmdId, OSData *data)
         break;
     }
 
-    if (!_interfaceTryGet()) {
-        return kIOReturnBusy;
-    }
-
     struct batt_auth_cmd *cmd = static_cast<struct batt_auth_cmd *>(IOMallocType(struct batt_auth_cmd));
     cmd->cmd = cmdId;
     cmd->data = data;
 
-    thread_call_enter1(_battAuthThreadCall, cmd);
+    if (!_enqueueCmd(cmd)) {
+        BA_ERR("command queue full, dropping command %u\n", cmdId);
+        OSSafeReleaseNULL(cmd->data);
+        IOFreeType(cmd, struct batt_auth_cmd);
+        return kIOReturnBusy;
+    }
 
     return kIOReturnSuccess;
 }
@@ -993,10 +1144,31 @@ IOReturn AppleBatteryAuth::_createReporters(void)
     _reporter->addChannel(kAuthCommandIDGetCertID, APPLE_BATTERYAUTH_RETRY_CERT_KEY);
     _reporter->addChannel(kAuthCommandIDSetTrustStatusID, APPLE_BATTERYAUTH_RETRY_TRUST_KEY);
     _reporter->addChannel(kGGResetCountID, APPLE_BATTERYAUTH_RETRY_GGRESET_KEY);
+    _reporter->addChannel(kGGResetAbortID, APPLE_BATTERYAUTH_GGRESET_ABORT_KEY);
 
     IOReportLegend::addReporterLegend(this, _reporter, kIOReportBatteryAuthGroupName, NULL);
     _reporterSet->setObject(_reporter);
 
+    IOHistogramSegmentConfig segments[kBattAuthLatencySegmentCount];
+    for (size_t i = 0; i < kBattAuthLatencySegmentCount; i++) {
+        segments[i].base_bucket_width = kBattAuthLatencySegments[i].width;
+        segments[i].scale_flag = 0;     // linear
+        segments[i].segment_idx = (uint32_t)i;
+        segments[i].segment_bucket_count = kBattAuthLatencySegments[i].count;
+    }
+
+    for (int i = 0; i < kBattAuthLatencyCount; i++) {
+        _latencyReporter[i] = IOHistogramReporter::with(this, kReportCategoryBatteryAuth,
+                                battAuthLatencyChannels[i].channelID, battAuthLatencyChannels[i].name,
+                                kIOReportUnit_ms, kBattAuthLatencySegmentCount, segments);
+        if (!_latencyReporter[i]) {
+            _destroyReporters();
+            return kIOReturnNoResources;
+        }
+        IOReportLegend::addReporterLegend(this, _latencyReporter[i], kIOReportBatteryAuthGroupName, NULL);
+        _reporterSet->setObject(_latencyReporter[i]);
+    }
+
     // set initial values
     _updateChannelValue(_reporter, kAuthCommandIDGetCertSNID, (int64_t)0);
     _updateChannelValue(_reporter, kAuthCommandIDGetInfoID, (int64_t)0);
@@ -1004,6 +1176,7 @@ IOReturn AppleBatteryAuth::_createReporters(void)
     _updateChannelValue(_reporter, kAuthCommandIDGetCertID, (int64_t)0);
     _updateChannelValue(_reporter, kAuthCommandIDSetTrustStatusID, (int64_t)0);
     _updateChannelValue(_reporter, kGGResetCountID, (int64_t)0);
+    _updateChannelValue(_reporter, kGGResetAbortID, (int64_t)0);
 
     return kIOReturnSuccess;
 }
@@ -1011,6 +1184,9 @@ IOReturn AppleBatteryAuth::_createReporters(void)
 IOReturn AppleBatteryAuth::_destroyReporters(void)
 {
     OSSafeReleaseNULL(_reporter);
+    for (int i = 0; i < kBattAuthLatencyCount; i++) {
+        OSSafeReleaseNULL(_latencyReporter[i]);
+    }
     OSSafeReleaseNULL(_reporterSet);
 
     _reporter = NULL;
@@ -1073,6 +1249,24 @@ IOReturn AppleBatteryAuth::_incrementChannel(uint8_t op)
     return _reporter->incrementValue(channelId, 1);
 }
 
+// Tally the time since @start, a clock_get_uptime() timestamp, in ms
+void AppleBatteryAuth::_tallyLatency(int which, uint64_t start)
+{
+    uint64_t now, nsec;
+    int bucket;
+
+    if (!_latencyReporter[which]) {
+        return;
+    }
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - start, &nsec);
+    bucket = battAuthLatencyBuckets.bucketFor((int64_t)(nsec / NSEC_PER_MSEC));
+    if (bucket >= 0) {
+        _latencyReporter[which]->incrementBucket(bucket, 1);
+    }
+}
+
 IOReturn AppleBatteryAuth::configureReport(IOReportChannelList *channels, IOReportConfigureAction action,
                                            void *result, void *destination)
 {
@@ -1151,6 +1345,12 @@ void AppleBatteryAuth::free(void)
 {
     OSSafeReleaseNULL(fWorkLoop);
     _destroyReporters();
+    _flushCertCache();
+    struct batt_auth_cmd *cmd;
+    while ((cmd = _cmdQueue.flush())) {
+        OSSafeReleaseNULL(cmd->data);
+        IOFreeType(cmd, struct batt_auth_cmd);
+    }
     IOLockFree(_submitLock);
     super::free();
 }
@@ -1184,7 +1384,7 @@ AppleBatteryAuth *AppleBatteryAuth::withSMCFamily(AppleSMCFamily *smc,
 
     me->fSMCDriver = smc;
     me->fWorkLoop = NULL;
-    me->_battAuthBusy = false;
+    me->_cmdQueue.init();
     me->_flags = authChip;
     me->trustedDataEnabled = trustedDataEnabled;
 
@@ -10,6 +10,8 @@
 #include <libkern/c++/OSObject.h>
 #include <kern/thread_call.h>
 #include <battery/battery_authentication.h>
+#include "AppleBatteryAuthCertCache.h"
+#include "AppleBatteryAuthQueue.h"
 
 class IOWorkLoop;
 class IOCommandGate;
@@ -22,6 +24,16 @@ struct AppleBatteryAuthNotificationStatus {
 };
 
 class AppleSmartBattery;
+struct batt_auth_cmd;
+
+// Latency histograms, each exported through its own IOHistogramReporter
+enum {
+    kBattAuthLatencyInfo = 0,       // one _getInfo() SMC round trip
+    kBattAuthLatencyCertSegment,    // one certificate segment
+    kBattAuthLatencySignature,      // challenge, nonce and signature round trips
+    kBattAuthLatencyStatusWait,     // Veridian auth status polling
+    kBattAuthLatencyCount
+};
 
 class AppleBatteryAuth : public AppleAuthCPRelayInterface {
 OSDeclareDefaultStructors(AppleBatteryAuth)
@@ -50,9 +62,13 @@ private:
     thread_call_t         _battAuthThreadCall;
     thread_call_t         _battAuthSMCNotifThreadCall;
     OSObject*             _battAuthOwner;
-    bool                  _battAuthBusy;
+    AppleBatteryAuthCmdQueue<struct batt_auth_cmd> _cmdQueue;
+    OSData                *_certCache;
+    OSData                *_certSNCache;
+    AppleBatteryAuthCertCacheKey _certCacheKey;
     OSSet                 *_reporterSet;
     IOSimpleReporter      *_reporter;
+    IOHistogramReporter   *_latencyReporter[kBattAuthLatencyCount];
     struct AppleBatteryAuthNotificationStatus _receivedNotificationStatus;
 
     SMCResult _smcReadKey(SMCKey key, IOByteCount length, void *data);
@@ -61,24 +77,29 @@ private:
     IOReturn _smcAuthNotifierHandlerThread(OSObject *param);
     void    _battAuthThread(void * param1);
     void    _battAuthThreadGated(struct batt_auth_cmd *cmd);
-    bool    _interfaceTryGet(void);
-    void    _interfacePut(void);
+    bool    _enqueueCmd(struct batt_auth_cmd *cmd);
+    struct batt_auth_cmd *_dequeueCmd(void);
     IOReturn _createReporters(void);
     IOReturn _destroyReporters(void);
     IOReturn _checkOperationStatus(uint8_t op);
 
     IOReturn _getCertificate(struct batt_auth_cmd *cmd, OSData **retdata);
+    void     _flushCertCache(void);
+    void     _validateCertCache(void);
+    OSData   *_copyCachedCert(uint8_t cmd);
+    void     _cacheCert(uint8_t cmd, OSData *data);
     IOReturn _getInfo(uint8_t op, void *retdata);
     IOReturn _veridianPollAuthStatus(unsigned int timeout_sec);
     IOReturn _updateChannelValue(IOSimpleReporter *reporter, uint64_t channel, OSObject *obj);
     IOReturn _updateChannelValue(IOSimpleReporter *reporter, uint64_t channel, int64_t value);
     IOReturn _incrementChannel(uint8_t op);
+    void     _tallyLatency(int which, uint64_t start);
     IOReturn configureReport(IOReportChannelList *channels, IOReportConfigureAction action,
                              void *result, void *destination) APPLE_KEXT_OVERRIDE;
     IOReturn updateReport(IOReportChannelList *channels, IOReportUpdateAction action,
                           void *result, void *destination) APPLE_KEXT_OVERRIDE;
 
-    uint16_t _readGgResetCount(void);
+    IOReturn _readGgResetCount(uint16_t *count);
     void _checkTrustValueAndPublishNonce(const OSData *authStatus);
     void _copyDeviceNonceTrustedData(const OSData *nonce);
     uint32_t _getBootArg(void);
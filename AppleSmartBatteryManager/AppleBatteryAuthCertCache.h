@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Key for the cached battery certificate and cert serial: the battery serial
+// number plus the GG reset count. The cached responses themselves are kept
+// by the driver, which drops them whenever validate() returns false.
+// Nothing is cached while the reset count can't be read, since a failed read
+// says nothing about whether the gauge reset.
+class AppleBatteryAuthCertCacheKey {
+public:
+    AppleBatteryAuthCertCacheKey() : _valid(false), _resetCount(0) { _serial[0] = '\0'; }
+
+    // Check the key against the battery that is installed now, with serial
+    // @serial (NULL if there is none). Returns true if cached responses may
+    // still be served; otherwise the caller must drop them, and the key is
+    // moved to the current battery if it can be identified.
+    bool validate(const char *serial, bool resetCountValid, uint16_t resetCount)
+    {
+        size_t len = serial ? strlen(serial) : 0;
+
+        if (!serial || !resetCountValid || len >= sizeof(_serial)) {
+            clear();
+            return false;
+        }
+
+        if (_valid && _resetCount == resetCount && !strcmp(_serial, serial)) {
+            return true;
+        }
+
+        memcpy(_serial, serial, len + 1);
+        _resetCount = resetCount;
+        _valid = true;
+
+        return false;
+    }
+
+    // Whether a response read under this key may be cached, given the reset
+    // count read back after the transfer
+    bool mayStore(bool resetCountValid, uint16_t resetCount) const
+    {
+        return _valid && resetCountValid && resetCount == _resetCount;
+    }
+
+    void clear()
+    {
+        _valid = false;
+        _resetCount = 0;
+        _serial[0] = '\0';
+    }
+
+    bool valid() const { return _valid; }
+    uint16_t resetCount() const { return _resetCount; }
+
+private:
+    bool        _valid;
+    uint16_t    _resetCount;
+    char        _serial[64];
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// One run of equal-width histogram buckets
+struct AppleBatteryAuthHistogramSegment {
+    uint32_t    width;
+    uint32_t    count;
+};
+
+// Maps values onto the buckets of a histogram made of linear segments.
+// Segment i holds segments[i].count buckets of segments[i].width, starting
+// where segment i - 1 ended; the first one starts at 0. Negative values land
+// in the first bucket and values past the last segment in the last bucket.
+class AppleBatteryAuthHistogram {
+public:
+    AppleBatteryAuthHistogram(const AppleBatteryAuthHistogramSegment *segments, size_t count)
+        : _segments(segments), _count(count) {}
+
+    int buckets() const
+    {
+        int n = 0;
+
+        for (size_t i = 0; i < _count; i++) {
+            n += (int)_segments[i].count;
+        }
+
+        return n;
+    }
+
+    // Index of the bucket @value falls in, or -1 if there are no buckets
+    int bucketFor(int64_t value) const
+    {
+        int64_t base = 0;
+        int bucket = 0;
+
+        if (value < 0) {
+            value = 0;
+        }
+
+        for (size_t i = 0; i < _count; i++) {
+            const AppleBatteryAuthHistogramSegment *seg = &_segments[i];
+            int64_t end = base + (int64_t)seg->width * seg->count;
+
+            if (value < end) {
+                return bucket + (int)((value - base) / seg->width);
+            }
+            base = end;
+            bucket += (int)seg->count;
+        }
+
+        return bucket - 1;
+    }
+
+    // Smallest value counted in @bucket
+    int64_t lowerBound(int bucket) const
+    {
+        int64_t base = 0;
+
+        for (size_t i = 0; i < _count && bucket >= 0; i++) {
+            const AppleBatteryAuthHistogramSegment *seg = &_segments[i];
+
+            if (bucket < (int)seg->count) {
+                return base + (int64_t)seg->width * bucket;
+            }
+            base += (int64_t)seg->width * seg->count;
+            bucket -= (int)seg->count;
+        }
+
+        return -1;
+    }
+
+private:
+    const AppleBatteryAuthHistogramSegment  *_segments;
+    size_t                                  _count;
+};
+
+// Latency buckets, in ms: 10ms wide up to 100ms, 100ms wide up to 1s and
+// 1s wide up to 10s, which covers the SMC_RESP_TIMEOUT notification timeout
+// and the longest Veridian status wait.
+static const AppleBatteryAuthHistogramSegment kBattAuthLatencySegments[] = {
+    { 10,   10 },
+    { 100,  9 },
+    { 1000, 9 },
+};
+
+#define kBattAuthLatencySegmentCount \
+    (sizeof(kBattAuthLatencySegments) / sizeof(kBattAuthLatencySegments[0]))
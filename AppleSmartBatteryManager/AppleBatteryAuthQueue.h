@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Commands submitted through authSendData() while another one is in flight
+// wait in a FIFO of this depth; authSendData() returns busy once it's full.
+#define BATT_AUTH_QUEUE_DEPTH   8
+
+// Bounded FIFO of auth commands, and whether the auth thread call is
+// draining it. The driver serializes every call with its submit lock.
+template <class T>
+class AppleBatteryAuthCmdQueue {
+public:
+    void init(void)
+    {
+        for (size_t i = 0; i < BATT_AUTH_QUEUE_DEPTH; i++) {
+            _cmds[i] = NULL;
+        }
+        _head = 0;
+        _count = 0;
+        _draining = false;
+    }
+
+    // Queue @cmd behind the ones already waiting. Fails if the queue is
+    // full. *kick is set when nothing is draining the queue, and the caller
+    // has to start the auth thread.
+    bool push(T *cmd, bool *kick)
+    {
+        *kick = false;
+
+        if (_count == BATT_AUTH_QUEUE_DEPTH) {
+            return false;
+        }
+
+        _cmds[(_head + _count) % BATT_AUTH_QUEUE_DEPTH] = cmd;
+        _count++;
+
+        if (!_draining) {
+            _draining = true;
+            *kick = true;
+        }
+
+        return true;
+    }
+
+    // Next command for the auth thread. Once the queue is empty it returns
+    // NULL and the thread stops; the next push() kicks it again.
+    T *pop(void)
+    {
+        T *cmd = take();
+
+        if (!cmd) {
+            _draining = false;
+        }
+
+        return cmd;
+    }
+
+    // Remove whatever is still queued, when the driver goes away
+    T *flush(void)
+    {
+        return take();
+    }
+
+    size_t count(void) const { return _count; }
+    bool draining(void) const { return _draining; }
+
+private:
+    T *take(void)
+    {
+        T *cmd;
+
+        if (!_count) {
+            return NULL;
+        }
+
+        cmd = _cmds[_head];
+        _cmds[_head] = NULL;
+        _head = (_head + 1) % BATT_AUTH_QUEUE_DEPTH;
+        _count--;
+
+        return cmd;
+    }
+
+    T           *_cmds[BATT_AUTH_QUEUE_DEPTH];
+    uint32_t    _head;
+    uint32_t    _count;
+    bool        _draining;
+};
+
+// Delays between auth status polls: @min_ms first, doubling up to @max_ms,
+// with the last one cut short so the polls never sleep past @timeout_ms.
+class AppleBatteryAuthPollBackoff {
+public:
+    AppleBatteryAuthPollBackoff(unsigned int timeout_ms, unsigned int min_ms, unsigned int max_ms)
+        : _timeout(timeout_ms), _max(max_ms), _delay(min_ms ? min_ms : 1), _elapsed(0) {}
+
+    // Delay before the next poll. Returns false once the timeout is used up.
+    bool next(unsigned int *delay_ms)
+    {
+        if (_elapsed >= _timeout) {
+            return false;
+        }
+
+        *delay_ms = (_delay < _timeout - _elapsed) ? _delay : _timeout - _elapsed;
+        _elapsed += *delay_ms;
+        _delay = (_delay > _max / 2) ? _max : _delay * 2;
+
+        return true;
+    }
+
+    // Time slept in the delays handed out so far
+    unsigned int elapsed(void) const { return _elapsed; }
+
+private:
+    unsigned int _timeout;
+    unsigned int _max;
+    unsigned int _delay;
+    unsigned int _elapsed;
+};
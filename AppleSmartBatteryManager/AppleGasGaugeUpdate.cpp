@@ -5,6 +5,9 @@
 #include "AppleGasGaugeUpdateUserClientPrivate.h"
 #include "AppleSmartBatteryManager.h"
 #include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOMessage.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/crc.h>
 
 #define super IOService
 OSDefineMetaClassAndStructors(AppleGasGaugeUpdate, IOService)
@@ -23,6 +26,8 @@ OSDefineMetaClassAndStructors(AppleGasGaugeUpdate, IOService)
 static const OSSymbol *_kCommError = OSSymbol::withCString("CommunicationError");
 static const OSSymbol *_kUpdaterStatus = OSSymbol::withCString("UpdaterStatus");
 static const OSSymbol *_kBatteryId = OSSymbol::withCString("BatteryID");
+static const OSSymbol *_kResumeType = OSSymbol::withCString("ResumeDataType");
+static const OSSymbol *_kResumeOffset = OSSymbol::withCString("ResumeOffset");
 
 void AppleGasGaugeUpdate::_clearErrorReports(void)
 {
@@ -30,6 +35,154 @@ void AppleGasGaugeUpdate::_clearErrorReports(void)
     removeProperty(_kUpdaterStatus);
 }
 
+void AppleGasGaugeUpdate::_clearCheckpoint(void)
+{
+    if (_ggCheckpoint.valid) {
+        GG_UPD_LOG("checkpoint cleared: type:%llu offset:%llu/%llu\n",
+                   _ggCheckpoint.type, _ggCheckpoint.ackedOffset, _ggCheckpoint.dataLength);
+    }
+    bzero(&_ggCheckpoint, sizeof(_ggCheckpoint));
+    removeProperty(_kResumeType);
+    removeProperty(_kResumeOffset);
+}
+
+void AppleGasGaugeUpdate::_publishCheckpoint(void)
+{
+    OSNumber *num;
+
+    num = OSNumber::withNumber(_ggCheckpoint.type, 64);
+    if (num) {
+        setProperty(_kResumeType, num);
+        OSSafeReleaseNULL(num);
+    }
+
+    num = OSNumber::withNumber(_ggCheckpoint.ackedOffset, 64);
+    if (num) {
+        setProperty(_kResumeOffset, num);
+        OSSafeReleaseNULL(num);
+    }
+}
+
+// Start tracking progress of an image transfer from offset 0
+void AppleGasGaugeUpdate::_armCheckpoint(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                         const uint8_t *bytes)
+{
+    _ggCheckpoint.valid = true;
+    _ggCheckpoint.batteryId = _ggBatteryId;
+    _ggCheckpoint.type = data->type;
+    _ggCheckpoint.dataLength = data->data_length;
+    _ggCheckpoint.imageCrc = crc32(0, bytes, data->data_length);
+    _ggCheckpoint.ackedOffset = 0;
+    _ggCheckpoint.prefixCrc = 0;
+    _ggCheckpoint.sleepCount = (uint32_t)_ggSleepCount;
+    memcpy(_ggCheckpoint.nonce, _ggSessionNonce, sizeof(_ggCheckpoint.nonce));
+}
+
+// Called once the updater has acknowledged [offset, offset + length)
+void AppleGasGaugeUpdate::_advanceCheckpoint(const uint8_t *data, size_t offset, size_t length)
+{
+    if (!_ggCheckpoint.valid || _ggCheckpoint.ackedOffset != offset) {
+        return;
+    }
+
+    _ggCheckpoint.prefixCrc = crc32(_ggCheckpoint.prefixCrc, &data[offset], length);
+    _ggCheckpoint.ackedOffset = offset + length;
+}
+
+// Read back what the updater reports about an interrupted transfer
+void AppleGasGaugeUpdate::_readResumeStateGated(struct AppleGasGaugeUpdateResumeState *state)
+{
+    uint16_t status = kRegUpdaterStatusBusy;
+
+    bzero(state, sizeof(*state));
+
+    state->ready = (_pollUpdaterStatus(&status) == kIOReturnSuccess && status == kRegUpdaterStatusReady);
+    state->batteryIdValid = (_getBatteryIdGated(&state->batteryId) == kIOReturnSuccess);
+
+    // Without sleep notifications a sleep since the checkpoint can't be ruled out
+    state->sleepCount = _ggSleepNotifier ? (uint32_t)_ggSleepCount : _ggCheckpoint.sleepCount + 1;
+
+    // Optional like 'BFUW', so don't go through _smcReadKey() and its retries
+    state->progressValid = (_SMCDriver->smcReadKeyHostEndian('BFUP', sizeof(state->progress),
+                                                             &state->progress) == kSMCSuccess);
+
+    state->nonceValid = (_getChallengeDataGated(state->nonce) == kIOReturnSuccess);
+}
+
+// Whether the updater still holds the prefix the checkpoint says it
+// acknowledged. Drops the checkpoint when it doesn't. On success @nonce, if
+// set, gets the nonce of the updater's session.
+bool AppleGasGaugeUpdate::_updaterHoldsCheckpointGated(uint8_t *nonce)
+{
+    struct AppleGasGaugeUpdateResumeState state;
+    enum AppleGasGaugeUpdateResumeCheck check;
+
+    _readResumeStateGated(&state);
+
+    check = AppleGasGaugeUpdateCheckResume(&_ggCheckpoint, &state);
+    if (check != kGgResumeOK) {
+        GG_UPD_LOG("checkpoint not resumable: reason:%u type:%llu acked:%llu received:%u\n",
+                   check, _ggCheckpoint.type, _ggCheckpoint.ackedOffset,
+                   state.progressValid ? state.progress.received : 0);
+        _clearCheckpoint();
+        return false;
+    }
+
+    if (nonce) {
+        memcpy(nonce, state.nonce, sizeof(state.nonce));
+    }
+
+    return true;
+}
+
+// An interrupted transfer can be resumed when the same image is sent again
+// to the same battery: the image CRC has to match, the prefix the updater
+// already acknowledged has to hash to the running CRC we kept, and the
+// updater has to confirm it still holds that prefix.
+bool AppleGasGaugeUpdate::_canResumeGated(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                          const uint8_t *bytes, size_t *resume_offset)
+{
+    if (!_ggCheckpoint.valid ||
+        _ggCheckpoint.type != data->type ||
+        _ggCheckpoint.dataLength != data->data_length ||
+        _ggCheckpoint.batteryId != _ggBatteryId) {
+        return false;
+    }
+
+    if (!_ggCheckpoint.ackedOffset || _ggCheckpoint.ackedOffset >= _ggCheckpoint.dataLength) {
+        return false;
+    }
+
+    if (crc32(0, bytes, _ggCheckpoint.ackedOffset) != _ggCheckpoint.prefixCrc ||
+        crc32(0, bytes, data->data_length) != _ggCheckpoint.imageCrc) {
+        GG_UPD_LOG("image changed since checkpoint, restarting transfer\n");
+        return false;
+    }
+
+    if (!_updaterHoldsCheckpointGated(NULL)) {
+        return false;
+    }
+
+    *resume_offset = _ggCheckpoint.ackedOffset;
+
+    return true;
+}
+
+// The updater doesn't keep its session across system sleep, so a transfer
+// interrupted before a sleep can't be resumed after it
+IOReturn AppleGasGaugeUpdate::_sleepWakeHandler(void *target, void *refCon __unused, UInt32 messageType,
+                                               IOService *provider __unused, void *messageArgument __unused,
+                                               vm_size_t argSize __unused)
+{
+    AppleGasGaugeUpdate *me = (AppleGasGaugeUpdate *)target;
+
+    if (messageType == kIOMessageSystemWillSleep) {
+        OSIncrementAtomic(&me->_ggSleepCount);
+    }
+
+    return kIOReturnSuccess;
+}
+
 IOReturn AppleGasGaugeUpdate::_smcGgFwUpdNotifierHandlerThreadGated(OSObject *param)
 {
     OSArray *objArray = OSDynamicCast(OSArray, param);
@@ -434,69 +587,182 @@ IOReturn AppleGasGaugeUpdate::_startImageGated(enum AppleGasGaugeUpdateUserClien
     return kIOReturnSuccess;
 }
 
-IOReturn AppleGasGaugeUpdate::_writeDataDataGated(const uint8_t *data, size_t data_length,
-                                                  enum gg_fw_update_op op)
+// Ask the updater how it wants image data paced. Updaters that can stage
+// the next chunk while the previous one is still being written to the gauge
+// publish 'BFUW'; older ones don't have the key and get one 32 byte chunk at
+// a time. The key is optional, so don't go through _smcReadKey() and its
+// retries.
+void AppleGasGaugeUpdate::_negotiateTransferGated(void)
+{
+    struct AppleGasGaugeUpdateTransferCaps caps = {};
+    SMCResult ret;
+
+    _ggXferWindow = 1;
+    _ggXferChunkLen = GG_SMCTRANSFER_LEN;
+
+    ret = _SMCDriver->smcReadKeyHostEndian('BFUW', sizeof(caps), &caps);
+    if (ret != kSMCSuccess) {
+        GG_UPD_LOG("windowed transfer not supported, using %u byte chunks\n", _ggXferChunkLen);
+        return;
+    }
+
+    if (caps.chunkLength && caps.chunkLength <= GG_SMCTRANSFER_LEN) {
+        _ggXferChunkLen = caps.chunkLength;
+    }
+    if (caps.window > 1) {
+        _ggXferWindow = 2;
+    }
+
+    GG_UPD_LOG("transfer negotiated: window:%u chunk:%u\n", _ggXferWindow, _ggXferChunkLen);
+}
+
+// Send the chunk staged in 'BFUD' and wait for the command notification
+IOReturn AppleGasGaugeUpdate::_sendDataCommandGated(uint8_t op, uint64_t offset)
 {
     SMCResult ret;
     AbsoluteTime dl;
-    uint8_t op_data;
-    uint8_t buffer[GG_SMCTRANSFER_LEN];
 
-    size_t offset = 0;
-    size_t data_remaining = data_length;
-    GG_UPD_LOG("writeDataData checkpoint: start transfer of %zu bytes\n", data_remaining);
-    while (data_remaining) {
-        size_t copy_size = min(GG_SMCTRANSFER_LEN, data_remaining);
+    ret = _smcWriteKey('BFUC', sizeof(op), &op);
+    if (ret) {
+        GG_UPD_ERR("Failed to set command '%u' at offset:%llu. rc:0x%x=%s\n", op, offset, ret, printSMCResult(ret));
+        return kIOReturnIOError;
+    }
 
-        if (copy_size < GG_SMCTRANSFER_LEN) {
-            bzero(buffer, sizeof(buffer));
-        }
+    clock_interval_to_deadline(SMC_RESP_TIMEOUT, kSecondScale, &dl);
+    if (_commandGate->commandSleep(&_ggFwUpdEvent, dl, THREAD_UNINT) != THREAD_AWAKENED) {
+        GG_UPD_ERR("timeout: waiting for command '%u' at offset %llu\n", op, offset);
+        // Assume we missed the notification and move on.
+        // ReadKey will fail if something is truly wrong.
+    }
 
-        memcpy(buffer, &data[offset], copy_size);
-        ret = _smcWriteKey('BFUD', sizeof(buffer), buffer);
-        if (ret) {
-            GG_UPD_ERR("Failed to pass data for command '%u'at offset:%zu. rc:0x%x=%s\n", op, offset, ret, printSMCResult(ret));
-            return kIOReturnIOError;
-        }
+    ret = _checkOperationStatus(op);
+    if (ret != kIOReturnSuccess) {
+        GG_UPD_ERR("Operation '%u' failed at offset:%llu. rc:0x%x=%s\n", op, offset, ret, printSMCResult(ret));
+        return ret;
+    }
 
-        op_data = op;
-        ret = _smcWriteKey('BFUC', sizeof(op_data), &op_data);
-        if (ret) {
-            GG_UPD_ERR("Failed to set command '%u' at offset:%zu. rc:0x%x=%s\n", op, offset, ret, printSMCResult(ret));
-            return kIOReturnIOError;
-        }
+    return kIOReturnSuccess;
+}
 
-        clock_interval_to_deadline(SMC_RESP_TIMEOUT, kSecondScale, &dl);
-        if (_commandGate->commandSleep(&_ggFwUpdEvent, dl, THREAD_UNINT) != THREAD_AWAKENED) {
-            GG_UPD_ERR("timeout: waiting for command '%u' at offset %zu\n", op, offset);
-            // Assume we missed the notification and move on.
-            // ReadKey will fail if something is truly wrong.
-        }
+// Wait up to @ms for a completion notification for @op
+IOReturn AppleGasGaugeUpdate::_waitNotificationGated(uint8_t op, unsigned int ms, bool *ready)
+{
+    AbsoluteTime dl;
+
+    *ready = false;
 
-        ret = _checkOperationStatus(op_data);
+    clock_interval_to_deadline(ms, kMillisecondScale, &dl);
+    if (_commandGate->commandSleep(&_ggFwUpdEvent, dl, THREAD_UNINT) == THREAD_AWAKENED) {
+        IOReturn ret = _checkOperationStatus(op);
         if (ret != kIOReturnSuccess) {
-            GG_UPD_ERR("Operation '%u' failed at offset:%zu. rc:0x%x=%s\n", op, offset, ret, printSMCResult(ret));
             return ret;
         }
+        *ready = (_receivedNotificationStatus.updaterStatus == kRegUpdaterStatusReady);
+    }
 
-        offset += copy_size;
-        data_remaining -= copy_size;
+    return kIOReturnSuccess;
+}
 
-        IOSleep(15);
+IOReturn AppleGasGaugeUpdate::_pollUpdaterReadyGated(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms)
+{
+    uint16_t polled_status = kRegUpdaterStatusBusy;
+    IOReturn rc = _pollUpdaterStatus(&polled_status, timeout_ms, retry_ms);
+    if (rc) {
+        return rc;
+    }
+    if (polled_status != kRegUpdaterStatusReady) {
+        GG_UPD_ERR("unexpected updater status: actual:%u expected:%u op:%u\n",
+                   polled_status, kRegUpdaterStatusReady, op);
+        return kIOReturnTimeout;
+    }
 
-        uint16_t polled_status = kRegUpdaterStatusBusy;
-        IOReturn rc = _pollUpdaterStatus(&polled_status, 700, 70);
-        if (rc) {
-            GG_UPD_ERR("Failed to poll updater status. op:%u offset:%zu rc:0x%x\n", op, offset, rc);
-            return rc;
-        }
-        if (polled_status != kRegUpdaterStatusReady) {
-            GG_UPD_ERR("unexpected updater status: actual:%u expected:%u op:%u offset:%zu\n",
-                       polled_status, kRegUpdaterStatusReady, op_data, offset);
-            return kIOReturnTimeout;
-        }
+    return kIOReturnSuccess;
+}
+
+IOReturn AppleGasGaugeUpdate::_stageDataGated(const uint8_t *chunk, size_t length, uint64_t offset)
+{
+    SMCResult ret;
+    uint8_t buffer[GG_SMCTRANSFER_LEN];
+
+    bzero(buffer, sizeof(buffer));
+    memcpy(buffer, chunk, min(length, sizeof(buffer)));
+    ret = _smcWriteKey('BFUD', sizeof(buffer), buffer);
+    if (ret) {
+        GG_UPD_ERR("Failed to pass data at offset:%llu. rc:0x%x=%s\n", offset, ret, printSMCResult(ret));
+        return kIOReturnIOError;
+    }
+
+    return kIOReturnSuccess;
+}
+
+// The SMC side of AppleGasGaugeUpdateTransfer
+struct AppleGasGaugeUpdateSMCPort {
+    AppleGasGaugeUpdate *gg;
+    const uint8_t       *data;
+
+    int stage(const uint8_t *chunk, size_t length, uint64_t offset)
+    {
+        return gg->_stageDataGated(chunk, length, offset);
+    }
+    int command(uint8_t op, uint64_t offset)
+    {
+        return gg->_sendDataCommandGated(op, offset);
+    }
+    bool notifiedReady(uint8_t op)
+    {
+        return gg->_receivedNotificationStatus.op == op &&
+               gg->_receivedNotificationStatus.updaterStatus == kRegUpdaterStatusReady;
+    }
+    int waitNotification(uint8_t op, unsigned int ms, bool *ready)
+    {
+        return gg->_waitNotificationGated(op, ms, ready);
+    }
+    void sleep(unsigned int ms)
+    {
+        IOSleep(ms);
+    }
+    int pollReady(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms)
+    {
+        return gg->_pollUpdaterReadyGated(op, timeout_ms, retry_ms);
+    }
+    void acked(uint64_t offset, size_t length)
+    {
+        gg->_advanceCheckpoint(data, offset, length);
+    }
+};
+
+IOReturn AppleGasGaugeUpdate::_writeDataDataGated(const uint8_t *data, size_t data_length,
+                                                  size_t start_offset, enum gg_fw_update_op op)
+{
+    IOReturn ioret;
+    AbsoluteTime start, end;
+    uint64_t nsec;
+    AppleGasGaugeUpdateSMCPort port = { this, data };
+    AppleGasGaugeUpdateTransfer<AppleGasGaugeUpdateSMCPort> xfer(port, _ggXferWindow, _ggXferChunkLen);
+
+    AppleGasGaugeUpdateCursor cursor(data, data_length);
+    if (!cursor.seek(start_offset)) {
+        return kIOReturnBadArgument;
     }
 
+    clock_get_uptime(&start);
+    GG_UPD_LOG("writeData checkpoint: start transfer of %llu bytes at offset %zu window:%u chunk:%u\n",
+               cursor.remaining(), start_offset, _ggXferWindow, _ggXferChunkLen);
+
+    ioret = xfer.run(cursor, op);
+    if (ioret != kIOReturnSuccess) {
+        GG_UPD_ERR("transfer failed. op:%u acked:%llu rc:0x%x\n", op, _ggCheckpoint.ackedOffset, ioret);
+        return ioret;
+    }
+
+    clock_get_uptime(&end);
+    SUB_ABSOLUTETIME(&end, &start);
+    absolutetime_to_nanoseconds(end, &nsec);
+    GG_UPD_LOG("writeData checkpoint: %zu bytes in %llu ms (%llu B/s) notified:%u polled:%u\n",
+               data_length - start_offset, nsec / NSEC_PER_MSEC,
+               nsec ? (uint64_t)(data_length - start_offset) * NSEC_PER_SEC / nsec : 0,
+               xfer.stats().notified, xfer.stats().polled);
+
     return kIOReturnSuccess;
 }
 
@@ -565,11 +831,18 @@ IOReturn AppleGasGaugeUpdate::_startCryptoGated(uint8_t images)
     return kIOReturnSuccess;
 }
 
+// @bytes points at the data_length bytes to send. They follow the header for
+// inline and descriptor requests, or live in the session's mapped image.
 IOReturn AppleGasGaugeUpdate::_writeDataGated(const struct AppleGasGaugeUpdateUserClientIData *data,
-                                              const struct AppleGasGaugeUpdateOpsArgs *ops)
+                                              const struct AppleGasGaugeUpdateOpsArgs *ops,
+                                              const uint8_t *bytes)
 {
     IOReturn ioret;
     uint16_t status;
+    size_t resume_offset = 0;
+    bool isImage = (data->type == kGgFwUpdDataTypeDnvdImage ||
+                    data->type == kGgFwUpdDataTypeConfigImage ||
+                    data->type == kGgFwUpdDataTypeFirmwareImage);
 
     GG_UPD_LOG("writeData checkpoint: start\n");
 
@@ -592,14 +865,18 @@ IOReturn AppleGasGaugeUpdate::_writeDataGated(const struct AppleGasGaugeUpdateUs
 
     GG_UPD_LOG("writeData checkpoint: status OK\n");
 
-    if (data->type == kGgFwUpdDataTypeDnvdImage ||
-        data->type == kGgFwUpdDataTypeConfigImage ||
-        data->type == kGgFwUpdDataTypeFirmwareImage) {
+    if (isImage && status == kRegUpdaterStatusReady && _canResumeGated(data, bytes, &resume_offset)) {
+        // updater still holds the acknowledged prefix, don't restart the image
+        GG_UPD_LOG("writeData checkpoint: resuming type:%llu at offset %zu/%llu\n",
+                   data->type, resume_offset, data->data_length);
+    } else if (isImage) {
         // signal image start
+        _clearCheckpoint();
         ioret = _startImageGated(data->type);
         if (ioret != kIOReturnSuccess) {
             return ioret;
         }
+        _armCheckpoint(data, bytes);
     } else {
         // write size
         ioret = _writeDataLengthGated(data->data_length & 0xffff, ops->op_length, 15, 700, 100, kRegUpdaterStatusReady);
@@ -611,11 +888,18 @@ IOReturn AppleGasGaugeUpdate::_writeDataGated(const struct AppleGasGaugeUpdateUs
     GG_UPD_LOG("writeData checkpoint: init done\n");
 
     // transfer image
-    ioret = _writeDataDataGated(data->data, data->data_length, ops->op_data);
+    ioret = _writeDataDataGated(bytes, data->data_length, resume_offset, ops->op_data);
     if (ioret != kIOReturnSuccess) {
+        if (isImage && _ggCheckpoint.valid) {
+            _publishCheckpoint();
+        }
         return ioret;
     }
 
+    if (isImage) {
+        _clearCheckpoint();
+    }
+
     GG_UPD_LOG("writeData checkpoint: transfer done\n");
 
     if (data->type == kGgFwUpdDataTypeDnvdImage ||
@@ -659,7 +943,7 @@ IOReturn AppleGasGaugeUpdate::_writeDataGated(const struct AppleGasGaugeUpdateUs
         }
 
         // write size in blocks!!
-        size_t blocks = (data->data_length + 31) / 32;
+        size_t blocks = (data->data_length + _ggXferChunkLen - 1) / _ggXferChunkLen;
         ioret = _writeDataLengthGated(blocks & 0xffff, ops->op_length, typical_ms, timeout_ms, retry_ms, status);
         if (ioret != kIOReturnSuccess) {
             return ioret;
@@ -684,7 +968,8 @@ IOReturn AppleGasGaugeUpdate::_writeDataGated(const struct AppleGasGaugeUpdateUs
     return kIOReturnSuccess;
 }
 
-IOReturn AppleGasGaugeUpdate::_writeImage(const struct AppleGasGaugeUpdateUserClientIData *data)
+IOReturn AppleGasGaugeUpdate::_writeImage(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                          const uint8_t *bytes)
 {
     const struct AppleGasGaugeUpdateOpsArgs ops = {
         .op_length = kGgFwUpdOpSetDone, .op_data = kGgFwUpdOpSetImageData,
@@ -692,10 +977,11 @@ IOReturn AppleGasGaugeUpdate::_writeImage(const struct AppleGasGaugeUpdateUserCl
 
     return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
                                    &AppleGasGaugeUpdate::_writeDataGated), (void *)data,
-                                   (void *)&ops);
+                                   (void *)&ops, (void *)bytes);
 }
 
-IOReturn AppleGasGaugeUpdate::_writeImg4Manifest(const struct AppleGasGaugeUpdateUserClientIData *data)
+IOReturn AppleGasGaugeUpdate::_writeImg4Manifest(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                                 const uint8_t *bytes)
 {
     const struct AppleGasGaugeUpdateOpsArgs ops = {
         .op_length = kGgFwUpdOpSetImg4Len, .op_data = kGgFwUpdOpSetImg4,
@@ -704,12 +990,13 @@ IOReturn AppleGasGaugeUpdate::_writeImg4Manifest(const struct AppleGasGaugeUpdat
 
     IOReturn ret = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
                                            &AppleGasGaugeUpdate::_writeDataGated), (void *)data,
-                                           (void *)&ops);
+                                           (void *)&ops, (void *)bytes);
 
     return ret;
 }
 
-IOReturn AppleGasGaugeUpdate::_writeDigestDict(const struct AppleGasGaugeUpdateUserClientIData *data)
+IOReturn AppleGasGaugeUpdate::_writeDigestDict(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                               const uint8_t *bytes)
 {
     const struct AppleGasGaugeUpdateOpsArgs ops = {
         .op_length = kGgFwUpdOpSetDigDictLen, .op_data = kGgFwUpdOpSetDigDict,
@@ -721,12 +1008,13 @@ IOReturn AppleGasGaugeUpdate::_writeDigestDict(const struct AppleGasGaugeUpdateU
 
     IOReturn ret = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
                                            &AppleGasGaugeUpdate::_writeDataGated), (void *)data,
-                                           (void *)&ops);
+                                           (void *)&ops, (void *)bytes);
 
     return ret;
 }
 
-IOReturn AppleGasGaugeUpdate::_writeCertificate(const struct AppleGasGaugeUpdateUserClientIData *data)
+IOReturn AppleGasGaugeUpdate::_writeCertificate(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                                const uint8_t *bytes)
 {
     const struct AppleGasGaugeUpdateOpsArgs ops = {
         .op_length = kGgFwUpdOpSetCertLen, .op_data = kGgFwUpdOpSetCert,
@@ -735,30 +1023,31 @@ IOReturn AppleGasGaugeUpdate::_writeCertificate(const struct AppleGasGaugeUpdate
 
     return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this,
                                    &AppleGasGaugeUpdate::_writeDataGated), (void *)data,
-                                   (void *)&ops);
+                                   (void *)&ops, (void *)bytes);
 }
 
-IOReturn AppleGasGaugeUpdate::_sendData(const struct AppleGasGaugeUpdateUserClientIData *data)
+IOReturn AppleGasGaugeUpdate::_sendData(const struct AppleGasGaugeUpdateUserClientIData *data,
+                                        const uint8_t *bytes)
 {
     GG_UPD_LOG("_sendData: type=%llu, length=%llu\n", data->type, data->data_length);
 
     switch (data->type) {
     case kGgFwUpdDataTypeCertificate:
-        return _writeCertificate(data);
+        return _writeCertificate(data, bytes);
         break;
 
     case kGgFwUpdDataTypeImg4Manifest:
-        return _writeImg4Manifest(data);
+        return _writeImg4Manifest(data, bytes);
         break;
 
     case kGgFwUpdDataTypeDigestDictionary:
-        return _writeDigestDict(data);
+        return _writeDigestDict(data, bytes);
         break;
 
     case kGgFwUpdDataTypeDnvdImage:
     case kGgFwUpdDataTypeConfigImage:
     case kGgFwUpdDataTypeFirmwareImage:
-        return _writeImage(data);
+        return _writeImage(data, bytes);
         break;
 
     default:
@@ -803,6 +1092,7 @@ IOReturn AppleGasGaugeUpdate::_getBatteryIdGated(uint32_t *battId)
     }
 
     *battId = *((uint32_t *)buffer);
+    _ggBatteryId = *battId;
     OSNumber *bid = OSNumber::withNumber(*battId, sizeof(*battId) * 8);
     if (bid) {
         setProperty(_kBatteryId, bid);
@@ -899,11 +1189,30 @@ IOReturn AppleGasGaugeUpdate::_startUpdateGated(struct AppleGasGaugeUpdateUserCl
 
     _clearErrorReports();
 
+    // Starting a new update discards whatever the updater has buffered. If an
+    // image transfer was interrupted and the updater confirms it still holds
+    // the acknowledged part, hand out battery ID and nonce without restarting
+    // so the client can resend the image and we only transfer what's missing.
+    //
+    // No 'start update' is sent on this path, so the updater stays in the
+    // session the checkpoint was taken in and keeps that session's nonce. The
+    // nonce handed out is the one the client already personalized for; the
+    // resume check requires it to be unchanged, since a new nonce means the
+    // updater started over.
+    if (_ggCheckpoint.valid && _updaterHoldsCheckpointGated(data->nonce)) {
+        GG_UPD_LOG("resumable update: type:%llu offset:%llu/%llu\n",
+                   _ggCheckpoint.type, _ggCheckpoint.ackedOffset, _ggCheckpoint.dataLength);
+        data->batteryId = _ggCheckpoint.batteryId;
+        return kIOReturnSuccess;
+    }
+
     ret =_initUpdateGated();
     if (ret != kIOReturnSuccess) {
         return ret;
     }
 
+    _negotiateTransferGated();
+
     ret =_getBatteryIdGated(&data->batteryId);
     if (ret != kIOReturnSuccess) {
         return ret;
@@ -913,6 +1222,7 @@ IOReturn AppleGasGaugeUpdate::_startUpdateGated(struct AppleGasGaugeUpdateUserCl
     if (ret != kIOReturnSuccess) {
         return ret;
     }
+    memcpy(_ggSessionNonce, data->nonce, sizeof(_ggSessionNonce));
 
     return kIOReturnSuccess;
 }
@@ -921,6 +1231,8 @@ IOReturn AppleGasGaugeUpdate::_commitImageGated(void)
 {
     IOReturn ret;
 
+    _clearCheckpoint();
+
     uint8_t op = kGgFwUpdOpCommitImage;
     ret = _smcWriteKey('BFUC', sizeof(op), &op);
     if (ret) {
@@ -1108,6 +1420,11 @@ bool AppleGasGaugeUpdate::start(IOService *provider)
         goto err;
     }
 
+    _ggSleepNotifier = registerPrioritySleepWakeInterest(&AppleGasGaugeUpdate::_sleepWakeHandler, this);
+    if (!_ggSleepNotifier) {
+        GG_UPD_WARN("failed to register for sleep notifications, interrupted transfers won't resume\n");
+    }
+
     registerService();
 
     return true;
@@ -1148,6 +1465,10 @@ IOWorkLoop *AppleGasGaugeUpdate::getWorkLoop() const
 
 void AppleGasGaugeUpdate::free(void)
 {
+    if (_ggSleepNotifier) {
+        _ggSleepNotifier->remove();
+        _ggSleepNotifier = NULL;
+    }
     OSSafeReleaseNULL(_workLoop);
     OSSafeReleaseNULL(_commandGate);
     super::free();
@@ -1171,6 +1492,9 @@ AppleGasGaugeUpdate *AppleGasGaugeUpdate::withSMCFamily(AppleSMCFamily *smc)
 #endif
     me->_SMCDriver = smc;
     me->_workLoop = NULL;
+    me->_ggSleepNotifier = NULL;
+    me->_ggXferWindow = 1;
+    me->_ggXferChunkLen = GG_SMCTRANSFER_LEN;
     me->init();
 
     return me;
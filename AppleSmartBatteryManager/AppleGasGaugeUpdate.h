@@ -11,6 +11,9 @@
 #include <battery/gasgauge_update.h>
 #include "AppleSmartBattery.h"
 #include "AppleGasGaugeUpdateUserClient.h"
+#include "AppleGasGaugeUpdateCursor.h"
+#include "AppleGasGaugeUpdateTransfer.h"
+#include "AppleGasGaugeUpdateResume.h"
 
 class IOWorkLoop;
 class IOCommandGate;
@@ -30,10 +33,19 @@ struct AppleGasGaugeUpdateNotificationStatus {
     uint8_t updaterStatus;
 };
 
+// Layout of the optional 'BFUW' key, published by updaters that accept the
+// next image chunk while the previous one is still being programmed.
+struct AppleGasGaugeUpdateTransferCaps {
+    uint8_t window;
+    uint8_t chunkLength;
+    uint16_t reserved;
+};
+
 class AppleGasGaugeUpdate : public IOService {
 OSDeclareDefaultStructors(AppleGasGaugeUpdate)
 
     friend class AppleGasGaugeUpdateUserClient;
+    friend struct AppleGasGaugeUpdateSMCPort;
 
 public:
     bool        start(IOService *provider) APPLE_KEXT_OVERRIDE;
@@ -47,11 +59,11 @@ protected:
     IOReturn _getInfo(struct AppleGasGaugeUpdateUserClientInfo *data);
     IOReturn _startUpdate(struct AppleGasGaugeUpdateUserClientOData *data);
     IOReturn _commitImage(void);
-    IOReturn _writeCertificate(const struct AppleGasGaugeUpdateUserClientIData *data);
-    IOReturn _writeImg4Manifest(const struct AppleGasGaugeUpdateUserClientIData *data);
-    IOReturn _writeDigestDict(const struct AppleGasGaugeUpdateUserClientIData *data);
-    IOReturn _writeImage(const struct AppleGasGaugeUpdateUserClientIData *data);
-    IOReturn _sendData(const struct AppleGasGaugeUpdateUserClientIData *data);
+    IOReturn _writeCertificate(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
+    IOReturn _writeImg4Manifest(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
+    IOReturn _writeDigestDict(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
+    IOReturn _writeImage(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
+    IOReturn _sendData(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
 
 private:
     AppleSmartBattery     *_provider;
@@ -62,8 +74,17 @@ private:
     thread_call_t         _ggFwUpdSMCNotifThreadCall;
     bool                  _displayKeys;
     bool                  _ggTwoStageUpdate;
+    uint8_t               _ggXferWindow;
+    uint8_t               _ggXferChunkLen;
+    uint32_t              _ggBatteryId;
+    struct AppleGasGaugeUpdateCheckpoint _ggCheckpoint;
+    uint8_t               _ggSessionNonce[kGgNonceLength];
+    volatile SInt32       _ggSleepCount;
+    IONotifier            *_ggSleepNotifier;
     struct AppleGasGaugeUpdateNotificationStatus _receivedNotificationStatus;
 
+    static IOReturn _sleepWakeHandler(void *target, void *refCon, UInt32 messageType,
+                                      IOService *provider, void *messageArgument, vm_size_t argSize);
     int      _smcGgFwUpdNotifierHandler(const OSSymbol *type, OSObject *val, uintptr_t refcon);
     IOReturn _smcGgFwUpdNotifierHandlerThread(void *param);
     IOReturn _smcGgFwUpdNotifierHandlerThreadGated(OSObject *param);
@@ -79,14 +100,28 @@ private:
     IOReturn _getChallengeDataGated(uint8_t *data);
     IOReturn _startImageGated(enum AppleGasGaugeUpdateUserClientDataType type);
     IOReturn _writeDataGated(const struct AppleGasGaugeUpdateUserClientIData *data,
-                             const struct AppleGasGaugeUpdateOpsArgs *ops);
+                             const struct AppleGasGaugeUpdateOpsArgs *ops, const uint8_t *bytes);
     IOReturn _writeDataLengthGated(uint16_t length, enum gg_fw_update_op op,
                                    unsigned int typical_ms, unsigned int timeout_ms, unsigned int retry_ms,
                                    unsigned int status);
     IOReturn _writeDataSignatureGated(const uint8_t *signature, enum gg_fw_update_op op_sign1, enum gg_fw_update_op op_sign2);
-    IOReturn _writeDataDataGated(const uint8_t *data, size_t data_length, enum gg_fw_update_op op);
+    IOReturn _writeDataDataGated(const uint8_t *data, size_t data_length, size_t start_offset,
+                                 enum gg_fw_update_op op);
+    void     _negotiateTransferGated(void);
+    IOReturn _stageDataGated(const uint8_t *chunk, size_t length, uint64_t offset);
+    IOReturn _sendDataCommandGated(uint8_t op, uint64_t offset);
+    IOReturn _waitNotificationGated(uint8_t op, unsigned int ms, bool *ready);
+    IOReturn _pollUpdaterReadyGated(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms);
     IOReturn _startCryptoGated(uint8_t images);
     void _clearErrorReports(void);
+    void _clearCheckpoint(void);
+    void _publishCheckpoint(void);
+    void _armCheckpoint(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes);
+    void _advanceCheckpoint(const uint8_t *data, size_t offset, size_t length);
+    bool _canResumeGated(const struct AppleGasGaugeUpdateUserClientIData *data, const uint8_t *bytes,
+                         size_t *resume_offset);
+    void _readResumeStateGated(struct AppleGasGaugeUpdateResumeState *state);
+    bool _updaterHoldsCheckpointGated(uint8_t *nonce);
 };
 
 #endif // TARGET_OS_IOS || TARGET_OS_WATCH || (TARGET_OS_OSX && TARGET_CPU_ARM64)
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Walks a byte range of an image mapped once per update session, handing
+// out segments of at most the requested length. The last segment of a range
+// is shorter when the range isn't a multiple of the segment length.
+class AppleGasGaugeUpdateCursor {
+public:
+    AppleGasGaugeUpdateCursor() : _base(NULL), _size(0), _start(0), _end(0), _pos(0) {}
+    AppleGasGaugeUpdateCursor(const uint8_t *base, uint64_t size)
+        : _base(base), _size(base ? size : 0), _start(0), _end(_size), _pos(0) {}
+
+    // Restrict the cursor to [offset, offset + length) and rewind it.
+    // Fails, leaving the cursor unchanged, if the range doesn't fit.
+    bool select(uint64_t offset, uint64_t length)
+    {
+        if (!_base || offset > _size || length > _size - offset) {
+            return false;
+        }
+
+        _start = _pos = offset;
+        _end = offset + length;
+
+        return true;
+    }
+
+    // Move to @offset within the selected range
+    bool seek(uint64_t offset)
+    {
+        if (offset > _end - _start) {
+            return false;
+        }
+
+        _pos = _start + offset;
+
+        return true;
+    }
+
+    // Return the next segment of at most @max_len bytes and advance past it
+    bool next(size_t max_len, const uint8_t **segment, size_t *length)
+    {
+        if (!max_len || _pos >= _end) {
+            return false;
+        }
+
+        uint64_t len = _end - _pos;
+        if (len > max_len) {
+            len = max_len;
+        }
+
+        *segment = _base + _pos;
+        *length = (size_t)len;
+        _pos += len;
+
+        return true;
+    }
+
+    const uint8_t *bytes() const { return _base ? _base + _start : NULL; }
+    uint64_t length() const { return _end - _start; }
+    uint64_t position() const { return _pos - _start; }
+    uint64_t remaining() const { return _end - _pos; }
+
+private:
+    const uint8_t   *_base;
+    uint64_t        _size;
+    uint64_t        _start;
+    uint64_t        _end;
+    uint64_t        _pos;
+};
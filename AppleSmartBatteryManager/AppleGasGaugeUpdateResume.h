@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#define kGgNonceLength  32
+
+// Layout of the optional 'BFUP' key, published by updaters that can report
+// how much of the image they are receiving has been programmed. A reset
+// updater reports nothing received.
+struct AppleGasGaugeUpdateProgress {
+    uint8_t  type;          // AppleGasGaugeUpdateUserClientDataType of the image
+    uint8_t  reserved[3];
+    uint32_t received;
+};
+
+// Progress of the last image transfer. It survives the user client going
+// away so that an interrupted transfer only has to send the part of the
+// image the updater hasn't acknowledged yet. While a transfer is resumable
+// the "ResumeDataType" and "ResumeOffset" properties are published.
+struct AppleGasGaugeUpdateCheckpoint {
+    bool     valid;
+    uint32_t batteryId;
+    uint64_t type;          // AppleGasGaugeUpdateUserClientDataType
+    uint64_t dataLength;
+    uint32_t imageCrc;
+    uint64_t ackedOffset;
+    uint32_t prefixCrc;
+    uint32_t sleepCount;    // system sleeps seen when the transfer started
+    uint8_t  nonce[kGgNonceLength];
+};
+
+// What the updater reports when a client comes back to an interrupted
+// transfer. The invalid flags mean the readback failed or, for the
+// progress, that the updater doesn't publish 'BFUP'.
+struct AppleGasGaugeUpdateResumeState {
+    bool     ready;
+    bool     batteryIdValid;
+    uint32_t batteryId;
+    uint32_t sleepCount;
+    bool     progressValid;
+    struct AppleGasGaugeUpdateProgress progress;
+    bool     nonceValid;
+    uint8_t  nonce[kGgNonceLength];
+};
+
+enum AppleGasGaugeUpdateResumeCheck {
+    kGgResumeOK,
+    kGgResumeNoCheckpoint,
+    kGgResumeNotReady,
+    kGgResumeBatteryChanged,
+    kGgResumeSlept,             // the updater doesn't keep a session across sleep
+    kGgResumeNoProgress,        // no 'BFUP', nothing proves the prefix is still there
+    kGgResumeProgressMismatch,  // reset, or programmed more or less than was acked
+    kGgResumeSessionChanged     // nonce changed: the updater started over
+};
+
+// An idle or freshly reset updater also reports ready for the same battery,
+// so those alone don't mean it still holds the acknowledged prefix. Resume
+// only when it reports having programmed exactly that prefix of this image,
+// within the session the checkpoint was taken in.
+static inline enum AppleGasGaugeUpdateResumeCheck
+AppleGasGaugeUpdateCheckResume(const struct AppleGasGaugeUpdateCheckpoint *cp,
+                               const struct AppleGasGaugeUpdateResumeState *st)
+{
+    if (!cp->valid || !cp->ackedOffset || cp->ackedOffset >= cp->dataLength) {
+        return kGgResumeNoCheckpoint;
+    }
+    if (!st->ready) {
+        return kGgResumeNotReady;
+    }
+    if (!st->batteryIdValid || st->batteryId != cp->batteryId) {
+        return kGgResumeBatteryChanged;
+    }
+    if (st->sleepCount != cp->sleepCount) {
+        return kGgResumeSlept;
+    }
+    if (!st->progressValid) {
+        return kGgResumeNoProgress;
+    }
+    if (st->progress.type != cp->type || st->progress.received != cp->ackedOffset) {
+        return kGgResumeProgressMismatch;
+    }
+    if (!st->nonceValid || memcmp(st->nonce, cp->nonce, kGgNonceLength)) {
+        return kGgResumeSessionChanged;
+    }
+
+    return kGgResumeOK;
+}
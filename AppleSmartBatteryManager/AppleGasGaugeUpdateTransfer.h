@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "AppleGasGaugeUpdateCursor.h"
+
+// How long the updater needs after latching a chunk before its status can
+// be trusted, and how the status is polled after that
+#define kGgXferSettleMs         15
+#define kGgXferPollTimeoutMs    700
+#define kGgXferPollRetryMs      70
+
+struct AppleGasGaugeUpdateTransferStats {
+    uint32_t notified;
+    uint32_t polled;
+};
+
+// Sends image data one chunk per 'BFUD' write + 'BFUC' command.
+//
+// Legacy updaters (window 1) get the original pacing: a fixed settle time
+// after each chunk and then a status poll. Their command notification may
+// report ready before the chunk has been programmed, so it isn't trusted.
+//
+// Updaters that negotiated a window of 2 through 'BFUW' get the next chunk
+// staged in 'BFUD' as soon as they have latched the current one, and the
+// next command goes out as soon as a notification reports them ready.
+// Polling is only the fallback; since it overwrites 'BFUD', the staged chunk
+// is sent again afterwards.
+//
+// @Port is the SMC side. Every int it returns is 0 or an IOReturn error that
+// is passed back to the caller:
+//   int  stage(const uint8_t *chunk, size_t length, uint64_t offset)
+//            write the chunk to 'BFUD'
+//   int  command(uint8_t op, uint64_t offset)
+//            write 'BFUC', wait for its notification and check it
+//   bool notifiedReady(uint8_t op)
+//            the last notification, for @op, reported the updater ready
+//   int  waitNotification(uint8_t op, unsigned int ms, bool *ready)
+//            wait up to @ms for another notification for @op
+//   void sleep(unsigned int ms)
+//   int  pollReady(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms)
+//            poll the updater status until it's ready; overwrites 'BFUD'
+//   void acked(uint64_t offset, size_t length)
+//            the updater is done with [offset, offset + length)
+template <class Port>
+class AppleGasGaugeUpdateTransfer {
+public:
+    AppleGasGaugeUpdateTransfer(Port &port, uint8_t window, uint8_t chunkLen)
+        : _port(port), _window(window), _chunkLen(chunkLen), _stats() {}
+
+    // Send what's left of @cursor, with command @op for every chunk
+    int run(AppleGasGaugeUpdateCursor cursor, uint8_t op)
+    {
+        const uint8_t *chunk;
+        size_t chunkSize;
+        bool staged = false;
+        int ret;
+
+        while (cursor.next(_chunkLen, &chunk, &chunkSize)) {
+            uint64_t chunkOffset = cursor.position() - chunkSize;
+
+            if (!staged && (ret = _port.stage(chunk, chunkSize, chunkOffset))) {
+                return ret;
+            }
+            staged = false;
+
+            if ((ret = _port.command(op, chunkOffset))) {
+                return ret;
+            }
+
+            // updater has latched this chunk, stage the next one while it's busy
+            AppleGasGaugeUpdateCursor peek = cursor;
+            const uint8_t *nextChunk;
+            size_t nextSize;
+
+            if (_window > 1 && peek.next(_chunkLen, &nextChunk, &nextSize)) {
+                if ((ret = _port.stage(nextChunk, nextSize, cursor.position()))) {
+                    return ret;
+                }
+                staged = true;
+            }
+
+            bool clobbered = false;
+            if ((ret = waitReady(op, &clobbered))) {
+                return ret;
+            }
+            if (clobbered) {
+                staged = false;
+            }
+
+            _port.acked(chunkOffset, chunkSize);
+        }
+
+        return 0;
+    }
+
+    const AppleGasGaugeUpdateTransferStats &stats() const { return _stats; }
+
+private:
+    // Wait for the updater to finish with the chunk just sent with @op.
+    // @clobbered tells the caller to stage its next chunk again.
+    int waitReady(uint8_t op, bool *clobbered)
+    {
+        bool ready = false;
+        int ret;
+
+        if (_window > 1) {
+            if (_port.notifiedReady(op)) {
+                _stats.notified++;
+                return 0;
+            }
+            if ((ret = _port.waitNotification(op, kGgXferSettleMs, &ready))) {
+                return ret;
+            }
+            if (ready) {
+                _stats.notified++;
+                return 0;
+            }
+        } else {
+            _port.sleep(kGgXferSettleMs);
+        }
+
+        _stats.polled++;
+        *clobbered = true;
+
+        return _port.pollReady(op, kGgXferPollTimeoutMs, kGgXferPollRetryMs);
+    }
+
+    Port                                    &_port;
+    uint8_t                                 _window;
+    uint8_t                                 _chunkLen;
+    struct AppleGasGaugeUpdateTransferStats _stats;
+};
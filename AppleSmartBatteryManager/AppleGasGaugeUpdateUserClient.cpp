@@ -5,6 +5,7 @@
 #include <sys/proc.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOKitKeys.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <kern/task.h>
 #include "AppleGasGaugeUpdateUserClientPrivate.h"
 
@@ -75,7 +76,7 @@ IOReturn AppleGasGaugeUpdateUserClient::sendData(const struct AppleGasGaugeUpdat
         return kIOReturnBadArgument;
     }
 
-    return _owner->_sendData(data);
+    return _owner->_sendData(data, data->data);
 }
 
 static bool args_valid(const struct AppleGasGaugeUpdateUserClientIData *data,
@@ -171,6 +172,134 @@ err:
     return ret;
 }
 
+// Map the whole image once for the session. Subsequent kGgFwUpdSendMappedData
+// calls only carry an offset and length into it, so the image isn't mapped
+// and prepared again for every chunk of the update.
+IOReturn AppleGasGaugeUpdateUserClient::mapImage(IOMemoryDescriptor *md)
+{
+    IOReturn ret;
+    IOMemoryMap *map;
+
+    unmapImage();
+
+    ret = md->prepare(kIODirectionOut);
+    if (ret != kIOReturnSuccess) {
+        GG_UPD_ERR("failed to prepare image rc:0x%x\n", ret);
+        return ret;
+    }
+
+    map = md->map(kIOMapReadOnly);
+    if (!map) {
+        GG_UPD_ERR("failed to map image\n");
+        md->complete(kIODirectionOut);
+        return kIOReturnNoMemory;
+    }
+
+    md->retain();
+    _imageMD = md;
+    _imageMap = map;
+    _imageCursor = AppleGasGaugeUpdateCursor((const uint8_t *)map->getVirtualAddress(), map->getLength());
+
+    GG_UPD_LOG("mapped image of %llu bytes\n", map->getLength());
+
+    return kIOReturnSuccess;
+}
+
+IOReturn AppleGasGaugeUpdateUserClient::unmapImage(void)
+{
+    if (!_imageMD) {
+        return kIOReturnSuccess;
+    }
+
+    OSSafeReleaseNULL(_imageMap);
+    _imageMD->complete(kIODirectionOut);
+    OSSafeReleaseNULL(_imageMD);
+    _imageCursor = AppleGasGaugeUpdateCursor();
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn extMapImage(OSObject *target, void *reference, IOExternalMethodArguments *arguments)
+{
+    AppleGasGaugeUpdateUserClient *self = OSDynamicCast(AppleGasGaugeUpdateUserClient, (OSObject *)reference);
+    if (self == nullptr) {
+        return kIOReturnBadArgument;
+    }
+
+    IOReturn ret;
+    IOMemoryDescriptor *md = arguments->structureInputDescriptor;
+
+    if (md) {
+        md->retain();
+    } else if (arguments->structureInput && arguments->structureInputSize) {
+        // small images arrive inline, copy them once
+        md = IOBufferMemoryDescriptor::withBytes(arguments->structureInput,
+                                                 arguments->structureInputSize, kIODirectionOut);
+        if (!md) {
+            return kIOReturnNoMemory;
+        }
+    } else {
+        GG_UPD_ERR("no image to map\n");
+        return kIOReturnBadArgument;
+    }
+
+    ret = OSMemberFunctionCast(IOReturn (*)(AppleGasGaugeUpdateUserClient *, IOMemoryDescriptor *), self, &AppleGasGaugeUpdateUserClient::mapImage)(self, md);
+    md->release();
+
+    return ret;
+}
+
+IOReturn AppleGasGaugeUpdateUserClient::sendMappedData(const struct AppleGasGaugeUpdateUserClientMappedIData *args)
+{
+    struct AppleGasGaugeUpdateUserClientIData data;
+
+    if (args == nullptr) {
+        return kIOReturnBadArgument;
+    }
+
+    if (!_imageMap) {
+        GG_UPD_ERR("no image mapped\n");
+        return kIOReturnNotReady;
+    }
+
+    if (args->type >= kGgFwUpdDataTypeMax) {
+        GG_UPD_ERR("invalid type:%llu\n", args->type);
+        return kIOReturnBadArgument;
+    }
+
+    if (!args->data_length || !_imageCursor.select(args->offset, args->data_length)) {
+        GG_UPD_ERR("invalid range offset:%llu length:%llu\n", args->offset, args->data_length);
+        return kIOReturnBadArgument;
+    }
+
+    bzero(&data, sizeof(data));
+    memcpy(data.signature, args->signature, sizeof(data.signature));
+    data.data_length = args->data_length;
+    data.type = args->type;
+
+    return _owner->_sendData(&data, _imageCursor.bytes());
+}
+
+static IOReturn extSendMappedData(OSObject *target, void *reference, IOExternalMethodArguments *arguments)
+{
+    AppleGasGaugeUpdateUserClient *self = OSDynamicCast(AppleGasGaugeUpdateUserClient, (OSObject *)reference);
+    if (self == nullptr) {
+        return kIOReturnBadArgument;
+    }
+
+    return OSMemberFunctionCast(IOReturn (*)(AppleGasGaugeUpdateUserClient *, const struct AppleGasGaugeUpdateUserClientMappedIData *), self, &AppleGasGaugeUpdateUserClient::sendMappedData)(self, (const struct AppleGasGaugeUpdateUserClientMappedIData *)arguments->structureInput);
+}
+
+static IOReturn extUnmapImage(OSObject *target, void *reference, IOExternalMethodArguments *arguments)
+{
+    AppleGasGaugeUpdateUserClient *self = OSDynamicCast(AppleGasGaugeUpdateUserClient, (OSObject *)reference);
+    if (self == nullptr) {
+        return kIOReturnBadArgument;
+    }
+
+    return OSMemberFunctionCast(IOReturn (*)(AppleGasGaugeUpdateUserClient *), self, &AppleGasGaugeUpdateUserClient::unmapImage)(self);
+}
+
 IOReturn AppleGasGaugeUpdateUserClient::externalMethod(uint32_t selector, IOExternalMethodArgumentsOpaque *arguments)
 {
     static const struct IOExternalMethodDispatch2022 dispatch_arr[] = {
@@ -180,6 +309,9 @@ IOReturn AppleGasGaugeUpdateUserClient::externalMethod(uint32_t selector, IOExte
         [kGgFwUpdStartUpdate] = { extStartUpdate, 0, 0, 0, sizeof(AppleGasGaugeUpdateUserClientOData), false },
         [kGgFwUpdSendData] = { extSendData, 0, kIOUCVariableStructureSize, 0, 0, false },
         [kGgFwUpdCommitImage] = { extCommitImage, 0, 0, 0, 0, false },
+        [kGgFwUpdMapImage] = { extMapImage, 0, kIOUCVariableStructureSize, 0, 0, false },
+        [kGgFwUpdSendMappedData] = { extSendMappedData, 0, sizeof(AppleGasGaugeUpdateUserClientMappedIData), 0, 0, false },
+        [kGgFwUpdUnmapImage] = { extUnmapImage, 0, 0, 0, 0, false },
     };
 
     return dispatchExternalMethod(selector, arguments, dispatch_arr, ARRAY_SIZE(dispatch_arr), _owner, this);
@@ -187,6 +319,7 @@ IOReturn AppleGasGaugeUpdateUserClient::externalMethod(uint32_t selector, IOExte
 
 IOReturn AppleGasGaugeUpdateUserClient::clientClose(void)
 {
+    unmapImage();
     detach(_owner);
 
     // We only have one application client. If the app is closed,
@@ -56,12 +56,28 @@ struct AppleGasGaugeUpdateUserClientIData {
     uint8_t data[];
 };
 
+// Input of kGgFwUpdSendMappedData: like AppleGasGaugeUpdateUserClientIData,
+// but the bytes are [offset, offset + data_length) of the image mapped with
+// kGgFwUpdMapImage instead of following the header.
+struct AppleGasGaugeUpdateUserClientMappedIData {
+    union {
+        uint8_t signature[64];
+        uint8_t updateImage;
+    };
+    uint64_t offset;
+    uint64_t data_length;
+    enum AppleGasGaugeUpdateUserClientDataType type;
+};
+
 /* Method index */
 enum {
     kGgFwUpdInfo,
     kGgFwUpdStartUpdate,
     kGgFwUpdSendData,
     kGgFwUpdCommitImage,
+    kGgFwUpdMapImage,
+    kGgFwUpdSendMappedData,
+    kGgFwUpdUnmapImage,
     kGgFwUpdMax
 };
 
@@ -13,6 +13,9 @@ class AppleGasGaugeUpdateUserClient : public IOUserClient2022
 
 private:
     AppleGasGaugeUpdate    *_owner;
+    IOMemoryDescriptor     *_imageMD;
+    IOMemoryMap            *_imageMap;
+    AppleGasGaugeUpdateCursor _imageCursor;
 
 public:
     bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
@@ -23,6 +26,9 @@ public:
     IOReturn startUpdate(struct AppleGasGaugeUpdateUserClientOData *data);
     IOReturn commitImage(void);
     IOReturn sendData(const struct AppleGasGaugeUpdateUserClientIData *data);
+    IOReturn mapImage(IOMemoryDescriptor *md);
+    IOReturn sendMappedData(const struct AppleGasGaugeUpdateUserClientMappedIData *args);
+    IOReturn unmapImage(void);
 };
 
 #endif // TARGET_OS_IOS || TARGET_OS_WATCH || (TARGET_OS_OSX && TARGET_CPU_ARM64)
@@ -107,7 +107,10 @@ bool AppleSmartBatteryManager::start(IOService *provider)
     if (!fSmbus) {
         BM_ERRLOG("Failed to instantiate SMBus Handler\n");
     }
-    fSmbus->initialize(this);
+    if (fSmbus->initialize(this) != kIOReturnSuccess) {
+        BM_ERRLOG("Failed to initialize SMBus Handler\n");
+        return false;
+    }
     fSmbusSupport = true;
 
 #else
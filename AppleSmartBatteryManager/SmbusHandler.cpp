@@ -22,6 +22,7 @@ static int  retryDelaysTable[kRetryAttempts] =
 // In microseconds.
 static const uint32_t microSecDelayTable[kRetryAttempts] =
 { 10, 100, 1000, 10000, 250000 };
+static_assert(kRetryAttempts <= UINT8_MAX, "retry count must fit SmbusRetryPolicy");
 
 // One "wait interval" is 100ms
 #define kWaitExclusiveIntervals 30
@@ -50,101 +51,137 @@ static const uint32_t microSecDelayTable[kRetryAttempts] =
 
 IOReturn SmbusHandler::initialize(AppleSmartBatteryManager *mgr)
 {
- 
-    fRetryAttempts = 0;
+#if ASBM_DEVELOPMENT
+    uint32_t sim = 0;
+#endif // ASBM_DEVELOPMENT
+
     fExternalTransactionWait = 0;
     fMgr = mgr;
     fWorkLoop = mgr->getWorkLoop();
-    return kIOReturnSuccess;
-}
-
-
-uint32_t SmbusHandler::requiresRetryGetMicroSec(IOSMBusTransaction *transaction)
-{
-    IOSMBusStatus       transaction_status = kIOSMBusStatusPECError;
-    bool                transaction_needs_retry = false;
-
-    if (transaction)
-        transaction_status = transaction->status;
-    else
-        return 0;
+    fMachine.init(microSecDelayTable, kRetryAttempts);
+
+    // Retries wait on a timer rather than sleeping in the completion path,
+    // so the workloop stays available to other clients in the meantime
+    fRetryTimer = IOTimerEventSource::timerEventSource(this,
+                    OSMemberFunctionCast(IOTimerEventSource::Action,
+                    this, &SmbusHandler::retryTimerFired));
+    if (!fRetryTimer || (kIOReturnSuccess != fWorkLoop->addEventSource(fRetryTimer))) {
+        BM_ERRLOG("Failed to create SMBus retry timer\n");
+        OSSafeReleaseNULL(fRetryTimer);
+        return kIOReturnNoResources;
+    }
 
-    /******************************************************************************************
-     ******************************************************************************************/
-    /* If the last transaction wasn't successful at the SMBus level, retry.
-     */
-    if (STATUS_ERROR_NEEDS_RETRY(transaction_status))
+#if ASBM_DEVELOPMENT
+    if (PE_parse_boot_argn("asbm-sim", &sim, sizeof(sim)) && sim) {
+        BM_LOG1("SmartBattery: using simulated battery\n");
+        fTransport = SmbusSimulatedBattery::withManager(mgr, fWorkLoop);
+    } else
+#endif // ASBM_DEVELOPMENT
     {
-        transaction_needs_retry = true;
-    } else if (STATUS_ERROR_NON_RECOVERABLE(transaction_status))
-    {
-        fRetryAttempts = 0;
-        transaction_needs_retry = false;
-
-        goto exit;
+        fTransport = SmbusControllerTransport::withController(mgr->fProvider);
+    }
+    if (!fTransport) {
+        BM_ERRLOG("Failed to create SMBus transport\n");
+        return kIOReturnNoResources;
     }
 
-    /******************************************************************************************
-     ******************************************************************************************/
-
-    if (kIOSMBusStatusOK == transaction_status)
-    {
-        if (0 != fRetryAttempts) {
-            BM_LOG1("SmartBattery: retry %d succeeded!\n", fRetryAttempts);
+    return kIOReturnSuccess;
+}
 
-            fRetryAttempts = 0;
-            transaction_needs_retry = false;    /* potentially overridden below */
+void SmbusHandler::free(void)
+{
+    if (fRetryTimer) {
+        fRetryTimer->cancelTimeout();
+        if (fWorkLoop) {
+            fWorkLoop->removeEventSource(fRetryTimer);
         }
+        OSSafeReleaseNULL(fRetryTimer);
+    }
+    OSSafeReleaseNULL(fTransport);
+    super::free();
+}
 
-        /* Check for absurd return value for RemainingCapacity or FullChargeCapacity.
-         If the returned value is zero, re-read until it's non-zero (or until we
-         try too many times).
+void SmbusHandler::logBudgetChange(void)
+{
+    const SmbusRetryPolicy  &retry = fMachine.retry();
+    const SmbusCmdBudget    &budget = retry.active();
 
-         (FullChargeCapacity = 0) is NOT a valid state
-         (DesignCapacity = 0) is NOT a valid state
-         (RemainingCapacity = 0) is a valid state
-         (RemainingCapacity = 0) && !fFullyDischarged is NOT a valid state
-         */
-        if (((kBFullChargeCapacityCmd == transaction->command)
-             || (kBDesignCapacityCmd == transaction->command)
-             || ((kBRemainingCapacityCmd == transaction->command)
-                 && !fFullyDischarged))
-           && ((transaction->receiveData[1] == 0)
-               && (transaction->receiveData[0] == 0)))
-        {
-            transaction_needs_retry = true;
-        }
+    switch (fMachine.budgetChange()) {
+        case kSmbusBudgetPromoted:
+            BM_LOG1("SmartBattery: (0x%02x, 0x%02x) recovered, restoring retries\n",
+                    retry.address(), retry.command());
+            break;
 
+        case kSmbusBudgetDemoted:
+            BM_ERRLOG("SmartBattery: (0x%02x, 0x%02x) failed %d polls in a row, demoting (ok:%u fail:%u)\n",
+                      retry.address(), retry.command(), budget.consecutiveFailures,
+                      budget.successes, budget.failures);
+            break;
+
+        default:
+            break;
     }
+}
 
-    /* Too many retries already?
-     */
-    if (transaction_needs_retry && (kRetryAttempts == fRetryAttempts))
-    {
-        // Too many consecutive failures to read this entry. Give up, and
-        // go on to attempt a read on the next element in the state machine.
+IOReturn SmbusHandler::submitTransaction(void)
+{
+    const SmbusBusTransfer &transfer = fMachine.transfer();
 
-        BM_ERRLOG("SmartBattery: Giving up on (0x%02x, 0x%02x) after %d retries.\n",
-                transaction->address, transaction->command, fRetryAttempts);
+    bzero(&fTransaction, sizeof(fTransaction));
+    fTransaction.address = transfer.address;
+    fTransaction.command = transfer.command;
+    switch (transfer.op) {
+        case kSmbusBusWriteWord:
+            fTransaction.protocol = kIOSMBusProtocolWriteWord;
+            break;
+        case kSmbusBusReadBlock:
+            fTransaction.protocol = kIOSMBusProtocolReadBlock;
+            break;
+        default:
+            fTransaction.protocol = kIOSMBusProtocolReadWord;
+            break;
+    }
+    fTransaction.sendDataCount = transfer.sendDataCount;
+    memcpy(fTransaction.sendData, transfer.sendData, transfer.sendDataCount);
 
-        fRetryAttempts = 0;
+    fCmdCount++;
+    return fTransport->performTransaction(&fTransaction,
+                                OSMemberFunctionCast(IOSMBusTransactionCompletion,
+                                                     this, &SmbusHandler::smbusCompletion),
+                                this, VOIDPTR(fCmdCount));
+}
 
-        transaction_needs_retry = false;
+void SmbusHandler::retryTimerFired(IOTimerEventSource *sender __unused)
+{
+    IOReturn ret;
 
-        // After too many retries, unblock PM state machine in case it is
-        // waiting for the first battery poll after wake to complete,
-        // avoiding a setPowerState timeout.
-        //TODO:acknowledgeSystemSleepWake();
+    if ((ret = isTransactionAllowed()) != kIOReturnSuccess) {
+        fMachine.abandon();
+        fCompletion(fTarget, fReference, ret, 0, NULL);
+        return;
+    }
 
-        goto exit;
+    ret = submitTransaction();
+    if (ret != kIOReturnSuccess) {
+        BM_ERRLOG("Smbus trasaction submission failed with error 0x%x\n", ret);
+        fMachine.submitFailed();
+        logBudgetChange();
+        fCompletion(fTarget, fReference, kIOReturnIOError, 0, NULL);
     }
+}
 
-exit:
-    if (transaction_needs_retry && fRetryAttempts < kRetryAttempts) {
-        return microSecDelayTable[fRetryAttempts++];
-    } else {
-        return 0;
+/* If the last transaction wasn't successful at the SMBus level, retry.
+ * STATUS_ERROR_NON_RECOVERABLE, and anything unlisted, is not retried.
+ */
+SmbusAttemptResult SmbusHandler::classifyStatus(IOSMBusStatus status)
+{
+    if (kIOSMBusStatusOK == status) {
+        return kSmbusAttemptOK;
+    }
+    if (STATUS_ERROR_NEEDS_RETRY(status)) {
+        return kSmbusAttemptRetry;
     }
+    return kSmbusAttemptFatal;
 }
 
 IOReturn SmbusHandler::isTransactionAllowed()
@@ -177,8 +214,9 @@ IOReturn SmbusHandler::isTransactionAllowed()
 
 void SmbusHandler::smbusCompletion(void *ref, IOSMBusTransaction *transaction)
 {
-    uint32_t delay_for;
-    IOReturn ret;
+    uint32_t            delay_for;
+    IOReturn            ret;
+    SmbusAttemptResult  result;
     uint32_t cmdCount = (uint32_t)((uintptr_t)ref);
 
     if (!transaction) {
@@ -203,78 +241,66 @@ void SmbusHandler::smbusCompletion(void *ref, IOSMBusTransaction *transaction)
             (transaction->receiveData[1] << 8) | transaction->receiveData[0]);
 
     if ((ret = isTransactionAllowed()) != kIOReturnSuccess) {
+        fMachine.abandon();
         fCompletion(fTarget, fReference, ret, 0, NULL);
         return ;
     }
 
-    if ((delay_for = requiresRetryGetMicroSec(transaction)) != 0) {
-        BM_ERRLOG("transaction cmd: 0x%02x failed with 0x%02x; retry attempt %d of %d\n",
-                transaction->command, transaction->status, fRetryAttempts, kRetryAttempts);
-        if (delay_for < 1000) {
-            IODelay(delay_for); // microseconds
-        } else {
-            IOSleep(delay_for / 1000); // milliseconds
-        }
-
-        fCmdCount++;
-        ret = fMgr->fProvider->performTransaction(&fTransaction,
-                                OSMemberFunctionCast(IOSMBusTransactionCompletion,
-                                                     this, &SmbusHandler::smbusCompletion),
-                                this, VOIDPTR(fCmdCount));
-
-        if (ret != kIOReturnSuccess) {
-            BM_ERRLOG("Smbus trasaction submission failed with error 0x%x\n", ret);
-            fRetryAttempts = 0;
-            fCompletion(fTarget, fReference, kIOReturnIOError, 0, NULL);
-
-        }
-        return;
-    }
-    if (transaction->status != kIOSMBusStatusOK) {
-        BM_ERRLOG("transaction cmd: 0x%x is returned due to error 0x%x after %d retries",
-                  transaction->command, transaction->status, fRetryAttempts);
-        fRetryAttempts = 0;
-        fCompletion(fTarget, fReference, kIOReturnIOError,
-                    transaction->receiveDataCount, transaction->receiveData);
-        return;
+    result = classifyStatus(transaction->status);
+    if ((kSmbusAttemptOK == result) && fMachine.retry().retryAttempts()) {
+        BM_LOG1("SmartBattery: retry %d succeeded!\n", fMachine.retry().retryAttempts());
     }
 
-    switch (fOpType) {
-        case kASBMSMBUSReadWord:
-        case kASBMSMBUSReadBlock:
-            fRetryAttempts = 0;
-            fCompletion(fTarget, fReference, kIOReturnSuccess,
-                        transaction->receiveDataCount, transaction->receiveData);
+    switch (fMachine.complete(result, transaction->receiveData, &delay_for)) {
+        case kSmbusStepRetry:
+            BM_ERRLOG("transaction cmd: 0x%02x failed with 0x%02x; retry attempt %d of %d\n",
+                    transaction->command, transaction->status,
+                    fMachine.retry().retryAttempts(), fMachine.retry().retryLimit());
+            fRetryTimer->setTimeoutUS(delay_for);
             break;
 
-        case kASBMSMBUSExtendedReadWord:
-            fTransaction.protocol = kIOSMBusProtocolReadWord;
-            fRetryAttempts = 0;
+        case kSmbusStepSubmit:
             BM_LOG2("Issuing read for extended read. proto:%d cmd:0x%x add:0x%x",
-                    fTransaction.protocol, fTransaction.command, fTransaction.address);
-
-            fOpType = kASBMSMBUSReadWord;
-            fCmdCount++;
-            ret = fMgr->fProvider->performTransaction(&fTransaction,
-                                                     OSMemberFunctionCast(IOSMBusTransactionCompletion,
-                                                                          this, &SmbusHandler::smbusCompletion),
-                                                     this, VOIDPTR(fCmdCount));
+                    kIOSMBusProtocolReadWord, fMachine.transfer().command, fMachine.transfer().address);
+            ret = submitTransaction();
             if (ret != kIOReturnSuccess) {
                 BM_ERRLOG("Smbus trasaction submission failed with error 0x%x\n", ret);
+                fMachine.submitFailed();
+                logBudgetChange();
                 fCompletion(fTarget, fReference, kIOReturnIOError, 0, NULL);
             }
             break;
 
-        case kASBMSMBUSWriteWord:
-            fCompletion(fTarget, fReference, kIOReturnSuccess, 0, NULL);
+        case kSmbusStepFailed:
+            if (fMachine.gaveUp()) {
+                // Too many consecutive failures to read this entry. Give up, and
+                // go on to attempt a read on the next element in the state machine.
+                // TODO: unblock the PM state machine in case it is waiting for
+                // the first battery poll after wake, avoiding a setPowerState timeout.
+                BM_ERRLOG("SmartBattery: Giving up on (0x%02x, 0x%02x) after %d retries.\n",
+                        transaction->address, transaction->command, fMachine.retry().retryLimit());
+            }
+            BM_ERRLOG("transaction cmd: 0x%x is returned due to error 0x%x",
+                      transaction->command, transaction->status);
+            logBudgetChange();
+            fCompletion(fTarget, fReference, kIOReturnIOError,
+                        transaction->receiveDataCount, transaction->receiveData);
             break;
 
-        default:
-            panic("Completion call for unexpected SMBUS transaction protocol %d\n", fOpType);
+        case kSmbusStepDone:
+            if (fMachine.gaveUp()) {
+                BM_ERRLOG("SmartBattery: Giving up on (0x%02x, 0x%02x) after %d retries.\n",
+                        transaction->address, transaction->command, fMachine.retry().retryLimit());
+            }
+            logBudgetChange();
+            if (kASBMSMBUSWriteWord == fMachine.opType()) {
+                fCompletion(fTarget, fReference, kIOReturnSuccess, 0, NULL);
+            } else {
+                fCompletion(fTarget, fReference, kIOReturnSuccess,
+                            transaction->receiveDataCount, transaction->receiveData);
+            }
             break;
     }
-
-    return;
 }
 
 IOReturn SmbusHandler::performTransaction(ASBMgrRequest *req,
@@ -294,61 +320,31 @@ IOReturn SmbusHandler::performTransaction(ASBMgrRequest *req,
         return ret;
     }
 
-    bzero(&fTransaction, sizeof(fTransaction));
-    fTransaction.address = req->address;
-    fTransaction.command = req->command;
-    fOpType = req->opType;
+    // a new request supersedes any retry still waiting on the timer
+    fRetryTimer->cancelTimeout();
 
     fCompletion = completion;
-    fFullyDischarged = req->fullyDischarged;
     fTarget = target;
     fReference = reference;
-    fRetryAttempts = 0;
-
-    switch (req->opType) {
-        case kASBMSMBUSReadWord:
-            fTransaction.protocol = kIOSMBusProtocolReadWord;
-            break;
-
-        case kASBMSMBUSExtendedReadWord:
-            fTransaction.protocol = kIOSMBusProtocolWriteWord;
-            fTransaction.sendData[0]   = req->command;
-            fTransaction.sendData[1]   = 0;
-            fTransaction.sendDataCount = 2;
-            if ((req->command == kBExtendedPFStatusCmd) || (req->command == kBExtendedOperationStatusCmd)) {
-                fTransaction.command = kBManufacturerAccessCmd;
-            }
-            else {
-                BM_ERRLOG("Extended read for cmd 0x%x is not supported\n", req->command);
-                return kIOReturnBadArgument;
-            }
-
-            BM_LOG2("Issuing write for extended read. proto:%d sendData:0x%x cmd:0x%x add:0x%x",
-                    fTransaction.protocol, fTransaction.sendData[1] << 8 | fTransaction.sendData[0],
-                    req->command, req->address);
-            break;
 
-        case kASBMSMBUSReadBlock:
-            fTransaction.protocol = kIOSMBusProtocolReadBlock;
-            break;
-
-        case kASBMSMBUSWriteWord:
-            fTransaction.protocol = kIOSMBusProtocolWriteWord;
-            fTransaction.sendDataCount = 2;
-            fTransaction.sendData[0] = req->outData[0];
-            fTransaction.sendData[1] = req->outData[1];
-            break;
+    if (!fMachine.start(req->opType, req->address, req->command,
+                        req->fullyDischarged, req->outData)) {
+        if (kASBMSMBUSExtendedReadWord == req->opType) {
+            BM_ERRLOG("Extended read for cmd 0x%x is not supported\n", req->command);
+            return kIOReturnBadArgument;
+        }
+        BM_ERRLOG("smbusRead received invalid opType: %d\n", req->opType);
+        return kIOReturnInvalid;
+    }
 
-        default:
-            BM_ERRLOG("smbusRead received invalid opType: %d\n", req->opType);
-            return kIOReturnInvalid;
+    if (kASBMSMBUSExtendedReadWord == req->opType) {
+        BM_LOG2("Issuing write for extended read. proto:%d sendData:0x%x cmd:0x%x add:0x%x",
+                kIOSMBusProtocolWriteWord,
+                fMachine.transfer().sendData[1] << 8 | fMachine.transfer().sendData[0],
+                req->command, req->address);
     }
 
-    fCmdCount++;
-    ret = fMgr->fProvider->performTransaction(&fTransaction,
-                                         OSMemberFunctionCast(IOSMBusTransactionCompletion,
-                                                              this, &SmbusHandler::smbusCompletion),
-                                         this, VOIDPTR(fCmdCount));
+    ret = submitTransaction();
 
     if (ret != kIOReturnSuccess) {
         BM_ERRLOG("Smbus trasaction submission failed with error 0x%x\n", ret);
@@ -398,6 +394,8 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
     uint16_t                i;
     uint16_t                retryAttempts = 0;
     IOReturn                transactionSuccess;
+    // Not fTransaction: a battery poll may be waiting on fRetryTimer to resubmit it
+    IOSMBusTransaction      transaction;
 
     EXSMBUSInputStruct      *inSMBus = (EXSMBUSInputStruct *)in;
     EXSMBUSOutputStruct     *outSMBus = (EXSMBUSOutputStruct *)out;
@@ -413,7 +411,7 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
      */
     do {
 
-        bzero(&fTransaction, sizeof(fTransaction));
+        bzero(&transaction, sizeof(transaction));
 
         // Input: bus address
         if (kSMBusAppleDoublerAddr == inSMBus->batterySelector
@@ -421,68 +419,68 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
             || kSMBusManagerAddr == inSMBus->batterySelector
             || kSMBusChargerAddr == inSMBus->batterySelector)
         {
-            fTransaction.address = inSMBus->batterySelector;
+            transaction.address = inSMBus->batterySelector;
         } else {
             if (0 == inSMBus->batterySelector)
             {
-                fTransaction.address = kSMBusBatteryAddr;
+                transaction.address = kSMBusBatteryAddr;
             } else {
-                fTransaction.address = kSMBusManagerAddr;
+                transaction.address = kSMBusManagerAddr;
             }
         }
 
         // Input: command
-        fTransaction.command = inSMBus->address;
+        transaction.command = inSMBus->address;
 
         // Input: Read/Write Word/Block
         switch (inSMBus->type) {
             case kEXWriteWord:
-                fTransaction.protocol = kIOSMBusProtocolWriteWord;
-                fTransaction.sendDataCount = 2;
+                transaction.protocol = kIOSMBusProtocolWriteWord;
+                transaction.sendDataCount = 2;
                 break;
             case kEXReadWord:
-                fTransaction.protocol = kIOSMBusProtocolReadWord;
-                fTransaction.sendDataCount = 0;
+                transaction.protocol = kIOSMBusProtocolReadWord;
+                transaction.sendDataCount = 0;
                 break;
             case kEXWriteBlock:
-                fTransaction.protocol = kIOSMBusProtocolWriteBlock;
+                transaction.protocol = kIOSMBusProtocolWriteBlock;
                 // rdar://5433060 workaround for SMC SMBus blockCount bug
                 // For block writes, clients always increment inByteCount +1
                 // greater than the actual byte count.
                 // We decrement it here for IOSMBusController.
-                fTransaction.sendDataCount = inSMBus->inByteCount - 1;
+                transaction.sendDataCount = inSMBus->inByteCount - 1;
                 break;
             case kEXReadBlock:
-                fTransaction.protocol = kIOSMBusProtocolReadBlock;
-                fTransaction.sendDataCount = 0;
+                transaction.protocol = kIOSMBusProtocolReadBlock;
+                transaction.sendDataCount = 0;
                 break;
             case kEXWriteByte:
-                fTransaction.protocol = kIOSMBusProtocolWriteByte;
-                fTransaction.sendDataCount = 1;
+                transaction.protocol = kIOSMBusProtocolWriteByte;
+                transaction.sendDataCount = 1;
                 break;
             case kEXReadByte:
-                fTransaction.protocol = kIOSMBusProtocolReadByte;
-                fTransaction.sendDataCount = 0;
+                transaction.protocol = kIOSMBusProtocolReadByte;
+                transaction.sendDataCount = 0;
                 break;
             case kEXSendByte:
-                fTransaction.protocol = kIOSMBusProtocolSendByte;
-                fTransaction.sendDataCount = 0;
+                transaction.protocol = kIOSMBusProtocolSendByte;
+                transaction.sendDataCount = 0;
                 break;
             default:
                 return kIOReturnBadArgument;
         }
 
         if (inSMBus->flags & kEXFlagUsePEC) {
-            fTransaction.options = kIOSMBusTransactionUsesPEC;
+            transaction.options = kIOSMBusTransactionUsesPEC;
         }
 
         // Input: copy data into transaction
         //  only need to copy data for write operations
-        if ((kIOSMBusProtocolWriteWord == fTransaction.protocol)
-            || (kIOSMBusProtocolWriteBlock == fTransaction.protocol))
+        if ((kIOSMBusProtocolWriteWord == transaction.protocol)
+            || (kIOSMBusProtocolWriteBlock == transaction.protocol))
         {
             for(i = 0; i<MAX_SMBUS_DATA_SIZE; i++) {
-                fTransaction.sendData[i] = inSMBus->inBuf[i];
+                transaction.sendData[i] = inSMBus->inBuf[i];
             }
         }
 
@@ -499,23 +497,23 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
 
         if (retryAttempts == 0) {
             BM_LOG2("External Smbus request with cmd:0x%x protocol:0x%x address:0x%x",
-                    fTransaction.command, fTransaction.protocol, fTransaction.address);
+                    transaction.command, transaction.protocol, transaction.address);
         }
         else {
             BM_LOG2("External Smbus request retry attempt %d for cmd:0x%x protocol:0x%x address:0x%x",
-                    retryAttempts, fTransaction.command, fTransaction.protocol, fTransaction.address);
+                    retryAttempts, transaction.command, transaction.protocol, transaction.address);
         }
 
-        transactionSuccess = fMgr->fProvider->performTransaction(&fTransaction,
+        transactionSuccess = fTransport->performTransaction(&transaction,
                                 OSMemberFunctionCast(IOSMBusTransactionCompletion, this, &SmbusHandler::smbusExternalTransactionCompletion),
-                                this, &fTransaction);
+                                this, &transaction);
 
         /* Output: status */
         if (kIOReturnSuccess == transactionSuccess)
         {
             // Block here until the transaction is completed
         BM_LOG2("smbusExternalTransaction blocked\n");
-            fMgr->fManagerGate->commandSleep(&fTransaction, THREAD_UNINT);
+            fMgr->fManagerGate->commandSleep(&transaction, THREAD_UNINT);
             outSMBus->status = kIOReturnSuccess;
         }
         else {
@@ -523,10 +521,10 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
             return kIOReturnError;
         }
 
-        outSMBus->status = getErrorCode(fTransaction.status);
+        outSMBus->status = getErrorCode(transaction.status);
 
-        if (fTransaction.status !=kIOSMBusStatusOK) {
-            BM_ERRLOG("SMBus external transaction failed with error 0x%x\n", fTransaction.status);
+        if (transaction.status !=kIOSMBusStatusOK) {
+            BM_ERRLOG("SMBus external transaction failed with error 0x%x\n", transaction.status);
         }
         else {
             BM_LOG2("External transaction request completed\n");
@@ -539,19 +537,19 @@ IOReturn SmbusHandler::smbusExternalTransaction(void *in, void *out, IOByteCount
              && (++retryAttempts < kRetryAttempts));
 
     /* Output: read word/read block results */
-    if (((kIOSMBusProtocolReadWord == fTransaction.protocol)
-         || (kIOSMBusProtocolReadBlock == fTransaction.protocol)
-         || (kIOSMBusProtocolReadByte == fTransaction.protocol))
-        && (kIOSMBusStatusOK == fTransaction.status))
+    if (((kIOSMBusProtocolReadWord == transaction.protocol)
+         || (kIOSMBusProtocolReadBlock == transaction.protocol)
+         || (kIOSMBusProtocolReadByte == transaction.protocol))
+        && (kIOSMBusStatusOK == transaction.status))
     {
-        if (fTransaction.receiveDataCount > sizeof(outSMBus->outBuf)) {
+        if (transaction.receiveDataCount > sizeof(outSMBus->outBuf)) {
             outSMBus->outByteCount = sizeof(outSMBus->outBuf);
         }
         else {
-            outSMBus->outByteCount = fTransaction.receiveDataCount;
+            outSMBus->outByteCount = transaction.receiveDataCount;
         }
 
-        memcpy(outSMBus->outBuf, fTransaction.receiveData, outSMBus->outByteCount);
+        memcpy(outSMBus->outBuf, transaction.receiveData, outSMBus->outByteCount);
     }
 
     return kIOReturnSuccess;
@@ -673,7 +671,7 @@ IOReturn SmbusHandler::disableInflow(int level)
     else {
         transaction.sendData[0] = 0x0;
     }
-    transactionSuccess = fMgr->fProvider->performTransaction(&transaction,
+    transactionSuccess = fTransport->performTransaction(&transaction,
                                  OSMemberFunctionCast(IOSMBusTransactionCompletion, this,
                                      &SmbusHandler::smbusExternalTransactionCompletion), this, &transaction);
 
@@ -711,7 +709,7 @@ IOReturn SmbusHandler::inhibitCharging(int level)
         transaction.sendData[0] = 0x70;
         transaction.sendData[1] = 0x17;
     }
-    transactionSuccess = fMgr->fProvider->performTransaction(&transaction,
+    transactionSuccess = fTransport->performTransaction(&transaction,
                                  OSMemberFunctionCast(IOSMBusTransactionCompletion, this,
                                      &SmbusHandler::smbusExternalTransactionCompletion), this, &transaction);
 
@@ -728,3 +726,313 @@ IOReturn SmbusHandler::inhibitCharging(int level)
         return kIOReturnError;
     }
 }
+
+#pragma mark - Transports
+
+OSDefineMetaClassAndAbstractStructors(SmbusTransport, OSObject)
+OSDefineMetaClassAndStructors(SmbusControllerTransport, SmbusTransport)
+
+SmbusControllerTransport *SmbusControllerTransport::withController(IOSMBusController *controller)
+{
+    SmbusControllerTransport *me;
+
+    if (!controller) {
+        return NULL;
+    }
+
+    me = new SmbusControllerTransport;
+    if (me && !me->init()) {
+        me->release();
+        return NULL;
+    }
+    if (me) {
+        me->fController = controller;
+    }
+    return me;
+}
+
+IOReturn SmbusControllerTransport::performTransaction(IOSMBusTransaction *transaction,
+                                                      IOSMBusTransactionCompletion completion,
+                                                      OSObject *target, void *reference)
+{
+    return fController->performTransaction(transaction, completion, target, reference);
+}
+
+#pragma mark - Simulated battery
+
+#if ASBM_DEVELOPMENT
+
+OSDefineMetaClassAndStructors(SmbusSimulatedBattery, SmbusTransport)
+
+// Publish statistics every this many transactions
+#define kSmbusSimStatsInterval      64
+
+SmbusSimulatedBattery *SmbusSimulatedBattery::withManager(IOService *mgr, IOWorkLoop *workLoop)
+{
+    SmbusSimulatedBattery *me;
+
+    me = new SmbusSimulatedBattery;
+    if (me && !me->init()) {
+        me->release();
+        return NULL;
+    }
+    if (!me) {
+        return NULL;
+    }
+
+    me->fMgr = mgr;
+    me->fTimer = IOTimerEventSource::timerEventSource(me,
+                    OSMemberFunctionCast(IOTimerEventSource::Action,
+                    me, &SmbusSimulatedBattery::completeTransaction));
+    if (!me->fTimer || (kIOReturnSuccess != workLoop->addEventSource(me->fTimer))) {
+        BM_ERRLOG("Failed to create simulated battery timer\n");
+        OSSafeReleaseNULL(me->fTimer);
+        me->release();
+        return NULL;
+    }
+
+    me->fModel.init();
+    me->fErrorStatus = kIOSMBusStatusDeviceError;
+
+    me->configure(OSDynamicCast(OSDictionary, mgr->getProperty("SimulatedBattery")));
+
+    return me;
+}
+
+void SmbusSimulatedBattery::free(void)
+{
+    if (fTimer) {
+        fTimer->cancelTimeout();
+        if (fTimer->getWorkLoop()) {
+            fTimer->getWorkLoop()->removeEventSource(fTimer);
+        }
+        OSSafeReleaseNULL(fTimer);
+    }
+    SmbusTransport::free();
+}
+
+/*
+ * Keys of the "SimulatedBattery" dictionary, all optional:
+ *   DefaultLatencyUS   completion latency for every command
+ *   Latency            array of { Command, LatencyUS }
+ *   Registers          array of { Address, Command, Value }
+ *   DeviceName         string returned by the DeviceName block read
+ *   NakEvery, ErrorCommand, ErrorCount,
+ *   RemoveAfter, InsertAfter
+ *                      fault injection, see SmbusSimulatedBatteryModel.h
+ *   ErrorStatus        IOSMBusStatus of the injected errors
+ */
+void SmbusSimulatedBattery::configure(OSDictionary *config)
+{
+    SmbusSimFaults  &faults = fModel.faults();
+    OSArray         *array;
+    OSDictionary    *entry;
+    OSNumber        *num, *cmd, *addr;
+    OSString        *str;
+
+    if (!config) {
+        return;
+    }
+
+    if ((num = OSDynamicCast(OSNumber, config->getObject("DefaultLatencyUS")))) {
+        fModel.setDefaultLatencyUS(num->unsigned32BitValue());
+    }
+
+    if ((array = OSDynamicCast(OSArray, config->getObject("Latency")))) {
+        for (unsigned i = 0; i < array->getCount(); i++) {
+            entry = OSDynamicCast(OSDictionary, array->getObject(i));
+            if (!entry) continue;
+            cmd = OSDynamicCast(OSNumber, entry->getObject("Command"));
+            num = OSDynamicCast(OSNumber, entry->getObject("LatencyUS"));
+            if (cmd && num) {
+                fModel.setLatencyUS(cmd->unsigned8BitValue(), num->unsigned32BitValue());
+            }
+        }
+    }
+
+    if ((array = OSDynamicCast(OSArray, config->getObject("Registers")))) {
+        for (unsigned i = 0; i < array->getCount(); i++) {
+            entry = OSDynamicCast(OSDictionary, array->getObject(i));
+            if (!entry) continue;
+            addr = OSDynamicCast(OSNumber, entry->getObject("Address"));
+            cmd = OSDynamicCast(OSNumber, entry->getObject("Command"));
+            num = OSDynamicCast(OSNumber, entry->getObject("Value"));
+            if (!addr || !cmd || !num
+                || !fModel.setRegister(addr->unsigned8BitValue(), cmd->unsigned8BitValue(),
+                                       num->unsigned16BitValue())) {
+                BM_ERRLOG("SmartBattery: ignoring simulated register entry %d\n", i);
+            }
+        }
+    }
+
+    if ((str = OSDynamicCast(OSString, config->getObject("DeviceName")))) {
+        if (!fModel.setBlock(kBDeviceNameCmd, str->getCStringNoCopy())) {
+            BM_ERRLOG("SmartBattery: no room for simulated block cmd 0x%02x\n", kBDeviceNameCmd);
+        }
+    }
+
+    if ((num = OSDynamicCast(OSNumber, config->getObject("NakEvery")))) {
+        faults.nakEvery = num->unsigned32BitValue();
+    }
+    if ((num = OSDynamicCast(OSNumber, config->getObject("ErrorCommand")))) {
+        faults.errorCmd = num->unsigned8BitValue();
+    }
+    if ((num = OSDynamicCast(OSNumber, config->getObject("ErrorStatus")))) {
+        fErrorStatus = (IOSMBusStatus)num->unsigned8BitValue();
+    }
+    if ((num = OSDynamicCast(OSNumber, config->getObject("ErrorCount")))) {
+        faults.errorCount = num->unsigned32BitValue();
+    }
+    if ((num = OSDynamicCast(OSNumber, config->getObject("RemoveAfter")))) {
+        faults.removeAfter = num->unsigned32BitValue();
+    }
+    if ((num = OSDynamicCast(OSNumber, config->getObject("InsertAfter")))) {
+        faults.insertAfter = num->unsigned32BitValue();
+    }
+
+    BM_LOG1("SmartBattery: simulated battery nakEvery:%u errCmd:0x%02x errCount:%u removeAfter:%u insertAfter:%u\n",
+            faults.nakEvery, faults.errorCmd, faults.errorCount, faults.removeAfter, faults.insertAfter);
+}
+
+IOReturn SmbusSimulatedBattery::performTransaction(IOSMBusTransaction *transaction,
+                                                   IOSMBusTransactionCompletion completion,
+                                                   OSObject *target, void *reference)
+{
+    uint32_t tail;
+
+    if (!transaction || !completion) {
+        return kIOReturnBadArgument;
+    }
+    if (fQueueCount == kSmbusSimQueueDepth) {
+        return kIOReturnBusy;
+    }
+
+    tail = (fQueueHead + fQueueCount) % kSmbusSimQueueDepth;
+    fQueue[tail].transaction = transaction;
+    fQueue[tail].completion = completion;
+    fQueue[tail].target = target;
+    fQueue[tail].reference = reference;
+    if (fQueueCount++ == 0) {
+        armTimer();
+    }
+
+    return kIOReturnSuccess;
+}
+
+void SmbusSimulatedBattery::armTimer(void)
+{
+    fTimer->setTimeoutUS(fModel.latencyUS(fQueue[fQueueHead].transaction->command));
+}
+
+void SmbusSimulatedBattery::completeTransaction(IOTimerEventSource *sender __unused)
+{
+    IOSMBusTransaction              *transaction;
+    IOSMBusTransactionCompletion    completion;
+    OSObject                        *target;
+    void                            *reference;
+    uint16_t                        state;
+
+    if (!fQueueCount) {
+        return;
+    }
+
+    transaction = fQueue[fQueueHead].transaction;
+    completion = fQueue[fQueueHead].completion;
+    target = fQueue[fQueueHead].target;
+    reference = fQueue[fQueueHead].reference;
+    fQueueHead = (fQueueHead + 1) % kSmbusSimQueueDepth;
+    fQueueCount--;
+
+    execute(transaction);
+
+    // The completion may queue the next transaction, re-arming the timer
+    if (fQueueCount) {
+        armTimer();
+    }
+    (*completion)(target, reference, transaction);
+
+    if (fModel.takeAlarm(&state)) {
+        postAlarm(state);
+    }
+}
+
+void SmbusSimulatedBattery::execute(IOSMBusTransaction *transaction)
+{
+    SmbusBusTransfer    transfer;
+    uint8_t             count = 0;
+
+    bzero(&transfer, sizeof(transfer));
+    transfer.address = transaction->address;
+    transfer.command = transaction->command;
+    switch (transaction->protocol) {
+        case kIOSMBusProtocolReadWord:      transfer.op = kSmbusBusReadWord;    break;
+        case kIOSMBusProtocolWriteWord:     transfer.op = kSmbusBusWriteWord;   break;
+        case kIOSMBusProtocolReadBlock:     transfer.op = kSmbusBusReadBlock;   break;
+        default:                            transfer.op = kSmbusBusOtherOp;     break;
+    }
+    transfer.sendDataCount = (transaction->sendDataCount < sizeof(transfer.sendData))
+                             ? transaction->sendDataCount : sizeof(transfer.sendData);
+    memcpy(transfer.sendData, transaction->sendData, transfer.sendDataCount);
+
+    switch (fModel.execute(transfer, transaction->receiveData, &count)) {
+        case kSmbusSimOK:               transaction->status = kIOSMBusStatusOK;                             break;
+        case kSmbusSimNak:              transaction->status = kIOSMBusStatusDeviceAddressNotAcknowledged;   break;
+        case kSmbusSimInjectedError:    transaction->status = fErrorStatus;                                 break;
+        case kSmbusSimShortWrite:       transaction->status = kIOSMBusStatusDeviceError;                    break;
+        case kSmbusSimNoSuchBlock:      transaction->status = kIOSMBusStatusDeviceCommandAccessDenied;      break;
+        default:                        transaction->status = kIOSMBusStatusHostUnsupportedProtocol;        break;
+    }
+    transaction->receiveDataCount = count;
+
+    if ((fModel.stats().transactions % kSmbusSimStatsInterval) == 0) {
+        publishStatistics();
+    }
+}
+
+void SmbusSimulatedBattery::postAlarm(uint16_t state)
+{
+    IOSMBusAlarmMessage     alarm;
+
+    BM_LOG1("SmartBattery: simulated battery alarm, battery %s after %llu transactions\n",
+            fModel.present() ? "present" : "removed", fModel.stats().transactions);
+
+    bzero(&alarm, sizeof(alarm));
+    alarm.fromAddress = kSMBusManagerAddr;
+    alarm.data[0] = state & 0xff;
+    alarm.data[1] = state >> 8;
+    fMgr->message(kIOMessageSMBusAlarm, fMgr, &alarm);
+
+    publishStatistics();
+}
+
+void SmbusSimulatedBattery::publishStatistics(void)
+{
+    const SmbusSimStats &sim = fModel.stats();
+    OSDictionary        *stats = OSDictionary::withCapacity(5);
+    const struct {
+        const char  *key;
+        uint64_t    value;
+    } counters[] = {
+        { "Transactions",   sim.transactions },
+        { "Retries",        sim.retries },
+        { "Naks",           sim.naks },
+        { "InjectedErrors", sim.errors },
+        { "Removals",       sim.removals },
+    };
+
+    if (!stats) {
+        return;
+    }
+
+    for (unsigned i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        OSNumber *num = OSNumber::withNumber(counters[i].value, 64);
+        if (num) {
+            stats->setObject(counters[i].key, num);
+            num->release();
+        }
+    }
+    fMgr->setProperty("SimulatedBatteryStats", stats);
+    stats->release();
+}
+
+#endif // ASBM_DEVELOPMENT
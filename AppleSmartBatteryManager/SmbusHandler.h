@@ -10,14 +10,98 @@
 #define SmbusHandler_h
 
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <IOKit/IOTimerEventSource.h>
 #include <libkern/c++/OSObject.h>
 #include "AppleSmartBatteryCommands.h"
 #include "AppleSmartBatteryManager.h"
+#include "SmbusTransactionMachine.h"
+#if ASBM_DEVELOPMENT
+#include "SmbusSimulatedBatteryModel.h"
+#endif // ASBM_DEVELOPMENT
 
 #define MAX_SMBUS_DATA_SIZE 32
 
 class AppleSmartBatteryManager;
 
+/*
+ * SmbusTransport - the bus SmbusHandler talks to. SmbusControllerTransport
+ * forwards to the IOSMBusController we're attached to. On development
+ * builds SmbusSimulatedBattery replaces it when the "asbm-sim" boot-arg is
+ * set, so the poll and retry paths can be exercised with faults a real pack
+ * won't produce on demand.
+ */
+class SmbusTransport : public OSObject
+{
+    OSDeclareAbstractStructors(SmbusTransport)
+
+public:
+    virtual IOReturn performTransaction(IOSMBusTransaction *transaction,
+                                        IOSMBusTransactionCompletion completion,
+                                        OSObject *target, void *reference) = 0;
+};
+
+class SmbusControllerTransport : public SmbusTransport
+{
+    OSDeclareDefaultStructors(SmbusControllerTransport)
+
+private:
+    IOSMBusController   *fController;
+
+public:
+    static SmbusControllerTransport *withController(IOSMBusController *controller);
+    IOReturn performTransaction(IOSMBusTransaction *transaction,
+                                IOSMBusTransactionCompletion completion,
+                                OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+};
+
+#if ASBM_DEVELOPMENT
+/*
+ * SmbusSimulatedBattery - transport around SmbusSimulatedBatteryModel.
+ * Completions are delivered from a timer on the workloop after the model's
+ * per-command latency, one transaction at a time like a controller would,
+ * and battery removal and insertion are reported to the manager with the
+ * same SMBus alarm real hardware sends.
+ *
+ * The configuration is read from the "SimulatedBattery" dictionary in the
+ * manager's personality; see configure() for the keys and
+ * SmbusSimulatedBatteryModel.h for the faults.
+ */
+#define kSmbusSimQueueDepth     4
+
+class SmbusSimulatedBattery : public SmbusTransport
+{
+    OSDeclareDefaultStructors(SmbusSimulatedBattery)
+
+private:
+    IOService                   *fMgr;
+    IOTimerEventSource          *fTimer;
+    SmbusSimulatedBatteryModel  fModel;
+    IOSMBusStatus               fErrorStatus;   // status of injected errors
+
+    struct {
+        IOSMBusTransaction              *transaction;
+        IOSMBusTransactionCompletion    completion;
+        OSObject                        *target;
+        void                            *reference;
+    }                           fQueue[kSmbusSimQueueDepth];
+    uint32_t                    fQueueHead;
+    uint32_t                    fQueueCount;
+
+    void     execute(IOSMBusTransaction *transaction);
+    void     armTimer(void);
+    void     completeTransaction(IOTimerEventSource *sender);
+    void     postAlarm(uint16_t state);
+    void     publishStatistics(void);
+
+public:
+    static SmbusSimulatedBattery *withManager(IOService *mgr, IOWorkLoop *workLoop);
+    void free(void) APPLE_KEXT_OVERRIDE;
+    void configure(OSDictionary *config);
+    IOReturn performTransaction(IOSMBusTransaction *transaction,
+                                IOSMBusTransactionCompletion completion,
+                                OSObject *target, void *reference) APPLE_KEXT_OVERRIDE;
+};
+#endif // ASBM_DEVELOPMENT
 
 class SmbusHandler : public OSObject
 {
@@ -25,30 +109,34 @@ class SmbusHandler : public OSObject
 OSDeclareDefaultStructors(SmbusHandler)
 
 private:
-    int         fRetryAttempts;
     int         fExternalTransactionWait;
     
     AppleSmartBatteryManager    *fMgr;
     IOWorkLoop                  *fWorkLoop;
+    SmbusTransport              *fTransport;
 
     ASBMgrTransactionCompletion     fCompletion;
-    bool                            fFullyDischarged;
     OSObject                        *fTarget;
     void                            *fReference;
     IOSMBusTransaction              fTransaction;
-    ASBMgrOpType                    fOpType;
     uint32_t                        fCmdCount;
+    IOTimerEventSource              *fRetryTimer;
+    SmbusTransactionMachine         fMachine;
 
     IOACPIPlatformDevice            *fACPIProvider;
 
     void smbusCompletion(void *ref, IOSMBusTransaction *transaction);
+    void retryTimerFired(IOTimerEventSource *sender);
+    void logBudgetChange(void);
+    IOReturn submitTransaction(void);
     void smbusExternalTransactionCompletion(void *ref, IOSMBusTransaction *transaction);
     IOReturn getErrorCode(IOSMBusStatus status);
 
 public:
 
     IOReturn initialize ( AppleSmartBatteryManager *mgr );
-    uint32_t requiresRetryGetMicroSec(IOSMBusTransaction *transaction);
+    void free(void) APPLE_KEXT_OVERRIDE;
+    SmbusAttemptResult classifyStatus(IOSMBusStatus status);
     IOReturn isTransactionAllowed();
     IOReturn performTransaction(ASBMgrRequest *req, ASBMgrTransactionCompletion completion, OSObject * target, void * reference);
 
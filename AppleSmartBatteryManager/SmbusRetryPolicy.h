@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Retry bookkeeping for one SMBus command on one device.
+ * A command that gives up after the full retry table on
+ * kSmbusDemoteAfterFailures polls in a row is demoted: it gets a single
+ * attempt per poll, and only goes through the retry table again every
+ * kSmbusDemotedProbeInterval polls. One success promotes it back.
+ */
+enum {
+    kSmbusDemoteAfterFailures   = 3,
+    kSmbusDemotedProbeInterval  = 10
+};
+
+struct SmbusCmdBudget {
+    uint32_t    successes;
+    uint32_t    failures;
+    uint8_t     retryAttempts;
+    uint8_t     consecutiveFailures;
+    uint8_t     pollsSinceProbe;
+    bool        demoted;
+};
+
+// How one attempt of a transaction went, as classified by the caller
+enum SmbusAttemptResult {
+    kSmbusAttemptOK,            // done, nothing to retry
+    kSmbusAttemptRetry,         // transient bus error or implausible value
+    kSmbusAttemptFatal          // error a retry won't fix
+};
+
+// What finish() did to the command's budget
+enum SmbusBudgetChange {
+    kSmbusBudgetUnchanged,
+    kSmbusBudgetDemoted,
+    kSmbusBudgetPromoted
+};
+
+/*
+ * SmbusRetryPolicy - the retry state machine of SmbusHandler. Budgets are
+ * kept per (address, command): the battery and the manager use the same
+ * command codes for unrelated registers, and one failing must not demote
+ * the other. Addresses in the Smart Battery System range 0x08-0x0f each get
+ * their own table; anything else shares the last one.
+ */
+#define kSmbusBudgetAddrBase    0x08
+#define kSmbusBudgetAddrSlots   9
+
+class SmbusRetryPolicy {
+public:
+    // @delaysUS is the wait before each retry; its length is the retry limit
+    void init(const uint32_t *delaysUS, uint8_t count)
+    {
+        memset(fBudget, 0, sizeof(fBudget));
+        fDelaysUS = delaysUS;
+        fDelayCount = count;
+        fRetryLimit = count;
+        fAddress = 0;
+        fCommand = 0;
+        fActive = &fBudget[kSmbusBudgetAddrSlots - 1][0];
+    }
+
+    // Start a transaction; picks the retry limit for this poll
+    void begin(uint8_t address, uint8_t command)
+    {
+        fAddress = address;
+        fCommand = command;
+        fActive = &fBudget[slot(address)][command];
+        fActive->retryAttempts = 0;
+        fRetryLimit = fDelayCount;
+        if (fActive->demoted) {
+            // Demoted commands get one attempt per poll, and the full retry
+            // table only on every kSmbusDemotedProbeInterval'th poll
+            if (++fActive->pollsSinceProbe >= kSmbusDemotedProbeInterval) {
+                fActive->pollsSinceProbe = 0;
+            } else {
+                fRetryLimit = 0;
+            }
+        }
+    }
+
+    // Microseconds to wait before retrying after an attempt ended with
+    // @result, or 0 if the transaction is done (see exhausted())
+    uint32_t nextRetryUS(SmbusAttemptResult result)
+    {
+        if (kSmbusAttemptRetry != result || fActive->retryAttempts >= fRetryLimit) {
+            return 0;
+        }
+        return fDelaysUS[fActive->retryAttempts++];
+    }
+
+    // Restart the retry count for a new phase of the same transaction,
+    // or after it was abandoned
+    void reset(void) { fActive->retryAttempts = 0; }
+
+    // Record the final outcome of the transaction
+    SmbusBudgetChange finish(bool success)
+    {
+        fActive->retryAttempts = 0;
+
+        if (success) {
+            fActive->successes++;
+            fActive->consecutiveFailures = 0;
+            if (fActive->demoted) {
+                fActive->demoted = false;
+                return kSmbusBudgetPromoted;
+            }
+            return kSmbusBudgetUnchanged;
+        }
+
+        fActive->failures++;
+        if (fActive->consecutiveFailures < UINT8_MAX) {
+            fActive->consecutiveFailures++;
+        }
+        if (!fActive->demoted && fActive->consecutiveFailures >= kSmbusDemoteAfterFailures) {
+            fActive->demoted = true;
+            fActive->pollsSinceProbe = 0;
+            return kSmbusBudgetDemoted;
+        }
+        return kSmbusBudgetUnchanged;
+    }
+
+    uint8_t address(void) const { return fAddress; }
+    uint8_t command(void) const { return fCommand; }
+    uint8_t retryAttempts(void) const { return fActive->retryAttempts; }
+    uint8_t retryLimit(void) const { return fRetryLimit; }
+    bool exhausted(void) const { return fActive->retryAttempts >= fRetryLimit; }
+    const SmbusCmdBudget &active(void) const { return *fActive; }
+
+    const SmbusCmdBudget &budget(uint8_t address, uint8_t command) const
+    {
+        return fBudget[slot(address)][command];
+    }
+
+private:
+    static int slot(uint8_t address)
+    {
+        if (address >= kSmbusBudgetAddrBase && address < kSmbusBudgetAddrBase + kSmbusBudgetAddrSlots - 1) {
+            return address - kSmbusBudgetAddrBase;
+        }
+        return kSmbusBudgetAddrSlots - 1;
+    }
+
+    const uint32_t  *fDelaysUS;
+    uint8_t         fDelayCount;
+    uint8_t         fRetryLimit;
+    uint8_t         fAddress;
+    uint8_t         fCommand;
+    SmbusCmdBudget  *fActive;
+    SmbusCmdBudget  fBudget[kSmbusBudgetAddrSlots][256];
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "AppleSmartBatteryCommands.h"
+#include "SmbusTransactionMachine.h"
+
+#define kSmbusSimBlockSlots         4
+// A typical SMBus word transaction at 100kHz, with the gauge clock stretching
+#define kSmbusSimDefaultLatencyUS   2000
+
+// How the model answered a transfer; SmbusSimulatedBattery maps these to
+// IOSMBusStatus
+enum SmbusSimResult {
+    kSmbusSimOK,
+    kSmbusSimNak,               // address not acknowledged
+    kSmbusSimInjectedError,     // ErrorCommand fault
+    kSmbusSimShortWrite,        // word write with fewer than 2 bytes
+    kSmbusSimNoSuchBlock,       // block read of a command with no block
+    kSmbusSimUnsupported        // protocol the model doesn't implement
+};
+
+// Deterministic faults, so runs are repeatable:
+//   nakEvery       every Nth transaction is not acknowledged
+//   errorCmd       the next errorCount transactions for this command
+//                  complete with kSmbusSimInjectedError
+//   removeAfter    the battery is removed after this many transactions
+//                  (and reinserted after insertAfter more, if set)
+struct SmbusSimFaults {
+    uint32_t    nakEvery;
+    uint8_t     errorCmd;
+    uint32_t    errorCount;
+    uint32_t    removeAfter;
+    uint32_t    insertAfter;
+};
+
+struct SmbusSimStats {
+    uint64_t    transactions;
+    uint64_t    retries;        // transactions repeating the last failed one
+    uint64_t    naks;
+    uint64_t    errors;         // injected errors
+    uint64_t    removals;
+};
+
+/*
+ * SmbusSimulatedBatteryModel - register level model of a smart battery and
+ * its system manager, behind SmbusSimulatedBattery. Word registers are read
+ * and written per (address, command); ManufacturerAccess extended reads
+ * return the register selected by the last write. Timing is left to the
+ * caller, which gets the per-command latency from latencyUS().
+ */
+class SmbusSimulatedBatteryModel {
+public:
+    // A healthy, discharging 3 cell pack
+    void init(void)
+    {
+        static const struct {
+            uint8_t     address;
+            uint8_t     command;
+            uint16_t    value;
+        } defaults[] = {
+            { kSMBusManagerAddr,    kMStateCmd,                 kMPresentBatt_A_Bit },
+            { kSMBusManagerAddr,    kMStateContCmd,             kMACPresentBit },
+            { kSMBusBatteryAddr,    kBTemperatureCmd,           2982 },             // 0.1K
+            { kSMBusBatteryAddr,    kBVoltageCmd,               12600 },            // mV
+            { kSMBusBatteryAddr,    kBCurrentCmd,               (uint16_t)-850 },   // mA
+            { kSMBusBatteryAddr,    kBAverageCurrentCmd,        (uint16_t)-850 },
+            { kSMBusBatteryAddr,    kBMaxErrorCmd,              1 },
+            { kSMBusBatteryAddr,    kBRemainingCapacityCmd,     4100 },             // mAh
+            { kSMBusBatteryAddr,    kBFullChargeCapacityCmd,    5000 },
+            { kSMBusBatteryAddr,    kBDesignCapacityCmd,        5100 },
+            { kSMBusBatteryAddr,    kBRunTimeToEmptyCmd,        289 },              // minutes
+            { kSMBusBatteryAddr,    kBAverageTimeToEmptyCmd,    289 },
+            { kSMBusBatteryAddr,    kBAverageTimeToFullCmd,     0xffff },
+            { kSMBusBatteryAddr,    kBBatteryStatusCmd,         0x00c0 },           // initialized, discharging
+            { kSMBusBatteryAddr,    kBCycleCountCmd,            42 },
+            { kSMBusBatteryAddr,    kBSerialNumberCmd,          0x0d1e },
+            { kSMBusBatteryAddr,    kBReadCellVoltage1Cmd,      4200 },             // mV
+            { kSMBusBatteryAddr,    kBReadCellVoltage2Cmd,      4200 },
+            { kSMBusBatteryAddr,    kBReadCellVoltage3Cmd,      4200 },
+            { kSMBusBatteryAddr,    kBPackReserveCmd,           200 },
+            { kSMBusBatteryAddr,    kBDesignCycleCount9CCmd,    1000 },
+        };
+
+        memset(fRegs, 0, sizeof(fRegs));
+        memset(fBlocks, 0, sizeof(fBlocks));
+        memset(&fFaults, 0, sizeof(fFaults));
+        memset(&fStats, 0, sizeof(fStats));
+        fMacSelect = 0;
+        fLastFailed = 0;
+        fAlarmPending = false;
+        fPresent = true;
+
+        for (unsigned i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+            setRegister(defaults[i].address, defaults[i].command, defaults[i].value);
+        }
+        setDefaultLatencyUS(kSmbusSimDefaultLatencyUS);
+        setBlock(kBManufactureNameCmd, "SMP");
+        setBlock(kBDeviceNameCmd, "bq20z451");
+        setBlock(kBAppleHardwareSerialCmd, "SIM0000000000000");
+    }
+
+    bool setRegister(uint8_t address, uint8_t command, uint16_t value)
+    {
+        int idx = regIndex(address);
+
+        if (idx < 0) {
+            return false;
+        }
+        fRegs[idx][command] = value;
+        return true;
+    }
+
+    uint16_t getRegister(uint8_t address, uint8_t command) const
+    {
+        int idx = regIndex(address);
+
+        return (idx < 0) ? 0 : fRegs[idx][command];
+    }
+
+    // Returns false if there is no free slot
+    bool setBlock(uint8_t cmd, const char *str)
+    {
+        size_t  len = strnlen(str, MAX_SMBUS_DATA_SIZE);
+        int     slot = -1;
+
+        for (int i = 0; i < kSmbusSimBlockSlots; i++) {
+            if (fBlocks[i].len && fBlocks[i].cmd == cmd) {
+                slot = i;
+                break;
+            }
+            if (slot < 0 && !fBlocks[i].len) {
+                slot = i;
+            }
+        }
+        if (slot < 0 || !len) {
+            return false;
+        }
+
+        fBlocks[slot].cmd = cmd;
+        fBlocks[slot].len = (uint8_t)len;
+        memcpy(fBlocks[slot].data, str, len);
+        return true;
+    }
+
+    void setDefaultLatencyUS(uint32_t us)
+    {
+        for (unsigned i = 0; i < 256; i++) {
+            fLatencyUS[i] = us;
+        }
+    }
+    void setLatencyUS(uint8_t cmd, uint32_t us) { fLatencyUS[cmd] = us; }
+    uint32_t latencyUS(uint8_t cmd) const { return fLatencyUS[cmd]; }
+
+    SmbusSimFaults &faults(void) { return fFaults; }
+    const SmbusSimStats &stats(void) const { return fStats; }
+    bool present(void) const { return fPresent; }
+
+    // Run one transfer. @rx must hold MAX_SMBUS_DATA_SIZE bytes.
+    SmbusSimResult execute(const SmbusBusTransfer &t, uint8_t *rx, uint8_t *rxCount)
+    {
+        int             idx = regIndex(t.address);
+        uint16_t        key = (uint16_t)((t.address << 8) | t.command);
+        uint16_t        value;
+        SmbusSimResult  result;
+
+        fStats.transactions++;
+        if (fLastFailed && fLastFailed == key) {
+            fStats.retries++;
+        }
+        // The manager only reacts to changes in the alarm data, so seed it with
+        // the present state the way a real manager does at boot
+        if (fStats.transactions == 1 && fFaults.removeAfter) {
+            fAlarmPending = true;
+        }
+
+        *rxCount = 0;
+
+        if ((idx < 0) || (!fPresent && (kSMBusBatteryAddr == t.address))
+            || (fFaults.nakEvery && (fStats.transactions % fFaults.nakEvery) == 0)) {
+            fStats.naks++;
+            result = kSmbusSimNak;
+            goto exit;
+        }
+
+        if (fFaults.errorCount && (fFaults.errorCmd == t.command)) {
+            fFaults.errorCount--;
+            fStats.errors++;
+            result = kSmbusSimInjectedError;
+            goto exit;
+        }
+
+        switch (t.op) {
+            case kSmbusBusReadWord:
+                value = fRegs[idx][t.command];
+                // Second half of an extended read; 0 means no register selected
+                if ((kSmbusSimBattery == idx) && (kBManufacturerAccessCmd == t.command) && fMacSelect) {
+                    value = fRegs[idx][fMacSelect & 0xff];
+                    fMacSelect = 0;
+                }
+                rx[0] = value & 0xff;
+                rx[1] = value >> 8;
+                *rxCount = 2;
+                result = kSmbusSimOK;
+                break;
+
+            case kSmbusBusWriteWord:
+                if (t.sendDataCount < 2) {
+                    result = kSmbusSimShortWrite;
+                    break;
+                }
+                value = (uint16_t)(t.sendData[0] | (t.sendData[1] << 8));
+                if ((kSmbusSimBattery == idx) && (kBManufacturerAccessCmd == t.command)) {
+                    fMacSelect = value;
+                } else {
+                    fRegs[idx][t.command] = value;
+                }
+                result = kSmbusSimOK;
+                break;
+
+            case kSmbusBusReadBlock:
+                result = kSmbusSimNoSuchBlock;
+                for (int slot = 0; slot < kSmbusSimBlockSlots; slot++) {
+                    if (fBlocks[slot].len && (fBlocks[slot].cmd == t.command)) {
+                        memcpy(rx, fBlocks[slot].data, fBlocks[slot].len);
+                        *rxCount = fBlocks[slot].len;
+                        result = kSmbusSimOK;
+                        break;
+                    }
+                }
+                break;
+
+            default:
+                result = kSmbusSimUnsupported;
+                break;
+        }
+
+    exit:
+        fLastFailed = (kSmbusSimOK == result) ? 0 : key;
+
+        if (fFaults.removeAfter && (fStats.transactions == fFaults.removeAfter)) {
+            setPresent(false);
+        } else if (fFaults.removeAfter && fFaults.insertAfter
+                   && (fStats.transactions == (uint64_t)fFaults.removeAfter + fFaults.insertAfter)) {
+            setPresent(true);
+        }
+
+        return result;
+    }
+
+    // Returns true, once, after the manager state changed; the caller sends
+    // the SMBus alarm real hardware would, carrying *state
+    bool takeAlarm(uint16_t *state)
+    {
+        if (!fAlarmPending) {
+            return false;
+        }
+        fAlarmPending = false;
+        *state = fRegs[kSmbusSimManager][kMStateCmd];
+        return true;
+    }
+
+private:
+    enum {
+        kSmbusSimDoubler = 0,
+        kSmbusSimBattery,
+        kSmbusSimManager,
+        kSmbusSimCharger
+    };
+
+    static int regIndex(uint8_t address)
+    {
+        switch (address) {
+            case kSMBusAppleDoublerAddr:    return kSmbusSimDoubler;
+            case kSMBusBatteryAddr:         return kSmbusSimBattery;
+            case kSMBusManagerAddr:         return kSmbusSimManager;
+            case kSMBusChargerAddr:         return kSmbusSimCharger;
+            default:                        return -1;
+        }
+    }
+
+    void setPresent(bool present)
+    {
+        fPresent = present;
+        if (present) {
+            fRegs[kSmbusSimManager][kMStateCmd] |= kMPresentBatt_A_Bit;
+        } else {
+            fRegs[kSmbusSimManager][kMStateCmd] &= ~kMPresentBatt_A_Bit;
+            fStats.removals++;
+        }
+        fAlarmPending = true;
+    }
+
+    uint16_t                fRegs[4][256];      // doubler, battery, manager, charger
+    uint32_t                fLatencyUS[256];
+    struct {
+        uint8_t     cmd;
+        uint8_t     len;
+        uint8_t     data[MAX_SMBUS_DATA_SIZE];
+    }                       fBlocks[kSmbusSimBlockSlots];
+    uint16_t                fMacSelect;
+    bool                    fPresent;
+    bool                    fAlarmPending;
+    uint16_t                fLastFailed;        // (address << 8) | command, 0 if none
+    SmbusSimFaults          fFaults;
+    SmbusSimStats           fStats;
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "AppleSmartBatteryCommands.h"
+#include "SmbusRetryPolicy.h"
+
+// Bus level operation of one SMBus transfer
+enum SmbusBusOp {
+    kSmbusBusReadWord,
+    kSmbusBusWriteWord,
+    kSmbusBusReadBlock,
+    kSmbusBusOtherOp            // anything else; only external transactions use these
+};
+
+struct SmbusBusTransfer {
+    uint8_t     address;
+    uint8_t     command;
+    SmbusBusOp  op;
+    uint8_t     sendDataCount;
+    uint8_t     sendData[2];
+};
+
+// What the caller does once a transfer completes
+enum SmbusTransactionStep {
+    kSmbusStepRetry,            // resubmit the same transfer after the delay
+    kSmbusStepSubmit,           // submit transfer(), the next phase of the request
+    kSmbusStepDone,             // complete the request with the data read
+    kSmbusStepFailed            // complete the request with an error
+};
+
+/*
+ * SmbusTransactionMachine - turns one battery poll request into SMBus
+ * transfers and decides what follows each completion: a retry from the
+ * SmbusRetryPolicy table, the read half of an extended read, or the end of
+ * the request. SmbusHandler supplies the bus and the timer; the caller
+ * classifies the bus status, since the status codes are IOKit's.
+ */
+class SmbusTransactionMachine {
+public:
+    void init(const uint32_t *delaysUS, uint8_t count)
+    {
+        fRetry.init(delaysUS, count);
+        memset(&fTransfer, 0, sizeof(fTransfer));
+        fOpType = kASBMInvalidOp;
+        fFullyDischarged = false;
+        fGaveUp = false;
+        fChange = kSmbusBudgetUnchanged;
+    }
+
+    // Set up the first transfer of a request. Returns false if the request
+    // isn't one the machine can issue.
+    bool start(ASBMgrOpType opType, uint8_t address, uint8_t command,
+               bool fullyDischarged, const uint8_t *outData)
+    {
+        memset(&fTransfer, 0, sizeof(fTransfer));
+        fTransfer.address = address;
+        fTransfer.command = command;
+        fOpType = opType;
+        fFullyDischarged = fullyDischarged;
+        fGaveUp = false;
+        fChange = kSmbusBudgetUnchanged;
+
+        fRetry.begin(address, command);
+
+        switch (opType) {
+            case kASBMSMBUSReadWord:
+                fTransfer.op = kSmbusBusReadWord;
+                return true;
+
+            case kASBMSMBUSExtendedReadWord:
+                // Select the register through ManufacturerAccess, then read it back
+                if ((command != kBExtendedPFStatusCmd) && (command != kBExtendedOperationStatusCmd)) {
+                    return false;
+                }
+                fTransfer.op = kSmbusBusWriteWord;
+                fTransfer.command = kBManufacturerAccessCmd;
+                fTransfer.sendData[0] = command;
+                fTransfer.sendData[1] = 0;
+                fTransfer.sendDataCount = 2;
+                return true;
+
+            case kASBMSMBUSReadBlock:
+                fTransfer.op = kSmbusBusReadBlock;
+                return true;
+
+            case kASBMSMBUSWriteWord:
+                if (!outData) {
+                    return false;
+                }
+                fTransfer.op = kSmbusBusWriteWord;
+                fTransfer.sendData[0] = outData[0];
+                fTransfer.sendData[1] = outData[1];
+                fTransfer.sendDataCount = 2;
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // A transfer completed with @bus; @data holds the first bytes read.
+    // Sets *delayUS for kSmbusStepRetry.
+    SmbusTransactionStep complete(SmbusAttemptResult bus, const uint8_t *data, uint32_t *delayUS)
+    {
+        SmbusAttemptResult result = bus;
+
+        /* Check for absurd return value for RemainingCapacity or FullChargeCapacity.
+         If the returned value is zero, re-read until it's non-zero (or until we
+         try too many times).
+
+         (FullChargeCapacity = 0) is NOT a valid state
+         (DesignCapacity = 0) is NOT a valid state
+         (RemainingCapacity = 0) is a valid state
+         (RemainingCapacity = 0) && !fFullyDischarged is NOT a valid state
+         */
+        if ((kSmbusAttemptOK == bus)
+            && ((kBFullChargeCapacityCmd == fTransfer.command)
+                || (kBDesignCapacityCmd == fTransfer.command)
+                || ((kBRemainingCapacityCmd == fTransfer.command) && !fFullyDischarged))
+            && (data[0] == 0) && (data[1] == 0))
+        {
+            result = kSmbusAttemptRetry;
+        }
+
+        *delayUS = fRetry.nextRetryUS(result);
+        fGaveUp = (!*delayUS && (kSmbusAttemptRetry == result));
+        if (*delayUS) {
+            return kSmbusStepRetry;
+        }
+
+        if (kSmbusAttemptOK != bus) {
+            fChange = fRetry.finish(false);
+            return kSmbusStepFailed;
+        }
+
+        if (kASBMSMBUSExtendedReadWord == fOpType) {
+            // Register selected, read it with a fresh set of retries
+            fOpType = kASBMSMBUSReadWord;
+            fTransfer.op = kSmbusBusReadWord;
+            fRetry.reset();
+            return kSmbusStepSubmit;
+        }
+
+        fChange = fRetry.finish(true);
+        return kSmbusStepDone;
+    }
+
+    // The request was dropped without a final outcome
+    void abandon(void) { fRetry.reset(); }
+
+    // A transfer couldn't be submitted; the request failed
+    void submitFailed(void)
+    {
+        fGaveUp = false;
+        fChange = fRetry.finish(false);
+    }
+
+    const SmbusBusTransfer &transfer(void) const { return fTransfer; }
+    ASBMgrOpType opType(void) const { return fOpType; }
+    const SmbusRetryPolicy &retry(void) const { return fRetry; }
+
+    // For logging: whether the last complete() ran out of retries, and what
+    // the request's outcome did to its budget
+    bool gaveUp(void) const { return fGaveUp; }
+    SmbusBudgetChange budgetChange(void) const { return fChange; }
+
+private:
+    SmbusRetryPolicy    fRetry;
+    SmbusBusTransfer    fTransfer;
+    ASBMgrOpType        fOpType;
+    bool                fFullyDischarged;
+    bool                fGaveUp;
+    SmbusBudgetChange   fChange;
+};
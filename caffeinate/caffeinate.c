@@ -27,9 +27,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <libproc.h>
+#include <sys/time.h>
 
 #include <dispatch/dispatch.h>
 #include <CoreFoundation/CFNumber.h>
+#include <CoreFoundation/CFSet.h>
 
 #include <IOKit/pwr_mgt/IOPMLib.h>
 #include <IOKit/pwr_mgt/IOPMLibPrivate.h>
@@ -62,11 +67,38 @@ static CFStringRef        kLocalizationBundlePath = CFSTR("/System/Library/CoreS
 
 #define kAssertionNameString    "caffeinate command-line tool"
 
+/*
+ * Set in the environment of a utility run with -T, as "<pid>:<flags>" of the
+ * caffeinate process holding the assertions. caffeinate invocations inside
+ * that utility's process tree reuse those assertions instead of creating
+ * their own.
+ */
+#define kCaffeinateTreeEnv      "CAFFEINATE_TREE_ASSERTIONS"
+
 int createAssertions(const char *progname, AssertionFlag flags, long timeout);
-void forkChild(char *argv[]);
+void forkChild(char *argv[], AssertionFlag flags);
+bool shareTreeAssertions(AssertionFlag flags, long timeout);
+void startTracking(pid_t root, pid_t pgid);
 void usage(void);
 
 pid_t   waitforpid;
+bool    trackTree;
+pid_t   trackpgid;
+
+/*
+ * Processes whose lifetime the assertions are bound to in -T and -g modes.
+ * Membership is driven by kernel fork and exit events on each member; the
+ * assertions are released when the last member exits.
+ */
+static struct {
+    CFMutableSetRef     members;        // pids, stored as pointer values
+    pid_t               pgid;           // only track members of this group, if set
+    pid_t               orphanPgid;     // process group orphans are adopted from
+    uint32_t            live;
+    uint32_t            total;
+    struct timespec     start;
+    struct timeval      startTime;      // wall clock, compared with process start times
+} gTree;
 
 
 int
@@ -78,7 +110,7 @@ main(int argc, char *argv[])
     dispatch_source_t   disp_src;
 
     errno = 0;
-    while ((ch = getopt(argc, argv, "mdhisut:w:")) != -1) {
+    while ((ch = getopt(argc, argv, "mdhisuTt:w:g:")) != -1) {
         switch((char)ch) {
             case 'm':
                 flags |= kDiskAssertionFlag;
@@ -106,6 +138,18 @@ main(int argc, char *argv[])
                 }
                 break;
 
+            case 'T':
+                trackTree = true;
+                break;
+
+            case 'g':
+                trackpgid = (pid_t)strtol(optarg, NULL, 0);
+                if (trackpgid <= 0) {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 't':
                 timeout = strtol(optarg, NULL,  0);
                 if (timeout == 0 && errno != 0) {
@@ -125,13 +169,39 @@ main(int argc, char *argv[])
         flags = kIdleAssertionFlag;
     }
 
+    if ((trackTree && trackpgid) || (trackpgid && (argc - optind))
+        || (trackTree && !(argc - optind) && !waitforpid)) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
     /* Spwan early, otherwise libraries might open resources that don't survive fork or exec */
     if (argc - optind) {
         argv += optind;
-        forkChild(argv);
+        if (shareTreeAssertions(flags, timeout)) {
+            execvp(*argv, argv);
+            int saved_errno = errno;
+            perror(*argv);
+            _exit((saved_errno == ENOENT) ? 127 : 126);
+        }
+        forkChild(argv, flags);
         if (createAssertions(*argv, flags, timeout)) {
             exit(EXIT_FAILURE);
         }
+        if (trackTree) {
+            startTracking(getppid(), 0);
+        }
+    } else if (trackTree || trackpgid) {
+        if (timeout) {
+            dispatch_time_t d_timeout = dispatch_time(DISPATCH_TIME_NOW, timeout * NSEC_PER_SEC);
+            dispatch_after(d_timeout, dispatch_get_main_queue(), ^{
+                           exit(EXIT_SUCCESS);
+                           });
+        }
+        if (createAssertions(NULL, flags, timeout)) {
+            exit(EXIT_FAILURE);
+        }
+        startTracking(waitforpid, trackpgid);
     } else {
         if (timeout) {
             dispatch_time_t d_timeout = dispatch_time(DISPATCH_TIME_NOW, timeout * NSEC_PER_SEC);
@@ -175,6 +245,9 @@ createAssertions(const char *progname, AssertionFlag flags, long timeout)
     if (progname) {
         (void)snprintf(assertionDetails, sizeof(assertionDetails),
             "caffeinate asserting on behalf of \'%s\' (pid %d)", progname, getppid());
+    } else if (trackpgid) {
+        snprintf(assertionDetails, sizeof(assertionDetails),
+                 "caffeinate asserting on behalf of Process Group ID %d", trackpgid);
     } else if (waitforpid) {
         if (timeout) {
             snprintf(assertionDetails, sizeof(assertionDetails), 
@@ -237,11 +310,12 @@ finish:
 }
 
 void
-forkChild(char *argv[])
+forkChild(char *argv[], AssertionFlag flags)
 {
     pid_t pid;
     dispatch_source_t source;
     int fd, max_fd;
+    char env[64];
 
     /* Our parent might care about the total life cycle of this process,
     * therefore rather than propagate exit status, Unix signals, Mach
@@ -249,7 +323,7 @@ forkChild(char *argv[])
     * have the parent exec() and the child monitor the parent for death rather
     * than the other way around.
     */
-    switch(fork()) {
+    switch((pid = fork())) {
         case 0:     /* child */
             break;
         case -1:    /* error */
@@ -257,6 +331,10 @@ forkChild(char *argv[])
             exit(EXIT_SUCCESS);
             /* NOTREACHED */
         default:    /* parent */
+            if (trackTree) {
+                snprintf(env, sizeof(env), "%d:%u", pid, flags);
+                setenv(kCaffeinateTreeEnv, env, 1);
+            }
             execvp(*argv, argv);
             int saved_errno = errno;
             perror(*argv);
@@ -278,6 +356,11 @@ forkChild(char *argv[])
     (void)signal(SIGINT, SIG_IGN);
     (void)signal(SIGQUIT, SIG_IGN);
 
+    /* With -T the whole tree is tracked once the assertions exist */
+    if (trackTree) {
+        return;
+    }
+
     source = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, pid,
         DISPATCH_PROC_EXIT, dispatch_get_main_queue());
     dispatch_source_set_event_handler(source, ^{
@@ -289,9 +372,202 @@ forkChild(char *argv[])
     return;
 }
 
+/*
+ * Returns true if an enclosing 'caffeinate -T' already holds every assertion
+ * asked for, in which case the utility can run without assertions of its own.
+ * Assertions with a timeout, and user active assertions, are always created
+ * afresh.
+ */
+bool
+shareTreeAssertions(AssertionFlag flags, long timeout)
+{
+    const char *env = getenv(kCaffeinateTreeEnv);
+    char *end = NULL;
+    pid_t holder;
+    unsigned long held;
+
+    if (!env || timeout || (flags & kUserActiveAssertionFlag)) {
+        return false;
+    }
+    holder = (pid_t)strtol(env, &end, 10);
+    if (holder <= 0 || !end || *end != ':') {
+        return false;
+    }
+    held = strtoul(end + 1, NULL, 10);
+    if ((flags & ~held) || (kill(holder, 0) != 0 && errno == ESRCH)) {
+        return false;
+    }
+    return true;
+}
+
+static void
+reportTreeUsage(void)
+{
+    struct timespec now;
+    double held;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    held = (double)(now.tv_sec - gTree.start.tv_sec) + (now.tv_nsec - gTree.start.tv_nsec) / 1e9;
+    fprintf(stderr, "caffeinate: assertions held for %.1f secs across %u processes\n", held, gTree.total);
+}
+
+static void trackProcess(pid_t pid);
+
+static void
+trackChildren(pid_t ppid)
+{
+    pid_t kids[512];
+    int count = proc_listchildpids(ppid, kids, sizeof(kids));
+
+    for (int i = 0; i < count; i++) {
+        trackProcess(kids[i]);
+    }
+}
+
+static void
+trackGroup(pid_t pgid)
+{
+    pid_t members[1024];
+    int count = proc_listpgrppids(pgid, members, sizeof(members));
+
+    for (int i = 0; i < count; i++) {
+        trackProcess(members[i]);
+    }
+}
+
+/*
+ * Children of an exiting member are reparented to launchd. Those forked
+ * right before the exit, or before the member's source was armed, or whose
+ * fork was reported together with the exit, were never seen by
+ * trackChildren(). Adopt orphans that are still in the tracked utility's
+ * process group and started after tracking did. Unrelated jobs elsewhere in
+ * the login session have their own process groups and are left alone.
+ */
+static void
+adoptOrphans(void)
+{
+    pid_t pids[1024];
+    struct proc_bsdinfo info;
+    int count;
+
+    if (gTree.orphanPgid <= 0) {
+        return;
+    }
+    count = proc_listpgrppids(gTree.orphanPgid, pids, sizeof(pids));
+
+    for (int i = 0; i < count; i++) {
+        if (pids[i] <= 1 || CFSetContainsValue(gTree.members, (const void *)(uintptr_t)pids[i])) {
+            continue;
+        }
+        if (proc_pidinfo(pids[i], PROC_PIDTBSDINFO, 0, &info, sizeof(info)) != sizeof(info)
+            || info.pbi_ppid != 1) {
+            continue;
+        }
+        if (info.pbi_start_tvsec < (uint64_t)gTree.startTime.tv_sec
+            || (info.pbi_start_tvsec == (uint64_t)gTree.startTime.tv_sec
+                && info.pbi_start_tvusec < (uint64_t)gTree.startTime.tv_usec)) {
+            continue;
+        }
+        trackProcess(pids[i]);
+    }
+}
+
+static void
+memberExited(pid_t pid, dispatch_source_t source)
+{
+    if (!CFSetContainsValue(gTree.members, (const void *)(uintptr_t)pid)) {
+        return;
+    }
+    CFSetRemoveValue(gTree.members, (const void *)(uintptr_t)pid);
+    gTree.live--;
+    dispatch_source_cancel(source);
+    adoptOrphans();
+
+    if (gTree.live) {
+        return;
+    }
+    /* Group members that moved in from elsewhere never forked from a tracked process */
+    if (gTree.pgid) {
+        trackGroup(gTree.pgid);
+    }
+    if (!gTree.live) {
+        exit(EXIT_SUCCESS);
+    }
+}
+
+static void
+trackProcess(pid_t pid)
+{
+    dispatch_source_t source;
+
+    if (pid <= 1 || pid == getpid()
+        || CFSetContainsValue(gTree.members, (const void *)(uintptr_t)pid)) {
+        return;
+    }
+    if (gTree.pgid && getpgid(pid) != gTree.pgid) {
+        return;
+    }
+
+    source = dispatch_source_create(DISPATCH_SOURCE_TYPE_PROC, pid,
+        DISPATCH_PROC_EXIT | DISPATCH_PROC_FORK, dispatch_get_main_queue());
+    if (!source) {
+        return;
+    }
+    CFSetAddValue(gTree.members, (const void *)(uintptr_t)pid);
+    gTree.live++;
+    gTree.total++;
+
+    dispatch_source_set_event_handler(source, ^{
+        unsigned long events = dispatch_source_get_data(source);
+
+        if (events & DISPATCH_PROC_FORK) {
+            trackChildren(pid);
+        }
+        if (events & DISPATCH_PROC_EXIT) {
+            memberExited(pid, source);
+        }
+    });
+    dispatch_source_set_cancel_handler(source, ^{
+        dispatch_release(source);
+    });
+    dispatch_resume(source);
+
+    /* It may have exited, or forked, before the source was armed */
+    if (kill(pid, 0) != 0 && errno == ESRCH) {
+        memberExited(pid, source);
+        return;
+    }
+    trackChildren(pid);
+}
+
+/*
+ * Binds the assertions to the process tree rooted at 'root', or to the
+ * members of process group 'pgid'. caffeinate exits, releasing them, once
+ * the last tracked process is gone.
+ */
+void
+startTracking(pid_t root, pid_t pgid)
+{
+    gTree.members = CFSetCreateMutable(kCFAllocatorDefault, 0, NULL);
+    gTree.pgid = pgid;
+    gTree.orphanPgid = pgid ? pgid : getpgid(root);
+    clock_gettime(CLOCK_MONOTONIC, &gTree.start);
+    gettimeofday(&gTree.startTime, NULL);
+    atexit(reportTreeUsage);
+
+    if (pgid) {
+        trackGroup(pgid);
+    } else {
+        trackProcess(root);
+    }
+    if (!gTree.live) {
+        exit(EXIT_SUCCESS);
+    }
+}
+
 void
 usage(void)
 {
-    fprintf(stderr, "usage: caffeinate [-disu] [-t timeout] [-w Process ID] [command arguments...]\n");
+    fprintf(stderr, "usage: caffeinate [-disu] [-t timeout] [-w Process ID] [-T] [-g Process Group ID] [command arguments...]\n");
     return;
 }
@@ -156,6 +156,72 @@
 
 #define kPMASLDomainClientWakeRequests      "ClientWakeRequests"
 
+/*
+ * PM connection response latency histograms
+ *
+ * powerd keeps, per client and per system transition, a histogram of how
+ * long the client took to acknowledge PM connection notifications.
+ * 'pmset -g responsetimes' reads them over XPC; the reply carries a binary
+ * blob made of one PMResponseLatencyHeader followed by 'recordCount'
+ * PMResponseLatencyRecords. All fields are in host byte order.
+ */
+#ifndef POWERD_XPC_ID
+#define POWERD_XPC_ID                       "com.apple.iokit.powerdxpc"
+#endif
+
+#define kPMResponseLatencyCopyMsg           "responseLatencyCopy"
+#define kPMResponseLatencyDataKey           "responseLatencyData"
+
+#define kPMResponseLatencyMagic             0x504d524c      // 'PMRL'
+#define kPMResponseLatencyVersion           1
+#define kPMResponseLatencyBucketCount       16
+#define kPMResponseLatencyNameLen           32
+
+enum {
+    kPMResponseTransitionSleep = 0,
+    kPMResponseTransitionDarkWake,
+    kPMResponseTransitionWake,
+    kPMResponseTransitionOther,         // unused; keeps the record layout
+    kPMResponseTransitionCount
+};
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    bucketCount;
+    uint16_t    transitionCount;
+    uint16_t    recordCount;
+    uint32_t    reserved;
+} PMResponseLatencyHeader;
+
+/* counts[t][0] holds responses under 1ms; counts[t][i] holds responses in
+ * [2^(i-1), 2^i) ms; the last bucket is open-ended. Timed out responses are
+ * only counted in timeouts[t].
+ */
+typedef struct {
+    char        name[kPMResponseLatencyNameLen];
+    uint32_t    counts[kPMResponseTransitionCount][kPMResponseLatencyBucketCount];
+    uint32_t    timeouts[kPMResponseTransitionCount];
+    uint32_t    maxMS[kPMResponseTransitionCount];
+} PMResponseLatencyRecord;
+
+static inline int PMResponseLatencyBucket(uint32_t ms)
+{
+    int bucket = 0;
+
+    while (ms && (bucket < kPMResponseLatencyBucketCount - 1)) {
+        ms >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/* Lower bound, in ms, of a histogram bucket */
+static inline uint32_t PMResponseLatencyBucketFloor(int bucket)
+{
+    return (bucket <= 0) ? 0 : (1U << (bucket - 1));
+}
+
 #define KPMASLWakeReqAppNamePrefix          "WakeAppName"
 #define kPMASLWakeReqTimePrefix             "WakeTime"
 #define kPMASLWakeReqTimeDeltaPrefix        "WakeTimeDelta"
@@ -182,6 +248,55 @@
 
 #define kPMASLStorePath                 "/var/log/powermanagement"
 
+/*
+ * PM event log
+ *
+ * powerd appends every message it sends to the PM ASL store to a compact
+ * binary log as well, so that pmset can answer 'pmset -g log' without
+ * searching the whole ASL store. The log is split into numbered segments.
+ * A new segment starts every time powerd launches and whenever the current
+ * one fills up; the oldest segments are deleted beyond kPMEventLogMaxSegments.
+ *
+ * Each segment is a pair of files in kPMEventLogDir:
+ *   <seq>.pmidx    PMEventLogSegmentHeader, then fixed-width PMEventLogRecords
+ *                  sorted by sortTime
+ *   <seq>.pmstr    kPMEventLogMagic, then NUL terminated strings (interned
+ *                  within the segment) and the {key, value} string offset
+ *                  pairs of each record
+ *
+ * All string and pair offsets are relative to the start of the .pmstr file;
+ * offset 0 means "none". The string file is always written before the record
+ * that refers to it, so a reader mapping a segment that is still being
+ * appended to only ever sees complete records.
+ */
+#define kPMEventLogDir                  "/var/db/powermanagement/events"
+#define kPMEventLogIndexSuffix          "pmidx"
+#define kPMEventLogStringSuffix         "pmstr"
+#define kPMEventLogMagic                0x504d4c47  /* 'PMLG' */
+#define kPMEventLogVersion              1
+#define kPMEventLogMaxSegments          16
+#define kPMEventLogMaxRecords           16384
+#define kPMEventLogMaxPairs             64
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    recordSize;         // sizeof(PMEventLogRecord)
+    uint32_t    sequence;
+    uint32_t    reserved;
+    uint64_t    createTime;         // seconds since 1970
+    char        bootUUID[40];       // kern.bootsessionuuid of the boot that wrote this segment
+} PMEventLogSegmentHeader;
+
+typedef struct {
+    uint64_t    sortTime;           // 'time', clamped so that it never decreases within a segment
+    uint64_t    time;               // seconds since 1970
+    uint32_t    nsec;
+    uint32_t    domain;             // offset of the kPMASLDomainKey value
+    uint32_t    pairs;              // offset of pairCount {key, value} uint32_t pairs
+    uint32_t    pairCount;
+} PMEventLogRecord;
+
 // SMC shutdown causes
 typedef struct {
     const char *shutdownCauseString;
@@ -40,6 +40,17 @@
 
 #define kIOPSPrivateBatteryCaseType "Battery Case"
 
+/*!
+    @defined kIOPSPartialUpdateKey
+    @abstract Marks an IOPSSetPowerSourceDetails() dictionary as a delta.
+    @discussion ioupsd sends only the keys that changed since its last update,
+    with this key set to kCFBooleanTrue. powerd merges them into the last
+    description it has for the power source, and fails the update with
+    kIOReturnNotReady if it has none, in which case the full dictionary is
+    sent.
+*/
+#define kIOPSPartialUpdateKey       "PartialUpdate"
+
 /*!
     @defined kIOUPSPlugInServerName
     @abstract Key for UPS Mig server.
@@ -64,6 +64,10 @@
 #define kDefaultUPSName		"Generic UPS"
 #define kDefaultTransport   "UNK"
 
+// Changes to cosmetic keys only (e.g. voltage, current) are forwarded to
+// powerd at most once per kCosmeticUpdateInterval seconds.
+#define kCosmeticUpdateInterval     30.0
+
 #define INFO_LOG(fmt, args...)    os_log(ioupsdLog, fmt, ##args);
 #define DEBUG_LOG(fmt, args...)   os_log_debug(ioupsdLog, fmt, ##args);
 #define ERROR_LOG(fmt, args...)   os_log_error(ioupsdLog, fmt, ##args);
@@ -97,6 +101,7 @@ typedef struct UPSData {
     int                     upsID;
     Boolean                 isPresent;
     CFMutableDictionaryRef  upsStoreDict;
+    CFMutableDictionaryRef  upsPendingDict;     // changed keys not yet sent to powerd
     CFRunLoopSourceRef      upsEventSource;
     NSTimer*                upsEventTimer;
     DeviceType              deviceType;
@@ -108,6 +113,12 @@ typedef struct UPSData {
     io_object_t             batteryStateNotification;
     io_object_t             currentLimitNotification;
     io_object_t             requiredVoltageNotification;
+    CFAbsoluteTime          lastDetailsUpdate;
+    CFRunLoopTimerRef       cosmeticUpdateTimer;
+    UInt64                  eventCount;
+    UInt64                  updateCount;
+    UInt64                  suppressedCount;
+    UInt64                  deferredCount;
 } UPSData;
 
 typedef UPSData *UPSDataRef;
@@ -127,6 +138,8 @@ static void RemoveAndReleasePowerManagerUPSEntry(UPSDataRef upsDataRef);
 static void UPSEventCallback(void * target, IOReturn result, void *refcon,
                              void *sender, CFDictionaryRef event);
 static void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event);
+static void UpdatePowerSourceDetails(UPSDataRef upsDataRef);
+static void ScheduleCosmeticUpdate(UPSDataRef upsDataRef);
 static void BatteryCaseHandleAdapterFamilyChange(UPSDataRef upsDataRef, CFTypeRef adapterFamily);
 static void BatteryCaseHandleACStateChange(UPSDataRef upsDataRef, CFTypeRef powerState);
 static UPSDataRef GetPrivateData( CFDictionaryRef properties );
@@ -662,6 +675,12 @@ static void releaseHidDataSourceResources(UPSDataRef upsDataRef)
         upsDataRef->upsEventTimer = NULL;
     }
 
+    if (upsDataRef->cosmeticUpdateTimer) {
+        CFRunLoopTimerInvalidate(upsDataRef->cosmeticUpdateTimer);
+        CFRelease(upsDataRef->cosmeticUpdateTimer);
+        upsDataRef->cosmeticUpdateTimer = NULL;
+    }
+
     if (upsDataRef->upsPlugInInterface != NULL) {
         (*(upsDataRef->upsPlugInInterface))->Release(upsDataRef->upsPlugInInterface);
         upsDataRef->upsPlugInInterface = NULL;
@@ -703,6 +722,9 @@ static void RemoveAndReleasePowerManagerUPSEntry(UPSDataRef upsDataRef) {
 
     upsDataRef->isPresent = FALSE;
 
+    INFO_LOG("UPS %d removed: events:%llu updates:%llu suppressed:%llu deferred:%llu\n",
+             upsDataRef->upsID, upsDataRef->eventCount, upsDataRef->updateCount,
+             upsDataRef->suppressedCount, upsDataRef->deferredCount);
 
     releaseHidDataSourceResources(upsDataRef);
 
@@ -720,6 +742,11 @@ static void RemoveAndReleasePowerManagerUPSEntry(UPSDataRef upsDataRef) {
         upsDataRef->upsStoreDict = NULL;
     }
 
+    if (upsDataRef->upsPendingDict) {
+        CFRelease(upsDataRef->upsPendingDict);
+        upsDataRef->upsPendingDict = NULL;
+    }
+
     if (gUPSCount == 0) {
         CFRelease(gUPSDataArrayRef);
         CleanupAndExit();
@@ -762,74 +789,175 @@ kern_return_t BatteryCaseSetDeviceCurrentLimit(CFTypeRef currentLimitRef) {
 }
 
 //---------------------------------------------------------------------------
-// ProcessUPSEvent
+// IsCosmeticUPSKey
 //
+// Keys whose changes alone don't justify an immediate update to powerd.
 //---------------------------------------------------------------------------
-void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event)
+static Boolean IsCosmeticUPSKey(CFTypeRef key)
 {
-    long count, index;
+    return (CFEqual(key, CFSTR(kIOPSVoltageKey)) ||
+            CFEqual(key, CFSTR(kIOPSCurrentKey)));
+}
 
-    if (!upsDataRef || !event)
+//---------------------------------------------------------------------------
+// UpdatePowerSourceDetails
+//
+// Sends the keys changed since the last update to powerd and cancels any
+// deferred cosmetic update. Falls back to sending all of upsStoreDict if
+// powerd can't apply the delta. The changed keys are only forgotten once
+// powerd has them; if the update fails they are sent again on the next
+// update, at the latest kCosmeticUpdateInterval seconds later.
+//---------------------------------------------------------------------------
+void UpdatePowerSourceDetails(UPSDataRef upsDataRef)
+{
+    IOReturn result;
+
+    if (upsDataRef->cosmeticUpdateTimer) {
+        CFRunLoopTimerInvalidate(upsDataRef->cosmeticUpdateTimer);
+        CFRelease(upsDataRef->cosmeticUpdateTimer);
+        upsDataRef->cosmeticUpdateTimer = NULL;
+    }
+
+    if (!upsDataRef->powerSourceID || !upsDataRef->upsStoreDict ||
+        !upsDataRef->upsPendingDict || !CFDictionaryGetCount(upsDataRef->upsPendingDict)) {
         return;
+    }
+
+    upsDataRef->lastDetailsUpdate = CFAbsoluteTimeGetCurrent();
+    upsDataRef->updateCount++;
 
-    CFMutableDictionaryRef mutableEvent = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, event);
-    if (!mutableEvent) {
+    CFDictionarySetValue(upsDataRef->upsPendingDict, CFSTR(kIOPSPartialUpdateKey), kCFBooleanTrue);
+    result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID, upsDataRef->upsPendingDict);
+
+    if (result == kIOReturnNotReady) {
+        DEBUG_LOG("UPS %d: partial update rejected, sending all details\n", upsDataRef->upsID);
+        result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID, upsDataRef->upsStoreDict);
+    }
+    if (result != kIOReturnSuccess) {
+        ERROR_LOG("UPS %d: updating power source details failed (0x%x), will retry\n",
+                  upsDataRef->upsID, result);
+        ScheduleCosmeticUpdate(upsDataRef);
         return;
     }
+    CFDictionaryRemoveAllValues(upsDataRef->upsPendingDict);
+}
 
-    if (upsDataRef->deviceType == kDeviceTypeBatteryCase &&
-        upsDataRef->requiresCurrentLimitControl &&
-        !upsDataRef->hasACPower) {
-        // inject kIOPSAppleBatteryCaseAvailableCurrentKey if not already in dict
-        if (!CFDictionaryGetValue(mutableEvent, CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey))) {
-            CFDictionarySetValue(mutableEvent, CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey),
-                                 CFDictionaryGetValue(upsDataRef->upsStoreDict, CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey)));
-        }
+//---------------------------------------------------------------------------
+// ScheduleCosmeticUpdate
+//
+// Arms a one-shot timer so that deferred cosmetic changes reach powerd
+// kCosmeticUpdateInterval seconds after the last update.
+//---------------------------------------------------------------------------
+static void ScheduleCosmeticUpdate(UPSDataRef upsDataRef)
+{
+    CFAbsoluteTime fireTime;
+
+    if (upsDataRef->cosmeticUpdateTimer) {
+        return;
     }
 
-    if ((count = CFDictionaryGetCount(mutableEvent))) {
-        CFTypeRef *keys     = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
-        CFTypeRef *values   = (CFTypeRef *) malloc(sizeof(CFTypeRef) * count);
+    fireTime = upsDataRef->lastDetailsUpdate + kCosmeticUpdateInterval;
+    upsDataRef->cosmeticUpdateTimer = CFRunLoopTimerCreateWithHandler(kCFAllocatorDefault,
+                                            fireTime, 0, 0, 0,
+                                            ^(CFRunLoopTimerRef timer __unused) {
+        UpdatePowerSourceDetails(upsDataRef);
+    });
+    if (upsDataRef->cosmeticUpdateTimer) {
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(), upsDataRef->cosmeticUpdateTimer, kCFRunLoopDefaultMode);
+    }
+}
 
-        CFDictionaryGetKeysAndValues(mutableEvent, (const void **)keys,
-                                     (const void **)values);
+typedef struct {
+    UPSDataRef  upsDataRef;
+    Boolean     changed;
+    Boolean     cosmeticChanged;
+} UPSEventDiff;
 
-        for (index = 0; index < count; index++) {
-            // If a battery case changes from "unplugged" to "plugged in",
-            // or vice versa, we need to configure it.
-            if (CFEqual(keys[index], CFSTR(kIOPSPowerAdapterFamilyKey)) &&
-                upsDataRef->deviceType == kDeviceTypeBatteryCase) {
-                CFTypeRef oldValue = CFDictionaryGetValue(upsDataRef->upsStoreDict, keys[index]);
-                if (oldValue == NULL || !CFEqual(oldValue, values[index])) {
-                    BatteryCaseHandleAdapterFamilyChange(upsDataRef, values[index]);
-                }
-            } else if (CFEqual(keys[index], CFSTR(kIOPSPowerSourceStateKey)) &&
-                upsDataRef->deviceType == kDeviceTypeBatteryCase) {
-                CFTypeRef oldValue = CFDictionaryGetValue(upsDataRef->upsStoreDict, keys[index]);
-                if (oldValue && !CFEqual(oldValue, values[index])) {
-                    BatteryCaseHandleACStateChange(upsDataRef, values[index]);
-                }
-            // Battery cases will indicate how much current we can draw from them
-            } else if (CFEqual(keys[index], CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey)) &&
-                       upsDataRef->deviceType == kDeviceTypeBatteryCase &&
-                       upsDataRef->requiresCurrentLimitControl &&
-                       !upsDataRef->hasACPower) {
-                BatteryCaseSetDeviceCurrentLimit(values[index]);
-            }
+//---------------------------------------------------------------------------
+// ApplyUPSEventValue
+//
+// CFDictionaryApplyFunction callback: merges one event key into
+// upsStoreDict and records whether it changed.
+//---------------------------------------------------------------------------
+static void ApplyUPSEventValue(const void *key, const void *value, void *context)
+{
+    UPSEventDiff    *diff = (UPSEventDiff *)context;
+    UPSDataRef      upsDataRef = diff->upsDataRef;
+    CFTypeRef       oldValue = CFDictionaryGetValue(upsDataRef->upsStoreDict, key);
+    Boolean         isBatteryCase = (upsDataRef->deviceType == kDeviceTypeBatteryCase);
+
+    // Battery cases will indicate how much current we can draw from them
+    if (isBatteryCase && CFEqual(key, CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey)) &&
+        upsDataRef->requiresCurrentLimitControl && !upsDataRef->hasACPower) {
+        BatteryCaseSetDeviceCurrentLimit(value);
+    }
 
-            CFDictionarySetValue(upsDataRef->upsStoreDict, keys[index], values[index]);
-        }
+    if (oldValue && CFEqual(oldValue, value)) {
+        return;
+    }
 
-        free (keys);
-        free (values);
+    // If a battery case changes from "unplugged" to "plugged in",
+    // or vice versa, we need to configure it.
+    if (isBatteryCase && CFEqual(key, CFSTR(kIOPSPowerAdapterFamilyKey))) {
+        BatteryCaseHandleAdapterFamilyChange(upsDataRef, value);
+    } else if (isBatteryCase && oldValue && CFEqual(key, CFSTR(kIOPSPowerSourceStateKey))) {
+        BatteryCaseHandleACStateChange(upsDataRef, value);
+    }
 
-        IOReturn result = IOPSSetPowerSourceDetails(upsDataRef->powerSourceID, upsDataRef->upsStoreDict);
-        if (result != kIOReturnSuccess) {
-            ERROR_LOG("updating power source details failed\n");
+    CFDictionarySetValue(upsDataRef->upsStoreDict, key, value);
+    CFDictionarySetValue(upsDataRef->upsPendingDict, key, value);
+
+    if (IsCosmeticUPSKey(key)) {
+        diff->cosmeticChanged = true;
+    } else {
+        diff->changed = true;
+    }
+}
+
+//---------------------------------------------------------------------------
+// ProcessUPSEvent
+//
+// Merges the event into upsStoreDict and forwards only the changed keys to
+// powerd, or nothing if no key changed. Events that only change cosmetic
+// keys are rate-limited to one update per kCosmeticUpdateInterval.
+//---------------------------------------------------------------------------
+void ProcessUPSEvent(UPSDataRef upsDataRef, CFDictionaryRef event)
+{
+    UPSEventDiff    diff = { upsDataRef, false, false };
+
+    if (!upsDataRef || !event || !upsDataRef->upsStoreDict || !upsDataRef->upsPendingDict)
+        return;
+
+    upsDataRef->eventCount++;
+
+    if (upsDataRef->deviceType == kDeviceTypeBatteryCase &&
+        upsDataRef->requiresCurrentLimitControl &&
+        !upsDataRef->hasACPower &&
+        !CFDictionaryGetValue(event, CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey))) {
+        // Re-apply the last known current limit if the event doesn't carry one
+        CFTypeRef currentLimit = CFDictionaryGetValue(upsDataRef->upsStoreDict,
+                                                      CFSTR(kIOPSAppleBatteryCaseAvailableCurrentKey));
+        if (currentLimit) {
+            BatteryCaseSetDeviceCurrentLimit(currentLimit);
         }
     }
 
-    CFRelease(mutableEvent);
+    CFDictionaryApplyFunction(event, ApplyUPSEventValue, &diff);
+
+    if (diff.changed) {
+        UpdatePowerSourceDetails(upsDataRef);
+    } else if (diff.cosmeticChanged) {
+        if (CFAbsoluteTimeGetCurrent() - upsDataRef->lastDetailsUpdate >= kCosmeticUpdateInterval) {
+            UpdatePowerSourceDetails(upsDataRef);
+        } else {
+            upsDataRef->deferredCount++;
+            ScheduleCosmeticUpdate(upsDataRef);
+        }
+    } else {
+        upsDataRef->suppressedCount++;
+        DEBUG_LOG("UPS %d: unchanged event suppressed (%llu)\n",
+                  upsDataRef->upsID, upsDataRef->suppressedCount);
+    }
 }
 
 
@@ -1025,6 +1153,9 @@ IOReturn CreatePowerManagerUPSEntry(UPSDataRef upsDataRef,
     if (result == kIOReturnSuccess) {
         // Store our SystemConfiguration variables in our private data
         upsDataRef->upsStoreDict = upsStoreDict;
+        upsDataRef->upsPendingDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        upsDataRef->lastDetailsUpdate = CFAbsoluteTimeGetCurrent();
     } else if (upsStoreDict) {
         CFRelease(upsStoreDict);
     }
@@ -30,6 +30,7 @@
  */
 
 #include <syslog.h>
+#include <float.h>
 #include <notify.h>
 #include <bsm/libbsm.h>
 #include "PrivateLib.h"
@@ -60,6 +61,9 @@ enum {
 
 #define MIN_EVENT_LEEWAY    (5.0)
 
+// Sort position of events without a valid kIOPMPowerEventTimeKey
+#define kInvalidEventTime   (DBL_MAX)
+
 extern uint32_t gDebugFlags;
 
 
@@ -95,16 +99,16 @@ PowerEventBehavior *behaviors[] =
 /*
  * forwards
  */
-static bool             isEntryValidAndFuturistic(CFDictionaryRef, CFDateRef);
 static void             schedulePowerEvent(PowerEventBehavior *);
 static void             purgePastEvents(PowerEventBehavior *);
 static void             copyScheduledPowerChangeArrays(void);
 static CFDictionaryRef  copyEarliestUpcoming(PowerEventBehavior *);
 static CFDateRef        _getScheduledEventDate(CFDictionaryRef);
-static CFArrayRef       copyMergedEventArray(PowerEventBehavior *, 
-                                             PowerEventBehavior *);
 static CFComparisonResult compareEvDates(CFDictionaryRef, 
                                              CFDictionaryRef, void *);
+static bool             rebuildEventTimes(PowerEventBehavior *);
+static CFIndex          firstEventAtOrAfter(PowerEventBehavior *, CFAbsoluteTime);
+static void             removeEventsAtIndex(PowerEventBehavior *, CFIndex, CFIndex);
 
 void poweronScheduleCallout(CFDictionaryRef);
 
@@ -178,7 +182,7 @@ removeEventsByAppName(PowerEventBehavior *behave, CFStringRef appName)
                 behave->currentEvent = NULL;
             }
 
-            CFArrayRemoveValueAtIndex(behave->array, j);
+            removeEventsAtIndex(behave, j, 1);
             activeEventCnt--;
         }
     }
@@ -502,31 +506,32 @@ __private_extern__ CFDictionaryRef copyEarliestRequestAutoWakeEvent(void)
 {
     return copyEarliestEvent(&wakeBehavior);
 }
-__private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave)
+/*
+ * earliestEventWithLeeway
+ * Finds the event in 'behave' with the earliest getWakeScheduleTime() that is
+ * not in the past. Leeway only ever pushes an event later than its
+ * kIOPMPowerEventTimeKey, so the scan can start at (now - maxLeeway) and stop
+ * once event dates pass the best candidate.
+ */
+static void
+earliestEventWithLeeway(PowerEventBehavior *behave, CFAbsoluteTime now,
+                        CFDictionaryRef *one_event, CFAbsoluteTime *one_event_ts)
 {
     CFIndex             cnt, i;
-    CFArrayRef          arr = NULL;
-
-    CFDictionaryRef     one_event = NULL;
     CFDictionaryRef     event = NULL;
-    CFDictionaryRef     repeat_event = NULL;
-    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
-    CFAbsoluteTime      one_event_ts = 0;
     CFAbsoluteTime      wakeup_abs = 0;
-    CFDictionaryRef     selected_event = NULL;
-    
-    
-    // wake and poweron types get merged with wakeorpoweron array
-    if(behave->sharedEvents) {
-        arr = copyMergedEventArray(behave, behave->sharedEvents);
-    } else {
-        arr = behave->array;
+
+    if (!behave || !isA_CFArray(behave->array)) {
+        return;
     }
 
+    cnt = CFArrayGetCount(behave->array);
+    for (i = firstEventAtOrAfter(behave, now - behave->maxLeeway); i < cnt; i++) {
+        if ((*one_event_ts != 0) && (behave->eventTimes[i] >= *one_event_ts)) {
+            break;
+        }
 
-    i = cnt = 0;
-    for ( isA_CFArray(arr) && (cnt = CFArrayGetCount(arr)); i < cnt; i++) {
-        event = CFArrayGetValueAtIndex(arr, i);
+        event = CFArrayGetValueAtIndex(behave->array, i);
         if (!isA_CFDictionary(event)) continue;
 
         DEBUG_LOG("Active wake request: %{public}@\n", event);
@@ -534,11 +539,28 @@ __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave
         if ((!wakeup_abs) || (wakeup_abs < now + MIN_SCHEDULE_TIME))
             continue;
 
-        if ((one_event_ts == 0) || (wakeup_abs < one_event_ts)) {
-            one_event = event;
-            one_event_ts = wakeup_abs;
+        if ((*one_event_ts == 0) || (wakeup_abs < *one_event_ts)) {
+            *one_event = event;
+            *one_event_ts = wakeup_abs;
         }
     }
+}
+
+__private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave)
+{
+    CFDictionaryRef     one_event = NULL;
+    CFDictionaryRef     repeat_event = NULL;
+    CFAbsoluteTime      now = CFAbsoluteTimeGetCurrent();
+    CFAbsoluteTime      one_event_ts = 0;
+    CFAbsoluteTime      wakeup_abs = 0;
+    CFDictionaryRef     selected_event = NULL;
+    
+    
+    // wake and poweron types also consider the wakeorpoweron events
+    earliestEventWithLeeway(behave, now, &one_event, &one_event_ts);
+    if(behave->sharedEvents) {
+        earliestEventWithLeeway(behave->sharedEvents, now, &one_event, &one_event_ts);
+    }
     
     repeat_event = copyNextRepeatingEvent(behave->title);
     if (repeat_event)
@@ -566,8 +588,6 @@ __private_extern__ CFDictionaryRef copyEarliestEvent(PowerEventBehavior  *behave
         CFRelease(repeat_event);
     }
 
-    if(arr && behave->sharedEvents) CFRelease(arr);
-
     return selected_event;
 }
 
@@ -697,54 +717,17 @@ void restartTimerExpiredCallout(CFDictionaryRef event __unused)
  ******************************************************************************/
 
 
-/*
- *
- * isEntryValidAndFuturistic
- * Returns true if the CFDictionary is validly formed
- *     AND if the date is in the future
- * Returns false if anything about the dictionary is invalid
- *     OR if the CFDate is prior to the current time
- *
- */
-static bool 
-isEntryValidAndFuturistic(CFDictionaryRef wakeup_dict, CFDateRef date_now)
-{
-    CFDateRef           wakeup_date;
-    bool                ret = true;
-
-    wakeup_dict = isA_CFDictionary(wakeup_dict);
-    if(!wakeup_dict) 
-    {
-        // bogus entry!
-        ret = false;
-    } else 
-    {
-        // valid entry    
-        wakeup_date = isA_CFDate(CFDictionaryGetValue(wakeup_dict, 
-                                        CFSTR(kIOPMPowerEventTimeKey)));
-        if( !wakeup_date 
-            || (kCFCompareLessThan == CFDateCompare(wakeup_date, date_now, 0)))
-        {
-            // date is too early
-            ret = false;
-        }
-        // otherwise date is after now, and ret = true
-    }
-
-    return ret;
-}
-
 /*
  *
  * Purge past wakeup times
  * Does not care whether its operating on wakeup or poweron array.
- * Just purges all entries with a time < now
+ * Just purges all entries with a time < now, and entries without a valid date
  *
  */
 static void 
 purgePastEvents(PowerEventBehavior  *behave)
 {
-    CFDateRef           date_now;
+    CFIndex             first, count, i;
     CFDictionaryRef     event;
 
     if ((!wakePurgeAllowed) && (behave == &wakeBehavior)) return;
@@ -757,28 +740,30 @@ purgePastEvents(PowerEventBehavior  *behave)
         return;
     }
     
-    date_now = CFDateCreate(0, CFAbsoluteTimeGetCurrent());
-
-    // Loop over the array and remove any values that are in the past.
-    // Since array is sorted by date already, we stop once we reach an event
-    // scheduled in the future.
-    // Do not try to optimize the CFArrayGetCount out of the while loop; this value may
-    // change during loop execution.
-    while(0 < CFArrayGetCount(behave->array))
-    {
-        event = CFArrayGetValueAtIndex(behave->array, 0);
-        if (isEntryValidAndFuturistic(event, date_now) )
-                break;
-
-        CFDictionaryRef purgee = CFArrayGetValueAtIndex(behave->array, 0);
-        DEBUG_LOG("Purged past event: %{public}@\n", purgee);
-        // Remove entry from the array - its time has past
-        // The rest of the array will shift down to fill index 0
-        CFArrayRemoveValueAtIndex(behave->array, 0);
-        activeEventCnt--;
+    // Entries without a valid date can never fire. They sort last, so
+    // everything from the first of them on is dropped as expired.
+    first = firstEventAtOrAfter(behave, kInvalidEventTime);
+    count = CFArrayGetCount(behave->array);
+    for (i = first; i < count; i++) {
+        event = CFArrayGetValueAtIndex(behave->array, i);
+        DEBUG_LOG("Purged undated event: %{public}@\n", event);
+    }
+    if (first < count) {
+        removeEventsAtIndex(behave, first, count - first);
+        activeEventCnt -= count - first;
     }
 
-    CFRelease(date_now);
+    // The array is sorted by date, so everything before the first event
+    // at or after 'now' is in the past.
+    count = firstEventAtOrAfter(behave, CFAbsoluteTimeGetCurrent());
+    for (i = 0; i < count; i++) {
+        event = CFArrayGetValueAtIndex(behave->array, i);
+        DEBUG_LOG("Purged past event: %{public}@\n", event);
+    }
+    if (count) {
+        removeEventsAtIndex(behave, 0, count);
+        activeEventCnt -= count;
+    }
 
     return;
 }
@@ -816,10 +801,15 @@ copyScheduledPowerChangeArrays(void)
         tmp = isA_CFArray(SCPreferencesGetValue(prefs, this_behavior->title));
         if(tmp && (0 < CFArrayGetCount(tmp))) {
             this_behavior->array = CFArrayCreateMutableCopy(0, 0, tmp);
+            // Should already be sorted; don't rely on it
+            CFArraySortValues(this_behavior->array,
+                    CFRangeMake(0, CFArrayGetCount(this_behavior->array)),
+                    (CFComparatorFunction)compareEvDates, 0);
             activeEventCnt += CFArrayGetCount(tmp);
         } else {
             this_behavior->array = NULL;
         }
+        rebuildEventTimes(this_behavior);
     }
 
 
@@ -836,50 +826,52 @@ copyScheduledPowerChangeArrays(void)
  * For repeat events, a new event dictionary is created. Caller has to take
  * care to release that dictionary eventually.
  */
+/*
+ * firstFutureEvent
+ * Returns the first valid event in 'b' dated at or after 'now', or NULL.
+ */
+static CFDictionaryRef
+firstFutureEvent(PowerEventBehavior *b, CFAbsoluteTime now, CFAbsoluteTime *when)
+{
+    CFIndex i;
+
+    if (!b || !isA_CFArray(b->array)) {
+        return NULL;
+    }
+    i = firstEventAtOrAfter(b, now);
+    if ((i >= CFArrayGetCount(b->array)) || (b->eventTimes[i] == kInvalidEventTime)) {
+        return NULL;
+    }
+    *when = b->eventTimes[i];
+    return CFArrayGetValueAtIndex(b->array, i);
+}
+
 static CFDictionaryRef 
 copyEarliestUpcoming(PowerEventBehavior *b)
 {
-    CFArrayRef              arr = NULL;
-    CFDateRef               now = NULL;
+    CFAbsoluteTime          now;
+    CFAbsoluteTime          when = 0, sharedWhen = 0;
     CFDictionaryRef         the_result = NULL;
+    CFDictionaryRef         shared = NULL;
     CFDictionaryRef         repeatEvent = NULL;
-    CFIndex                 i, count;
     CFComparisonResult      eq;
 
     if(!b) return NULL;
 
-    // wake and poweron types get merged with wakeorpoweron array
-    if(b->sharedEvents) {
-
-        // musst release arr later
-        arr = copyMergedEventArray(b, b->sharedEvents);
-
-    } else {
-        arr = b->array;
-    }
-
-    // If the array is NULL, we have no work to do.
-    if (arr && (count = CFArrayGetCount(arr)) != 0) {
+    // Earliest entry occurring >MIN_SCHEDULE_TIME seconds in the future
+    now = CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME;
+    the_result = firstFutureEvent(b, now, &when);
 
-        
-        now = CFDateCreate(0, CFAbsoluteTimeGetCurrent() + MIN_SCHEDULE_TIME);
-
-        // iterate through all past entries, stopping at one occurring  
-        // >MIN_SCHEDULE_TIME seconds in the future, or at the end of the array
-        i = 0;
-        while( (i < count)
-            && !isEntryValidAndFuturistic(CFArrayGetValueAtIndex(arr, i), now) )
-        {
-            i++;
-        }
-        CFRelease(now);
-
-        if(i < count) 
-        {
-            the_result = CFArrayGetValueAtIndex(arr, i);
-            CFRetain(the_result);
+    // wake and poweron types also consider the wakeorpoweron events
+    if(b->sharedEvents) {
+        shared = firstFutureEvent(b->sharedEvents, now, &sharedWhen);
+        if (shared && (!the_result || (sharedWhen < when))) {
+            the_result = shared;
         }
     }
+    if (the_result) {
+        CFRetain(the_result);
+    }
 
     // Compare against the repeat event, if there is any
     repeatEvent = copyNextRepeatingEvent(b->title);
@@ -900,14 +892,12 @@ copyEarliestUpcoming(PowerEventBehavior *b)
         }
     }
     
-    if(arr && b->sharedEvents) CFRelease(arr);
-    
     return the_result;
 }
 
 /*
  *
- * comapareEvDates() - internal sorting helper for copyMergedEventArray()
+ * comapareEvDates() - sort order of the per-behavior event arrays
  *
  */
  static CFComparisonResult 
@@ -931,48 +921,125 @@ compareEvDates(
 }
 
 /*
+ * Event time index
  *
- * copyMergedEventArray
- *
- * Takes two PowerEventBehavior*, merges their CFArray array members into one 
- * mutable array, sorted by date.
+ * behave->eventTimes mirrors behave->array, which is kept sorted by
+ * compareEvDates(). Entries without a valid date sort last and are recorded
+ * as kInvalidEventTime.
  */
-static CFArrayRef       
-copyMergedEventArray(
-    PowerEventBehavior *a, 
-    PowerEventBehavior *b)
+static CFAbsoluteTime
+eventTime(CFDictionaryRef event)
 {
-    CFMutableArrayRef       merged;
-    CFIndex                 bcount;
-    CFRange                 rng;
+    CFDateRef date;
 
-    if(!a || !b) return NULL;
-    if(!a->array && !b->array) return NULL;
-    if(!a->array) return CFRetain(b->array);
-    if(!b->array) return CFRetain(a->array);
+    if (!isA_CFDictionary(event)) {
+        return kInvalidEventTime;
+    }
+    date = isA_CFDate(CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventTimeKey)));
+    return date ? CFDateGetAbsoluteTime(date) : kInvalidEventTime;
+}
 
-    // merge!
-    merged = CFArrayCreateMutableCopy(0, 0, a->array);
-    
-    bcount = CFArrayGetCount(b->array);
-    rng =  CFRangeMake(0, bcount);
-    CFArrayAppendArray(merged, b->array, rng);
-
-    // sort!
-    // We sort using the same compare_dates function used in IOKitUser
-    // pwr_mgt/IOPMAutoWake.c. Arrays must be sorted identically to how
-    // they would be there.
-    bcount = CFArrayGetCount(merged);
-    rng =  CFRangeMake(0, bcount);
-    CFArraySortValues(merged, rng, (CFComparatorFunction)compareEvDates, 0);
-
-    // caller must release
-    return merged;
+static int
+eventLeeway(CFDictionaryRef event)
+{
+    CFNumberRef leeway = NULL;
+    int         leeway_secs = 0;
+
+    if (isA_CFDictionary(event)) {
+        leeway = CFDictionaryGetValue(event, CFSTR(kIOPMPowerEventLeewayKey));
+        if (isA_CFNumber(leeway)) {
+            CFNumberGetValue(leeway, kCFNumberIntType, &leeway_secs);
+        }
+    }
+    return (leeway_secs > 0) ? leeway_secs : 0;
+}
+
+static bool
+reserveEventTimes(PowerEventBehavior *behave, CFIndex count)
+{
+    CFAbsoluteTime  *times;
+    CFIndex         capacity;
+
+    if (count <= behave->eventTimesCapacity) {
+        return true;
+    }
+    capacity = behave->eventTimesCapacity ? behave->eventTimesCapacity : 16;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    times = realloc(behave->eventTimes, capacity * sizeof(*times));
+    if (!times) {
+        return false;
+    }
+    behave->eventTimes = times;
+    behave->eventTimesCapacity = capacity;
+    return true;
 }
 
+static bool
+rebuildEventTimes(PowerEventBehavior *behave)
+{
+    CFIndex count, i;
 
+    behave->maxLeeway = 0;
+    count = behave->array ? CFArrayGetCount(behave->array) : 0;
+    if (!reserveEventTimes(behave, count)) {
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        CFDictionaryRef event = CFArrayGetValueAtIndex(behave->array, i);
 
+        behave->eventTimes[i] = eventTime(event);
+        behave->maxLeeway = MAX(behave->maxLeeway, eventLeeway(event));
+    }
+    return true;
+}
 
+/* Index of the first event dated at or after 'when' */
+static CFIndex
+firstEventAtOrAfter(PowerEventBehavior *behave, CFAbsoluteTime when)
+{
+    CFIndex lo = 0, hi, mid;
+
+    hi = behave->array ? CFArrayGetCount(behave->array) : 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (behave->eventTimes[mid] < when) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Index just past the last event dated at or before 'when' */
+static CFIndex
+firstEventAfter(PowerEventBehavior *behave, CFAbsoluteTime when)
+{
+    CFIndex lo = 0, hi, mid;
+
+    hi = behave->array ? CFArrayGetCount(behave->array) : 0;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (behave->eventTimes[mid] <= when) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void
+removeEventsAtIndex(PowerEventBehavior *behave, CFIndex index, CFIndex len)
+{
+    CFIndex count = CFArrayGetCount(behave->array);
+
+    CFArrayReplaceValues(behave->array, CFRangeMake(index, len), NULL, 0);
+    memmove(&behave->eventTimes[index], &behave->eventTimes[index + len],
+            (count - index - len) * sizeof(*behave->eventTimes));
+}
 
 static CFDateRef
 _getScheduledEventDate(CFDictionaryRef event)
@@ -1029,24 +1096,32 @@ destroySCSession(SCPreferencesRef prefs, int unlock)
 static void
 addEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
 {
+    CFAbsoluteTime  when = eventTime(event);
+    CFIndex         count, index;
+
     if (isA_CFArray(behave->array)) {
 
         // First clear off any expired events
         purgePastEvents(behave);
-
-        CFArrayAppendValue(behave->array, event);
-
-        // XXX: Manual sorting is probably better than using CFArraySortValues()
-        // Element is being added to already sorted array
-        CFArraySortValues( 
-                behave->array, CFRangeMake(0, CFArrayGetCount(behave->array)),
-                (CFComparatorFunction)compareEvDates, 0);
     }
     else {
         behave->array = CFArrayCreateMutable(
                             0, 0, &kCFTypeArrayCallBacks); 
-        CFArrayAppendValue(behave->array, event);
     }
+
+    count = CFArrayGetCount(behave->array);
+    if (!reserveEventTimes(behave, count + 1)) {
+        return;
+    }
+
+    // Keep the array sorted: insert after any events with the same date
+    index = firstEventAfter(behave, when);
+    CFArrayInsertValueAtIndex(behave->array, index, event);
+    memmove(&behave->eventTimes[index + 1], &behave->eventTimes[index],
+            (count - index) * sizeof(*behave->eventTimes));
+    behave->eventTimes[index] = when;
+    behave->maxLeeway = MAX(behave->maxLeeway, eventLeeway(event));
+
     activeEventCnt++;
 
 }
@@ -1090,8 +1165,9 @@ removeEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
     if (!behave->array || !isA_CFArray(behave->array))
         return false;
 
+    // Only events with the same date can match
     count = CFArrayGetCount(behave->array);
-    for (i = 0; i < count; i++)
+    for (i = firstEventAtOrAfter(behave, eventTime(event)); i < count; i++)
     {
         cancelee = CFArrayGetValueAtIndex(behave->array, i);
         eq = compareEvDates(event, cancelee, 0);
@@ -1121,7 +1197,7 @@ removeEvent(PowerEventBehavior  *behave, CFDictionaryRef event)
                 if (CFDictionaryGetValue(cancelee, CFSTR(kIOPMPowerEventUserVisible)) == kCFBooleanTrue) {
                     notify_post(kIOPMUserVisiblePowerEventNotification);
                 }
-                CFArrayRemoveValueAtIndex(behave->array, i);
+                removeEventsAtIndex(behave, i, 1);
                 activeEventCnt--;
                 return true;
             }
@@ -1154,12 +1230,14 @@ removeAllEvents(audit_token_t token)
             behaviors[i]->currentEvent = NULL;
         }
         CFArrayRemoveAllValues(behaviors[i]->array);
+        behaviors[i]->maxLeeway = 0;
         if((ret=updateToDisk(prefs, behaviors[i], behaviors[i]->title) != kIOReturnSuccess)) {
             ret=kIOReturnError;
             goto exit;
         }
         /* updateToDisk throws error if 'behaviours[i]->array=NULL' is passed as a parameter. */
         /* Resetting the array to NULL post updatToDisk */
+        CFRelease(behaviors[i]->array);
         behaviors[i]->array=NULL;
         /* Schedule the power event */
         if (CFEqual(behaviors[i]->title, CFSTR(kIOPMAutoWakeOrPowerOn))) {
@@ -60,6 +60,12 @@ struct PowerEventBehavior {
     // and upcoming power events
     CFMutableArrayRef       array;
     CFDictionaryRef         currentEvent;
+
+    // kIOPMPowerEventTimeKey of each entry in 'array', in the same
+    // (sorted) order, so lookups by date are binary searches
+    CFAbsoluteTime          *eventTimes;
+    CFIndex                 eventTimesCapacity;
+    int                     maxLeeway;
     dispatch_source_t       timer;
     
     CFStringRef             title;
@@ -1348,6 +1348,7 @@ static void publish_IOPSBatteryGetWarningLevel(
 
             CFRelease(newlevel);
 
+            PMStoreFlush();
             BatteryTimeRemaining_notify_post(kIOPSNotifyLowBattery);
             if (newWarningLevel != prevLoggedLevel) {
                 INFO_LOG("Warning level: %d cap: %d\n", newWarningLevel, percent);
@@ -4888,6 +4889,13 @@ kern_return_t _io_ps_new_pspowersource(
             }
             INFO_LOG("Posted notifications for loss of power source id %d\n", ps->psid);
             ps->procdeathsrc = NULL;
+            if ((ps->psType == kPSTypeUPS) && ps->description) {
+                CFNumberRef upsIDNum = isA_CFNumber(CFDictionaryGetValue(ps->description, CFSTR(kIOPSPowerSourceIDKey)));
+                int upsID = 0;
+                if (upsIDNum && CFNumberGetValue(upsIDNum, kCFNumberIntType, &upsID)) {
+                    UPSLowPowerUnitRemoved(upsID);
+                }
+            }
             if (ps->description) {
                 CFRelease(ps->description);
             }
@@ -4927,6 +4935,11 @@ static void log_ps_dictionary(int psid, int callerPID, CFDictionaryRef details)
     }
 }
 
+static void mergeDictionaryValue(const void *key, const void *value, void *context)
+{
+    CFDictionarySetValue((CFMutableDictionaryRef)context, key, value);
+}
+
 kern_return_t _io_ps_update_pspowersource(
     mach_port_t         server __unused,
     audit_token_t       token,
@@ -4965,6 +4978,25 @@ kern_return_t _io_ps_update_pspowersource(
             goto exit;
         }
 
+        // ioupsd sends only the keys that changed; merge them into the
+        // last full description
+        if (CFDictionaryGetValue(details, CFSTR(kIOPSPartialUpdateKey)) == kCFBooleanTrue) {
+            CFMutableDictionaryRef merged = NULL;
+
+            CFDictionaryRemoveValue(details, CFSTR(kIOPSPartialUpdateKey));
+            if (next->description && (next->psType == kPSTypeUPS)) {
+                merged = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, next->description);
+            }
+            if (!merged) {
+                *return_code = kIOReturnNotReady;
+                CFRelease(details);
+                goto exit;
+            }
+            CFDictionaryApplyFunction(details, mergeDictionaryValue, merged);
+            CFRelease(details);
+            details = merged;
+        }
+
         psIDKey = CFDictionaryGetValue(details, CFSTR(kIOPSPowerSourceIDKey));
         if (!isA_CFNumber(psIDKey)) {
             psID = MAKE_UNIQ_SOURCE_ID(next->pid, next->psid);
@@ -5000,6 +5032,9 @@ kern_return_t _io_ps_update_pspowersource(
                 INFO_LOG("Posted \"%s\" for new power source id %d\n", kIOPSNotifyAttach, psid);
             }
             next->description = details;
+            if (next->psType == kPSTypeUPS) {
+                UPSLowPowerUnitChanged(details);
+            }
             dispatch_async(batteryTimeRemainingQ, ^() {
                 HandlePublishAllPowerSources();
             });
@@ -28,22 +28,98 @@
 #include <bsm/libbsm.h>
 #include "HIDEventWatcher.h"
 
-static CFMutableArrayRef   gHIDEventHistory = NULL;
-
 static const CFTimeInterval kFiveMinutesInSeconds   = (double)300.0;
-static const int kMaxFiveMinutesWindowsCount        = 12;
-static const int kMaxPIDRecorded                    = 10;
+#define kMaxFiveMinutesWindowsCount     12
+#define kMaxPIDRecorded                 10
+#define kPIDHashBuckets                 16
+#define kNoSlot                         (-1)
 
 #define __NX_NULL_EVENT     0
 
 /*
- * gHIDEventHistory = One big CFArrayRef
- *   full of CFDictionaries
- *       pid is at kIOPMHIDAppPIDKey
- *       path is at kIOPMHIDAppPathKey
- *       CFArray of buckets is at kIOPMHIDHistoryArrayKey
- *           Each bucket is a IOPMHIDPostEventActivityWindow
+ * gHIDEventSlots = one slot per tracked pid, kMaxPIDRecorded slots.
+ *   Each slot holds a ring of the last kMaxFiveMinutesWindowsCount
+ *   IOPMHIDPostEventActivityWindow buckets; 'newest' indexes the most
+ *   recent one.
+ *   Slots are handed out round-robin, so once the table is full the pid
+ *   we started tracking first is evicted.
+ *   gPIDHash chains slots by pid so an event finds its slot without a scan.
+ *
+ * Nothing here is a CF object; _io_pm_hid_event_copy_history() builds the
+ * CFArray of CFDictionaries (pid at kIOPMHIDAppPIDKey, path at
+ * kIOPMHIDAppPathKey, buckets at kIOPMHIDHistoryArrayKey) on request.
  */
+typedef struct {
+    pid_t                           pid;
+    bool                            inUse;
+    int8_t                          hashNext;
+    uint8_t                         newest;
+    uint8_t                         bucketCount;
+    char                            name[2*MAXCOMLEN + 1];
+    IOPMHIDPostEventActivityWindow  buckets[kMaxFiveMinutesWindowsCount];
+} HIDEventSlot;
+
+static HIDEventSlot     gHIDEventSlots[kMaxPIDRecorded];
+static int8_t           gPIDHash[kPIDHashBuckets];
+static int              gNextSlot = 0;
+static int              gSlotsUsed = 0;
+static bool             gPIDHashInited = false;
+
+static inline int pidHash(pid_t pid)
+{
+    return (int)((uint32_t)pid % kPIDHashBuckets);
+}
+
+static HIDEventSlot *slotForPID(pid_t pid)
+{
+    for (int8_t i = gPIDHash[pidHash(pid)]; i != kNoSlot; i = gHIDEventSlots[i].hashNext) {
+        if (gHIDEventSlots[i].pid == pid) {
+            return &gHIDEventSlots[i];
+        }
+    }
+    return NULL;
+}
+
+static void unhashSlot(int8_t slot)
+{
+    int8_t *link = &gPIDHash[pidHash(gHIDEventSlots[slot].pid)];
+
+    while (*link != kNoSlot) {
+        if (*link == slot) {
+            *link = gHIDEventSlots[slot].hashNext;
+            return;
+        }
+        link = &gHIDEventSlots[*link].hashNext;
+    }
+}
+
+static HIDEventSlot *newSlotForPID(pid_t pid)
+{
+    int8_t          slot = (int8_t)gNextSlot;
+    HIDEventSlot    *s = &gHIDEventSlots[slot];
+
+    // Limit number of PID's tracked at one time.
+    if (s->inUse) {
+        unhashSlot(slot);
+    } else {
+        gSlotsUsed++;
+    }
+    gNextSlot = (gNextSlot + 1) % kMaxPIDRecorded;
+
+    bzero(s, sizeof(*s));
+    s->inUse = true;
+    s->pid = pid;
+
+    /* Tag the process name */
+    if (0 == proc_name(pid, s->name, sizeof(s->name))) {
+        s->name[0] = 0;
+    }
+
+    s->hashNext = gPIDHash[pidHash(pid)];
+    gPIDHash[pidHash(pid)] = slot;
+
+    return s;
+}
 
 __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
     mach_port_t server,
@@ -52,15 +128,9 @@ __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
     int         *allowEvent)
 {
     pid_t                               callerPID;
-    CFNumberRef                         appPID = NULL;
-    int                                 _app_pid_;
-    CFMutableDictionaryRef              foundDictionary = NULL;
-    CFMutableArrayRef                   bucketsArray = NULL;
-    CFDataRef                           dataEvent = NULL;
+    HIDEventSlot                        *slot = NULL;
     IOPMHIDPostEventActivityWindow      *ev = NULL;
     CFAbsoluteTime                      timeNow = CFAbsoluteTimeGetCurrent();
-    long                                arrayCount = 0;
-    long                                i = 0;
     
 
     if ((__NX_NULL_EVENT == _action) && (isA_NotificationDisplayWake())) {
@@ -70,129 +140,94 @@ __private_extern__ kern_return_t _io_pm_hid_event_report_activity(
         *allowEvent = 1;
     }
 
-
-    // Unwrapping big data structure...
-    if (!gHIDEventHistory) {
-        gHIDEventHistory = CFArrayCreateMutable(0, 1, &kCFTypeArrayCallBacks);
+    if (!gPIDHashInited) {
+        memset(gPIDHash, kNoSlot, sizeof(gPIDHash));
+        gPIDHashInited = true;
     }
-    if (!gHIDEventHistory) {
-        goto exit;
-    }
-    
+
     audit_token_to_au32(token, NULL, NULL, NULL, NULL, NULL, &callerPID, NULL, NULL);
 
-    if (0 !=(arrayCount = CFArrayGetCount(gHIDEventHistory)))
-    {
-        // Scan through the array to find an existing dictionary for the given pid
-        for (i=0; i<arrayCount; i++)
-        {
-            CFMutableDictionaryRef dictionaryForApp = NULL;
-            dictionaryForApp = (CFMutableDictionaryRef)CFArrayGetValueAtIndex(gHIDEventHistory, i);
-            if (!dictionaryForApp) {
-                break;
-            }
-            appPID = CFDictionaryGetValue(dictionaryForApp, kIOPMHIDAppPIDKey);
-            if (appPID) {
-                CFNumberGetValue(appPID, kCFNumberIntType, &_app_pid_);
-                if (callerPID == _app_pid_) {
-                    foundDictionary = dictionaryForApp;
-                    break;
-                }
-            }
-        }
+    slot = slotForPID(callerPID);
+    if (!slot) {
+        slot = newSlotForPID(callerPID);
     }
-    
-    // Unwrapping big data structure...
-    if (!foundDictionary) {
-        foundDictionary = CFDictionaryCreateMutable(0, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-        CFArrayAppendValue(gHIDEventHistory, foundDictionary);
-        CFRelease(foundDictionary);
-        
-        if (CFArrayGetCount(gHIDEventHistory) > kMaxPIDRecorded) {
-            // Limit number of PID's tracked at one time.
-            CFArrayRemoveValueAtIndex(gHIDEventHistory, 0);
-        }
-        
-        /* Tag our pid */
-        appPID = CFNumberCreate(0, kCFNumberIntType, &callerPID);
-        if (appPID) {
-            CFDictionarySetValue(foundDictionary, kIOPMHIDAppPIDKey, appPID);
-            CFRelease(appPID);
+
+    // Check last HID event bucket timestamp - is it more than 5 minutes old?
+    if (slot->bucketCount) {
+        ev = &slot->buckets[slot->newest];
+        if (timeNow >= (ev->eventWindowStart + kFiveMinutesInSeconds)) {
+            ev = NULL;
         }
+    }
 
-        /* Tag the process name */
-        CFStringRef appName = NULL;
-        char    appBuf[MAXPATHLEN];
-        int     len = proc_name(callerPID, appBuf, MAXPATHLEN);
-        if (0 != len) {
-            appName = CFStringCreateWithCString(0, appBuf, kCFStringEncodingMacRoman);
-            if (appName) {
-                CFDictionarySetValue(foundDictionary, kIOPMHIDAppPathKey, appName);
-                CFRelease(appName);
-            }
+    if (!ev) {
+        // Start a new window, overwriting the oldest one once the ring is full
+        slot->newest = (slot->newest + 1) % kMaxFiveMinutesWindowsCount;
+        if (slot->bucketCount < kMaxFiveMinutesWindowsCount) {
+            slot->bucketCount++;
         }
+        ev = &slot->buckets[slot->newest];
+
+        // We align the starts of our windows with 5 minute intervals
+        ev->eventWindowStart = ((int)timeNow / (int)kFiveMinutesInSeconds) * kFiveMinutesInSeconds;
+        ev->nullEventCount = ev->hidEventCount = 0;
     }
 
-    if (!foundDictionary)
-        goto exit;
+    // We bump the count for HID activity!
+    if (__NX_NULL_EVENT == _action) {
+        ev->nullEventCount++;
+    } else {
+        ev->hidEventCount++;
+    }
 
-    // Unwrapping big data structure...
-    bucketsArray = (CFMutableArrayRef)CFDictionaryGetValue(foundDictionary, kIOPMHIDHistoryArrayKey);
-    if (!bucketsArray) {
-        bucketsArray = CFArrayCreateMutable(0, 1, &kCFTypeArrayCallBacks);
-        CFDictionarySetValue(foundDictionary, kIOPMHIDHistoryArrayKey, bucketsArray);
-        CFRelease(bucketsArray);
+    return KERN_SUCCESS;
+}
+
+static CFDictionaryRef copySlotDictionary(HIDEventSlot *slot)
+{
+    CFMutableDictionaryRef  dict = NULL;
+    CFMutableArrayRef       bucketsArray = NULL;
+    CFNumberRef             appPID = NULL;
+    CFStringRef             appName = NULL;
+    CFDataRef               dataEvent = NULL;
+
+    dict = CFDictionaryCreateMutable(0, 3, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (!dict) {
+        return NULL;
     }
-    if (!bucketsArray) 
-        goto exit;
 
-    // Check last HID event bucket timestamp - is it more than 5 minutes old?
-    bool foundWindowForEvent = false;
-    if (0 < CFArrayGetCount(bucketsArray)) {
-        dataEvent = (CFDataRef)CFArrayGetValueAtIndex(bucketsArray, 0);
-    }
-    if (dataEvent) {
-        ev = (IOPMHIDPostEventActivityWindow *)CFDataGetBytePtr(dataEvent);
-        if (timeNow < (ev->eventWindowStart + kFiveMinutesInSeconds))
-        {
-            // This HID event gets dropped into this existing 5 minute bucket.
-            // We bump the count for HID activity!
-            if (__NX_NULL_EVENT == _action) {
-                ev->nullEventCount++;
-            } else {
-                ev->hidEventCount++;
-            }
-            foundWindowForEvent = true;
+    /* Tag our pid */
+    appPID = CFNumberCreate(0, kCFNumberIntType, &slot->pid);
+    if (appPID) {
+        CFDictionarySetValue(dict, kIOPMHIDAppPIDKey, appPID);
+        CFRelease(appPID);
+    }
+
+    if (slot->name[0]) {
+        appName = CFStringCreateWithCString(0, slot->name, kCFStringEncodingMacRoman);
+        if (appName) {
+            CFDictionarySetValue(dict, kIOPMHIDAppPathKey, appName);
+            CFRelease(appName);
         }
     }
 
-    if (!foundWindowForEvent) {
-        IOPMHIDPostEventActivityWindow  newv;
+    // Newest window first
+    bucketsArray = CFArrayCreateMutable(0, slot->bucketCount, &kCFTypeArrayCallBacks);
+    if (bucketsArray) {
+        for (int i = 0; i < slot->bucketCount; i++) {
+            int b = (slot->newest + kMaxFiveMinutesWindowsCount - i) % kMaxFiveMinutesWindowsCount;
 
-        // We align the starts of our windows with 5 minute intervals
-        newv.eventWindowStart = ((int)timeNow / (int)kFiveMinutesInSeconds) * kFiveMinutesInSeconds;
-        newv.nullEventCount = newv.hidEventCount = 0;
-        if (__NX_NULL_EVENT == _action) {
-            newv.nullEventCount++;
-        } else {
-            newv.hidEventCount++;
-        }
-    
-        dataEvent = CFDataCreate(0, (const UInt8 *)&newv, sizeof(IOPMHIDPostEventActivityWindow));
-        if (dataEvent) {
-            CFArrayInsertValueAtIndex(bucketsArray, 0, dataEvent);
-            CFRelease(dataEvent);
-        }
-        
-        // If we've recorded more than kMaxFiveMinutesWindowsCount activity windows for this process, delete the old ones.
-        while (kMaxFiveMinutesWindowsCount < CFArrayGetCount(bucketsArray)) {
-            CFArrayRemoveValueAtIndex(bucketsArray, CFArrayGetCount(bucketsArray) - 1);
+            dataEvent = CFDataCreate(0, (const UInt8 *)&slot->buckets[b], sizeof(IOPMHIDPostEventActivityWindow));
+            if (dataEvent) {
+                CFArrayAppendValue(bucketsArray, dataEvent);
+                CFRelease(dataEvent);
+            }
         }
-        
+        CFDictionarySetValue(dict, kIOPMHIDHistoryArrayKey, bucketsArray);
+        CFRelease(bucketsArray);
     }
 
-exit:
-    return KERN_SUCCESS;
+    return dict;
 }
 
 __private_extern__ kern_return_t _io_pm_hid_event_copy_history(
@@ -201,27 +236,51 @@ __private_extern__ kern_return_t _io_pm_hid_event_copy_history(
             mach_msg_type_number_t  *array_dataLen,
             int             *return_val)
 {
-    CFDataRef   sendData = NULL;
+    CFDataRef           sendData = NULL;
+    CFMutableArrayRef   history = NULL;
+    CFDictionaryRef     dict = NULL;
+    int                 first;
+
     *array_data = 0;
     *array_dataLen = 0;
+    *return_val = kIOReturnError;
+
+    if (0 == gSlotsUsed) {
+        goto exit;
+    }
+
+    history = CFArrayCreateMutable(0, gSlotsUsed, &kCFTypeArrayCallBacks);
+    if (!history) {
+        goto exit;
+    }
+
+    // Oldest tracked pid first
+    first = (gSlotsUsed < kMaxPIDRecorded) ? 0 : gNextSlot;
+    for (int i = 0; i < gSlotsUsed; i++) {
+        dict = copySlotDictionary(&gHIDEventSlots[(first + i) % kMaxPIDRecorded]);
+        if (dict) {
+            CFArrayAppendValue(history, dict);
+            CFRelease(dict);
+        }
+    }
 
-    sendData = CFPropertyListCreateData(0, gHIDEventHistory, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+    sendData = CFPropertyListCreateData(0, history, kCFPropertyListXMLFormat_v1_0, 0, NULL);
+    CFRelease(history);
     if (!sendData) {
-        *return_val = kIOReturnError;
         goto exit;
     }
 
-    *array_data = (vm_offset_t)CFDataGetBytePtr(sendData);
     *array_dataLen = (mach_msg_type_number_t)CFDataGetLength(sendData);
     vm_allocate(mach_task_self(), (vm_address_t *)array_data, *array_dataLen, TRUE);
     if (*array_data) {
         memcpy((void *)*array_data, CFDataGetBytePtr(sendData), *array_dataLen);
         *return_val = kIOReturnSuccess;
+    } else {
+        *array_dataLen = 0;
     }
 
     CFRelease(sendData);
 
-    *return_val = kIOReturnSuccess;
 exit:
     return KERN_SUCCESS;
 }
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef MT2ProcessNames_h
+#define MT2ProcessNames_h
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Process names interned to the small IDs that index the per-process mt2
+ * counters. The table only lives for one mt2 reporting period: the caller
+ * resets it together with the counters after each publish, so it only ever
+ * holds the processes seen in that period.
+ */
+
+#define kMT2MaxProcessNames         1024
+#define kMT2UnknownProcessID        0
+#define kMT2ProcessNameLen          64          /* kProcNameBufLen */
+#define kMT2ProcessNameBuckets      (2 * kMT2MaxProcessNames)
+
+typedef struct {
+    uint32_t    generation;                         /* bumped by every reset, never 0 once used */
+    uint16_t    count;                              /* IDs handed out, including kMT2UnknownProcessID */
+    uint16_t    buckets[kMT2ProcessNameBuckets];    /* open addressing by name hash; 0 is empty */
+    char        names[kMT2MaxProcessNames][kMT2ProcessNameLen];
+} MT2ProcessNames;
+
+/*
+ * An ID cached by its user, e.g. in ProcessInfo. It is only meaningful while
+ * its generation matches the table's.
+ */
+typedef struct {
+    uint32_t    generation;
+    uint16_t    id;
+} MT2ProcessNameRef;
+
+static inline void mt2ProcessNamesReset(MT2ProcessNames *t)
+{
+    memset(t->buckets, 0, sizeof(t->buckets));
+    memcpy(t->names[kMT2UnknownProcessID], "Unknown", sizeof("Unknown"));
+    t->count = kMT2UnknownProcessID + 1;
+    if (++t->generation == 0) {
+        t->generation = 1;
+    }
+}
+
+static inline uint32_t mt2ProcessNameHash(const char *name, size_t len)
+{
+    uint32_t    h = 2166136261u;
+    size_t      i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Returns the ID for @name, adding it if this period hasn't seen it yet.
+ * Names are compared on their first kMT2ProcessNameLen - 1 bytes. NULL names,
+ * and new names once the table is full, map to kMT2UnknownProcessID.
+ */
+static inline uint16_t mt2ProcessNamesIntern(MT2ProcessNames *t, const char *name)
+{
+    size_t      len;
+    uint32_t    slot;
+    uint16_t    nameID;
+
+    if (!t->generation) {
+        mt2ProcessNamesReset(t);
+    }
+    if (!name) {
+        return kMT2UnknownProcessID;
+    }
+
+    len = strnlen(name, kMT2ProcessNameLen - 1);
+    slot = mt2ProcessNameHash(name, len) & (kMT2ProcessNameBuckets - 1);
+
+    while ((nameID = t->buckets[slot])) {
+        if (!memcmp(t->names[nameID], name, len) && !t->names[nameID][len]) {
+            return nameID;
+        }
+        slot = (slot + 1) & (kMT2ProcessNameBuckets - 1);
+    }
+
+    if (t->count >= kMT2MaxProcessNames) {
+        return kMT2UnknownProcessID;
+    }
+
+    nameID = t->count++;
+    memcpy(t->names[nameID], name, len);
+    t->names[nameID][len] = '\0';
+    t->buckets[slot] = nameID;
+
+    return nameID;
+}
+
+/*
+ * Returns @ref's ID, interning the name @name returns only when the cached ID
+ * is from an earlier period. @name is only called then, which keeps string
+ * conversions out of the common path.
+ */
+static inline uint16_t mt2ProcessNamesLookup(MT2ProcessNames *t, MT2ProcessNameRef *ref,
+                                             const char *(*name)(void *context, char *buf, size_t len),
+                                             void *context)
+{
+    char        buf[kMT2ProcessNameLen];
+
+    if (!t->generation || ref->generation != t->generation) {
+        ref->id = mt2ProcessNamesIntern(t, name(context, buf, sizeof(buf)));
+        ref->generation = t->generation;
+    }
+    return ref->id;
+}
+
+static inline uint16_t mt2ProcessNamesCount(const MT2ProcessNames *t)
+{
+    return t->generation ? t->count : 0;
+}
+
+static inline const char *mt2ProcessNamesGet(const MT2ProcessNames *t, uint16_t nameID)
+{
+    return (nameID < mt2ProcessNamesCount(t)) ? t->names[nameID] : NULL;
+}
+
+#endif /* MT2ProcessNames_h */
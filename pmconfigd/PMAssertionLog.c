@@ -610,7 +610,7 @@ static void logAssertionToASL(assertLogAction  action,
         asl_set(m, ASL_KEY_MSG, aslMessageString);
         asl_set(m, kPMASLActionKey, assertionAction);
         asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-        asl_send(NULL, m);
+        pmLogSend(m);
         asl_free(m);
     }
 
@@ -686,7 +686,7 @@ void logASLAssertionsAggregate(void)
         asl_set(m, ASL_KEY_MSG, aslMessageString);
         asl_set(m, kPMASLActionKey, kPMASLAssertionActionSummary);
         asl_set(m, kPMASLDomainKey, kPMASLDomainPMAssertions);
-        asl_send(NULL, m);
+        pmLogSend(m);
         asl_free(m);
     }
 
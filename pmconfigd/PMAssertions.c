@@ -1681,7 +1681,7 @@ static bool sendIdleSleepRevertReqestToKernel(void)
 __private_extern__ void PMAssertions_SettingsHaveChanged(void)
 {
     static int lastDWBTSetting = -1;
-    int newDWBT = GetPMSettingBool(CFSTR(kIOPMDarkWakeBackgroundTaskKey));
+    int newDWBT = GetPMSettingBoolForID(kPMSettingDarkWakeBackgroundTask);
 
     if (newDWBT == lastDWBTSetting) {
         return;
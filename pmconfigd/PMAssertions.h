@@ -32,6 +32,7 @@
 #define _PMAssertions_h_
 
 #include "XCTest_FunctionDefinitions.h"
+#include "MT2ProcessNames.h"
 #include <IOKit/pwr_mgt/IOPM.h>
 #include <IOKit/pwr_mgt/IOPMLibPrivate.h>
 #include <IOKit/pwr_mgt/powermanagement_mig.h>
@@ -221,6 +222,7 @@ typedef struct {
                                   
     uint32_t            retain_cnt;     // Retain cnt of this structure
     CFStringRef         name;           // Process name
+    MT2ProcessNameRef   mt2Name;        // Name ID for mt2 counters, interned on first use each period
     
 
     XCT_UNSAFE_UNRETAINED dispatch_source_t   disp_src;       // Dispatch src to handle process exit
@@ -218,6 +218,8 @@ typedef struct {
     bool                    notifyEnable;
     int                     timeoutCnt;
     dispatch_source_t       procExit;
+    int                     latencySlot;    // index+1 into gResponseLatency; 0 if unassigned
+    IOPMCapabilityBits      eligibleBits;   // interestsBits counted in gEligibleInterestCounts
 } PMConnection;
 
 
@@ -284,6 +286,8 @@ static void cleanClientResponses(PMResponseWrangler *wrangler, bool timeout);
 
 static void cleanupConnection(PMConnection *reap);
 
+static void updateConnectionEligibility(PMConnection *connection);
+
 static void cleanupResponseWrangler(PMResponseWrangler *reap);
 
 static void setSystemSleepStateTracking(IOPMCapabilityBits);
@@ -358,6 +362,25 @@ static io_connect_t             gRootDomainConnect = IO_OBJECT_NULL;
 static PMResponseWrangler *     gLastResponseWrangler = NULL;
 static uint16_t                 gWranglerGenerationCount = 0;
 
+/* Connections that can be notified of a capability change (notifications
+ * enabled and a notify port registered), counted per interest bit.
+ * gEligibleInterestBits is the union of the bits with a non-zero count; it
+ * lets connectionFireNotification() see that nobody is listening without
+ * walking gConnections or allocating anything.
+ */
+#define kEligibleInterestBitCount   (sizeof(IOPMCapabilityBits) * 8)
+static uint32_t                 gEligibleInterestCounts[kEligibleInterestBitCount];
+static IOPMCapabilityBits       gEligibleInterestBits = 0;
+
+/* Response latency histograms, one record per client name.
+ * Records outlive connections so that clients that reconnect on every
+ * wake accumulate into one record. Once the table is full, new clients
+ * share the last record.
+ */
+#define kPMResponseLatencyMaxClients    64
+static PMResponseLatencyRecord  gResponseLatency[kPMResponseLatencyMaxClients];
+static int                      gResponseLatencyCount = 0;
+
 SleepServiceStruct              gSleepService;
 
 uint32_t                        gDebugFlags = kIOPMDebugAssertionASLLog|
@@ -619,6 +642,7 @@ exit:
     } else {
         mach_port_deallocate(mach_task_self(), notify_port_in);
     }
+    updateConnectionEligibility(connection);
 
     *return_code = kIOReturnSuccess;
 exit:
@@ -723,6 +747,116 @@ static CFDictionaryRef _io_pm_connection_acknowledge_event_unpack_payload(
     return ackOptionsDict;
 }
 
+static int responseLatencySlot(PMConnection *connection)
+{
+    char    name[kPMResponseLatencyNameLen];
+    int     i;
+
+    if (connection->latencySlot) {
+        return connection->latencySlot - 1;
+    }
+
+    if (!isA_CFString(connection->callerName) ||
+        !CFStringGetCString(connection->callerName, name, sizeof(name), kCFStringEncodingUTF8)) {
+        snprintf(name, sizeof(name), "pid %d", connection->callerPID);
+    }
+
+    for (i = 0; i < gResponseLatencyCount; i++) {
+        if (!strncmp(gResponseLatency[i].name, name, sizeof(name))) {
+            break;
+        }
+    }
+    if (i == gResponseLatencyCount) {
+        if (gResponseLatencyCount < kPMResponseLatencyMaxClients) {
+            gResponseLatencyCount++;
+            strlcpy(gResponseLatency[i].name,
+                    (i == kPMResponseLatencyMaxClients - 1) ? "(other)" : name,
+                    sizeof(gResponseLatency[i].name));
+        } else {
+            i = kPMResponseLatencyMaxClients - 1;
+        }
+    }
+
+    connection->latencySlot = i + 1;
+    return i;
+}
+
+static void recordResponseLatency(PMResponse *resp)
+{
+    PMResponseLatencyRecord *record;
+    uint32_t                timeIntervalMS;
+    int                     transition;
+
+    if (!resp->connection)
+        return;
+
+    // Classify by the capabilities this response acknowledges, not by the
+    // state the system is in by the time the reply arrives.
+    if (!BIT_IS_SET(resp->notificationType, kIOPMSystemCapabilityCPU)) {
+        transition = kPMResponseTransitionSleep;
+    }
+    else if (BIT_IS_SET(resp->notificationType, kIOPMSystemCapabilityGraphics)) {
+        transition = kPMResponseTransitionWake;
+    }
+    else {
+        transition = kPMResponseTransitionDarkWake;
+    }
+
+    record = &gResponseLatency[responseLatencySlot(resp->connection)];
+    if (resp->timedout) {
+        record->timeouts[transition]++;
+        return;
+    }
+
+    timeIntervalMS = (resp->repliedWhen - resp->notifiedWhen) * 1000;
+    record->counts[transition][PMResponseLatencyBucket(timeIntervalMS)]++;
+    if (timeIntervalMS > record->maxMS[transition]) {
+        record->maxMS[transition] = timeIntervalMS;
+    }
+}
+
+__private_extern__ void copyResponseLatencyStats(xpc_object_t remote, xpc_object_t msg)
+{
+    PMResponseLatencyHeader header;
+    xpc_object_t            reply_msg = NULL;
+    uint8_t                 *blob = NULL;
+    size_t                  len;
+
+    if (!remote || !msg) {
+        ERROR_LOG("Invalid parameters. remote: %@ msg: %@", remote, msg);
+        return;
+    }
+
+    reply_msg = xpc_dictionary_create_reply(msg);
+    if (!reply_msg) {
+        ERROR_LOG("Cannot create reply dictionary");
+        return;
+    }
+
+    bzero(&header, sizeof(header));
+    header.magic = kPMResponseLatencyMagic;
+    header.version = kPMResponseLatencyVersion;
+    header.bucketCount = kPMResponseLatencyBucketCount;
+    header.transitionCount = kPMResponseTransitionCount;
+    header.recordCount = gResponseLatencyCount;
+
+    len = sizeof(header) + gResponseLatencyCount * sizeof(PMResponseLatencyRecord);
+    blob = malloc(len);
+    if (blob) {
+        memcpy(blob, &header, sizeof(header));
+        memcpy(blob + sizeof(header), gResponseLatency,
+               gResponseLatencyCount * sizeof(PMResponseLatencyRecord));
+        xpc_dictionary_set_data(reply_msg, kPMResponseLatencyDataKey, blob, len);
+        xpc_dictionary_set_int64(reply_msg, kMsgReturnCode, kIOReturnSuccess);
+        free(blob);
+    } else {
+        xpc_dictionary_set_int64(reply_msg, kMsgReturnCode, kIOReturnNoMemory);
+    }
+
+    xpc_connection_send_message(remote, reply_msg);
+    xpc_release(reply_msg);
+}
+
 static void cacheResponseStats(PMResponse *resp)
 {
     PMResponseWrangler *respWrangler = resp->myResponseWrangler;
@@ -817,6 +951,7 @@ kern_return_t _io_pm_connection_acknowledge_event
     foundResponse->repliedWhen = CFAbsoluteTimeGetCurrent();
     foundResponse->replied = true;
     
+    recordResponseLatency(foundResponse);
     cacheResponseStats(foundResponse);
     
     // Unpack the passed-in options data structure
@@ -1113,6 +1248,8 @@ static void cleanupConnection(PMConnection *reap)
         mach_port_deallocate(mach_task_self(), reap->notifyPort);
         reap->notifyPort = MACH_PORT_NULL;
     }
+    reap->notifyEnable = false;
+    updateConnectionEligibility(reap);
 
     if (reap->procExit) {
         dispatch_source_cancel(reap->procExit);
@@ -1258,6 +1395,10 @@ static void setSystemSleepStateTracking(IOPMCapabilityBits capables)
         CFRelease(capablesNum);
     }
 
+    // Callers post kIOPMSystemPowerStateNotify right after this; readers
+    // woken by it must see the new capabilities, possibly just before sleep.
+    PMStoreFlush();
+
     CFRelease(key);
 }
 
@@ -1464,7 +1605,7 @@ static void logASLMessageSleepServiceBegins(long withCapTime)
     snprintf(strbuf, sizeof(strbuf), "SleepService: window begins with cap time=%ld secs", withCapTime/1000);
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1521,7 +1662,7 @@ __private_extern__ void logASLMessageSleepServiceTerminated(int forcedTimeoutCnt
         asl_set(m, kPMASLSignatureKey, kPMASLSigSleepServiceTimedOut);
     }
     
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
     
     /* Messages describes the next state - S3, S0Dark, S0
@@ -1752,7 +1893,7 @@ void setAutoPowerOffTimer(bool initialCall, CFAbsoluteTime  postponeAfter)
     int64_t timer_fire;
     CFAbsoluteTime  cur_time = 0.0;
 
-    if ( (GetPMSettingNumber(CFSTR(kIOPMAutoPowerOffEnabledKey), &apo_enable) != kIOReturnSuccess) ||
+    if ( (GetPMSettingNumberForID(kPMSettingAutoPowerOffEnabled, &apo_enable) != kIOReturnSuccess) ||
             (apo_enable != 1) ) {
         if (gDebugFlags & kIOPMDebugLogCallbacks)
            asl_log(0,0,ASL_LEVEL_ERR, "Failed to get APO enabled key\n");
@@ -1760,7 +1901,7 @@ void setAutoPowerOffTimer(bool initialCall, CFAbsoluteTime  postponeAfter)
         return;
     }
 
-    if ( (GetPMSettingNumber(CFSTR(kIOPMAutoPowerOffDelayKey), &apo_delay) != kIOReturnSuccess) ) {
+    if ( (GetPMSettingNumberForID(kPMSettingAutoPowerOffDelay, &apo_delay) != kIOReturnSuccess) ) {
         if (gDebugFlags & kIOPMDebugLogCallbacks)
            asl_log(0,0,ASL_LEVEL_ERR, "Failed to get APO delay timer \n");
         ts_apo = 0;
@@ -2792,6 +2933,43 @@ bool isEmergencySleep(void)
 #pragma mark -
 #pragma mark Responses
 
+/* updateConnectionEligibility
+ * Must be called whenever interestsBits, notifyEnable or notifyPort change
+ * on a connection.
+ */
+static void updateConnectionEligibility(PMConnection *connection)
+{
+    IOPMCapabilityBits  newBits = 0;
+    IOPMCapabilityBits  changed;
+    unsigned int        bit;
+
+    if (connection->notifyEnable && (MACH_PORT_NULL != connection->notifyPort)) {
+        newBits = connection->interestsBits;
+    }
+
+    changed = newBits ^ connection->eligibleBits;
+    if (!changed) {
+        return;
+    }
+
+    for (bit = 0; bit < kEligibleInterestBitCount; bit++) {
+        IOPMCapabilityBits mask = (IOPMCapabilityBits)1 << bit;
+
+        if (!(changed & mask)) {
+            continue;
+        }
+        if (newBits & mask) {
+            if (gEligibleInterestCounts[bit]++ == 0) {
+                gEligibleInterestBits |= mask;
+            }
+        } else if (gEligibleInterestCounts[bit] && (--gEligibleInterestCounts[bit] == 0)) {
+            gEligibleInterestBits &= ~mask;
+        }
+    }
+    connection->eligibleBits = newBits;
+}
+
+
 static PMResponseWrangler *connectionFireNotification(
     int interestBitsNotify,
     long kernelAcknowledgementID)
@@ -2843,6 +3021,13 @@ static PMResponseWrangler *connectionFireNotification(
 
     gCurrentCapabilityBits = interestBitsNotify;
 
+    if (!(affectedBits & gEligibleInterestBits)) {
+        // Nobody can be notified of this change. Return NULL so the caller
+        // acknowledges the kernel right away.
+        DEBUG_LOG("connectionFireNotification: no eligible clients for 0x%x\n", affectedBits);
+        goto exit;
+    }
+
     interested = createArrayOfConnectionsWithInterest(affectedBits);
     if (!interested) {
         goto exit;
@@ -3061,6 +3246,9 @@ static void cleanClientResponses(PMResponseWrangler *responseWrangler, bool time
         one_response->timedout = timeout;
         one_response->repliedWhen = CFAbsoluteTimeGetCurrent();
         
+        if (timeout) {
+            recordResponseLatency(one_response);
+        }
         cacheResponseStats(one_response);
 
         if (isA_CFString(one_response->connection->callerName) &&
@@ -3399,7 +3587,7 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
     // Disable all dark wake requests if system is going to standby and kIOPMDestroyFVKeyOnStandbyKey
     // is set. This is done by resetting earliestWake to kCFAbsoluteTimeIntervalSince1904
 #if !(TARGET_OS_OSX && TARGET_CPU_ARM64)
-    bool destroyFVKey = GetSystemPowerSettingBool(CFSTR(kIOPMDestroyFVKeyOnStandbyKey));
+    bool destroyFVKey = GetSystemPowerSettingBoolForID(kPMSystemSettingDestroyFVKeyOnStandby);
     if (getDeltaToStandby() == 0 && destroyFVKey) {
         INFO_LOG("Entering standby and kIOPMDestroyFVKeyOnStandbyKey is set. Disabling dark wakes");
         disableWakeReq = true;
@@ -3522,7 +3710,7 @@ static bool checkResponses_ScheduleWakeEvents(PMResponseWrangler *wrangler)
         char chosenStr[5];
         snprintf(chosenStr, sizeof(chosenStr), "%d", chosenReq);
         asl_set(m, kPMASLWakeReqChosenIdx, chosenStr);
-        asl_send(NULL, m);
+        pmLogSend(m);
     }
 
     if (earliestWake != kCFAbsoluteTimeIntervalSince1904) {
@@ -3730,8 +3918,8 @@ static CFArrayRef createArrayOfConnectionsWithInterest(
     {
         lookee = (PMConnection *)CFArrayGetValueAtIndex(gConnections, i);
 
-        // Matching interest in this connection
-        if (interestBits & lookee->interestsBits) {
+        // Matching interest in a connection that can be notified
+        if (interestBits & lookee->eligibleBits) {
             CFArrayAppendValue(arrayFoundInterests, lookee);
         }
     }
@@ -44,6 +44,29 @@ enum {
     kPMPreventWakeOnLan             = (1<<5)
 };
 
+/* Energy Saver settings cached by PMSettings for fast lookup.
+ * Read with GetPMSettingBoolForID() / GetPMSettingNumberForID().
+ * Add an entry here and in gPMSettingKeys[] to cache another setting.
+ */
+typedef enum {
+    kPMSettingDarkWakeBackgroundTask = 0,
+    kPMSettingAutoPowerOffEnabled,
+    kPMSettingAutoPowerOffDelay,
+    kPMSettingDeepSleepDelayHigh,
+    kPMSettingTCPKeepAlivePref,
+    kPMSettingWakeOnLAN,
+    kPMSettingCount
+} PMSettingID;
+
+/* System power settings cached by PMSettings.
+ * Read with GetSystemPowerSettingBoolForID().
+ */
+typedef enum {
+    kPMSystemSettingDestroyFVKeyOnStandby = 0,
+    kPMSystemSettingSleepDisabled,
+    kPMSystemSettingCount
+} PMSystemSettingID;
+
 __private_extern__ void PMSettings_prime(void);
  
 __private_extern__ void PMSettingsCapabilityChangeNotification(const struct IOPMSystemCapabilityChangeParameters * p);
@@ -60,6 +83,12 @@ __private_extern__ bool GetPMSettingBool(CFStringRef);
 
 __private_extern__ IOReturn GetPMSettingNumber(CFStringRef which, int64_t *value);
 
+__private_extern__ bool GetSystemPowerSettingBoolForID(PMSystemSettingID which);
+
+__private_extern__ bool GetPMSettingBoolForID(PMSettingID which);
+
+__private_extern__ IOReturn GetPMSettingNumberForID(PMSettingID which, int64_t *value);
+
 // For UPS shutdown/restart code in PSLowPower.c
 __private_extern__ CFDictionaryRef  PMSettings_CopyActivePMSettings(void);
 
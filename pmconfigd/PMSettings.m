@@ -140,17 +140,222 @@ __private_extern__ void overrideSetting
     }
 }
 
+/* Settings cache
+ *
+ * GetPMSettingBool/Number are called from assertion handlers and sleep
+ * decision paths. Rather than picking a profile out of energySettings and
+ * unboxing a CFNumber on each call, the settings listed in gPMSettingKeys are
+ * compiled into flat per-source tables whenever the prefs or the power source
+ * change. The new table is built off to the side and swapped in with a single
+ * pointer store, so a reader never sees a half-refreshed table.
+ */
+enum {
+    kPMSettingsProfileAC = 0,
+    kPMSettingsProfileBattery,
+    kPMSettingsProfileCount
+};
+
+typedef struct {
+    int64_t             value[kPMSettingCount];
+    bool                present[kPMSettingCount];
+} PMSettingsProfileCache;
+
+typedef struct {
+    PMSettingsProfileCache  profile[kPMSettingsProfileCount];
+    bool                    system[kPMSystemSettingCount];
+} PMSettingsCache;
+
+static const char *gPMSettingKeys[kPMSettingCount] = {
+    [kPMSettingDarkWakeBackgroundTask]  = kIOPMDarkWakeBackgroundTaskKey,
+    [kPMSettingAutoPowerOffEnabled]     = kIOPMAutoPowerOffEnabledKey,
+    [kPMSettingAutoPowerOffDelay]       = kIOPMAutoPowerOffDelayKey,
+    [kPMSettingDeepSleepDelayHigh]      = kIOPMDeepSleepDelayHighKey,
+    [kPMSettingTCPKeepAlivePref]        = kIOPMTCPKeepAlivePrefKey,
+    [kPMSettingWakeOnLAN]               = kIOPMWakeOnLANKey,
+};
+
+static CFStringRef gPMSettingKeyStrings[kPMSettingCount];
+static CFDictionaryRef gPMSettingIDs = NULL;   // CFString key -> (PMSettingID + 1)
+static CFStringRef gPMSystemSettingKeys[kPMSystemSettingCount];
+
+static PMSettingsCache                  gSettingsCacheBuffers[2];
+static PMSettingsCache * volatile       gSettingsCache = &gSettingsCacheBuffers[0];
+
+static void initSettingKeys(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        CFMutableDictionaryRef  ids;
+        int                     i;
+
+        ids = CFDictionaryCreateMutable(0, kPMSettingCount, &kCFTypeDictionaryKeyCallBacks, NULL);
+        for (i = 0; i < kPMSettingCount; i++) {
+            gPMSettingKeyStrings[i] = CFStringCreateWithCString(0, gPMSettingKeys[i], kCFStringEncodingUTF8);
+            if (ids && gPMSettingKeyStrings[i]) {
+                CFDictionarySetValue(ids, gPMSettingKeyStrings[i], (const void *)(uintptr_t)(i + 1));
+            }
+        }
+        gPMSettingIDs = ids;
+
+        gPMSystemSettingKeys[kPMSystemSettingDestroyFVKeyOnStandby] = CFSTR(kIOPMDestroyFVKeyOnStandbyKey);
+        gPMSystemSettingKeys[kPMSystemSettingSleepDisabled] = kIOPMSleepDisabledKey;
+    });
+}
+
+static PMSettingsCache *inactiveSettingsCache(void)
+{
+    return (gSettingsCache == &gSettingsCacheBuffers[0]) ?
+                &gSettingsCacheBuffers[1] : &gSettingsCacheBuffers[0];
+}
+
+static void compileProfile(CFDictionaryRef profile, PMSettingsProfileCache *out)
+{
+    CFStringRef     key;
+    CFTypeRef       obj;
+    int             i;
+
+    bzero(out, sizeof(*out));
+    if (!isA_CFDictionary(profile)) {
+        return;
+    }
+
+    initSettingKeys();
+    for (i = 0; i < kPMSettingCount; i++) {
+        key = gPMSettingKeyStrings[i];
+        if (!key) {
+            continue;
+        }
+        obj = CFDictionaryGetValue(profile, key);
+
+        if (isA_CFNumber(obj)) {
+            CFNumberGetValue(obj, kCFNumberSInt64Type, &out->value[i]);
+            out->present[i] = true;
+        }
+        else if (isA_CFBoolean(obj)) {
+            out->value[i] = CFBooleanGetValue(obj) ? 1 : 0;
+            out->present[i] = true;
+        }
+    }
+}
+
+/* refreshSettingsCache
+ *
+ * Recompiles the AC and battery profiles from energySettings. Must be called
+ * whenever energySettings is replaced.
+ */
+static void refreshSettingsCache(void)
+{
+    PMSettingsCache *next = inactiveSettingsCache();
+
+    memcpy(next->system, gSettingsCache->system, sizeof(next->system));
+    if (isA_CFDictionary(energySettings)) {
+        compileProfile(CFDictionaryGetValue(energySettings, CFSTR(kIOPMACPowerKey)),
+                       &next->profile[kPMSettingsProfileAC]);
+        compileProfile(CFDictionaryGetValue(energySettings, CFSTR(kIOPMBatteryPowerKey)),
+                       &next->profile[kPMSettingsProfileBattery]);
+    } else {
+        bzero(next->profile, sizeof(next->profile));
+    }
+
+    gSettingsCache = next;
+}
+
+/* refreshSystemSettingsCache
+ *
+ * Recompiles the cached system power settings from the dictionary returned
+ * by IOPMCopySystemPowerSettings(). NULL clears them.
+ */
+static void refreshSystemSettingsCache(CFDictionaryRef systemSettings)
+{
+    PMSettingsCache *next = inactiveSettingsCache();
+    int             i;
+
+    initSettingKeys();
+    memcpy(next->profile, gSettingsCache->profile, sizeof(next->profile));
+    for (i = 0; i < kPMSystemSettingCount; i++) {
+        next->system[i] = (systemSettings &&
+            (kCFBooleanTrue == CFDictionaryGetValue(systemSettings, gPMSystemSettingKeys[i])));
+    }
+
+    gSettingsCache = next;
+}
+
+static inline const PMSettingsProfileCache *currentProfileCache(void)
+{
+    // Don't use 'currentPowerSource' here as that gets updated
+    // little slowly after this function is called to get a setting
+    // on new power source.
+    return &gSettingsCache->profile[(_getPowerSource() == kBatteryPowered) ?
+                                        kPMSettingsProfileBattery : kPMSettingsProfileAC];
+}
+
+static int lookupSettingID(CFStringRef which)
+{
+    const void  *value = NULL;
+
+    initSettingKeys();
+    if (!gPMSettingIDs || !CFDictionaryGetValueIfPresent(gPMSettingIDs, which, &value)) {
+        return -1;
+    }
+    return (int)((uintptr_t)value - 1);
+}
+
+__private_extern__ bool GetSystemPowerSettingBoolForID(PMSystemSettingID which)
+{
+    if (which >= kPMSystemSettingCount)
+        return false;
+
+    return gSettingsCache->system[which];
+}
+
+__private_extern__ bool GetPMSettingBoolForID(PMSettingID which)
+{
+    const PMSettingsProfileCache *profile;
+
+    if (!energySettings || (which >= kPMSettingCount))
+        return false;
+
+    profile = currentProfileCache();
+    return (profile->present[which] && (0 != (int)profile->value[which]));
+}
+
+__private_extern__ IOReturn GetPMSettingNumberForID(PMSettingID which, int64_t *value)
+{
+    const PMSettingsProfileCache *profile;
+
+    if (!energySettings || !value || (which >= kPMSettingCount))
+        return kIOReturnBadArgument;
+
+    profile = currentProfileCache();
+    if (!profile->present[which])
+        return kIOReturnError;
+
+    *value = profile->value[which];
+    return kIOReturnSuccess;
+}
+
 __private_extern__ bool GetSystemPowerSettingBool(CFStringRef which)
 {
     CFDictionaryRef system_power_settings = NULL;
     CFBooleanRef value = kCFBooleanFalse;
-    system_power_settings = IOPMCopySystemPowerSettings();
-    if (!system_power_settings || !which)
+    int i;
+
+    if (!which)
         return false;
-    if (system_power_settings) {
-        value = CFDictionaryGetValue(system_power_settings, which);
-        CFRelease(system_power_settings);
+
+    initSettingKeys();
+    for (i = 0; i < kPMSystemSettingCount; i++) {
+        if (CFEqual(which, gPMSystemSettingKeys[i]))
+            return GetSystemPowerSettingBoolForID(i);
     }
+
+    // Not cached; go to the preferences store
+    system_power_settings = IOPMCopySystemPowerSettings();
+    if (!system_power_settings)
+        return false;
+    value = CFDictionaryGetValue(system_power_settings, which);
+    CFRelease(system_power_settings);
+
     return (value == kCFBooleanTrue) ? true : false;
 }
 
@@ -161,18 +366,19 @@ GetPMSettingBool(CFStringRef which)
     CFNumberRef         n;
     int                 nint = 0;
     CFStringRef         pwrSrc;
+    int                 settingID;
     
     if (!energySettings || !which) 
         return false;
 
-    
+    settingID = lookupSettingID(which);
+    if (settingID >= 0)
+        return GetPMSettingBoolForID(settingID);
+
     if (_getPowerSource() == kBatteryPowered)
        pwrSrc = CFSTR(kIOPMBatteryPowerKey);
     else
        pwrSrc = CFSTR(kIOPMACPowerKey);
-    // Don't use 'currentPowerSource' here as that gets updated
-    // little slowly after this function is called to get a setting
-    // on new power source.
     current_settings = (CFDictionaryRef)isA_CFDictionary(
                          CFDictionaryGetValue(energySettings, pwrSrc));
 
@@ -194,17 +400,19 @@ GetPMSettingNumber(CFStringRef which, int64_t *value)
     CFDictionaryRef     current_settings; 
     CFNumberRef         n;
     CFStringRef         pwrSrc;
+    int                 settingID;
     
     if (!energySettings || !which) 
         return kIOReturnBadArgument;
 
+    settingID = lookupSettingID(which);
+    if (settingID >= 0)
+        return GetPMSettingNumberForID(settingID, value);
+
     if (_getPowerSource() == kBatteryPowered)
        pwrSrc = CFSTR(kIOPMBatteryPowerKey);
     else
        pwrSrc = CFSTR(kIOPMACPowerKey);
-    // Don't use 'currentPowerSource' here as that gets updated
-    // little slowly after this function is called to get a setting
-    // on new power source.
     current_settings = (CFDictionaryRef)isA_CFDictionary(
                          CFDictionaryGetValue(energySettings, pwrSrc));
 
@@ -402,25 +610,14 @@ PMSettings_CopyActivePMSettings(void)
 /* _DWBT_enabled() returns true if the system supports DWBT and if user has opted in */
 __private_extern__ bool _DWBT_enabled(void)
 {
-   CFDictionaryRef     current_settings; 
-   CFNumberRef         n;
-   int                 nint = 0;
-
+   const PMSettingsProfileCache *ac;
 
    if (!energySettings) 
        return false;
 
-    current_settings = (CFDictionaryRef)isA_CFDictionary(
-                         CFDictionaryGetValue(energySettings, CFSTR(kIOPMACPowerKey)));
-    if (current_settings) {
-        n = CFDictionaryGetValue(current_settings, CFSTR(kIOPMDarkWakeBackgroundTaskKey));
-        if (n) {
-            CFNumberGetValue(n, kCFNumberIntType, &nint);
-        }
-        return (0 != nint);
-    }
-
-    return false;
+   ac = &gSettingsCache->profile[kPMSettingsProfileAC];
+   return (ac->present[kPMSettingDarkWakeBackgroundTask] &&
+           (0 != (int)ac->value[kPMSettingDarkWakeBackgroundTask]));
 }
 
 #ifdef XCTEST
@@ -448,6 +645,7 @@ void xctSetEnergySettings(CFDictionaryRef settings) {
         CFRelease(energySettings);
     }
     energySettings = CFRetain(settings);
+    refreshSettingsCache();
 }
 
 #else
@@ -455,7 +653,7 @@ void xctSetEnergySettings(CFDictionaryRef settings) {
 __private_extern__ bool
 _DWBT_allowed(void)
 {
-    return ( (GetPMSettingBool(CFSTR(kIOPMDarkWakeBackgroundTaskKey))) &&
+    return ( (GetPMSettingBoolForID(kPMSettingDarkWakeBackgroundTask)) &&
              (kACPowered == _getPowerSource()) );
 
 }
@@ -466,7 +664,7 @@ __private_extern__ bool _SS_allowed(void)
     if (_DWBT_allowed())
         return true;
 
-    return ( (GetPMSettingBool(CFSTR(kIOPMDarkWakeBackgroundTaskKey))) &&
+    return ( (GetPMSettingBoolForID(kPMSettingDarkWakeBackgroundTask)) &&
              (kBatteryPowered == _getPowerSource()) );
 
 }
@@ -1127,8 +1325,7 @@ activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
         ret = ActivatePMSettings(energy_settings, removeUnsupported);
     }
         
-    activePMPrefs = SCDynamicStoreCopyValue(_getSharedPMDynamicStore(), 
-                                            CFSTR(kIOPMDynamicStoreSettingsKey));
+    activePMPrefs = PMStoreCopyValue(CFSTR(kIOPMDynamicStoreSettingsKey));
     
     // If there isn't currently a value for kIOPMDynamicStoreSettingsKey,
     //   or the current value is different than the new value,
@@ -1137,6 +1334,9 @@ activate_profiles(CFDictionaryRef d, CFStringRef s, bool removeUnsupported)
     if( !isA_CFDictionary(activePMPrefs) || !CFEqual(activePMPrefs, energy_settings) )
     {
         PMStoreSetValue(CFSTR(kIOPMDynamicStoreSettingsKey), energy_settings);
+        // 'pmset force' and prefs-change clients read the live settings back
+        // as soon as their request returns
+        PMStoreFlush();
     }
 
     if (activePMPrefs)
@@ -1175,6 +1375,7 @@ __private_extern__ void PMSettings_prime(void)
 
     // load the initial configuration from the database
     energySettings = IOPMCopyActivePMPreferences();
+    refreshSettingsCache();
 
     // send the initial configuration to the kernel
     if(energySettings) {
@@ -1334,6 +1535,7 @@ static IOReturn PMActivateSystemPowerSettings( void )
     bool                        disable_sleep = false;
 
     settings = IOPMCopySystemPowerSettings();
+    refreshSystemSettingsCache(settings);
     if(!settings) {
         goto exit;
     }
@@ -1385,17 +1587,20 @@ PMSettingsPrefsHaveChanged(void)
     if(energySettings) CFRelease(energySettings);
 
     energySettings = IOPMCopyPMPreferences();
+    if(!isA_CFDictionary(energySettings)) {
+        if (energySettings) {
+            CFRelease(energySettings);
+        }
+        energySettings = NULL;
+    }
+    // activate_profiles() reads through the cache, so it must see the new prefs
+    refreshSettingsCache();
 
     // push new preferences out to the kernel
-    if(isA_CFDictionary(energySettings)) {
+    if(energySettings) {
         activate_profiles(energySettings, 
                             currentPowerSource,
                             kIOPMRemoveUnsupportedSettings);
-    } else {
-        if (energySettings) {
-            CFRelease(energySettings);
-        }
-        energySettings = NULL;
     }
     PMAssertions_SettingsHaveChanged();
     
@@ -1441,6 +1646,7 @@ static void PMSettingsPSChange_sync(void)
             // re read settings in memory
             CFRelease(energySettings);
             energySettings = IOPMCopyPMPreferences();
+            refreshSettingsCache();
             INFO_LOG("Settings change for power source change to %@ %{public}@", newPowerSource, energySettings);
             activate_profiles( energySettings, 
                                 currentPowerSource,
@@ -11,6 +11,8 @@
 #include <SystemConfiguration/SCValidation.h>
 #include <SystemConfiguration/SCDynamicStorePrivate.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <os/lock.h>
+#include <os/state_private.h>
 #include "PMStore.h"
 #include "PrivateLib.h"
 
@@ -20,10 +22,27 @@ typedef (void *)PMStoreKeysChangedCallBack(void *param, CFArrayRef keys);
 __private_extern__ void PMStoreRequestCallBack(void *param, (PMStoreKeysChangedCallBack *)callback, CFArrayRef keys);
 */
 
+/* gPMStore holds the last value set for every key we own, including writes
+ * that have not been flushed to configd yet.
+ *
+ * Sets and removes are write-combined: they are accumulated in gPendingSets
+ * and gPendingRemoves and pushed to configd with one SCDynamicStoreSetMultiple
+ * at the end of the current main queue turn. Writes that are CFEqual to the
+ * last value are dropped without an IPC.
+ *
+ * PMStoreSetValue() may be called off the main queue (e.g. from the battery
+ * queue); gPMStoreLock protects all of the state below.
+ */
 static CFMutableDictionaryRef   gPMStore = NULL;
+static CFMutableDictionaryRef   gPendingSets = NULL;
+static CFMutableSetRef          gPendingRemoves = NULL;
+static bool                     gFlushScheduled = false;
+static os_unfair_lock           gPMStoreLock = OS_UNFAIR_LOCK_INIT;
+static PMStoreStatistics        gPMStoreStats;
 SCDynamicStoreRef               gSCDynamicStore = NULL;
 
 static void PMDynamicStoreDisconnectCallBack(SCDynamicStoreRef store, void *info __unused);
+static void scheduleFlush_locked(void);
 
 /* dynamicStoreNotifyCallBack
  * defined in pmconfigd.c
@@ -37,6 +56,8 @@ __private_extern__ void dynamicStoreNotifyCallBack(
 void PMStoreLoad(void)
 {
     gPMStore = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingSets = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingRemoves = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
 
     gSCDynamicStore = SCDynamicStoreCreate(0, CFSTR("powerd"), dynamicStoreNotifyCallBack, NULL);
 
@@ -45,12 +66,50 @@ void PMStoreLoad(void)
     }
 
     SCDynamicStoreSetDisconnectCallBack(gSCDynamicStore, PMDynamicStoreDisconnectCallBack);
+
+    os_state_add_handler(_getPMMainQueue(), ^os_state_data_t(os_state_hints_t hints) {
+        PMStoreStatistics stats;
+
+        PMStoreGetStatistics(&stats);
+        INFO_LOG("PMStore: requested:%llu unchanged:%llu coalesced:%llu flushes:%llu ipcsSaved:%llu\n",
+                 stats.requested, stats.unchanged, stats.coalesced, stats.flushes,
+                 (stats.requested > stats.flushes) ? (stats.requested - stats.flushes) : 0);
+        return NULL;
+    });
 }
 
-bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
+/* Returns true if 'value' matches the last value set for 'key' */
+static bool isUnchanged_locked(CFStringRef key, CFTypeRef value)
+{
+    CFTypeRef lastValue = CFDictionaryGetValue(gPMStore, key);
+
+    if (!lastValue || !CFEqual(lastValue, value)) {
+        return false;
+    }
+    // A pending remove of this key still has to go out
+    return !CFSetContainsValue(gPendingRemoves, key);
+}
+
+static void setValue_locked(CFStringRef key, CFTypeRef value)
 {
-    CFTypeRef lastValue = NULL;
+    gPMStoreStats.requested++;
+
+    if (isUnchanged_locked(key, value)) {
+        gPMStoreStats.unchanged++;
+        return;
+    }
+
+    if (CFDictionaryContainsKey(gPendingSets, key) || CFSetContainsValue(gPendingRemoves, key)) {
+        gPMStoreStats.coalesced++;
+    }
+    CFSetRemoveValue(gPendingRemoves, key);
+    CFDictionarySetValue(gPendingSets, key, value);
+    CFDictionarySetValue(gPMStore, key, value);
+    scheduleFlush_locked();
+}
 
+bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
+{
     if (!key || !value || !gPMStore)
         return false;
 
@@ -58,31 +117,189 @@ bool PMStoreSetValue(CFStringRef key, CFTypeRef value)
         return false;
     }
 
-    lastValue = CFDictionaryGetValue(gPMStore, key);
+    os_unfair_lock_lock(&gPMStoreLock);
+    setValue_locked(key, value);
+    os_unfair_lock_unlock(&gPMStoreLock);
+
+    return true;
+}
+
+/* PMStoreSetValues
+ * Sets every key/value pair in 'keysToSet'. Like PMStoreSetValue(), the
+ * writes go out with the next flush.
+ */
+bool PMStoreSetValues(CFDictionaryRef keysToSet)
+{
+    CFIndex                 count, i;
+    const void              **keys = NULL;
+    const void              **values = NULL;
+
+    if (!isA_CFDictionary(keysToSet) || !gPMStore)
+        return false;
 
-    if (lastValue && CFEqual(lastValue, value)) {
+    count = CFDictionaryGetCount(keysToSet);
+    if (count == 0)
         return true;
+
+    keys = (const void **)malloc(sizeof(void *) * count * 2);
+    if (!keys)
+        return false;
+    values = keys + count;
+    CFDictionaryGetKeysAndValues(keysToSet, keys, values);
+
+    os_unfair_lock_lock(&gPMStoreLock);
+    for (i = 0; i < count; i++) {
+        if (!isA_CFString(keys[i]) || !values[i]) {
+            continue;
+        }
+        setValue_locked(keys[i], values[i]);
     }
+    os_unfair_lock_unlock(&gPMStoreLock);
 
-    CFDictionarySetValue(gPMStore, key, value);
-    return SCDynamicStoreSetValue(gSCDynamicStore, key, value);
+    free(keys);
+    return true;
 }
 
 bool PMStoreRemoveValue(CFStringRef key)
 {
-    if (!key || !isA_CFString(key)) {
+    if (!key || !isA_CFString(key) || !gPMStore) {
         return false;
     }
 
+    os_unfair_lock_lock(&gPMStoreLock);
+    gPMStoreStats.requested++;
+    if (CFDictionaryContainsKey(gPendingSets, key) || CFSetContainsValue(gPendingRemoves, key)) {
+        gPMStoreStats.coalesced++;
+    }
+    CFDictionaryRemoveValue(gPendingSets, key);
     CFDictionaryRemoveValue(gPMStore, key);
-    return SCDynamicStoreRemoveValue(gSCDynamicStore, key);
+    CFSetAddValue(gPendingRemoves, key);
+    scheduleFlush_locked();
+    os_unfair_lock_unlock(&gPMStoreLock);
+
+    return true;
+}
+
+/* PMStoreCopyValue
+ * Returns the last value set for one of our keys, including values that
+ * haven't been flushed to configd yet. Use this rather than
+ * SCDynamicStoreCopyValue() to read back keys powerd publishes.
+ */
+CFTypeRef PMStoreCopyValue(CFStringRef key)
+{
+    CFTypeRef value = NULL;
+
+    if (!key || !isA_CFString(key) || !gPMStore) {
+        return NULL;
+    }
+
+    os_unfair_lock_lock(&gPMStoreLock);
+    value = CFDictionaryGetValue(gPMStore, key);
+    if (value) {
+        CFRetain(value);
+    }
+    os_unfair_lock_unlock(&gPMStoreLock);
+
+    return value;
+}
+
+/* PMStoreFlush
+ * Pushes all pending sets and removes to configd with a single IPC.
+ * Publishers that post a notification for a key right after setting it
+ * call this first, so that readers woken by the notification see the new
+ * value.
+ */
+bool PMStoreFlush(void)
+{
+    CFDictionaryRef     sets = NULL;
+    CFArrayRef          removes = NULL;
+    CFIndex             count;
+    const void          **keys = NULL;
+    bool                ret = true;
+
+    if (!gPMStore) {
+        return false;
+    }
+
+    os_unfair_lock_lock(&gPMStoreLock);
+    if (CFDictionaryGetCount(gPendingSets)) {
+        sets = CFDictionaryCreateCopy(0, gPendingSets);
+        CFDictionaryRemoveAllValues(gPendingSets);
+    }
+    count = CFSetGetCount(gPendingRemoves);
+    if (count) {
+        keys = (const void **)malloc(sizeof(void *) * count);
+        if (keys) {
+            CFSetGetValues(gPendingRemoves, keys);
+            removes = CFArrayCreate(0, keys, count, &kCFTypeArrayCallBacks);
+            free(keys);
+        }
+        CFSetRemoveAllValues(gPendingRemoves);
+    }
+    if (sets || removes) {
+        gPMStoreStats.flushes++;
+    }
+    os_unfair_lock_unlock(&gPMStoreLock);
+
+    if (sets || removes) {
+        ret = SCDynamicStoreSetMultiple(gSCDynamicStore, sets, removes, NULL);
+        if (!ret) {
+            ERROR_LOG("PMStore flush failed: %s\n", SCErrorString(SCError()));
+        }
+    }
+
+    if (sets)
+        CFRelease(sets);
+    if (removes)
+        CFRelease(removes);
+
+    return ret;
+}
+
+void PMStoreGetStatistics(PMStoreStatistics *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    os_unfair_lock_lock(&gPMStoreLock);
+    *stats = gPMStoreStats;
+    os_unfair_lock_unlock(&gPMStoreLock);
+}
+
+static void scheduleFlush_locked(void)
+{
+    if (gFlushScheduled) {
+        return;
+    }
+    gFlushScheduled = true;
+
+    dispatch_async(_getPMMainQueue(), ^{
+        os_unfair_lock_lock(&gPMStoreLock);
+        gFlushScheduled = false;
+        os_unfair_lock_unlock(&gPMStoreLock);
+
+        PMStoreFlush();
+    });
 }
 
 static void PMDynamicStoreDisconnectCallBack(
     SCDynamicStoreRef           store,
     void                        *info __unused)
 {
+    CFDictionaryRef     all = NULL;
+
     assert (store == gSCDynamicStore);
 
-    SCDynamicStoreSetMultiple(gSCDynamicStore, gPMStore, NULL, NULL);
+    // gPMStore already includes everything that's pending
+    os_unfair_lock_lock(&gPMStoreLock);
+    all = CFDictionaryCreateCopy(0, gPMStore);
+    CFDictionaryRemoveAllValues(gPendingSets);
+    CFSetRemoveAllValues(gPendingRemoves);
+    os_unfair_lock_unlock(&gPMStoreLock);
+
+    if (all) {
+        SCDynamicStoreSetMultiple(gSCDynamicStore, all, NULL, NULL);
+        CFRelease(all);
+    }
 }
@@ -7,9 +7,26 @@
  *
  */
 
+/* Write-combining counters. Every set or remove counts as 'requested';
+ * 'flushes' is the number of IPCs actually sent to configd.
+ */
+typedef struct {
+    uint64_t    requested;      // PMStoreSetValue/PMStoreRemoveValue calls
+    uint64_t    unchanged;      // sets dropped because the value was CFEqual
+    uint64_t    coalesced;      // writes that replaced a pending write
+    uint64_t    flushes;        // SCDynamicStoreSetMultiple calls
+} PMStoreStatistics;
+
 __private_extern__ void PMStoreLoad(void);
 
 __private_extern__ bool PMStoreSetValue(CFStringRef key, CFTypeRef value);
 
+__private_extern__ bool PMStoreSetValues(CFDictionaryRef keysToSet);
+
 __private_extern__ bool PMStoreRemoveValue(CFStringRef key);
 
+__private_extern__ CFTypeRef PMStoreCopyValue(CFStringRef key);
+
+__private_extern__ bool PMStoreFlush(void);
+
+__private_extern__ void PMStoreGetStatistics(PMStoreStatistics *stats);
@@ -29,6 +29,7 @@
 #include "PrivateLib.h"
 #include "PMSystemEvents.h"
 #include "PMSettings.h"
+#include "PMStore.h"
 
 #ifndef _PMSystemEvents_h_
 #define _PMSystemEvents_h_
@@ -40,7 +41,6 @@
 
 #define kIOPMRootDomainPowerStatusKey       "Power Status"
 
-#define kMySCIdentity           CFSTR("IOKit Power")
 
 static int              thermalState = kIOPMThermalLevelUnknown;
 static int              perfState    = kIOPMPerformanceNormal;
@@ -98,7 +98,6 @@ PMSystemEventsRootDomainInterest(void)
     CFMutableDictionaryRef  setTheseDSKeys = NULL;
     CFStringRef             *keys = NULL;
     CFNumberRef             *vals = NULL;
-    SCDynamicStoreRef       store = NULL;
     CFIndex                 count = 0;
     CFIndex                 i;
     int                     thermNewState = -1;
@@ -163,11 +162,9 @@ PMSystemEventsRootDomainInterest(void)
         }
     }
 
-    store = SCDynamicStoreCreate(0, kMySCIdentity, NULL, NULL);
-    if (!store)
-        goto exit;
-
-    SCDynamicStoreSetMultiple(store, setTheseDSKeys, NULL, NULL);
+    // Readers wake on the notifications below; make sure the keys are out first
+    PMStoreSetValues(setTheseDSKeys);
+    PMStoreFlush();
 
     for (i=0; i<count; i++)
     {
@@ -226,8 +223,6 @@ exit:
         free(vals);
     if (setTheseDSKeys)
         CFRelease(setTheseDSKeys);
-    if (store)
-        CFRelease(store);
     if (thermalStatus)
         CFRelease(thermalStatus);
     return;
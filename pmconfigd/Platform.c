@@ -154,7 +154,7 @@ tcpKeepAliveStates_et  getTCPKeepAliveState(char *buf, int buflen, bool quiet)
         return kInactive;
     }
 #if !(TARGET_OS_OSX && TARGET_CPU_ARM64)
-    if ((getDeltaToStandby() == 0) && GetSystemPowerSettingBool(CFSTR(kIOPMDestroyFVKeyOnStandbyKey))) {
+    if ((getDeltaToStandby() == 0) && GetSystemPowerSettingBoolForID(kPMSystemSettingDestroyFVKeyOnStandby)) {
         state = kInactive;
         if (!quiet) INFO_LOG("TCPKeepAliveState: inactive due to standby with destroyfvkeyonstandby enabled ");
         if (buf) snprintf(buf, buflen, "inactive");
@@ -184,7 +184,7 @@ static bool userPrefForTcpka(void)
     IOReturn rc;
     int64_t pref = 1;
 
-    rc = GetPMSettingNumber(CFSTR(kIOPMTCPKeepAlivePrefKey), &pref);
+    rc = GetPMSettingNumberForID(kPMSettingTCPKeepAlivePref, &pref);
     if ((rc != kIOReturnSuccess) || (pref == 1)) {
         // Preference defaults to enabled
         DEBUG_LOG("User Prefs for TCPKeepAlive is set to enabled\n");
@@ -292,7 +292,7 @@ __private_extern__ bool getWakeOnLanState(void)
     if ((thermalState == kIOPMThermalLevelWarning) || (thermalState == kIOPMThermalLevelTrap))
         return false;
 
-    if ((GetPMSettingNumber(CFSTR(kIOPMWakeOnLANKey), &value) == kIOReturnSuccess) &&
+    if ((GetPMSettingNumberForID(kPMSettingWakeOnLAN, &value) == kIOReturnSuccess) &&
         (value == 1)) 
         return true;
 
@@ -512,6 +512,7 @@ __private_extern__ void                 logASLSleepPreventers(int preventerType)
 #define kAppResponseLogThresholdMS              250
 
 __private_extern__ aslmsg               new_msg_pmset_log(void);
+__private_extern__ void                 pmLogSend(aslmsg m);
 __private_extern__ bool                 isA_installEnvironment(void);
 
 __private_extern__ void                 _removeBattery(io_registry_entry_t);
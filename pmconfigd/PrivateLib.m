@@ -48,18 +48,22 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <dispatch/dispatch.h>
+#include <os/lock.h>
 #include <notify.h>
 #include <xpc/private.h>
 #include <IOKit/pwr_mgt/powermanagement_mig.h>
 #include <spawn.h>
 #include <spawn_private.h>
 #include <crt_externs.h>
+#include <dirent.h>
+#include <errno.h>
 
 #include "Platform.h"
 #include "PrivateLib.h"
 #include "BatteryTimeRemaining.h"
 #include "PMAssertions.h"
 #include "PMSettings.h"
+#include "SleepWakeJournal.h"
 #include "PMAssertions.h"
 #include "adaptiveDisplay.h"
 
@@ -1054,6 +1058,337 @@ __private_extern__ aslmsg new_msg_pmset_log(void)
     return m;
 }
 
+/*****************************************************************************/
+/* PM event log
+ *
+ * See CommonLib.h for the on-disk format. Messages are flattened on the
+ * caller's queue and written out on gEventLogQ, so logging never blocks on
+ * disk I/O.
+ */
+
+#define kEventLogMaxInternLen       128
+#define kEventLogMaxInterned        4096
+
+static dispatch_queue_t         gEventLogQ = NULL;
+static bool                     gEventLogDisabled = false;
+static int                      gEventLogIdxFd = -1;
+static int                      gEventLogStrFd = -1;
+static uint32_t                 gEventLogRecordCount = 0;
+static uint32_t                 gEventLogStrSize = 0;
+static uint64_t                 gEventLogLastTime = 0;
+static CFMutableDictionaryRef   gEventLogStrings = NULL;
+
+static bool eventLogWrite(int fd, const void *buf, size_t len)
+{
+    const uint8_t   *p = buf;
+    ssize_t         written;
+
+    while (len) {
+        written = write(fd, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += written;
+        len -= written;
+    }
+    return true;
+}
+
+static void eventLogCloseSegment(void)
+{
+    if (gEventLogIdxFd != -1) {
+        close(gEventLogIdxFd);
+        gEventLogIdxFd = -1;
+    }
+    if (gEventLogStrFd != -1) {
+        close(gEventLogStrFd);
+        gEventLogStrFd = -1;
+    }
+    if (gEventLogStrings) {
+        CFRelease(gEventLogStrings);
+        gEventLogStrings = NULL;
+    }
+}
+
+static int compareSegmentSeq(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Returns the next segment sequence number, and deletes the oldest segments
+ * so that at most kPMEventLogMaxSegments remain once it is created.
+ */
+static uint32_t eventLogPruneSegments(void)
+{
+    DIR             *dir;
+    struct dirent   *entry;
+    uint32_t        seqs[256];
+    uint32_t        count = 0;
+    uint32_t        next = 0;
+    char            path[PATH_MAX];
+
+    dir = opendir(kPMEventLogDir);
+    if (!dir) {
+        return 0;
+    }
+    while ((entry = readdir(dir))) {
+        char        *end = NULL;
+        unsigned long seq = strtoul(entry->d_name, &end, 10);
+
+        if (end == entry->d_name || !end || *end != '.' || strcmp(end + 1, kPMEventLogIndexSuffix)) {
+            continue;
+        }
+        if (seq + 1 > next) {
+            next = (uint32_t)seq + 1;
+        }
+        if (count < sizeof(seqs)/sizeof(seqs[0])) {
+            seqs[count++] = (uint32_t)seq;
+        }
+    }
+    closedir(dir);
+
+    qsort(seqs, count, sizeof(seqs[0]), compareSegmentSeq);
+    for (uint32_t i = 0; count - i >= kPMEventLogMaxSegments; i++) {
+        snprintf(path, sizeof(path), "%s/%u.%s", kPMEventLogDir, seqs[i], kPMEventLogIndexSuffix);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/%u.%s", kPMEventLogDir, seqs[i], kPMEventLogStringSuffix);
+        unlink(path);
+    }
+
+    return next;
+}
+
+static bool eventLogOpenSegment(void)
+{
+    PMEventLogSegmentHeader hdr;
+    uint32_t                magic = kPMEventLogMagic;
+    uint32_t                seq;
+    size_t                  len;
+    char                    path[PATH_MAX];
+
+    eventLogCloseSegment();
+
+    if ((mkdir("/var/db/powermanagement", 0755) && errno != EEXIST)
+        || (mkdir(kPMEventLogDir, 0755) && errno != EEXIST)) {
+        ERROR_LOG("Failed to create %s: %d\n", kPMEventLogDir, errno);
+        return false;
+    }
+
+    seq = eventLogPruneSegments();
+
+    snprintf(path, sizeof(path), "%s/%u.%s", kPMEventLogDir, seq, kPMEventLogStringSuffix);
+    gEventLogStrFd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    snprintf(path, sizeof(path), "%s/%u.%s", kPMEventLogDir, seq, kPMEventLogIndexSuffix);
+    gEventLogIdxFd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (gEventLogStrFd == -1 || gEventLogIdxFd == -1) {
+        ERROR_LOG("Failed to create PM event log segment %u: %d\n", seq, errno);
+        eventLogCloseSegment();
+        return false;
+    }
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = kPMEventLogMagic;
+    hdr.version = kPMEventLogVersion;
+    hdr.recordSize = sizeof(PMEventLogRecord);
+    hdr.sequence = seq;
+    hdr.createTime = (uint64_t)time(NULL);
+    len = sizeof(hdr.bootUUID) - 1;
+    sysctlbyname("kern.bootsessionuuid", hdr.bootUUID, &len, NULL, 0);
+
+    // The string file header goes first; the index header makes the segment visible
+    if (!eventLogWrite(gEventLogStrFd, &magic, sizeof(magic))
+        || !eventLogWrite(gEventLogIdxFd, &hdr, sizeof(hdr))) {
+        ERROR_LOG("Failed to initialize PM event log segment %u: %d\n", seq, errno);
+        eventLogCloseSegment();
+        return false;
+    }
+
+    gEventLogStrSize = sizeof(magic);
+    gEventLogRecordCount = 0;
+    gEventLogLastTime = 0;
+    gEventLogStrings = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+
+    return true;
+}
+
+/* Returns the string pool offset of 'str', writing it out if it hasn't been
+ * interned in this segment yet. Returns 0 on failure.
+ */
+static uint32_t eventLogInternString(const char *str)
+{
+    CFStringRef     key = NULL;
+    const void      *offset = NULL;
+    size_t          len = strlen(str) + 1;
+    uint32_t        ret = 0;
+
+    if (len <= kEventLogMaxInternLen) {
+        key = CFStringCreateWithCString(0, str, kCFStringEncodingUTF8);
+        if (key && CFDictionaryGetValueIfPresent(gEventLogStrings, key, &offset)) {
+            CFRelease(key);
+            return (uint32_t)(uintptr_t)offset;
+        }
+    }
+
+    if (eventLogWrite(gEventLogStrFd, str, len)) {
+        ret = gEventLogStrSize;
+        gEventLogStrSize += len;
+        if (key && CFDictionaryGetCount(gEventLogStrings) < kEventLogMaxInterned) {
+            CFDictionarySetValue(gEventLogStrings, key, (const void *)(uintptr_t)ret);
+        }
+    }
+    if (key) {
+        CFRelease(key);
+    }
+    return ret;
+}
+
+/* 'strings' holds 'pairCount' key and value strings, back to back */
+static void eventLogAppendRecord(struct timespec ts, const char *strings, uint32_t pairCount)
+{
+    PMEventLogRecord    rec;
+    uint32_t            pairs[kPMEventLogMaxPairs * 2];
+    uint32_t            pad = 0;
+    const char          *p = strings;
+    const char          *prevKey = NULL;
+
+    if (gEventLogDisabled) {
+        return;
+    }
+    if ((gEventLogIdxFd == -1 || gEventLogRecordCount >= kPMEventLogMaxRecords)
+        && !eventLogOpenSegment()) {
+        gEventLogDisabled = true;
+        return;
+    }
+
+    bzero(&rec, sizeof(rec));
+    for (uint32_t i = 0; i < pairCount * 2; i++) {
+        pairs[i] = eventLogInternString(p);
+        if (!pairs[i]) {
+            goto fail;
+        }
+        if ((i & 1) && !strcmp(prevKey, kPMASLDomainKey)) {
+            rec.domain = pairs[i];
+        }
+        prevKey = p;
+        p += strlen(p) + 1;
+    }
+
+    // Pair arrays are kept 4 byte aligned
+    if (gEventLogStrSize & 3) {
+        uint32_t padLen = 4 - (gEventLogStrSize & 3);
+        if (!eventLogWrite(gEventLogStrFd, &pad, padLen)) {
+            goto fail;
+        }
+        gEventLogStrSize += padLen;
+    }
+    if (!eventLogWrite(gEventLogStrFd, pairs, pairCount * 2 * sizeof(pairs[0]))) {
+        goto fail;
+    }
+
+    rec.time = ts.tv_sec;
+    rec.nsec = (uint32_t)ts.tv_nsec;
+    rec.sortTime = MAX(rec.time, gEventLogLastTime);
+    rec.pairs = gEventLogStrSize;
+    rec.pairCount = pairCount;
+    gEventLogStrSize += pairCount * 2 * sizeof(pairs[0]);
+
+    if (!eventLogWrite(gEventLogIdxFd, &rec, sizeof(rec))) {
+        goto fail;
+    }
+    gEventLogRecordCount++;
+    gEventLogLastTime = rec.sortTime;
+    return;
+
+fail:
+    // Start over in a fresh segment with the next message
+    ERROR_LOG("Failed to append to PM event log: %d\n", errno);
+    eventLogCloseSegment();
+}
+
+static dispatch_queue_t eventLogQueue(void)
+{
+    static dispatch_once_t  onceToken;
+
+    dispatch_once(&onceToken, ^{
+        gEventLogQ = dispatch_queue_create("Power Management event log queue", DISPATCH_QUEUE_SERIAL);
+    });
+    return gEventLogQ;
+}
+
+/* Records @m in the PM event log with timestamp @ts. Pass @onQueue when
+ * already running on the event log queue, so the record is written in order
+ * with the caller's other records.
+ */
+static void eventLogAppendAt(aslmsg m, struct timespec ts, bool onQueue)
+{
+    const char              *key, *val, *facility;
+    char                    *strings = NULL;
+    size_t                  len = 0;
+    uint32_t                pairCount = 0;
+
+    if (!m) {
+        return;
+    }
+    facility = asl_get(m, ASL_KEY_FACILITY);
+    if (!facility || strcmp(facility, kPMFacility)) {
+        return;
+    }
+
+    // Flatten the message. The time keys are reconstructed from the record
+    for (uint32_t i = 0; (key = asl_key(m, i)) && pairCount < kPMEventLogMaxPairs; i++) {
+        if (!strcmp(key, ASL_KEY_TIME) || !strcmp(key, ASL_KEY_TIME_NSEC)
+            || !(val = asl_get(m, key))) {
+            continue;
+        }
+        size_t keyLen = strlen(key) + 1;
+        size_t valLen = strlen(val) + 1;
+        char *grown = realloc(strings, len + keyLen + valLen);
+        if (!grown) {
+            free(strings);
+            return;
+        }
+        strings = grown;
+        memcpy(strings + len, key, keyLen);
+        memcpy(strings + len + keyLen, val, valLen);
+        len += keyLen + valLen;
+        pairCount++;
+    }
+    if (!pairCount) {
+        free(strings);
+        return;
+    }
+
+    if (onQueue) {
+        eventLogAppendRecord(ts, strings, pairCount);
+        free(strings);
+        return;
+    }
+    dispatch_async(eventLogQueue(), ^{
+        eventLogAppendRecord(ts, strings, pairCount);
+        free(strings);
+    });
+}
+
+/* pmLogSend
+ * Records a message created with new_msg_pmset_log() in the PM event log
+ * read by pmset -g log, then sends it to ASL. Use this rather than
+ * asl_send() for every pmset log message.
+ */
+__private_extern__ void pmLogSend(aslmsg m)
+{
+    struct timespec         ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    eventLogAppendAt(m, ts, false);
+    asl_send(NULL, m);
+}
+
 
 __private_extern__ void logASLMessagePMStart(void)
 {
@@ -1067,7 +1402,7 @@ __private_extern__ void logASLMessagePMStart(void)
     }
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMStart);
     asl_set(m, ASL_KEY_MSG, "powerd process is started\n");
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 
     if (isA_installEnvironment()) {
@@ -1088,33 +1423,356 @@ __private_extern__ void logASLMessageSMCShutdownCause(int shutdownCause)
     asl_set(m, kPMASLDomainKey, kPMASLDomainSMCShutdownCause);
     asl_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
     asl_set(m, ASL_KEY_MSG, buf);
+    pmLogSend(m);
+    asl_release(m);
+}
+
+
+/* Returns true, and the keep alive state in @keepAliveString, if the platform
+ * supports TCP keep alive during sleep
+ */
+static bool getTCPKeepAliveLogState(
+                                    char *keepAliveString,
+                                    unsigned int len)
+{
+    CFTypeRef           platformSupport = NULL;
+    bool                supported = false;
+
+    IOPlatformCopyFeatureDefault(kIOPlatformTCPKeepAliveDuringSleep, &platformSupport);
+    if (kCFBooleanTrue == platformSupport)
+    {
+        getTCPKeepAliveState(keepAliveString, len, false);
+        supported = true;
+    }
+
+    if (platformSupport){
+        CFRelease(platformSupport);
+    }
+    return supported;
+}
+
+static void attachTCPKeepAliveKeys(
+                                   aslmsg m,
+                                   char *tcpString,
+                                   unsigned int tcpStringLen)
+
+{
+    char                keepAliveString[100];
+
+    if (getTCPKeepAliveLogState(keepAliveString, sizeof(keepAliveString)))
+    {
+        asl_set(m, kPMASLTCPKeepAlive, "supported");
+        asl_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
+        snprintf(tcpString, tcpStringLen, "TCPKeepAlive=%s", keepAliveString);
+    }
+}
+
+
+/* Sleep/wake journal
+ *
+ * The sleep, wake, hibernate statistics and app wake reason messages are
+ * logged on the main queue in the middle of a transition. Their entry points
+ * only snapshot the state they report into a fixed-size record, which is
+ * queued in gSleepWakeJournal (SleepWakeJournal.h). The records are rendered to ASL and the PM
+ * event log in order on the event log queue, stamped with the time they were
+ * captured. If rendering falls kSleepWakeJournalDepth records behind, the
+ * oldest records are dropped and counted.
+ */
+#define kPMASLDomainAppWakeReason   "AppWakeReason"
+
+static SleepWakeJournal         gSleepWakeJournal;
+static os_unfair_lock           gJournalLock = OS_UNFAIR_LOCK_INIT;
+
+static aslmsg journalNewMsg(const SleepWakeJournalRecord *rec)
+{
+    aslmsg  m = new_msg_pmset_log();
+    char    buf[32];
+
+    snprintf(buf, sizeof(buf), "%ld", (long)rec->time.tv_sec);
+    asl_set(m, ASL_KEY_TIME, buf);
+    snprintf(buf, sizeof(buf), "%ld", (long)rec->time.tv_nsec);
+    asl_set(m, ASL_KEY_TIME_NSEC, buf);
+
+    return m;
+}
+
+static void journalSend(const SleepWakeJournalRecord *rec, aslmsg m)
+{
+    eventLogAppendAt(m, rec->time, true);
     asl_send(NULL, m);
     asl_release(m);
 }
 
+static void journalRenderSleep(const SleepWakeJournalRecord *rec)
+{
+    aslmsg  m = journalNewMsg(rec);
+    char    messageString[200];
+    char    numbuf[15];
+
+    numbuf[0] = 0;
+
+    if (rec->u.sleep.success) {
+        snprintf(messageString, sizeof(messageString), "%s",
+                 (rec->u.sleep.sleepType == kIsS0Sleep) ? "Entering Sleep state" : "Entering DarkWake state");
+        if (rec->u.sleep.reason[0]) {
+            strlcat(messageString, " due to ", sizeof(messageString));
+            strlcat(messageString, rec->u.sleep.reason, sizeof(messageString));
+        }
+
+        asl_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
+
+        snprintf(numbuf, 10, "%d", rec->u.sleep.battPct);
+        asl_set(m, kPMASLBatteryPercentageKey, numbuf);
+
+        asl_set(m, kPMASLPowerSourceKey, rec->u.sleep.onAC ? "AC" : "Batt");
+
+        strlcat(messageString, ":", sizeof(messageString));
+        if (rec->u.sleep.tcpKeepAliveSupported) {
+            asl_set(m, kPMASLTCPKeepAlive, "supported");
+            asl_set(m, kPMASLTCPKeepAliveExpired, rec->u.sleep.tcpKeepAlive);
+            strlcat(messageString, "TCPKeepAlive=", sizeof(messageString));
+            strlcat(messageString, rec->u.sleep.tcpKeepAlive, sizeof(messageString));
+        }
+    } else {
+        snprintf(messageString, sizeof(messageString), "Failure during sleep: %s : %s",
+                 rec->u.sleep.failure, rec->sig);
+        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+    }
+    INFO_LOG("%{public}s", messageString);
+
+    if (rec->uuid[0]) {
+        asl_set(m, kPMASLUUIDKey, rec->uuid);
+    }
+    asl_set(m, kPMASLSignatureKey, rec->sig);
+    asl_set(m, ASL_KEY_MSG, messageString);
+    journalSend(rec, m);
+
+    if (isA_installEnvironment()) {
+        syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
+                messageString, numbuf, rec->u.sleep.onAC ? "AC" : "Batt");
+    }
+}
+
+static void journalRenderWake(const SleepWakeJournalRecord *rec)
+{
+    aslmsg                  m = journalNewMsg(rec);
+    char                    buf[200];
+    char                    msg[300];
+    char                    numbuf[15];
+    char                    battCap[15];
+    char                    cBuf[50];
+    char                    claimed[255];
+    char                    key[255];
+    const char              *detailString = NULL;
+
+    battCap[0] = claimed[0] = 0;
+
+    asl_set(m, kPMASLSignatureKey, rec->sig);
+    if (rec->uuid[0]) {
+        asl_set(m, kPMASLUUIDKey, rec->uuid);
+    }
+
+    if (!rec->u.wake.success) {
+        snprintf(buf, sizeof(buf), "Failure during wake: %s : %s", rec->u.wake.failure, rec->sig);
+        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
+    }
+    else {
+        detailString = rec->u.wake.detail;
+
+        snprintf(battCap, 10, "%d", rec->u.wake.battPct);
+        asl_set(m, kPMASLBatteryPercentageKey, battCap);
+        asl_set(m, kPMASLPowerSourceKey, rec->u.wake.onAC ? "AC" : "BATT");
+
+        /* populate driver wake reasons */
+        for (uint32_t i = 0; i < rec->u.wake.claimCount; i++) {
+            snprintf(claimed, sizeof(claimed), "DriverReason:%s - DriverDetails:%s",
+                     rec->u.wake.claimReason[i], rec->u.wake.claimDetails[i]);
+            snprintf(key, sizeof(key), "%s-%d", kPMASLClaimedEventKey, i);
+            asl_set(m, key, claimed);
+        }
+
+        if (rec->u.wake.wakeType == kIsDarkWake) {
+            snprintf(buf, sizeof(buf), "%s", "DarkWake");
+            asl_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
+            snprintf(numbuf, sizeof(numbuf), "%d", rec->u.wake.darkWakeCnt);
+            asl_set(m, kPMASLValueKey, numbuf);
+        }
+        else if (rec->u.wake.wakeType == kIsDarkToFullWake) {
+            asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+            snprintf(buf, sizeof(buf), "%s", "DarkWake to FullWake");
+        }
+        else {
+            asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
+            snprintf(buf, sizeof(buf), "%s", "Wake");
+        }
+
+        if (rec->u.wake.sleepType[0]) {
+            strlcat(buf, " from ", sizeof(buf));
+            strlcat(buf, rec->u.wake.sleepType, sizeof(buf));
+        }
+
+        printCapabilitiesToBuf(cBuf, sizeof(cBuf), rec->u.wake.capabilities);
+        strlcat(buf, cBuf, sizeof(buf));
+    }
+
+    snprintf(msg, sizeof(msg), "%s %s %s\n", buf,
+          detailString ? ": due to" : "",
+          detailString ? detailString : "");
+
+    INFO_LOG("%{public}s\n", msg);
+    if (claimed[0]) {
+        INFO_LOG("WakeDetails: %s", claimed);
+    }
+    asl_set(m, ASL_KEY_MSG, msg);
+    journalSend(rec, m);
+
+    if (isA_installEnvironment()) {
+        syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
+                msg, battCap, rec->u.wake.onAC ? "AC" : "Batt");
+    }
+}
+
+static void journalRenderHibernateStats(const SleepWakeJournalRecord *rec)
+{
+    aslmsg                  m = journalNewMsg(rec);
+    CFDataRef               statsData = NULL;
+    PMStatsStruct           *stats = NULL;
+    uint64_t                readHIBImageMS = 0;
+    uint64_t                writeHIBImageMS = 0;
+    CFNumberRef             hibernateModeNum = NULL;
+    CFNumberRef             hibernateDelayNum = NULL;
+    int                     hibernateMode = 0;
+    char                    valuestring[25];
+    int                     hibernateDelay = 0;
+    char                    buf[100];
+
+    asl_set(m, kPMASLDomainKey, kPMASLDomainHibernateStatistics);
+
+    if (rec->uuid[0]) {
+        asl_set(m, kPMASLUUIDKey, rec->uuid);
+    }
+
+    snprintf(buf, sizeof(buf), "%d", rec->u.hibernate.sleepCntSinceBoot);
+    asl_set(m, kPMASLSleepCntSinceBoot, buf);
+    snprintf(buf, sizeof(buf), "%d", rec->u.hibernate.sleepCntSinceFailure);
+    asl_set(m, kPMASLSleepCntSinceFailure, buf);
+
+    // These describe the last sleep, and don't change until the next one
+    hibernateModeNum = (CFNumberRef)_copyRootDomainProperty(CFSTR(kIOHibernateModeKey));
+    if (hibernateModeNum) {
+        CFNumberGetValue(hibernateModeNum, kCFNumberIntType, &hibernateMode);
+        CFRelease(hibernateModeNum);
+    }
+
+    hibernateDelayNum= (CFNumberRef)_copyRootDomainProperty(CFSTR(kIOPMDeepSleepDelayKey));
+    if (hibernateDelayNum) {
+        CFNumberGetValue(hibernateDelayNum, kCFNumberIntType, &hibernateDelay);
+        CFRelease(hibernateDelayNum);
+    }
+
+    statsData = (CFDataRef)_copyRootDomainProperty(CFSTR(kIOPMSleepStatisticsKey));
+    if (statsData && (stats = (PMStatsStruct *)CFDataGetBytePtr(statsData)))
+    {
+        writeHIBImageMS = (stats->hibWrite.stop - stats->hibWrite.start)/1000000UL;
+
+        readHIBImageMS =(stats->hibRead.stop - stats->hibRead.start)/1000000UL;
+
+    }
+
+    snprintf(valuestring, sizeof(valuestring), "hibernatemode=%d", hibernateMode);
+    asl_set(m, kPMASLSignatureKey, valuestring);
+    // If readHibImageMS == zero, that means we woke from the contents of memory
+    // and did not read the hibernate image.
+    if (writeHIBImageMS)
+        snprintf(buf, sizeof(buf), "wr=%qd ms ", writeHIBImageMS);
+
+    if (readHIBImageMS)
+        snprintf(buf, sizeof(buf), "rd=%qd ms", readHIBImageMS);
+    asl_set(m, kPMASLDelayKey, buf);
+
+    snprintf(buf, sizeof(buf), "hibmode=%d standbydelaylow=%d standbydelayhigh=%lld",
+             hibernateMode, hibernateDelay, rec->u.hibernate.standbyDelayHigh);
+    asl_set(m, ASL_KEY_MSG, buf);
+
+    journalSend(rec, m);
+
+    if(statsData)
+        CFRelease(statsData);
+}
+
+static void journalRenderAppWakeReason(const SleepWakeJournalRecord *rec)
+{
+    aslmsg  m = journalNewMsg(rec);
+    char    msg[255];
+
+    snprintf(msg, sizeof(msg), "AppWoke:%s Reason:%s", rec->u.appWake.ident, rec->u.appWake.reason);
+    INFO_LOG("%{public}s\n", msg);
+
+    asl_set(m, kPMASLDomainKey, kPMASLDomainAppWakeReason);
+    if (rec->u.appWake.hasIdent) {
+        asl_set(m, kPMASLSignatureKey, rec->u.appWake.ident);
+    }
+
+    asl_set(m, ASL_KEY_MSG, msg);
+    journalSend(rec, m);
+}
+
+/* Renders every record posted so far, oldest first. Runs on the event log queue. */
+static void journalDrain(void)
+{
+    SleepWakeJournalRecord  rec;
+    static uint64_t         reportedDrops = 0;
+    uint64_t                dropped;
+
+    while (true) {
+        os_unfair_lock_lock(&gJournalLock);
+        if (!sleepWakeJournalTake(&gSleepWakeJournal, &rec)) {
+            os_unfair_lock_unlock(&gJournalLock);
+            break;
+        }
+        dropped = gSleepWakeJournal.dropped;
+        os_unfair_lock_unlock(&gJournalLock);
+
+        if (dropped != reportedDrops) {
+            ERROR_LOG("Sleep/wake journal overflowed; %llu records dropped\n", dropped - reportedDrops);
+            reportedDrops = dropped;
+        }
+
+        switch (rec.type) {
+            case kJournalSleep:             journalRenderSleep(&rec); break;
+            case kJournalWake:              journalRenderWake(&rec); break;
+            case kJournalHibernateStats:    journalRenderHibernateStats(&rec); break;
+            case kJournalAppWakeReason:     journalRenderAppWakeReason(&rec); break;
+            default: break;
+        }
+    }
+}
+
+static void journalPost(const SleepWakeJournalRecord *rec)
+{
+    os_unfair_lock_lock(&gJournalLock);
+    sleepWakeJournalPost(&gSleepWakeJournal, rec);
+    os_unfair_lock_unlock(&gJournalLock);
 
-static void attachTCPKeepAliveKeys(
-                                   aslmsg m,
-                                   char *tcpString,
-                                   unsigned int tcpStringLen)
+    dispatch_async(eventLogQueue(), ^{ journalDrain(); });
+}
 
+static void journalInitRecord(SleepWakeJournalRecord *rec, SleepWakeJournalType type, const char *sig)
 {
-    CFTypeRef           platformSupport = NULL;
-    char                keepAliveString[100];
-    
-    IOPlatformCopyFeatureDefault(kIOPlatformTCPKeepAliveDuringSleep, &platformSupport);
-    if (kCFBooleanTrue == platformSupport)
-    {
-        asl_set(m, kPMASLTCPKeepAlive, "supported");
-        
-        getTCPKeepAliveState(keepAliveString, sizeof(keepAliveString), false);
-
-        asl_set(m, kPMASLTCPKeepAliveExpired, keepAliveString);
-        snprintf(tcpString, tcpStringLen, "TCPKeepAlive=%s", keepAliveString);
+    bzero(rec, sizeof(*rec));
+    rec->type = type;
+    clock_gettime(CLOCK_REALTIME, &rec->time);
+    if (sig) {
+        strlcpy(rec->sig, sig, sizeof(rec->sig));
     }
+}
 
-    if (platformSupport){
-        CFRelease(platformSupport);
+static void journalCaptureUUID(SleepWakeJournalRecord *rec, const char *uuidStr)
+{
+    if (uuidStr) {
+        strlcpy(rec->uuid, uuidStr, sizeof(rec->uuid));  // Caller Provided
+    } else if (!_getUUIDString(rec->uuid, sizeof(rec->uuid))) {
+        rec->uuid[0] = 0;
     }
 }
 
@@ -1126,77 +1784,26 @@ __private_extern__ void logASLMessageSleep(
     int   sleepType
 )
 {
-    aslmsg                  m;
-    char                    uuidString[150];
-    uint32_t                percentage = 0;
-    char                    source[10];
-    char                    numbuf[15];
-    bool                    success = true;
-    char                    messageString[200];
-    char                    reasonString[100];
-    char                    tcpKeepAliveString[50];
+    SleepWakeJournalRecord  rec;
     PowerSources            pwrSrc = kACPowered;
 
-    numbuf[0] = 0;
+    journalInitRecord(&rec, kJournalSleep, sig);
+    journalCaptureUUID(&rec, uuidStr);
+    rec.u.sleep.sleepType = sleepType;
+    rec.u.sleep.success = !strncmp(sig, kPMASLSigSuccess, sizeof(kPMASLSigSuccess));
 
-    reasonString[0] = messageString[0] = tcpKeepAliveString[0] = source[0] =  0;
-    
-    _getSleepReasonLogStr(reasonString, sizeof(reasonString));
-    
-    if (!strncmp(sig, kPMASLSigSuccess, sizeof(kPMASLSigSuccess)))
-    {
-        success = true;
-        if (sleepType == kIsS0Sleep) {
-            snprintf(messageString, sizeof(messageString), "Entering Sleep state");
-        } else {
-           snprintf(messageString, sizeof(messageString), "Entering DarkWake state");
-        }
+    _getSleepReasonLogStr(rec.u.sleep.reason, sizeof(rec.u.sleep.reason));
+    getPowerState(&pwrSrc, &rec.u.sleep.battPct);
+    rec.u.sleep.onAC = (pwrSrc == kACPowered);
 
-        if (reasonString[0] != 0) {
-            snprintf(messageString, sizeof(messageString), "%s due to %s", messageString, reasonString);
-        }
-        
+    if (rec.u.sleep.success) {
+        rec.u.sleep.tcpKeepAliveSupported = getTCPKeepAliveLogState(rec.u.sleep.tcpKeepAlive,
+                                                                    sizeof(rec.u.sleep.tcpKeepAlive));
     } else {
-        success = false;
-        snprintf(messageString, sizeof(messageString), "Failure during sleep: %s : %s", failureStr, (sig) ? sig : "");
+        snprintf(rec.u.sleep.failure, sizeof(rec.u.sleep.failure), "%s", failureStr);
     }
 
-    INFO_LOG("%{public}s", messageString);
-    getPowerState(&pwrSrc, &percentage);
-    m = new_msg_pmset_log();
-    if (success) {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMSleep);
-
-        snprintf(numbuf, 10, "%d", percentage);
-        asl_set(m, kPMASLBatteryPercentageKey, numbuf);
-
-        asl_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "Batt");
-
-        attachTCPKeepAliveKeys(m, tcpKeepAliveString, sizeof(tcpKeepAliveString));
-        snprintf(messageString, sizeof(messageString), "%s:%s",
-                messageString, tcpKeepAliveString);
-    }
-    else {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
-    }
-
-    // UUID
-    if (uuidStr) {
-        asl_set(m, kPMASLUUIDKey, uuidStr);  // Caller Provided
-    } else if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
-    }
-    
-    
-    asl_set(m, kPMASLSignatureKey, sig);
-    asl_set(m, ASL_KEY_MSG, messageString);
-    asl_send(NULL, m);
-    asl_release(m);
-
-    if (isA_installEnvironment()) {
-        syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
-                messageString, numbuf, (pwrSrc == kACPowered) ? "AC" : "Batt");
-    }
+    journalPost(&rec);
 }
 
 /*****************************************************************************/
@@ -1204,46 +1811,42 @@ __private_extern__ void logASLMessageSleep(
 
 __private_extern__ void logASLMessageWake(
     const char *sig,
-    const char *uuidStr,
+    const char *uuidStr __unused,
     const char *failureStr,
     IOPMCapabilityBits in_capabilities,
     WakeTypeEnum dark_wake
 )
 {
-    aslmsg                  m;
-    char                    numbuf[15];
+    SleepWakeJournalRecord  rec;
     CFStringRef             tmpStr = NULL;
-    char                    claimed[255];
-    uint32_t                percentage = 0;
-    char                    buf[200];
-    char                    source[10];
-    char                    wakeReasonBuf[512];
-    char                    cBuf[50];
-    const char *            detailString = NULL;
     static int              darkWakeCnt = 0;
-    char                    battCap[15];
     static char             prev_uuid[50];
     CFStringRef             wakeType = NULL;
     const char *            sleepTypeString;
-    bool                    success = true;
     PowerSources            pwrSrc = kACPowered;
 
-    m = new_msg_pmset_log();
-    asl_set(m, kPMASLSignatureKey, sig);
+    journalInitRecord(&rec, kJournalWake, sig);
+    journalCaptureUUID(&rec, NULL);
+    if (rec.uuid[0] && strncmp(rec.uuid, prev_uuid, sizeof(prev_uuid))) {
+        // New sleep/wake cycle.
+        snprintf(prev_uuid, sizeof(prev_uuid), "%s", rec.uuid);
+        darkWakeCnt = 0;
+    }
 
-    if (_getUUIDString(buf, sizeof(buf))) {
-        asl_set(m, kPMASLUUIDKey, buf);
-        if (strncmp(buf, prev_uuid, sizeof(prev_uuid))) {
-              // New sleep/wake cycle.
-              snprintf(prev_uuid, sizeof(prev_uuid), "%s", buf);
-              darkWakeCnt = 0;
-        }
+    rec.u.wake.wakeType = dark_wake;
+    rec.u.wake.capabilities = in_capabilities;
+    rec.u.wake.success = !strncmp(sig, kPMASLSigSuccess, sizeof(kPMASLSigSuccess));
+    getPowerState(&pwrSrc, &rec.u.wake.battPct);
+    rec.u.wake.onAC = (pwrSrc == kACPowered);
+
+    if (!rec.u.wake.success) {
+        snprintf(rec.u.wake.failure, sizeof(rec.u.wake.failure), "%s", failureStr);
+        journalPost(&rec);
+        return;
     }
 
-    buf[0] = source[0] = battCap[0] = 0;
-    getPowerState(&pwrSrc, &percentage);
-    if (!strncmp(sig, kPMASLSigSuccess, sizeof(kPMASLSigSuccess)))
     {
+        char  wakeReasonBuf[kJournalStrLen];
         char  wakeTypeBuf[50];
 
         wakeReasonBuf[0] = wakeTypeBuf[0] = 0;
@@ -1253,125 +1856,82 @@ __private_extern__ void logASLMessageWake(
         if (isA_CFString(reasons.platformWakeType)) {
             CFStringGetCString(reasons.platformWakeType, wakeTypeBuf, sizeof(wakeTypeBuf), kCFStringEncodingUTF8);
         }
-        snprintf(wakeReasonBuf, sizeof(wakeReasonBuf), "%s/%s", wakeReasonBuf, wakeTypeBuf);
-        detailString = wakeReasonBuf;
-
-        snprintf(battCap, 10, "%d", percentage);
-        asl_set(m, kPMASLBatteryPercentageKey, battCap);
-        asl_set(m, kPMASLPowerSourceKey, (pwrSrc == kACPowered) ? "AC" : "BATT");
-    } else {
-        snprintf(buf, sizeof(buf), "Failure during wake: %s : %s", 
-                 failureStr, (sig) ? sig : "");
-        success = false;
-
+        snprintf(rec.u.wake.detail, sizeof(rec.u.wake.detail), "%s/%s", wakeReasonBuf, wakeTypeBuf);
     }
 
-    /* populate driver wake reasons */
-    if (success && isA_CFArray(reasons.claimedWakeEventsArray))
+    /* capture driver wake reasons */
+    if (isA_CFArray(reasons.claimedWakeEventsArray))
     {
-        int  keyIndex = 0;
         long    claimedCount = CFArrayGetCount(reasons.claimedWakeEventsArray);
+        char    *claimedReasonStr, *claimedDetailsStr;
 
-        for (int i=0; i<claimedCount; i++) {
-            /* Legal requirement: 16513925 & 16544525
-             * Limit the length of the reported string to 60 characters.
-             */
-            const int               kMaxClaimReportLen = 60;
-
+        for (int i=0; i<claimedCount && rec.u.wake.claimCount < kJournalClaimsMax; i++) {
             CFDictionaryRef         claimedEvent = NULL;
-            char                    claimedReasonStr[kMaxClaimReportLen];
-            char                    claimedDetailsStr[kMaxClaimReportLen];
-            char                    key[255];
 
-            claimedReasonStr[0] = 0;
-            claimedDetailsStr[0] = 0;
-            
+            claimedReasonStr = rec.u.wake.claimReason[rec.u.wake.claimCount];
+            claimedDetailsStr = rec.u.wake.claimDetails[rec.u.wake.claimCount];
+
             claimedEvent = CFArrayGetValueAtIndex(reasons.claimedWakeEventsArray, i);
             if (!isA_CFDictionary(claimedEvent)) continue;
-            
+
             tmpStr = CFDictionaryGetValue(claimedEvent,
                                           CFSTR(kIOPMWakeEventReasonKey));
             if (isA_CFString(tmpStr)) {
-                CFStringGetCString(tmpStr, claimedReasonStr, sizeof(claimedReasonStr), kCFStringEncodingUTF8);
+                CFStringGetCString(tmpStr, claimedReasonStr, kJournalClaimLen, kCFStringEncodingUTF8);
             }
             if (!claimedReasonStr[0]) continue;
 
             tmpStr = CFDictionaryGetValue(claimedEvent,
                                           CFSTR(kIOPMWakeEventDetailsKey));
             if (isA_CFString(tmpStr)) {
-                CFStringGetCString(tmpStr, claimedDetailsStr, sizeof(claimedDetailsStr), kCFStringEncodingUTF8);
+                CFStringGetCString(tmpStr, claimedDetailsStr, kJournalClaimLen, kCFStringEncodingUTF8);
             }
-
-            snprintf(claimed, sizeof(claimed), "DriverReason:%s - DriverDetails:%s",
-                                                claimedReasonStr, claimedDetailsStr);
-            
-            snprintf(key, sizeof(key), "%s-%d", kPMASLClaimedEventKey, keyIndex);
-            
-            asl_set(m, key, claimed);
-            keyIndex++;
+            rec.u.wake.claimCount++;
         }
     }
 
-    if (!success)
-    {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainSWFailure);
-    }
-    else if (dark_wake == kIsDarkWake)
+    if (dark_wake == kIsDarkWake)
     {
-        darkWakeCnt++;
-        snprintf(buf, sizeof(buf), "%s", "DarkWake");
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMDarkWake);
-        snprintf(numbuf, sizeof(numbuf), "%d", darkWakeCnt);
-        asl_set(m, kPMASLValueKey, numbuf);
+        rec.u.wake.darkWakeCnt = ++darkWakeCnt;
     }
     else if (dark_wake == kIsDarkToFullWake)
     {
         wakeType = _copyRootDomainProperty(CFSTR(kIOPMRootDomainWakeTypeKey));
         if (isA_CFString(wakeType)) {
-            CFStringGetCString(wakeType, wakeReasonBuf, sizeof(wakeReasonBuf), kCFStringEncodingUTF8);
+            CFStringGetCString(wakeType, rec.u.wake.detail, sizeof(rec.u.wake.detail), kCFStringEncodingUTF8);
         }
         if (wakeType) {
             CFRelease(wakeType);
         }
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
-        snprintf(buf, sizeof(buf), "%s", "DarkWake to FullWake");
-    }
-    else
-    {
-        asl_set(m, kPMASLDomainKey, kPMASLDomainPMWake);
-        snprintf(buf, sizeof(buf), "%s", "Wake");
     }
 
-    if (success)
+    if ((sleepTypeString = getSleepTypeString()))
     {
-        if ((sleepTypeString = getSleepTypeString()))
-        {
-            snprintf(buf, sizeof(buf), "%s from %s", buf, sleepTypeString);
-        }
-
-        printCapabilitiesToBuf(cBuf, sizeof(cBuf), in_capabilities);
-        strncat(buf, cBuf, sizeof(buf)-strlen(buf)-1);
+        strlcpy(rec.u.wake.sleepType, sleepTypeString, sizeof(rec.u.wake.sleepType));
     }
 
-    snprintf(buf, sizeof(buf), "%s %s %s\n", buf,
-          detailString ? ": due to" : "",
-          detailString ? detailString : "");
+    journalPost(&rec);
+    logASLMessageHibernateStatistics( );
+}
 
-    INFO_LOG("%{public}s\n", buf);
-    INFO_LOG("WakeDetails: %s", claimed);
-    asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
-    if (success) {
-        logASLMessageHibernateStatistics( );
-    }
-    asl_release(m);
+static void logASLMessageHibernateStatistics(void)
+{
+    SleepWakeJournalRecord  rec;
 
-    if (isA_installEnvironment()) {
-        syslog(LOG_INFO | LOG_INSTALL, "%s battCap:%s pwrSrc: %s\n",
-                buf, battCap, (pwrSrc == kACPowered) ? "AC" : "Batt");
+    if (sleepCntSinceFailure == -1) {
+        initSleepCnt();
+        if (sleepCntSinceFailure < 0) {
+            sleepCntSinceFailure = 0;
+        }
     }
 
+    journalInitRecord(&rec, kJournalHibernateStats, NULL);
+    journalCaptureUUID(&rec, NULL);
+    rec.u.hibernate.sleepCntSinceBoot = sleepCntSinceBoot;
+    rec.u.hibernate.sleepCntSinceFailure = sleepCntSinceFailure;
+    GetPMSettingNumberForID(kPMSettingDeepSleepDelayHigh, &rec.u.hibernate.standbyDelayHigh);
 
+    journalPost(&rec);
 }
 
 __private_extern__ void logASLMessageWakeTime(uint64_t waketime, WakeTypeEnum waketype)
@@ -1387,7 +1947,7 @@ __private_extern__ void logASLMessageWakeTime(uint64_t waketime, WakeTypeEnum wa
     asl_set(m, kPMASLDomainKey, kPMASLDomainWakeTime);
     asl_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     mt2PublishWakeTime(wakeTime, waketype);
     asl_release(m);
 }
@@ -1397,22 +1957,14 @@ __private_extern__ void logASLAppWakeReason(
                                             const char * ident,
                                             const char * reason)
 {
-#define kPMASLDomainAppWakeReason   "AppWakeReason"
-
-    char msg[255];
-    snprintf(msg, sizeof(msg), "AppWoke:%s Reason:%s", ident?ident:"--none--", reason?reason:"--none--");
-    INFO_LOG("%{public}s\n", msg);
-
-    aslmsg m = new_msg_pmset_log();
+    SleepWakeJournalRecord  rec;
 
-    asl_set(m, kPMASLDomainKey, kPMASLDomainAppWakeReason);
-    if (ident) {
-        asl_set(m, kPMASLSignatureKey, ident);
-    }
+    journalInitRecord(&rec, kJournalAppWakeReason, NULL);
+    rec.u.appWake.hasIdent = (ident != NULL);
+    strlcpy(rec.u.appWake.ident, ident ? ident : "--none--", sizeof(rec.u.appWake.ident));
+    strlcpy(rec.u.appWake.reason, reason ? reason : "--none--", sizeof(rec.u.appWake.reason));
 
-    asl_set(m, ASL_KEY_MSG, msg);
-    asl_send(NULL, m);
-    asl_release(m);
+    journalPost(&rec);
 }
 
 
@@ -1447,7 +1999,7 @@ __private_extern__ void logASLPMConnectionNotify(
          appName,notificationBits );
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1469,7 +2021,7 @@ __private_extern__ void logASLDisplayStateChange(void)
         displayOff ? "off" : "on");
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 
     if (isA_installEnvironment()) {
@@ -1523,7 +2075,7 @@ __private_extern__ void logASLInactivityWindow(inactivityWindowType type, CFDate
 
     INFO_LOG("%{public}s\n", buf);
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 
     if (startStr) {
@@ -1552,7 +2104,7 @@ __private_extern__ void logASLPerforamceState(int perfState)
     snprintf(buf, sizeof(buf), "Performance State is %d", perfState);
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1572,7 +2124,7 @@ __private_extern__ void logASLThermalState(int thermalState)
    snprintf(buf, sizeof(buf), "Thermal State is %d", thermalState);
 
     asl_set(m, ASL_KEY_MSG, buf);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1673,7 +2225,7 @@ __private_extern__ void logASLMessagePMConnectionResponse(
        asl_set(m, kPMASLDelayKey, buf);
     }
 
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 
     if (timeout) {
@@ -1795,7 +2347,7 @@ __private_extern__ void  logASLMessageAppStats(CFArrayRef appFailuresArray, char
             mt2RecordAppTimeouts(reasons.sleepReason, appNameString);
         }
     }
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1828,7 +2380,7 @@ __private_extern__ void logASLMessagePMConnectionScheduledWakeEvents(CFStringRef
 
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
     asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
     CFRelease(messageString);
 }
@@ -1856,7 +2408,7 @@ __private_extern__ void logASLMessageExecutedWakeupEvent(CFStringRef requestedMa
 
     asl_set(m, kPMASLDomainKey, kPMASLDomainPMWakeRequests);
     asl_set(m, ASL_KEY_MSG, requestors);
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
     CFRelease(messageString);
 }
@@ -1881,7 +2433,7 @@ __private_extern__ void logASLMessageIgnoredDWTEmergency(void)
         "Ignored DarkWake thermal emergency signal %s", tcpKeepAliveString);
     asl_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1915,7 +2467,7 @@ __private_extern__ void logASLMessageSleepCanceledAtLastCall(
 
     asl_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1950,7 +2502,7 @@ __private_extern__ void logASLBatteryHealthChanged(const char *health,
     }
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -1970,7 +2522,7 @@ __private_extern__ void logASLLowBatteryWarning(IOPSLowBatteryWarningLevel level
              level, time, ccap);
     asl_set(m, ASL_KEY_MSG, strbuf);
     
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 }
 
@@ -2025,7 +2577,7 @@ __private_extern__ void logASLSleepPreventers(int preventerType)
     }
     asl_set(m, ASL_KEY_MSG, strbuf);
 
-    asl_send(NULL, m);
+    pmLogSend(m);
     asl_release(m);
 
     if (preventers)
@@ -2048,6 +2600,20 @@ __private_extern__ void logASLSleepPreventers(int preventerType)
  * MessageTracer2 DarkWake Keys
  */
 
+/* Per-process domains, counted by the IDs in gMT2ProcessNames. The first
+ * kMT2DarkWakeDomainCount count a process at most once per dark wake.
+ */
+enum {
+    kMT2ProcBackgroundTasks = 0,
+    kMT2ProcPushTasks,
+    kMT2ProcPushTimeouts,
+    kMT2DarkWakeDomainCount,
+    kMT2ProcIdleSleepAckTo = kMT2DarkWakeDomainCount,
+    kMT2ProcDemandSleepAckTo,
+    kMT2ProcDarkWakeSleepAckTo,
+    kMT2ProcDomainCount
+};
+
 typedef struct {
     CFAbsoluteTime              startedPeriod;
     dispatch_source_t           nextFireSource;
@@ -2062,18 +2628,11 @@ typedef struct {
     uint16_t                    wakeEvents[kWakeStateCount];
     /* for domain com.apple.darkwake.thermal */
     uint16_t                    thermalEvents[kThermalStateCount];
-    /* for domain com.apple.darkwake.backgroundtasks */
-    CFMutableSetRef             alreadyRecordedBackground;
-    CFMutableDictionaryRef      tookBackground;
-    /* for domain com.apple.darkwake.pushservicetasks */
-    CFMutableSetRef             alreadyRecordedPush;
-    CFMutableDictionaryRef      tookPush;
-    /* for domain com.apple.darkwake.pushservicetasktimeout */
-    CFMutableSetRef             alreadyRecordedPushTimeouts;
-    CFMutableDictionaryRef      timeoutPush;
-    CFMutableDictionaryRef      idleSleepAppTimeouts;
-    CFMutableDictionaryRef      demandSleepAppTimeouts;
-    CFMutableDictionaryRef      darkwakeSleepAppTimeouts;
+    /* for domains com.apple.darkwake.{backgroundtasks,pushservicetasks,pushservicetimeouts}
+     * and com.apple.ackto.* */
+    uint32_t                    procEvents[kMT2ProcDomainCount][kMT2MaxProcessNames];
+    /* processes already counted in the current dark wake, cleared by mt2DarkWakeEnded() */
+    uint64_t                    recordedThisDarkWake[kMT2DarkWakeDomainCount][kMT2MaxProcessNames / 64];
 } MT2Aggregator;
 
 static const uint64_t   kMT2CheckIntervalTimer = 4ULL*60ULL*60ULL*NSEC_PER_SEC;     /* Check every 4 hours */
@@ -2082,37 +2641,53 @@ static const uint64_t   kBigLeeway = (30Ull * NSEC_PER_SEC);
 
 static MT2Aggregator    *mt2 = NULL;
 
+/* Per-process counters are indexed by IDs from this table. It is reset with
+ * the counters each time they are published.
+ */
+static MT2ProcessNames  gMT2ProcessNames;
+
+static const char *mt2ProcessNameCString(void *context, char *buf, size_t len)
+{
+    CFStringRef name = (CFStringRef)context;
+
+    if (!isA_CFString(name) || !CFStringGetCString(name, buf, len, kCFStringEncodingUTF8)) {
+        return NULL;
+    }
+    return buf;
+}
+
+static uint16_t mt2InternProcessName(CFStringRef name)
+{
+    char buf[kMT2ProcessNameLen];
+
+    return mt2ProcessNamesIntern(&gMT2ProcessNames, mt2ProcessNameCString((void *)name, buf, sizeof(buf)));
+}
+
+/* ProcessInfo caches its ID, so a process's name is converted and looked up
+ * at most once per reporting period, on its first mt2 event.
+ */
+static uint16_t mt2ProcessNameID(ProcessInfo *pinfo)
+{
+    if (!pinfo) {
+        return kMT2UnknownProcessID;
+    }
+    return mt2ProcessNamesLookup(&gMT2ProcessNames, &pinfo->mt2Name,
+                                 mt2ProcessNameCString, (void *)pinfo->name);
+}
+
 void initializeMT2Aggregator(void)
 {
     if (mt2)
     {
         /* Zero out & recycle MT2Aggregator structure */
         mt2->nextFireSource = nil;
-        CFRelease(mt2->alreadyRecordedBackground);
-        CFRelease(mt2->tookBackground);
-        CFRelease(mt2->alreadyRecordedPush);
-        CFRelease(mt2->tookPush);
-        CFRelease(mt2->alreadyRecordedPushTimeouts);
-        CFRelease(mt2->timeoutPush);
-        CFRelease(mt2->idleSleepAppTimeouts);
-        CFRelease(mt2->demandSleepAppTimeouts);
-        CFRelease(mt2->darkwakeSleepAppTimeouts);
-
         bzero((void *)mt2, sizeof(MT2Aggregator));
     } else {
         /* New datastructure */
         mt2 = calloc(1, sizeof(MT2Aggregator));
     }
     mt2->startedPeriod                      = CFAbsoluteTimeGetCurrent();
-    mt2->alreadyRecordedBackground          = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPush                = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->alreadyRecordedPushTimeouts        = CFSetCreateMutable(0, 0, &kCFTypeSetCallBacks);
-    mt2->tookBackground                     = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->tookPush                           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->timeoutPush                        = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->idleSleepAppTimeouts               = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->demandSleepAppTimeouts             = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
-    mt2->darkwakeSleepAppTimeouts           = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, NULL);
+    mt2ProcessNamesReset(&gMT2ProcessNames);
 
     mt2->nextFireSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _getPMMainQueue());
     if (mt2->nextFireSource) {
@@ -2276,26 +2851,23 @@ static int mt2PublishDomainThermals(void)
     return sentCount;
 }
 
-static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
+static int mt2PublishDomainProcess(const char *appdomain, int domain)
 {
 #define kMT2KeyApp                      "com.apple.message.process"
 
-    CFStringRef         *keys;
-    uintptr_t           *counts;
+    const uint32_t      *counts;
     char                buf[2*kProcNameBufLen];
     int                 sendCount = 0;
     long                appcount = 0;
     int                 i = 0;
 
-    if (!mt2 || !apps || (0 == (appcount = CFDictionaryGetCount(apps))))
+    if (!mt2)
     {
         return 0;
     }
 
-    keys = (CFStringRef *)calloc(sizeof(CFStringRef), appcount);
-    counts = (uintptr_t *)calloc(sizeof(uintptr_t), appcount);
-
-    CFDictionaryGetKeysAndValues(apps, (const void **)keys, (const void **)counts);
+    counts = mt2->procEvents[domain];
+    appcount = mt2ProcessNamesCount(&gMT2ProcessNames);
 
     for (i=0; i<appcount; i++)
     {
@@ -2305,10 +2877,7 @@ static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
         aslmsg m = asl_new(ASL_TYPE_MSG);
         asl_set(m, "com.apple.message.domain", appdomain);
 
-        if (!CFStringGetCString(keys[i], buf, sizeof(buf), kCFStringEncodingUTF8)) {
-            snprintf(buf, sizeof(buf), "com.apple.message.%s", "Unknown");
-        }
-        asl_set(m, kMT2KeyApp, buf);
+        asl_set(m, kMT2KeyApp, mt2ProcessNamesGet(&gMT2ProcessNames, i));
 
         snprintf(buf, sizeof(buf), "%d", (int)counts[i]);
         asl_set(m, "com.apple.message.count", buf);
@@ -2319,9 +2888,6 @@ static int mt2PublishDomainProcess(const char *appdomain, CFDictionaryRef apps)
 
     }
 
-    free(keys);
-    free(counts);
-
     return sendCount;
 }
 
@@ -2354,12 +2920,12 @@ void mt2PublishReports(void)
     {
         mt2PublishDomainWakes();
         mt2PublishDomainThermals();
-        mt2PublishDomainProcess(kMT2DomainPushTasks, mt2->tookPush);
-        mt2PublishDomainProcess(kMT2DomainPushTimeouts, mt2->timeoutPush);
-        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, mt2->tookBackground);
-        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, mt2->idleSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, mt2->demandSleepAppTimeouts);
-        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, mt2->darkwakeSleepAppTimeouts);
+        mt2PublishDomainProcess(kMT2DomainPushTasks, kMT2ProcPushTasks);
+        mt2PublishDomainProcess(kMT2DomainPushTimeouts, kMT2ProcPushTimeouts);
+        mt2PublishDomainProcess(kMT2DomainBackgroundTasks, kMT2ProcBackgroundTasks);
+        mt2PublishDomainProcess(kMT2DomainIdleSlpAckTo, kMT2ProcIdleSleepAckTo);
+        mt2PublishDomainProcess(kMT2DomainDemandSlpAckTo, kMT2ProcDemandSleepAckTo);
+        mt2PublishDomainProcess(kMT2DomainDarkWkSlpAckTo, kMT2ProcDarkWakeSleepAckTo);
 
         // Recyle the data structure for the next reporting.
         initializeMT2Aggregator();
@@ -2377,9 +2943,7 @@ void mt2DarkWakeEnded(void)
     if (!mt2) {
         return;
     }
-    CFSetRemoveAllValues(mt2->alreadyRecordedBackground);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPush);
-    CFSetRemoveAllValues(mt2->alreadyRecordedPushTimeouts);
+    bzero(mt2->recordedThisDarkWake, sizeof(mt2->recordedThisDarkWake));
 }
 
 void mt2EvaluateSystemSupport(void)
@@ -2477,8 +3041,11 @@ bool isA_DarkWakeState(void);
 
 void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
 {
-    CFStringRef         processName;
     CFStringRef         assertionType;
+    uint16_t            nameID;
+    uint64_t            *recorded;
+    uint64_t            bit;
+    int                 domain;
 
     if (!mt2) {
         return;
@@ -2488,72 +3055,70 @@ void mt2RecordAssertionEvent(assertionOps action, assertion_t *theAssertion)
         return;
     }
 
-    if (!(processName = processInfoGetName(theAssertion->pinfo->pid))) {
-        processName = CFSTR("Unknown");
+    /* BackgroundTask and ApplePushServiceTask only ever map to these two
+     * types, though either can alias the other, so the type string still
+     * decides which domain to count in.
+     */
+    if ((kBackgroundTaskType != theAssertion->kassert) && (kPushServiceTaskType != theAssertion->kassert)) {
+        return;
     }
 
-    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))
-        || (!CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask)
-         && !CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask)))
-    {
+    if (!(assertionType = CFDictionaryGetValue(theAssertion->props, kIOPMAssertionTypeKey))) {
         return;
     }
 
     if (CFEqual(assertionType, kIOPMAssertionTypeBackgroundTask))
     {
-        if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedBackground, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookBackground, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookBackground, processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedBackground, processName);
-            }
+        if (kAssertionOpRaise != action) {
+            return;
         }
+        domain = kMT2ProcBackgroundTasks;
     }
     else if (CFEqual(assertionType, kIOPMAssertionTypeApplePushServiceTask))
     {
         if (kAssertionOpRaise == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPush, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->tookPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->tookPush, processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPush, processName);
-            }
-        }
-        else if (kAssertionOpGlobalTimeout == action) {
-            if (!CFSetContainsValue(mt2->alreadyRecordedPushTimeouts, processName)) {
-                int x = (int)CFDictionaryGetValue(mt2->timeoutPush, processName);
-                x++;
-                CFDictionarySetValue(mt2->timeoutPush, (const void *)processName, (void *)(uintptr_t)x);
-                CFSetAddValue(mt2->alreadyRecordedPushTimeouts, processName);
-            }
+            domain = kMT2ProcPushTasks;
+        } else if (kAssertionOpGlobalTimeout == action) {
+            domain = kMT2ProcPushTimeouts;
+        } else {
+            return;
         }
     }
+    else {
+        return;
+    }
+
+    nameID = mt2ProcessNameID(theAssertion->pinfo);
+    recorded = &mt2->recordedThisDarkWake[domain][nameID / 64];
+    bit = 1ULL << (nameID % 64);
+
+    if (!(*recorded & bit)) {
+        *recorded |= bit;
+        mt2->procEvents[domain][nameID]++;
+    }
 
     return;
 }
 
 void mt2RecordAppTimeouts(CFStringRef sleepReason, CFStringRef procName)
 {
-    CFMutableDictionaryRef dict;
+    int domain;
 
     if ( !mt2 || !isA_CFString(procName)) return;
 
     if (CFStringCompare(sleepReason, CFSTR(kIOPMIdleSleepKey), 0) == kCFCompareEqualTo) {
-        dict = mt2->idleSleepAppTimeouts;
+        domain = kMT2ProcIdleSleepAckTo;
     }
     else  if ((CFStringCompare(sleepReason, CFSTR(kIOPMClamshellSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMPowerButtonSleepKey), 0) == kCFCompareEqualTo) ||
             (CFStringCompare(sleepReason, CFSTR(kIOPMSoftwareSleepKey), 0) == kCFCompareEqualTo)) {
-        dict = mt2->demandSleepAppTimeouts;
+        domain = kMT2ProcDemandSleepAckTo;
     }
     else {
-        dict = mt2->darkwakeSleepAppTimeouts;
+        domain = kMT2ProcDarkWakeSleepAckTo;
     }
 
-    int x = (int)CFDictionaryGetValue(dict, procName);
-    x++;
-    CFDictionarySetValue(dict, (const void *)procName, (void *)(uintptr_t)x);
+    mt2->procEvents[domain][mt2InternProcessName(procName)]++;
 
 }
 
@@ -2698,90 +3263,6 @@ void mt2PublishSleepWakeFailure(const char *failType, const char *phase, const c
 
 /*****************************************************************************/
 
-static void logASLMessageHibernateStatistics(void)
-{
-    aslmsg                  m = NULL;
-    CFDataRef               statsData = NULL;
-    PMStatsStruct           *stats = NULL;
-    uint64_t                readHIBImageMS = 0;
-    uint64_t                writeHIBImageMS = 0;
-    CFNumberRef             hibernateModeNum = NULL;
-    CFNumberRef             hibernateDelayNum = NULL;
-    int                     hibernateMode = 0;
-    char                    valuestring[25];
-    int                     hibernateDelay = 0;
-    int64_t                 hibernateDelayHigh = 0;
-    char                    buf[100];
-    char                    uuidString[150];
-
-    if (sleepCntSinceFailure == -1) {
-        initSleepCnt();
-        if (sleepCntSinceFailure < 0) {
-            sleepCntSinceFailure = 0;
-        }
-    }
-    m = new_msg_pmset_log();
-
-    asl_set(m, kPMASLDomainKey, kPMASLDomainHibernateStatistics);
-
-    asl_set(m, ASL_KEY_LEVEL, ASL_STRING_NOTICE);
-
-    if (_getUUIDString(uuidString, sizeof(uuidString))) {
-        asl_set(m, kPMASLUUIDKey, uuidString);
-    }
-
-    snprintf(buf, sizeof(buf), "%d", sleepCntSinceBoot);
-    asl_set(m, kPMASLSleepCntSinceBoot, buf);
-    snprintf(buf, sizeof(buf), "%d", sleepCntSinceFailure);
-    asl_set(m, kPMASLSleepCntSinceFailure, buf);
-
-    hibernateModeNum = (CFNumberRef)_copyRootDomainProperty(CFSTR(kIOHibernateModeKey));
-    if (hibernateModeNum) {
-        CFNumberGetValue(hibernateModeNum, kCFNumberIntType, &hibernateMode);
-        CFRelease(hibernateModeNum);
-    }
-
-    hibernateDelayNum= (CFNumberRef)_copyRootDomainProperty(CFSTR(kIOPMDeepSleepDelayKey));
-    if (hibernateDelayNum) {
-        CFNumberGetValue(hibernateDelayNum, kCFNumberIntType, &hibernateDelay);
-        CFRelease(hibernateDelayNum);
-    }
-
-    GetPMSettingNumber(CFSTR(kIOPMDeepSleepDelayHighKey), &hibernateDelayHigh);
-
-    statsData = (CFDataRef)_copyRootDomainProperty(CFSTR(kIOPMSleepStatisticsKey));
-    if (statsData && (stats = (PMStatsStruct *)CFDataGetBytePtr(statsData)))
-    {
-        writeHIBImageMS = (stats->hibWrite.stop - stats->hibWrite.start)/1000000UL;
-
-        readHIBImageMS =(stats->hibRead.stop - stats->hibRead.start)/1000000UL;
-
-    }
-
-    snprintf(valuestring, sizeof(valuestring), "hibernatemode=%d", hibernateMode);
-    asl_set(m, kPMASLSignatureKey, valuestring);
-    // If readHibImageMS == zero, that means we woke from the contents of memory
-    // and did not read the hibernate image.
-    if (writeHIBImageMS)
-        snprintf(buf, sizeof(buf), "wr=%qd ms ", writeHIBImageMS);
-
-    if (readHIBImageMS)
-        snprintf(buf, sizeof(buf), "rd=%qd ms", readHIBImageMS);
-    asl_set(m, kPMASLDelayKey, buf);
-
-    snprintf(buf, sizeof(buf), "hibmode=%d standbydelaylow=%d standbydelayhigh=%lld", hibernateMode, hibernateDelay, hibernateDelayHigh);
-    asl_set(m, ASL_KEY_MSG, buf);
-
-    if (m) {
-        asl_send(NULL, m);
-        asl_release(m);
-    }
-    if(statsData)
-        CFRelease(statsData);
-    return;
-}
-
-
 #pragma mark FDR
 
 /*************************
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2017 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef SleepWakeJournal_h
+#define SleepWakeJournal_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Sleep/wake journal records and the ring they are queued in between the
+ * main queue, which captures them, and the event log queue, which renders
+ * them. Records are stored encoded: a slot header followed by the fields
+ * common to every record and only the part of the union its type uses.
+ * The caller serializes access to the ring.
+ */
+
+#define kSleepWakeJournalDepth      32
+#define kJournalStrLen              128
+#define kJournalClaimsMax           4
+/* Legal requirement: 16513925 & 16544525
+ * Limit the length of the reported string to 60 characters.
+ */
+#define kJournalClaimLen            60
+
+typedef enum {
+    kJournalSleep = 1,
+    kJournalWake,
+    kJournalHibernateStats,
+    kJournalAppWakeReason
+} SleepWakeJournalType;
+
+typedef struct {
+    uint32_t                type;
+    struct timespec         time;
+    char                    uuid[64];
+    char                    sig[64];
+    union {
+        struct {
+            int32_t         sleepType;
+            bool            success;
+            bool            onAC;
+            bool            tcpKeepAliveSupported;
+            uint32_t        battPct;
+            char            reason[100];
+            char            tcpKeepAlive[50];
+            char            failure[kJournalStrLen];
+        } sleep;
+        struct {
+            uint32_t        wakeType;           // WakeTypeEnum
+            uint32_t        capabilities;       // IOPMCapabilityBits
+            bool            success;
+            bool            onAC;
+            uint32_t        battPct;
+            int32_t         darkWakeCnt;
+            uint32_t        claimCount;
+            char            sleepType[32];
+            char            detail[2*kJournalStrLen];
+            char            failure[kJournalStrLen];
+            char            claimReason[kJournalClaimsMax][kJournalClaimLen];
+            char            claimDetails[kJournalClaimsMax][kJournalClaimLen];
+        } wake;
+        struct {
+            int32_t         sleepCntSinceBoot;
+            int32_t         sleepCntSinceFailure;
+            int64_t         standbyDelayHigh;
+        } hibernate;
+        struct {
+            bool            hasIdent;
+            char            ident[kJournalStrLen];
+            char            reason[kJournalStrLen];
+        } appWake;
+    } u;
+} SleepWakeJournalRecord;
+
+typedef struct {
+    uint64_t                seq;        // position in the journal, to catch a stale slot
+    uint32_t                type;
+    uint32_t                length;     // bytes of record that follow
+} SleepWakeJournalSlotHeader;
+
+#define kJournalCommonLen           offsetof(SleepWakeJournalRecord, u)
+#define kJournalSlotLen             (sizeof(SleepWakeJournalSlotHeader) + sizeof(SleepWakeJournalRecord))
+
+typedef struct {
+    uint64_t                head;       // records posted
+    uint64_t                tail;       // records taken or dropped
+    uint64_t                dropped;
+    uint8_t                 slots[kSleepWakeJournalDepth][kJournalSlotLen];
+} SleepWakeJournal;
+
+/* Bytes of the record a record of @type carries, 0 for an unknown type */
+static inline size_t sleepWakeJournalRecordLen(uint32_t type)
+{
+    switch (type) {
+        case kJournalSleep:
+            return kJournalCommonLen + sizeof(((SleepWakeJournalRecord *)0)->u.sleep);
+        case kJournalWake:
+            return kJournalCommonLen + sizeof(((SleepWakeJournalRecord *)0)->u.wake);
+        case kJournalHibernateStats:
+            return kJournalCommonLen + sizeof(((SleepWakeJournalRecord *)0)->u.hibernate);
+        case kJournalAppWakeReason:
+            return kJournalCommonLen + sizeof(((SleepWakeJournalRecord *)0)->u.appWake);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Encodes @rec as journal entry @seq into @buf. Returns the bytes written, or
+ * 0 if the type is unknown or @len too short.
+ */
+static inline size_t sleepWakeJournalEncode(const SleepWakeJournalRecord *rec, uint64_t seq,
+                                            uint8_t *buf, size_t len)
+{
+    SleepWakeJournalSlotHeader  hdr;
+    size_t                      recLen = sleepWakeJournalRecordLen(rec->type);
+
+    if (!recLen || len < sizeof(hdr) + recLen) {
+        return 0;
+    }
+
+    hdr.seq = seq;
+    hdr.type = rec->type;
+    hdr.length = (uint32_t)recLen;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), rec, recLen);
+
+    return sizeof(hdr) + recLen;
+}
+
+#define JOURNAL_TERMINATE(s)        ((s)[sizeof(s) - 1] = '\0')
+
+/*
+ * Decodes journal entry @seq from @buf into @rec. Fails on a slot holding a
+ * different entry, an unknown type or a length that doesn't match it. The
+ * strings of a decoded record are always terminated.
+ */
+static inline bool sleepWakeJournalDecode(const uint8_t *buf, size_t len, uint64_t seq,
+                                          SleepWakeJournalRecord *rec)
+{
+    SleepWakeJournalSlotHeader  hdr;
+    size_t                      recLen;
+
+    if (len < sizeof(hdr)) {
+        return false;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    recLen = sleepWakeJournalRecordLen(hdr.type);
+    if (hdr.seq != seq || !recLen || hdr.length != recLen || len < sizeof(hdr) + recLen) {
+        return false;
+    }
+
+    memset(rec, 0, sizeof(*rec));
+    memcpy(rec, buf + sizeof(hdr), recLen);
+    rec->type = hdr.type;
+
+    JOURNAL_TERMINATE(rec->uuid);
+    JOURNAL_TERMINATE(rec->sig);
+    switch (rec->type) {
+        case kJournalSleep:
+            JOURNAL_TERMINATE(rec->u.sleep.reason);
+            JOURNAL_TERMINATE(rec->u.sleep.tcpKeepAlive);
+            JOURNAL_TERMINATE(rec->u.sleep.failure);
+            break;
+        case kJournalWake:
+            if (rec->u.wake.claimCount > kJournalClaimsMax) {
+                rec->u.wake.claimCount = kJournalClaimsMax;
+            }
+            JOURNAL_TERMINATE(rec->u.wake.sleepType);
+            JOURNAL_TERMINATE(rec->u.wake.detail);
+            JOURNAL_TERMINATE(rec->u.wake.failure);
+            for (int i = 0; i < kJournalClaimsMax; i++) {
+                JOURNAL_TERMINATE(rec->u.wake.claimReason[i]);
+                JOURNAL_TERMINATE(rec->u.wake.claimDetails[i]);
+            }
+            break;
+        case kJournalAppWakeReason:
+            JOURNAL_TERMINATE(rec->u.appWake.ident);
+            JOURNAL_TERMINATE(rec->u.appWake.reason);
+            break;
+        default:
+            break;
+    }
+
+    return true;
+}
+
+/*
+ * Queues @rec. When the ring is full the oldest record is dropped and
+ * counted. Returns false, queueing nothing, for a record of unknown type.
+ */
+static inline bool sleepWakeJournalPost(SleepWakeJournal *j, const SleepWakeJournalRecord *rec)
+{
+    if (!sleepWakeJournalRecordLen(rec->type)) {
+        return false;
+    }
+    if (j->head - j->tail == kSleepWakeJournalDepth) {
+        j->tail++;
+        j->dropped++;
+    }
+    sleepWakeJournalEncode(rec, j->head, j->slots[j->head % kSleepWakeJournalDepth], kJournalSlotLen);
+    j->head++;
+
+    return true;
+}
+
+/*
+ * Takes the oldest queued record. Returns false once the ring is empty.
+ * Records whose slot doesn't decode are skipped and counted as dropped.
+ */
+static inline bool sleepWakeJournalTake(SleepWakeJournal *j, SleepWakeJournalRecord *rec)
+{
+    while (j->tail != j->head) {
+        uint64_t seq = j->tail++;
+
+        if (sleepWakeJournalDecode(j->slots[seq % kSleepWakeJournalDepth], kJournalSlotLen, seq, rec)) {
+            return true;
+        }
+        j->dropped++;
+    }
+    return false;
+}
+
+#endif /* SleepWakeJournal_h */
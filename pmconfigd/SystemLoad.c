@@ -49,9 +49,27 @@ static int minOfThree(int a, int b, int c);
 
 extern uint32_t                     gDebugFlags;
 // Forwards
-const bool  kNoNotify  = false;
-const bool  kYesNotify = true;
-static void shareTheSystemLoad(bool shouldNotify);
+/* System load signals
+ *
+ * Every input to the system load advisory is modelled as a signal. Producers
+ * update the globals backing a signal and then call systemLoadSignalChanged().
+ * That marks the levels depending on the signal dirty and schedules a single
+ * recompute at the end of the current main queue turn, so a burst of battery,
+ * thermal and CPU power updates results in one recompute and one publish.
+ */
+typedef enum {
+    kSystemLoadSignalBattery        = (1 << 0),     // onACPower, batteryBelowThreshold
+    kSystemLoadSignalThermal        = (1 << 1),     // thermalPressureLevel
+    kSystemLoadSignalCPUPower       = (1 << 2),     // plimits, cores, forced idle, thermal warning
+    kSystemLoadSignalUser           = (1 << 3),     // gUserActive.loggedIn
+    kSystemLoadSignalDisplay        = (1 << 4),     // displayIsOff
+    kSystemLoadSignalDWBT           = (1 << 5),     // _DWBT_enabled()
+    kSystemLoadSignalPowerState     = (1 << 6),     // isA_BTMtnceWake()
+    kSystemLoadSignalAll            = 0x7f
+} SystemLoadSignal;
+
+static void systemLoadSignalChanged(uint32_t signals);
+static void shareTheSystemLoad(void);
 
 static char *sysload_qname = "com.apple.powermanagement.systemload";
 static dispatch_queue_t  sysloadQ;
@@ -449,29 +467,26 @@ CFAbsoluteTime get_SleepFromUserWakeTime(void)
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static void shareTheSystemLoad(bool shouldNotify)
-{
-    static uint64_t         lastSystemLoad  = 0;
-    uint64_t                theseSystemLoad = 0;
-    int                     userLevel       = kIOSystemLoadAdvisoryLevelGreat;
-    int                     batteryLevel    = kIOSystemLoadAdvisoryLevelGreat;
-    int                     powerLevel      = kIOSystemLoadAdvisoryLevelGreat;
-    int                     combinedLevel   = kIOSystemLoadAdvisoryLevelGreat;
-
 /******************************************
  * Power Level Computation code begins here
- * Edit this block of code to change what
+ * Edit these functions to change what
  * defines a "good time" to do work, based on system load.
  */
 /******************************************/
 
+static int computeBatteryLevel(void)
+{
     if (onACPower) {
-        batteryLevel = kIOSystemLoadAdvisoryLevelGreat;
+        return kIOSystemLoadAdvisoryLevelGreat;
     } else if (!batteryBelowThreshold) {
-        batteryLevel = kIOSystemLoadAdvisoryLevelOK;
-    } else {
-        batteryLevel = kIOSystemLoadAdvisoryLevelBad;
+        return kIOSystemLoadAdvisoryLevelOK;
     }
+    return kIOSystemLoadAdvisoryLevelBad;
+}
+
+static int computePowerLevel(void)
+{
+    int powerLevel = kIOSystemLoadAdvisoryLevelGreat;
 
     if (!tpl_supported) {
         // Check plimits and GFI only if pressure levels are not
@@ -498,6 +513,12 @@ static void shareTheSystemLoad(bool shouldNotify)
             powerLevel = kIOSystemLoadAdvisoryLevelBad;
         }
     }
+    return powerLevel;
+}
+
+static int computeUserLevel(void)
+{
+    int userLevel = kIOSystemLoadAdvisoryLevelGreat;
 
     // TODO: Use seconds since last UI activity as an indicator of
     // userLevel. Basing this data on display dimming is a crutch,
@@ -521,90 +542,188 @@ static void shareTheSystemLoad(bool shouldNotify)
         // TODO: If user is performing a full screen activity, or
         // is actively producing UI events, time is BAD.
     }
-
-    // The combined level is the lowest/worst level of the contributing factors
-    combinedLevel = minOfThree(userLevel, batteryLevel, powerLevel);
+    return userLevel;
+}
 
 /******************************************/
 /* Power Level Computation code ends here */
 /******************************************/
 
-    theseSystemLoad = combinedLevel
-                | (userLevel << 8)
-                | (batteryLevel << 16)
-                | (powerLevel << 24);
+/* Dependency graph
+ * Each level is a node that is recomputed only when one of its input
+ * signals is dirty. The combined level is the lowest/worst of the nodes.
+ */
+enum {
+    kSystemLoadNodeUser = 0,
+    kSystemLoadNodeBattery,
+    kSystemLoadNodePower,
+    kSystemLoadNodeCount
+};
+
+typedef struct {
+    uint32_t    inputs;
+    int         (*compute)(void);
+    int         level;
+} SystemLoadNode;
+
+static SystemLoadNode systemLoadNodes[kSystemLoadNodeCount] = {
+    [kSystemLoadNodeUser] = {
+        kSystemLoadSignalUser | kSystemLoadSignalDisplay | kSystemLoadSignalDWBT | kSystemLoadSignalPowerState,
+        computeUserLevel, kIOSystemLoadAdvisoryLevelGreat },
+    [kSystemLoadNodeBattery] = {
+        kSystemLoadSignalBattery,
+        computeBatteryLevel, kIOSystemLoadAdvisoryLevelGreat },
+    [kSystemLoadNodePower] = {
+        kSystemLoadSignalThermal | kSystemLoadSignalCPUPower,
+        computePowerLevel, kIOSystemLoadAdvisoryLevelGreat },
+};
+
+static uint32_t dirtySystemLoadSignals      = kSystemLoadSignalAll;
+static bool     systemLoadRecomputePending  = false;
+
+static void systemLoadSignalChanged(uint32_t signals)
+{
+    dirtySystemLoadSignals |= signals;
 
-    if (theseSystemLoad != lastSystemLoad)
-    {
-        CFMutableDictionaryRef publishDetails = NULL;
-        CFNumberRef publishNum = NULL;
+#ifdef XCTEST
+    shareTheSystemLoad();
+#else
+    if (systemLoadRecomputePending) {
+        return;
+    }
+    systemLoadRecomputePending = true;
 
-        lastSystemLoad = theseSystemLoad;
+    // Runs after whatever else is already queued in this turn
+    dispatch_async(_getPMMainQueue(), ^{
+        systemLoadRecomputePending = false;
+        shareTheSystemLoad();
+    });
+#endif
+}
 
-        /* Publish the combinedLevel under our notify key 'kIOSystemLoadAdvisoryNotifyName'
-         */
-        notify_set_state(gNotifyToken, (uint64_t)combinedLevel);
+/* copyLevelNumber
+ * Level values are tiny; keep one CFNumber per level around rather than
+ * allocating fresh ones on every publish.
+ */
+static CFNumberRef copyLevelNumber(int level)
+{
+    static CFNumberRef levelNumbers[kIOSystemLoadAdvisoryLevelGreat + 1];
 
-        /* Publish the SystemLoad key read by API
-         * IOGetSystemLoadAdvisory();
-         */
-        publishNum = CFNumberCreate(0, kCFNumberSInt64Type, &theseSystemLoad);
-        if (publishNum)
-        {
-            PMStoreSetValue(systemLoadKey, publishNum);
-            CFRelease(publishNum);
-            publishNum = NULL;
+    if ((level < 0) || (level > kIOSystemLoadAdvisoryLevelGreat)) {
+        return CFNumberCreate(0, kCFNumberIntType, &level);
+    }
+    if (!levelNumbers[level]) {
+        levelNumbers[level] = CFNumberCreate(0, kCFNumberIntType, &level);
+        if (!levelNumbers[level]) {
+            return NULL;
         }
+    }
+    return CFRetain(levelNumbers[level]);
+}
 
-        /* Publish the Detailed key read by API
-         * CFDictionaryRef IOPMCheckSystemLoadDetailed();
-         */
-        publishDetails = CFDictionaryCreateMutable(0, 0,
+static void publishTheSystemLoad(uint64_t theseSystemLoad, int userLevel,
+                                 int batteryLevel, int powerLevel, int combinedLevel)
+{
+    CFMutableDictionaryRef  publish = NULL;
+    CFDictionaryRef         publishDetails = NULL;
+    CFNumberRef             publishNum = NULL;
+    const void              *detailKeys[4];
+    const void              *detailValues[4];
+    int                     i;
+
+    /* Publish the combinedLevel under our notify key 'kIOSystemLoadAdvisoryNotifyName'
+     */
+    notify_set_state(gNotifyToken, (uint64_t)combinedLevel);
+
+    publish = CFDictionaryCreateMutable(0, 2,
+                            &kCFTypeDictionaryKeyCallBacks,
+                            &kCFTypeDictionaryValueCallBacks);
+    if (!publish) return;
+
+    /* The SystemLoad key read by API
+     * IOGetSystemLoadAdvisory();
+     */
+    publishNum = CFNumberCreate(0, kCFNumberSInt64Type, &theseSystemLoad);
+    if (publishNum)
+    {
+        CFDictionarySetValue(publish, systemLoadKey, publishNum);
+        CFRelease(publishNum);
+        publishNum = NULL;
+    }
+
+    /* The Detailed key read by API
+     * CFDictionaryRef IOPMCheckSystemLoadDetailed();
+     */
+    detailKeys[0] = kIOSystemLoadAdvisoryUserLevelKey;
+    detailValues[0] = copyLevelNumber(userLevel);
+    detailKeys[1] = kIOSystemLoadAdvisoryBatteryLevelKey;
+    detailValues[1] = copyLevelNumber(batteryLevel);
+    detailKeys[2] = kIOSystemLoadAdvisoryThermalLevelKey;
+    detailValues[2] = copyLevelNumber(powerLevel);
+    detailKeys[3] = kIOSystemLoadAdvisoryCombinedLevelKey;
+    detailValues[3] = copyLevelNumber(combinedLevel);
+
+    if (detailValues[0] && detailValues[1] && detailValues[2] && detailValues[3]) {
+        publishDetails = CFDictionaryCreate(0, detailKeys, detailValues, 4,
                                 &kCFTypeDictionaryKeyCallBacks,
                                 &kCFTypeDictionaryValueCallBacks);
-        if (!publishDetails) return;
-        publishNum = CFNumberCreate(0, kCFNumberIntType, &userLevel);
-        if (publishNum) {
-            CFDictionarySetValue(publishDetails,
-                                    kIOSystemLoadAdvisoryUserLevelKey,
-                                    publishNum);
-            CFRelease(publishNum);
-            publishNum = 0;
-        }
-        publishNum = CFNumberCreate(0, kCFNumberIntType, &batteryLevel);
-        if (publishNum) {
-            CFDictionarySetValue(publishDetails,
-                                    kIOSystemLoadAdvisoryBatteryLevelKey,
-                                    publishNum);
-            CFRelease(publishNum);
-            publishNum = 0;
-        }
-        publishNum = CFNumberCreate(0, kCFNumberIntType, &powerLevel);
-        if (publishNum) {
-            CFDictionarySetValue(publishDetails,
-                                    kIOSystemLoadAdvisoryThermalLevelKey,
-                                    publishNum);
-            CFRelease(publishNum);
-            publishNum = 0;
-        }
-        publishNum = CFNumberCreate(0, kCFNumberIntType, &combinedLevel);
-        if (publishNum) {
-            CFDictionarySetValue(publishDetails,
-                                    kIOSystemLoadAdvisoryCombinedLevelKey,
-                                    publishNum);
-            CFRelease(publishNum);
-            publishNum = 0;
-        }
-
-        // Publish SystemLoadDetailed
-        PMStoreSetValue(systemLoadDetailedKey, publishDetails);
+    }
+    for (i = 0; i < 4; i++) {
+        if (detailValues[i]) CFRelease(detailValues[i]);
+    }
+    if (publishDetails) {
+        CFDictionarySetValue(publish, systemLoadDetailedKey, publishDetails);
         CFRelease(publishDetails);
+    }
+
+    // Publish SystemLoad and SystemLoadDetailed in one store update, and
+    // get it out before clients are told to go read it.
+    PMStoreSetValues(publish);
+    PMStoreFlush();
+    CFRelease(publish);
+
+    // post notification
+    notify_post(kIOSystemLoadAdvisoryNotifyName);
+}
+
+static void shareTheSystemLoad(void)
+{
+    static uint64_t         lastSystemLoad  = 0;
+    uint64_t                theseSystemLoad = 0;
+    uint32_t                dirty           = dirtySystemLoadSignals;
+    int                     combinedLevel   = kIOSystemLoadAdvisoryLevelGreat;
+    int                     i;
 
-        // post notification
-        if (shouldNotify) {
-            notify_post(kIOSystemLoadAdvisoryNotifyName);
+    dirtySystemLoadSignals = 0;
+    if (!dirty) {
+        return;
+    }
+
+    for (i = 0; i < kSystemLoadNodeCount; i++) {
+        if (systemLoadNodes[i].inputs & dirty) {
+            systemLoadNodes[i].level = systemLoadNodes[i].compute();
         }
     }
+
+    // The combined level is the lowest/worst level of the contributing factors
+    combinedLevel = minOfThree(systemLoadNodes[kSystemLoadNodeUser].level,
+                               systemLoadNodes[kSystemLoadNodeBattery].level,
+                               systemLoadNodes[kSystemLoadNodePower].level);
+
+    theseSystemLoad = combinedLevel
+                | (systemLoadNodes[kSystemLoadNodeUser].level << 8)
+                | (systemLoadNodes[kSystemLoadNodeBattery].level << 16)
+                | (systemLoadNodes[kSystemLoadNodePower].level << 24);
+
+    if (theseSystemLoad != lastSystemLoad)
+    {
+        lastSystemLoad = theseSystemLoad;
+        publishTheSystemLoad(theseSystemLoad,
+                             systemLoadNodes[kSystemLoadNodeUser].level,
+                             systemLoadNodes[kSystemLoadNodeBattery].level,
+                             systemLoadNodes[kSystemLoadNodePower].level,
+                             combinedLevel);
+    }
 }
 
 
@@ -836,7 +955,7 @@ __private_extern__ void SystemLoad_prime(void)
                               ^(int token) {
                                     notify_get_state(token, &thermalPressureLevel);
                                     tpl_supported = 1;
-                                    shareTheSystemLoad(kYesNotify);
+                                    systemLoadSignalChanged(kSystemLoadSignalThermal);
                               });
 
 }
@@ -874,7 +993,7 @@ __private_extern__ void SystemLoadDisplayPowerStateHasChanged(bool _displayIsOff
     }
     INFO_LOG("Display state: %s NotificationWake : %d\n", (displayIsOff ? "Off" : "On"), isA_NotificationDisplayWake());
 
-    shareTheSystemLoad(kYesNotify);
+    systemLoadSignalChanged(kSystemLoadSignalDisplay);
     evaluateHidIdleNotification();
     InternalEvaluateProcTimerOnDisplayStateChange(_displayIsOff);
     logAssertionCount(displayIsOff);
@@ -946,7 +1065,6 @@ __private_extern__ void updateOnenessState(xpc_object_t connection, xpc_object_t
  */
 __private_extern__ void SystemLoadPrefsHaveChanged(void)
 {
-    SCDynamicStoreRef   _store       = _getSharedPMDynamicStore();
     CFDictionaryRef     liveSettings = NULL;
     CFNumberRef         displaySleep = NULL;
     CFTypeRef           dwbt = NULL;
@@ -955,8 +1073,7 @@ __private_extern__ void SystemLoadPrefsHaveChanged(void)
     static int          lastDWBT = -1;
     bool                notify = false;
 
-    liveSettings = SCDynamicStoreCopyValue(_store,
-                        CFSTR(kIOPMDynamicStoreSettingsKey));
+    liveSettings = PMStoreCopyValue(CFSTR(kIOPMDynamicStoreSettingsKey));
     if (liveSettings)
     {
         displaySleep = CFDictionaryGetValue(liveSettings,
@@ -988,7 +1105,7 @@ __private_extern__ void SystemLoadPrefsHaveChanged(void)
     }
 
     if (notify)
-        shareTheSystemLoad(kYesNotify);
+        systemLoadSignalChanged(kSystemLoadSignalDWBT);
     return;
 }
 
@@ -1038,10 +1155,15 @@ __private_extern__ void SystemLoadBatteriesHaveChanged(int count)
 
 exit:
     dispatch_async(_getPMMainQueue(), ^() {
+        if ((onACPower == local_onACPower)
+            && (onBatteryPower == local_onBatteryPower)
+            && (batteryBelowThreshold == local_batteryBelowThreshold)) {
+            return;
+        }
         onACPower = local_onACPower;
         onBatteryPower = local_onBatteryPower;
         batteryBelowThreshold = local_batteryBelowThreshold;
-        shareTheSystemLoad(kYesNotify);
+        systemLoadSignalChanged(kSystemLoadSignalBattery);
     });
 }
 
@@ -1137,7 +1259,7 @@ __private_extern__ void SystemLoadCPUPowerHasChanged(CFDictionaryRef newCPU)
         forcedIdle = true;
     }
 
-    shareTheSystemLoad(kYesNotify);
+    systemLoadSignalChanged(kSystemLoadSignalCPUPower);
 
 exit:
     if (ourAllocatedCPU)
@@ -1168,12 +1290,12 @@ __private_extern__ void SystemLoadUserStateHasChanged(void)
         CFRelease(loggedInUserName);
     }
 
-    shareTheSystemLoad(kYesNotify);
+    systemLoadSignalChanged(kSystemLoadSignalUser);
 }
 
 __private_extern__ void SystemLoadSystemPowerStateHasChanged(void)
 {
-    shareTheSystemLoad(kYesNotify);
+    systemLoadSignalChanged(kSystemLoadSignalPowerState);
 }
 
 /*! SystemLoadUserActiveAssertions
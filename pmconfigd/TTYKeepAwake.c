@@ -67,19 +67,38 @@
 // dev_path_t also in kextmanager_types.h but it needs IOKitLib.h
 typedef char dev_path_t[DEVMAXPATHSIZE];
 
-SLIST_HEAD(ttyhead, ttyentry);
+/* Every remote tty listed in utmpx has a ttyentry, found through a small
+ * hash on its device path.
+ *
+ * Active ttys (accessed within the idle sleep time) sit in a min-heap keyed
+ * on the time they'll go idle. A tty's access time only moves forward, so
+ * its deadline can only move later; we only need to stat() the ttys whose
+ * deadline has passed. Idle ttys are kept on s_idlettys and are only
+ * re-examined when someone asks whether the system may sleep.
+ */
+LIST_HEAD(ttylist, ttyentry);
 struct ttyentry {
-    dev_path_t ttydev;
-    SLIST_ENTRY(ttyentry) next;
+    dev_path_t              ttydev;
+    time_t                  deadline;       // last known atime + idle sleep time
+    size_t                  heapIndex;      // valid while active
+    uint32_t                generation;     // last read_logins() pass that saw this tty
+    bool                    active;
+    LIST_ENTRY(ttyentry)    hashLink;
+    LIST_ENTRY(ttyentry)    idleLink;       // valid while idle
 };
 
-static char                     s_activetty_names[DEVMAXPATHSIZE * 4];
+#define kTTYHashBuckets 64
 
 #define kMinIdleCheckTime 10
 static CFStringRef kTTYAssertion = CFSTR("com.apple.powermanagement.ttyassertion");
 
 // Globals protected by s_tty_queue
-static struct ttyhead           s_activettys = SLIST_HEAD_INITIALIZER(s_activettys);
+static struct ttylist           s_ttyhash[kTTYHashBuckets];
+static struct ttylist           s_idlettys = LIST_HEAD_INITIALIZER(s_idlettys);
+static struct ttyentry          **s_activeheap = NULL;
+static size_t                   s_activecount = 0;
+static size_t                   s_activecapacity = 0;
+static uint32_t                 s_generation = 0;
 static time_t                   settingIdleSleepSeconds = 0;
 static bool                     settingTTYSPreventSleep = true;
 static IOPMAssertionID          s_assertion = 0;
@@ -89,9 +108,13 @@ static dispatch_queue_t         s_tty_queue;
 
 // Protos
 static void freettys(void);
-static void addtty(char *ttyname);
+static struct ttyentry *findtty(const char *ttydev, uint32_t *bucket);
+static void addtty(const char *ttyname);
+static void removetty(struct ttyentry *tty);
+static void refreshtty(struct ttyentry *tty, time_t curtime);
 static void read_logins(void);
-static boolean_t ttys_are_active(time_t *time_to_idle_out);
+static boolean_t ttys_are_active(bool recheckIdle, time_t *time_to_idle_out);
+static bool consider_assertion(bool recheckIdle);
 static void create_assertion(void);
 static void release_assertion(void);
 static void rearm_timer(time_t time_to_idle);
@@ -101,7 +124,6 @@ static void cleanup_tty_tracking(void);
 /* __private_extern__ */
 void TTYKeepAwake_prime(void)
 {
-    dispatch_queue_t    q_default;
     uint32_t            status;
     int                 result = -1;
 
@@ -110,26 +132,26 @@ void TTYKeepAwake_prime(void)
         goto finish;
     }
 
-    q_default = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-    if (!q_default) {
-        goto finish;
+    for (int i = 0; i < kTTYHashBuckets; i++) {
+        LIST_INIT(&s_ttyhash[i]);
     }
 
     status = notify_register_dispatch(UTMPX_CHANGE_NOTIFICATION,
-        &s_utmpx_notify_token, q_default, ^(int t){ read_logins(); });
+        &s_utmpx_notify_token, s_tty_queue, ^(int t){ read_logins(); });
     if (status != NOTIFY_STATUS_OK) {
         result = -1;
         goto finish;
     }
 
     s_timer_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
-        q_default);
+        s_tty_queue);
     if (!s_timer_source) {
         result = -1;
         goto finish;
     }
     dispatch_source_set_event_handler(s_timer_source, ^{ 
-        TTYKeepAwakeConsiderAssertion();
+        // Only ttys whose deadline passed need a look
+        consider_assertion(false);
     });
     dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
     dispatch_resume(s_timer_source);
@@ -138,7 +160,7 @@ void TTYKeepAwake_prime(void)
     TTYKeepAwakePrefsHaveChanged();
 
     // load up current user list
-    read_logins();
+    dispatch_async(s_tty_queue, ^{ read_logins(); });
 
     result = 0;    // hooray
 finish:
@@ -196,12 +218,23 @@ void TTYKeepAwakePrefsHaveChanged( void )
     CFNumberGetValue(ttysPreventNum, kCFNumberIntType, &ttysPreventSleep);
 
     dispatch_async(s_tty_queue, ^{
-        settingIdleSleepSeconds = systemIdleMinutes * SEC_PER_MIN;
+        time_t          curtime = time(NULL);
+        struct ttyentry *tty;
+
         settingTTYSPreventSleep = ttysPreventSleep;
+        if (settingIdleSleepSeconds != (time_t)(systemIdleMinutes * SEC_PER_MIN)) {
+            settingIdleSleepSeconds = systemIdleMinutes * SEC_PER_MIN;
+
+            // Every deadline depends on the idle time; recompute them all
+            for (int i = 0; i < kTTYHashBuckets; i++) {
+                LIST_FOREACH(tty, &s_ttyhash[i], hashLink) {
+                    refreshtty(tty, curtime);
+                }
+            }
+        }
+        consider_assertion(true);
     });
 
-    TTYKeepAwakeConsiderAssertion();
-
 finish:
     if (activePMSettings) CFRelease(activePMSettings);
 
@@ -210,12 +243,30 @@ finish:
 
 /* __private_extern__ */
 bool  TTYKeepAwakeConsiderAssertion( void )
+{
+    __block bool allow_sleep = true;
+
+    if (!s_tty_queue)
+        return true;
+
+    dispatch_sync(s_tty_queue, ^{
+        allow_sleep = consider_assertion(true);
+    });
+
+    return allow_sleep;
+}
+
+/* consider_assertion
+ * Must be called on s_tty_queue. 'recheckIdle' also re-examines ttys that
+ * were idle last time we looked.
+ */
+static bool consider_assertion(bool recheckIdle)
 {
     boolean_t active;
     bool allow_sleep = true;
     time_t time_to_idle = 0;
 
-    active = ttys_are_active(&time_to_idle);
+    active = ttys_are_active(recheckIdle, &time_to_idle);
 
     if (active && settingTTYSPreventSleep) 
     {
@@ -231,12 +282,21 @@ bool  TTYKeepAwakeConsiderAssertion( void )
     return allow_sleep;
 }
 
+/* read_logins
+ * Runs on s_tty_queue whenever utmpx changes. Ttys that are already tracked
+ * keep their state; only new entries are stat()ed and only entries that
+ * disappeared are freed.
+ */
 static void read_logins(void)
 {
     struct utmpx *ent;
-    int cnt = 0;
+    struct ttyentry *tty;
+    struct ttyentry *tmptty;
+    uint32_t added = 0, removed = 0;
 
-    freettys();
+    if (++s_generation == 0) {
+        s_generation = 1;
+    }
 
     setutxent();
     while((ent = getutxent())) 
@@ -248,173 +308,305 @@ static void read_logins(void)
          */
         if (0 < strlen(ent->ut_host))
         {
-            addtty(ent->ut_line);            
-            cnt++;
+            dev_path_t ttydev;
+
+            if (strlcpy(ttydev, "/dev/", sizeof(ttydev)) >= sizeof(ttydev) ||
+                strlcat(ttydev, ent->ut_line, sizeof(ttydev)) >= sizeof(ttydev)) {
+                continue;
+            }
+
+            tty = findtty(ttydev, NULL);
+            if (tty) {
+                tty->generation = s_generation;
+            } else {
+                addtty(ttydev);
+                added++;
+            }
         }
     }
     endutxent();
 
-    TTYKeepAwakeConsiderAssertion();
+    for (int i = 0; i < kTTYHashBuckets; i++) {
+        LIST_FOREACH_SAFE(tty, &s_ttyhash[i], hashLink, tmptty) {
+            if (tty->generation != s_generation) {
+                removetty(tty);
+                removed++;
+            }
+        }
+    }
+
+    if (added || removed) {
+        DEBUG_LOG("TTYKeepAwake: %u ttys added, %u removed\n", added, removed);
+        consider_assertion(false);
+    }
+}
+
+static uint32_t ttyhash(const char *ttydev)
+{
+    uint32_t h = 5381;
+
+    while (*ttydev) {
+        h = (h * 33) ^ (uint8_t)*ttydev++;
+    }
+    return h % kTTYHashBuckets;
+}
+
+static struct ttyentry *findtty(const char *ttydev, uint32_t *bucket)
+{
+    struct ttyentry *tty;
+    uint32_t        b = ttyhash(ttydev);
+
+    if (bucket) {
+        *bucket = b;
+    }
+    LIST_FOREACH(tty, &s_ttyhash[b], hashLink) {
+        if (!strcmp(tty->ttydev, ttydev)) {
+            return tty;
+        }
+    }
+    return NULL;
+}
+
+#pragma mark Active heap
+
+static void heap_swap(size_t a, size_t b)
+{
+    struct ttyentry *tmp = s_activeheap[a];
+
+    s_activeheap[a] = s_activeheap[b];
+    s_activeheap[b] = tmp;
+    s_activeheap[a]->heapIndex = a;
+    s_activeheap[b]->heapIndex = b;
+}
+
+static void heap_siftup(size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (s_activeheap[parent]->deadline <= s_activeheap[i]->deadline) {
+            break;
+        }
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void heap_siftdown(size_t i)
+{
+    for (;;) {
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        size_t smallest = i;
+
+        if (left < s_activecount && s_activeheap[left]->deadline < s_activeheap[smallest]->deadline) {
+            smallest = left;
+        }
+        if (right < s_activecount && s_activeheap[right]->deadline < s_activeheap[smallest]->deadline) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            break;
+        }
+        heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static bool heap_insert(struct ttyentry *tty)
+{
+    if (s_activecount == s_activecapacity) {
+        size_t newCapacity = s_activecapacity ? (2 * s_activecapacity) : 16;
+        struct ttyentry **newHeap = realloc(s_activeheap, newCapacity * sizeof(*newHeap));
+        if (!newHeap) {
+            return false;
+        }
+        s_activeheap = newHeap;
+        s_activecapacity = newCapacity;
+    }
+    tty->heapIndex = s_activecount++;
+    s_activeheap[tty->heapIndex] = tty;
+    heap_siftup(tty->heapIndex);
+    return true;
+}
+
+static void heap_remove(struct ttyentry *tty)
+{
+    size_t i = tty->heapIndex;
+
+    s_activecount--;
+    if (i != s_activecount) {
+        heap_swap(i, s_activecount);
+        heap_siftdown(i);
+        heap_siftup(i);
+    }
+}
+
+#pragma mark -
+
+static void settty_idle(struct ttyentry *tty)
+{
+    if (tty->active) {
+        heap_remove(tty);
+        tty->active = false;
+        LIST_INSERT_HEAD(&s_idlettys, tty, idleLink);
+    }
+}
+
+/* refreshtty
+ * stat()s the tty and files it on the active heap or the idle list.
+ */
+static void refreshtty(struct ttyentry *tty, time_t curtime)
+{
+    struct stat sb;
+
+    if ((0 != stat(tty->ttydev, &sb)) || (curtime == (time_t)-1)) {
+        settty_idle(tty);
+        return;
+    }
+
+    // Subtract one second so we aren't racing to check at expiration
+    tty->deadline = sb.st_atime + settingIdleSleepSeconds - 1;
+
+    if (tty->deadline < curtime) {
+        settty_idle(tty);
+    } else if (tty->active) {
+        heap_siftdown(tty->heapIndex);
+        heap_siftup(tty->heapIndex);
+    } else {
+        LIST_REMOVE(tty, idleLink);
+        if (heap_insert(tty)) {
+            tty->active = true;
+        } else {
+            LIST_INSERT_HEAD(&s_idlettys, tty, idleLink);
+        }
+    }
 }
 
 static void freettys(void)
 {
-    if (s_tty_queue) {
-        dispatch_sync(s_tty_queue, ^{
-            struct ttyentry *tty;
-            struct ttyentry *tmptty;
+    struct ttyentry *tty;
+    struct ttyentry *tmptty;
 
-            SLIST_FOREACH_SAFE(tty, &s_activettys, next, tmptty) {
-                SLIST_REMOVE(&s_activettys, tty, ttyentry, next);
-                free(tty);
-            }
-        });
+    for (int i = 0; i < kTTYHashBuckets; i++) {
+        LIST_FOREACH_SAFE(tty, &s_ttyhash[i], hashLink, tmptty) {
+            removetty(tty);
+        }
     }
+    free(s_activeheap);
+    s_activeheap = NULL;
+    s_activecount = s_activecapacity = 0;
 }
 
-static void addtty(char *ttyname)
+static void addtty(const char *ttydev)
 {
     struct ttyentry *tty;
-    size_t len;
+    uint32_t bucket = ttyhash(ttydev);
 
-    tty = malloc(sizeof(*tty));
+    tty = calloc(1, sizeof(*tty));
     if (!tty) 
-        goto finish;
-
-    len = strlcpy(tty->ttydev, "/dev/", sizeof(tty->ttydev));
-    if (len > sizeof(tty->ttydev))
-        goto finish;
+        return;
 
-    len = strlcat(tty->ttydev, ttyname, sizeof(tty->ttydev));
-    if (len > sizeof(tty->ttydev)) 
-        goto finish;
+    strlcpy(tty->ttydev, ttydev, sizeof(tty->ttydev));
+    tty->generation = s_generation;
 
-    dispatch_async(s_tty_queue, ^{
-        SLIST_INSERT_HEAD(&s_activettys, tty, next);
-    });
-    tty = NULL;
+    LIST_INSERT_HEAD(&s_ttyhash[bucket], tty, hashLink);
+    LIST_INSERT_HEAD(&s_idlettys, tty, idleLink);
+    refreshtty(tty, time(NULL));
+}
 
-finish:
-    if (tty) 
-        free(tty);
-    return;
+static void removetty(struct ttyentry *tty)
+{
+    if (tty->active) {
+        heap_remove(tty);
+    } else {
+        LIST_REMOVE(tty, idleLink);
+    }
+    LIST_REMOVE(tty, hashLink);
+    free(tty);
 }
 
-static boolean_t ttys_are_active(time_t *time_to_idle_out)
+/* ttys_are_active
+ * Must be called on s_tty_queue. Re-stats the ttys whose idle deadline has
+ * passed, plus the idle ttys if 'recheckIdle' is set.
+ */
+static boolean_t ttys_are_active(bool recheckIdle, time_t *time_to_idle_out)
 {	
     time_t curtime;
-    __block time_t time_to_idle;
-    __block boolean_t active = FALSE;
-
-    if (!s_tty_queue)
-        return false;
-    
-    *time_to_idle_out = time_to_idle = 0;
+    struct ttyentry *tty;
+    struct ttyentry *tmptty;
 
-    bzero(s_activetty_names, sizeof(s_activetty_names));
+    *time_to_idle_out = 0;
 
     curtime = time(NULL);
     if (curtime == (time_t)-1) {
-        goto finish;
+        return false;
     }
-    
-    dispatch_sync(s_tty_queue, ^{
-        struct ttyentry *tty;
-        struct stat sb;
-        time_t minimum_idle_secs;
-        bool isPrintedFirst = TRUE;
-
-        minimum_idle_secs = settingIdleSleepSeconds;
-
-        SLIST_FOREACH(tty, &s_activettys, next) {
-            time_t current_idle_secs;
-            int result;
-            
-            result = stat(tty->ttydev, &sb);
-            if (result != 0) 
-                continue;
 
-            // Add one second so we aren't racing to check at expiration
-            current_idle_secs = curtime - sb.st_atime + 1;
-            if (current_idle_secs > settingIdleSleepSeconds) {
-                continue;
-            }
-            minimum_idle_secs = MIN(current_idle_secs, minimum_idle_secs);
-            active = TRUE;
-            
-            if (isPrintedFirst) {
-                isPrintedFirst = FALSE;
-            } else { // print a pretty comma between tty names
-                strlcat(s_activetty_names, ", ", sizeof(s_activetty_names));
-            }
-            
-            // Record the active ttys' device paths in the string s_activetty_names
-            strlcat(s_activetty_names, tty->ttydev, sizeof(s_activetty_names));
+    // Expired deadlines: the tty may have been used since we last looked.
+    // refreshtty() either moves the deadline past curtime or drops the tty
+    // from the heap, so this terminates.
+    while (s_activecount && (s_activeheap[0]->deadline < curtime)) {
+        refreshtty(s_activeheap[0], curtime);
+    }
+
+    if (recheckIdle) {
+        LIST_FOREACH_SAFE(tty, &s_idlettys, idleLink, tmptty) {
+            refreshtty(tty, curtime);
         }
+    }
 
-        time_to_idle = (active) ? (settingIdleSleepSeconds - minimum_idle_secs) : 0;
-    });
+    if (!s_activecount) {
+        return false;
+    }
 
-    *time_to_idle_out = time_to_idle;
-finish:
-    return active;
+    *time_to_idle_out = s_activeheap[0]->deadline - curtime;
+    return true;
 }
 
 static void create_assertion(void)
 {
-    dispatch_sync(s_tty_queue, ^{
-        if (s_assertion == kIOPMNullAssertionID) {
-            InternalCreateAssertionWithTimeout(kIOPMAssertNetworkClientActive, kTTYAssertion, 0, &s_assertion);
-        }
-    });
+    if (s_assertion == kIOPMNullAssertionID) {
+        InternalCreateAssertionWithTimeout(kIOPMAssertNetworkClientActive, kTTYAssertion, 0, &s_assertion);
+    }
 }
 
 static void release_assertion(void)
 {
-    if (!s_tty_queue)
-        return;
-
-    dispatch_sync(s_tty_queue, ^{
-        if (s_assertion != kIOPMNullAssertionID) {
-            InternalReleaseAssertionSync(s_assertion);
-            s_assertion = kIOPMNullAssertionID;
-        }
-    });
+    if (s_assertion != kIOPMNullAssertionID) {
+        InternalReleaseAssertionSync(s_assertion);
+        s_assertion = kIOPMNullAssertionID;
+    }
 }
 
 static void rearm_timer(time_t time_to_idle)
 {
     if (s_timer_source){
-        dispatch_async(s_tty_queue, ^{
-            // XXX MJR - Avoid overflow which leads to powerd spinning at 100% CPU
-            // This is because AppleARMPlatform advertises a very large value for
-            // system idle sleep time.  time_to_idle should never be negative here.
-            int64_t delta = time_to_idle * NSEC_PER_SEC;
-            if (delta <= 0) {
-                delta = INT64_MAX;
-            }
-            dispatch_source_set_timer(s_timer_source,
-                dispatch_time(DISPATCH_TIME_NOW, delta),
-                DISPATCH_TIME_FOREVER, 1 * NSEC_PER_SEC);
-        });
+        // XXX MJR - Avoid overflow which leads to powerd spinning at 100% CPU
+        // This is because AppleARMPlatform advertises a very large value for
+        // system idle sleep time.  time_to_idle should never be negative here.
+        int64_t delta = time_to_idle * NSEC_PER_SEC;
+        if (delta <= 0) {
+            delta = INT64_MAX;
+        }
+        dispatch_source_set_timer(s_timer_source,
+            dispatch_time(DISPATCH_TIME_NOW, delta),
+            DISPATCH_TIME_FOREVER, 1 * NSEC_PER_SEC);
     }
 }
 
 static void pause_timer(void)
 {
-    if (s_timer_source && s_tty_queue) {
-            dispatch_async(s_tty_queue, ^{
-                dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
-            });
+    if (s_timer_source) {
+        dispatch_source_set_timer(s_timer_source, DISPATCH_TIME_FOREVER, 0, 0);
     }
 }
 
 static void cleanup_tty_tracking(void)
 {
-    freettys();        // no-op on empty list; clears list
-
     if (s_tty_queue) {
         dispatch_sync(s_tty_queue, ^{
+            freettys();
+
             if (s_utmpx_notify_token != -1) {
                 notify_cancel(s_utmpx_notify_token);
                 s_utmpx_notify_token = -1;
@@ -430,4 +622,3 @@ static void cleanup_tty_tracking(void)
         s_tty_queue = NULL;
     }
 }
-
@@ -37,6 +37,7 @@
 #include "PrivateLib.h"
 #include "UPSLowPower.h"
 #include "PMSettings.h"
+#include "PMStore.h"
 
 // Data structure to track UPS shutdown thresholds
 #define     kHaltEnabled        0
@@ -56,11 +57,49 @@ IOReturn IOUPSGetEvent(mach_port_t connect, int upsID, CFDictionaryRef *event);
 IOReturn IOUPSGetCapabilities(mach_port_t connect, int upsID, CFSetRef *capabilities);
 #endif
 
+// Per-UPS state, parsed once from each power source update
+#define     kUPSMaxUnits        8
+#define     kUPSValueUnknown    -1
+
+typedef struct {
+    int             upsID;              // kIOPSPowerSourceIDKey; 0 if slot is free
+    bool            onBattery;
+    int             percentRemaining;
+    int             minutesRemaining;
+    CFAbsoluteTime  onBatterySince;
+} ups_unit_struct;
+
+// Host-level view across all attached units. The host loses external power
+// only when every unit is running off its battery; from then on it stays up
+// until the last unit runs out.
+typedef struct {
+    int             unitCount;
+    int             onBatteryCount;
+    int             percentRemaining;   // highest across units on battery
+    int             percentUnit;
+    int             minutesRemaining;   // longest runtime across units on battery
+    int             minutesUnit;
+    int             worstMinutesRemaining; // time until the first unit drops out
+    int             lastOnBatteryUnit;
+} ups_aggregate_struct;
+
+#define kIOPMUPSShutdownReasonKey       "/IOKit/UPSShutdownReason"
+#define kUPSReasonUPSIDKey              "UPSID"
+#define kUPSReasonThresholdKey          "Threshold"
+#define kUPSReasonValueKey              "Value"
+#define kUPSReasonLimitKey              "Limit"
+#define kUPSReasonUnitCountKey          "UnitCount"
+#define kUPSReasonMinutesRemainingKey   "AggregateMinutesRemaining"
+#define kUPSReasonWorstMinutesKey       "WorstCaseMinutesRemaining"
+
 // Globals
+static ups_unit_struct          _upsUnits[kUPSMaxUnits];
+static ups_aggregate_struct     _upsAggregate;
 static const int                _delayedRemovePowerMinutes = 3;
 static const int                _delayBeforeStartupMinutes = 4;
 static CFAbsoluteTime           _switchedToUPSPowerTime = 0.0;
 static threshold_struct        *_thresh;
+static bool                     _shutdownReasonPublished = false;
 #if HAVE_CF_USER_NOTIFICATION
 static CFUserNotificationRef    _UPSAlert = NULL;
 #endif
@@ -76,6 +115,7 @@ static  bool        _weManageUPSPower(void);
 static  void        _getUPSShutdownThresholdsFromDisk(threshold_struct *thresho);
 static  void        _reEvaluatePowerSourcesLater(int seconds);
 static  void        _doPowerEmergencyShutdown(CFNumberRef ups_id);
+static  void        _evaluateUPSPolicy(void);
 
 enum {
     _kIOUPSInternalPowerBit,
@@ -111,170 +151,399 @@ UPSLowPowerPrefsHaveChanged(void)
 }
 
 
-static void
-UPSLowPowerPSChange_sync(void)
+static ups_unit_struct *
+_unitForID(int upsID, bool create)
 {
-    CFDictionaryRef     ups_info = 0;
-    int                 t1, t2;
-    CFNumberRef         n1, n2;
-    int                 minutes_remaining;
-    int                 percent_remaining;
-    CFBooleanRef        isPresent;
-    static int          last_ups_power_source = _kIOUPSExternalPowerBit;
-    CFStringRef         power_source = 0;
-    CFNumberRef         ups_id = 0;
-    
-    // Exit immediately if another application
-    //   is managing emergency UPS shutdown
-    if(!_weManageUPSPower()) {
-        goto _exit_PowerSourcesHaveChanged_;
-    }
-    
-    // *** Inspect UPS power levels
-    // We assume we're only dealing with 1 UPS for simplicity.
-    // The "more than one UPS attached " case is undefined.
-    if((ups_info = getActiveUPSDictionary()))
-    {
-        ups_id = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceIDKey)));
-        if(!ups_id) goto _exit_PowerSourcesHaveChanged_;
-        
-        // Check UPS "Is Present" key
-        isPresent = isA_CFBoolean(CFDictionaryGetValue(ups_info, CFSTR(kIOPSIsPresentKey)));
-        if(!isPresent || !CFBooleanGetValue(isPresent))
-        {
-#if HAVE_CF_USER_NOTIFICATION
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif
-            // If UPS isn't active or connected we shouldn't base policy decisions on it
-            goto _exit_PowerSourcesHaveChanged_;
+    ups_unit_struct *freeSlot = NULL;
+
+    for (int i = 0; i < kUPSMaxUnits; i++) {
+        if (_upsUnits[i].upsID == upsID) {
+            return &_upsUnits[i];
         }
-        
-        // Check Power Source
-        power_source = isA_CFString(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceStateKey)));
-        if(!power_source || !CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue)))
-        {
-#if HAVE_CF_USER_NOTIFICATION
-            // Running off of AC Power
-            if(_UPSAlert)
-            {
-                CFUserNotificationCancel(_UPSAlert);
-                _UPSAlert = 0;
-            }
-#endif                
-            // we have to be draining the internal battery to do a shutdown, so we'll just exit from here.
-            goto _exit_PowerSourcesHaveChanged_;
+        if (!freeSlot && (0 == _upsUnits[i].upsID)) {
+            freeSlot = &_upsUnits[i];
         }
-        
-        // UPS is running off of internal battery power. Show warning if we just switched from AC to battery.
-        if(_kIOUPSExternalPowerBit == last_ups_power_source)
-        {
-            _switchedToUPSPowerTime = CFAbsoluteTimeGetCurrent();
-            
-            if( _thresh->haltafter[kHaltEnabled] ) {    
-                // If there's a "shutdown after X minutes on UPS power" threshold, 
-                // set a timer to remind us to check UPS state again after X minutes
-                _reEvaluatePowerSourcesLater(5 + (60*_thresh->haltafter[kHaltValue]));
-            }
-            
-#if HAVE_CF_USER_NOTIFICATION
-            if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
-#endif 
+    }
+    if (create && freeSlot) {
+        bzero(freeSlot, sizeof(*freeSlot));
+        freeSlot->upsID = upsID;
+        freeSlot->percentRemaining = kUPSValueUnknown;
+        freeSlot->minutesRemaining = kUPSValueUnknown;
+    }
+    return create ? freeSlot : NULL;
+}
 
+/* _recomputeUPSAggregate
+ *
+ * Folds the per-unit state into _upsAggregate. Only called when a unit
+ * changes; policy evaluation reads the aggregate.
+ */
+static void
+_recomputeUPSAggregate(void)
+{
+    ups_aggregate_struct    agg;
+    CFAbsoluteTime          latestSwitch = 0.0;
+
+    bzero(&agg, sizeof(agg));
+    agg.percentRemaining = kUPSValueUnknown;
+    agg.minutesRemaining = kUPSValueUnknown;
+    agg.worstMinutesRemaining = kUPSValueUnknown;
+
+    for (int i = 0; i < kUPSMaxUnits; i++) {
+        ups_unit_struct *u = &_upsUnits[i];
+
+        if (0 == u->upsID) {
+            continue;
+        }
+        agg.unitCount++;
+        if (!u->onBattery) {
+            continue;
         }
+        agg.onBatteryCount++;
 
-        // getActiveBatteryDictionary is an alternative method to IOPSCopyPowerSourcesInfo because it would dispatch
-        // batteryTimeRemainingQ main queue again that causes dead lock
-        CFBooleanRef built_in_battery = IOPSPowerSourceSupported(NULL, CFSTR(kIOPMBatteryPowerKey));
-        CFDictionaryRef battery_info = getActiveBatteryDictionary();
-        if (built_in_battery == kCFBooleanTrue || battery_info)
-        {
-            // Do not do UPS shutdown if internal battery is present.
-            // Internal battery may still be providing power. 
-            // Don't do any further UPS shutdown processing.
-            // PMU will cause an emergency sleep when the battery runs out - we fall back on that
-            // in the battery case.
-            goto _exit_PowerSourcesHaveChanged_;                
+        if (u->onBatterySince >= latestSwitch) {
+            latestSwitch = u->onBatterySince;
+            agg.lastOnBatteryUnit = u->upsID;
         }
-        
-        // ******
-        // ****** Perform emergency shutdown if any of the shutdown thresholds is true
-        
-        // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
-        // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
-        // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
-        if(_secondsSpentOnUPSPower() < 10) {
-            _reEvaluatePowerSourcesLater(10);
-            goto _exit_PowerSourcesHaveChanged_;
-         }
-        
-        // Calculate battery percentage remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSCurrentCapacityKey)));
-        n2 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSMaxCapacityKey)));
-        if(n1 && n2)
-        {
-            if( CFNumberGetValue(n1, kCFNumberIntType, &t1) &&
-                CFNumberGetValue(n2, kCFNumberIntType, &t2)) {
-                percent_remaining = (int)(100.0* ((double)t1) / ((double)t2) );
-    
-                if( _thresh->haltpercent[kHaltEnabled] ) {
-                    if( percent_remaining <= _thresh->haltpercent[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
-            }
+        if (u->percentRemaining > agg.percentRemaining) {
+            agg.percentRemaining = u->percentRemaining;
+            agg.percentUnit = u->upsID;
         }
-        
-        // Get UPS's estimated time remaining
-        n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSTimeToEmptyKey)));
-        if(n1)
-        {
-            if(CFNumberGetValue(n1, kCFNumberIntType, &minutes_remaining))
-            {
-                if( _thresh->haltremain[kHaltEnabled] ) {
-                    if( minutes_remaining <= _thresh->haltremain[kHaltValue] ) {
-                        _doPowerEmergencyShutdown(ups_id);
-                    }
-                }
-            }
+        if (u->minutesRemaining > agg.minutesRemaining) {
+            agg.minutesRemaining = u->minutesRemaining;
+            agg.minutesUnit = u->upsID;
         }
+        if ((u->minutesRemaining != kUPSValueUnknown) &&
+            ((agg.worstMinutesRemaining == kUPSValueUnknown) ||
+             (u->minutesRemaining < agg.worstMinutesRemaining))) {
+            agg.worstMinutesRemaining = u->minutesRemaining;
+        }
+    }
 
-        // Determine how long we've been running on UPS power
-        if( _thresh->haltafter[kHaltEnabled] ) {
-            if(_minutesSpentOnUPSPower() >= _thresh->haltafter[kHaltValue]) {
-                _doPowerEmergencyShutdown(ups_id);
-            }
+    if (agg.unitCount && (agg.onBatteryCount == agg.unitCount)) {
+        // Host lost external power when the last unit switched over
+        _switchedToUPSPowerTime = latestSwitch;
+    }
+    _upsAggregate = agg;
+}
+
+/* _publishShutdownReason
+ *
+ * Records which unit and threshold caused an emergency shutdown.
+ */
+static void
+_publishShutdownReason(int upsID, const char *threshold, int value, int limit)
+{
+    CFMutableDictionaryRef  reason = NULL;
+    CFStringRef             key = NULL;
+    CFNumberRef             n;
+    CFStringRef             str;
+    const struct {
+        CFStringRef key;
+        int         value;
+    } numbers[] = {
+        { CFSTR(kUPSReasonUPSIDKey),            upsID },
+        { CFSTR(kUPSReasonValueKey),            value },
+        { CFSTR(kUPSReasonLimitKey),            limit },
+        { CFSTR(kUPSReasonUnitCountKey),        _upsAggregate.unitCount },
+        { CFSTR(kUPSReasonMinutesRemainingKey), _upsAggregate.minutesRemaining },
+        { CFSTR(kUPSReasonWorstMinutesKey),     _upsAggregate.worstMinutesRemaining },
+    };
+
+    INFO_LOG("UPS shutdown triggered by UPS %d: %s %d (limit %d), units %d, aggregate %d min, worst case %d min\n",
+             upsID, threshold, value, limit, _upsAggregate.unitCount,
+             _upsAggregate.minutesRemaining, _upsAggregate.worstMinutesRemaining);
+
+    reason = CFDictionaryCreateMutable(0, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    key = SCDynamicStoreKeyCreate(0, CFSTR("%@%@"), kSCDynamicStoreDomainState, CFSTR(kIOPMUPSShutdownReasonKey));
+    if (!reason || !key) {
+        goto exit;
+    }
+
+    for (unsigned int i = 0; i < sizeof(numbers)/sizeof(numbers[0]); i++) {
+        n = CFNumberCreate(0, kCFNumberIntType, &numbers[i].value);
+        if (n) {
+            CFDictionarySetValue(reason, numbers[i].key, n);
+            CFRelease(n);
         }
-        
-    } else {
-        // No "active UPS" detected. 
-        // One could have just disappeared - if we're showing an alert, clear it.
+    }
+    str = CFStringCreateWithCString(0, threshold, kCFStringEncodingUTF8);
+    if (str) {
+        CFDictionarySetValue(reason, CFSTR(kUPSReasonThresholdKey), str);
+        CFRelease(str);
+    }
+
+    PMStoreSetValue(key, reason);
+    // Make it visible before upsshutdown runs
+    PMStoreFlush();
+    _shutdownReasonPublished = true;
+
+exit:
+    if (reason)
+        CFRelease(reason);
+    if (key)
+        CFRelease(key);
+}
+
+/* _clearShutdownReason
+ *
+ * Removes the reason published by _publishShutdownReason() once the
+ * condition that caused it has cleared.
+ */
+static void
+_clearShutdownReason(void)
+{
+    CFStringRef key;
+
+    if (!_shutdownReasonPublished) {
+        return;
+    }
+
+    key = SCDynamicStoreKeyCreate(0, CFSTR("%@%@"), kSCDynamicStoreDomainState, CFSTR(kIOPMUPSShutdownReasonKey));
+    if (key) {
+        INFO_LOG("UPS shutdown condition cleared\n");
+        PMStoreRemoveValue(key);
+        CFRelease(key);
+        _shutdownReasonPublished = false;
+    }
+}
+
+static void
+_shutdownForUnit(int upsID, const char *threshold, int value, int limit)
+{
+    CFNumberRef ups_id = CFNumberCreate(0, kCFNumberIntType, &upsID);
+
+    _publishShutdownReason(upsID, threshold, value, limit);
+    _doPowerEmergencyShutdown(ups_id);
+    if (ups_id)
+        CFRelease(ups_id);
+}
+
+static void
+_cancelUPSAlert(void)
+{
 #if HAVE_CF_USER_NOTIFICATION
-        if(_UPSAlert)
-        {
-            CFUserNotificationCancel(_UPSAlert);
-            _UPSAlert = 0;
+    if(_UPSAlert)
+    {
+        CFUserNotificationCancel(_UPSAlert);
+        _UPSAlert = 0;
+    }
+#endif
+}
+
+/* _evaluateUPSThresholds
+ *
+ * Checks the haltpercent, haltremain and haltafter thresholds against the
+ * aggregate of all attached units. Emergency shutdown is only considered
+ * once every unit is running off its battery. Returns true if one of them
+ * triggered a shutdown.
+ */
+static bool
+_evaluateUPSThresholds(void)
+{
+    static bool         hostOnUPSPower = false;
+    bool                wasOnUPSPower = hostOnUPSPower;
+
+    hostOnUPSPower = _upsAggregate.unitCount
+                        && (_upsAggregate.onBatteryCount == _upsAggregate.unitCount);
+
+    // Exit immediately if another application
+    //   is managing emergency UPS shutdown
+    if(!_weManageUPSPower() || !_thresh) {
+        return false;
+    }
+
+    if (!hostOnUPSPower) {
+        // Either no UPS is attached, or at least one still has external power.
+        _cancelUPSAlert();
+        return false;
+    }
+
+    // Show warning if the host just lost its last external power feed.
+    if (!wasOnUPSPower)
+    {
+        if( _thresh->haltafter[kHaltEnabled] ) {
+            // If there's a "shutdown after X minutes on UPS power" threshold,
+            // set a timer to remind us to check UPS state again after X minutes
+            _reEvaluatePowerSourcesLater(5 + (60*_thresh->haltafter[kHaltValue]));
         }
+
+#if HAVE_CF_USER_NOTIFICATION
+        if(!_UPSAlert) _UPSAlert = _copyUPSWarning();
 #endif
     }
-    
-    // exit point
-    _exit_PowerSourcesHaveChanged_:
 
-    if (ups_info) {
-        CFRelease(ups_info);
+    // getActiveBatteryDictionary is an alternative method to IOPSCopyPowerSourcesInfo because it would dispatch
+    // batteryTimeRemainingQ main queue again that causes dead lock
+    CFBooleanRef built_in_battery = IOPSPowerSourceSupported(NULL, CFSTR(kIOPMBatteryPowerKey));
+    CFDictionaryRef battery_info = getActiveBatteryDictionary();
+    bool            has_battery = (battery_info != NULL);
+    if (battery_info) {
+        CFRelease(battery_info);
+    }
+    if (built_in_battery == kCFBooleanTrue || has_battery)
+    {
+        // Do not do UPS shutdown if internal battery is present.
+        // Internal battery may still be providing power.
+        // Don't do any further UPS shutdown processing.
+        // PMU will cause an emergency sleep when the battery runs out - we fall back on that
+        // in the battery case.
+        return false;
+    }
+
+    // ******
+    // ****** Perform emergency shutdown if any of the shutdown thresholds is true
+
+    // Check to make sure that the UPS has been on battery power for a full 10 seconds before initiating a shutdown.
+    // Certain UPS's have reported transient "on battery power with 0% capacity remaining" states for 3-5 seconds.
+    // So we make sure not to heed this shutdown notice unless we've been on battery power for 10 seconds.
+    if(_secondsSpentOnUPSPower() < 10) {
+        _reEvaluatePowerSourcesLater(10);
+        return false;
     }
 
-    if(power_source && CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue))) {
-        last_ups_power_source = _kIOUPSInternalPowerBit;
-    } else {
-        last_ups_power_source = _kIOUPSExternalPowerBit;
+    if( _thresh->haltpercent[kHaltEnabled]
+        && (_upsAggregate.percentRemaining != kUPSValueUnknown)
+        && (_upsAggregate.percentRemaining <= _thresh->haltpercent[kHaltValue]) )
+    {
+        _shutdownForUnit(_upsAggregate.percentUnit, "haltpercent",
+                         _upsAggregate.percentRemaining, _thresh->haltpercent[kHaltValue]);
+        return true;
     }
-    
-    return;
+
+    if( _thresh->haltremain[kHaltEnabled]
+        && (_upsAggregate.minutesRemaining != kUPSValueUnknown)
+        && (_upsAggregate.minutesRemaining <= _thresh->haltremain[kHaltValue]) )
+    {
+        _shutdownForUnit(_upsAggregate.minutesUnit, "haltremain",
+                         _upsAggregate.minutesRemaining, _thresh->haltremain[kHaltValue]);
+        return true;
+    }
+
+    // Determine how long we've been running on UPS power
+    if( _thresh->haltafter[kHaltEnabled]
+        && (_minutesSpentOnUPSPower() >= _thresh->haltafter[kHaltValue]) )
+    {
+        _shutdownForUnit(_upsAggregate.lastOnBatteryUnit, "haltafter",
+                         _minutesSpentOnUPSPower(), _thresh->haltafter[kHaltValue]);
+        return true;
+    }
+
+    return false;
+}
+
+/* _evaluateUPSPolicy
+ *
+ * Runs the shutdown thresholds, and withdraws the published shutdown reason
+ * once none of them holds any more, e.g. after external power came back.
+ */
+static void
+_evaluateUPSPolicy(void)
+{
+    if (!_evaluateUPSThresholds()) {
+        _clearShutdownReason();
+    }
+}
+
+/* UPSLowPowerUnitChanged
+ *
+ * Called from the power sources queue with the latest description of a UPS.
+ * The few values the policy needs are extracted here; evaluation happens
+ * on the main queue against the cached per-unit state.
+ */
+__private_extern__ void
+UPSLowPowerUnitChanged(CFDictionaryRef ups_info)
+{
+    CFNumberRef         n1, n2;
+    CFBooleanRef        isPresent;
+    CFStringRef         power_source;
+    int                 upsID = 0;
+    int                 t1, t2;
+    ups_unit_struct     update;
+
+    if (!isA_CFDictionary(ups_info)) {
+        return;
+    }
+
+    n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceIDKey)));
+    if (!n1 || !CFNumberGetValue(n1, kCFNumberIntType, &upsID) || (0 == upsID)) {
+        return;
+    }
+
+    // If UPS isn't active or connected we shouldn't base policy decisions on it
+    isPresent = isA_CFBoolean(CFDictionaryGetValue(ups_info, CFSTR(kIOPSIsPresentKey)));
+    if (!isPresent || !CFBooleanGetValue(isPresent)) {
+        UPSLowPowerUnitRemoved(upsID);
+        return;
+    }
+
+    bzero(&update, sizeof(update));
+    update.upsID = upsID;
+    update.percentRemaining = kUPSValueUnknown;
+    update.minutesRemaining = kUPSValueUnknown;
+
+    power_source = isA_CFString(CFDictionaryGetValue(ups_info, CFSTR(kIOPSPowerSourceStateKey)));
+    update.onBattery = (power_source && CFEqual(power_source, CFSTR(kIOPSBatteryPowerValue)));
+
+    n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSCurrentCapacityKey)));
+    n2 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSMaxCapacityKey)));
+    if (n1 && n2
+        && CFNumberGetValue(n1, kCFNumberIntType, &t1)
+        && CFNumberGetValue(n2, kCFNumberIntType, &t2)
+        && (t2 > 0)) {
+        update.percentRemaining = (int)(100.0* ((double)t1) / ((double)t2) );
+    }
+
+    n1 = isA_CFNumber(CFDictionaryGetValue(ups_info, CFSTR(kIOPSTimeToEmptyKey)));
+    if (n1 && CFNumberGetValue(n1, kCFNumberIntType, &t1)) {
+        update.minutesRemaining = t1;
+    }
+
+    dispatch_async(_getPMMainQueue(), ^() {
+        bool            isNew = (_unitForID(update.upsID, false) == NULL);
+        ups_unit_struct *unit = _unitForID(update.upsID, true);
+
+        if (!unit) {
+            ERROR_LOG("No room to track UPS %d\n", update.upsID);
+            return;
+        }
+        if (!isNew
+            && (unit->onBattery == update.onBattery)
+            && (unit->percentRemaining == update.percentRemaining)
+            && (unit->minutesRemaining == update.minutesRemaining)) {
+            return;
+        }
+
+        if (update.onBattery && !unit->onBattery) {
+            unit->onBatterySince = CFAbsoluteTimeGetCurrent();
+        }
+        unit->onBattery = update.onBattery;
+        unit->percentRemaining = update.percentRemaining;
+        unit->minutesRemaining = update.minutesRemaining;
+
+        _recomputeUPSAggregate();
+        _evaluateUPSPolicy();
+    });
+}
+
+/* UPSLowPowerUnitRemoved
+ *
+ * The UPS went away or is no longer present.
+ */
+__private_extern__ void
+UPSLowPowerUnitRemoved(int upsID)
+{
+    dispatch_async(_getPMMainQueue(), ^() {
+        ups_unit_struct *unit = _unitForID(upsID, false);
+
+        if (!unit) {
+            return;
+        }
+        bzero(unit, sizeof(*unit));
+
+        _recomputeUPSAggregate();
+        _evaluateUPSPolicy();
+    });
 }
 
 /* UPSLowPowerPSChange
@@ -283,6 +552,9 @@ UPSLowPowerPSChange_sync(void)
  * state changes. We might respond to this by posting a user notification
  * or performing emergency shutdown.
  *
+ * Per-UPS state arrives through UPSLowPowerUnitChanged(); this only
+ * re-runs the policy, e.g. for a change in internal battery presence.
+ *
  * This is called from BatteryTimeRemaining on its queue but also calls back
  * into that module. Hence, dispatch in a different queue.
  */
@@ -290,7 +562,7 @@ __private_extern__ void
 UPSLowPowerPSChange(void)
 {
     dispatch_async(_getPMMainQueue(), ^() {
-        UPSLowPowerPSChange_sync();
+        _evaluateUPSPolicy();
     });
 }
 
@@ -573,7 +845,7 @@ _reEvaluatePowerSourcesLater(int seconds)
 {
     dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(seconds * NSEC_PER_SEC));
     dispatch_after(when, _getPMMainQueue(), ^{
-        UPSLowPowerPSChange_sync();
+        _evaluateUPSPolicy();
     });
 }
 
@@ -35,6 +35,10 @@ __private_extern__ void UPSLowPower_prime(void);
 
 __private_extern__ void UPSLowPowerPSChange(void);
 
+__private_extern__ void UPSLowPowerUnitChanged(CFDictionaryRef ups_info);
+
+__private_extern__ void UPSLowPowerUnitRemoved(int upsID);
+
 __private_extern__ void UPSLowPowerPrefsHaveChanged(void);
 
 #endif //_UPSLowPower_h_
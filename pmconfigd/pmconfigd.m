@@ -842,6 +842,10 @@ static void incoming_XPC_connection(xpc_connection_t peer)
                          os_log_debug(OS_LOG_DEFAULT, "XPC %s from PID %u\n", kIOPMPowerEventDataKey, xpc_connection_get_pid(peer));
                         getScheduledWake(peer, event);
                      }
+                     else if (xpc_dictionary_get_value(event, kPMResponseLatencyCopyMsg)) {
+                         os_log_debug(OS_LOG_DEFAULT, "XPC %s from PID %u\n", kPMResponseLatencyCopyMsg, xpc_connection_get_pid(peer));
+                         copyResponseLatencyStats(peer, event);
+                     }
 #if TARGET_OS_IOS || TARGET_OS_WATCH || TARGET_OS_OSX
                      else if (xpc_dictionary_get_value(event, kSetBHUpdateTimeDelta)) {
                          os_log_debug(OS_LOG_DEFAULT, "XPC %s from PID %u\n", kSetBHUpdateTimeDelta, xpc_connection_get_pid(peer));
@@ -66,8 +66,15 @@
 #include <notify.h>
 #include <asl.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <mach/mach_time.h>
 #include <sysexits.h>
+#include <errno.h>
 #include <libproc.h>
+#include <xpc/xpc.h>
 
 #if __has_include (<SkyLight/SLSDisplayManager.h>)
 #define SLSDISPLAYMANAGER   1
@@ -188,6 +195,7 @@
 #define LOG_TEXT            0
 #define LOG_JSON            1
 #define ARG_LISTEN          "listen"
+#define ARG_TAIL            "tail"
 #define ARG_HISTORY         "history"
 #define ARG_HISTORY_DETAILED "historydetailed"
 #define ARG_HID_NULL        "hidnull"
@@ -202,6 +210,7 @@
 #define ARG_POWERSTATE      "powerstate"
 #define ARG_POWERSTATELOG   "powerstatelog"
 #define ARG_RDSTATS         "stats"
+#define ARG_RESPONSETIMES   "responsetimes"
 #define ARG_SYSSTATE        "systemstate"
 #define ARG_SLEEPBLOCKERS   "sleepblockers"
 #define ARG_FBA             "fba"
@@ -395,6 +404,30 @@ typedef struct {
 
 MsgCache *msgCache = NULL;
 
+/* Reads the PM event log written by powerd (see CommonLib.h) */
+#define kEventLogMsgPoolSize (RING_SIZE + 2)
+typedef struct {
+    uint32_t            segs[kPMEventLogMaxSegments * 2];
+    uint32_t            segCount;
+    uint32_t            segIdx;         // index into segs of the mapped segment
+    const uint8_t       *idx;
+    size_t              idxLen;
+    const char          *str;
+    size_t              strLen;
+    uint32_t            recIdx;
+    uint32_t            recCount;
+    // Messages handed out are kept alive until kEventLogMsgPoolSize more have been handed out,
+    // which covers the look-ahead in msgCache
+    asl_object_t        msgPool[kEventLogMsgPoolSize];
+    uint32_t            poolIdx;
+} PMEventLogReader;
+
+/* Where 'pmset -g log' reads messages from */
+typedef struct {
+    asl_object_t        response;       // ASL store search results
+    PMEventLogReader    *eventLog;      // used instead of 'response' if set
+} PMLogSource;
+
 // function declarations
 static void usage(void);
 static IOReturn setRootDomainProperty(CFStringRef key, CFTypeRef val);
@@ -429,16 +462,18 @@ static void log_useractivity_level(bool runOnce);
 static void show_useractivity_level(uint64_t lev, uint64_t msb);
 
 static void show_log(char **argv);
-static void show_log_text(asl_object_t repsonse);
-static void show_log_json(asl_object_t repsonse);
+static void show_log_text(PMLogSource *source);
+static void show_log_json(PMLogSource *source);
 static void show_uuid(bool keep_running);
 static void listen_for_everything(void);
+static void tail_pm_events(char **argv);
 static bool is_display_dim_captured(void);
 static void show_power_adapter(void);
 static void show_getters(void);
 static void show_power_state(char **argv);
 static void show_power_statelog(char **argv);
 static void show_rdStats(char **argv);
+static void show_response_times(char **argv);
 static void show_sysstate(char **argv);
 static void show_sleep_blockers(char **argv);
 static void print_fba(char **argv);
@@ -620,6 +655,7 @@ static CommandAndAction the_getters[] =
     	{kActionGetOnceNoArgs,  ARG_USERACTIVITY   ,^(char **arg){ log_useractivity_presentActive(kRunOnce); }},
     	{kActionGetOnceNoArgs,  ARG_LOG,            ^(char **arg){ show_log(arg); }},
     	{kActionGetLog,         ARG_LISTEN,         ^(char **arg){ listen_for_everything(); }},
+    	{kActionGetLog,         ARG_TAIL,           ^(char **arg){ tail_pm_events(arg); }},
     	{kActionGetOnceNoArgs,  ARG_HISTORY,        ^(char **arg){ show_power_event_history(); }},
     	{kActionGetOnceNoArgs,  ARG_HISTORY_DETAILED, ^(char **arg){ show_power_event_history_detailed(); }},
     	{kActionGetOnceNoArgs,  ARG_HID_NULL,       ^(char **arg){ show_NULL_HID_events(); }},
@@ -632,6 +668,7 @@ static CommandAndAction the_getters[] =
         {kActionGetOnceNoArgs,  ARG_POWERSTATE,     ^(char **arg){show_power_state(arg); }},
         {kActionGetLog,         ARG_POWERSTATELOG,  ^(char **arg){show_power_statelog(arg); }},
         {kActionGetOnceNoArgs,  ARG_RDSTATS,        ^(char **arg){show_rdStats(arg); }},
+        {kActionGetOnceNoArgs,  ARG_RESPONSETIMES,  ^(char **arg){show_response_times(arg); }},
         {kActionGetOnceNoArgs,  ARG_SYSSTATE,       ^(char **arg){show_sysstate(arg); }},
         {kActionGetLog,         ARG_SLEEPBLOCKERS,  ^(char **arg){show_sleep_blockers(arg); }},
         {kActionNotForEverything,   ARG_EVERYTHING, ^(char **arg){show_everything(arg); }}
@@ -2108,6 +2145,392 @@ exit:
     }
 }
 
+/******************************************************************************/
+/*                                                                            */
+/*     STREAMING EXPORT (-jsonl, -csv)                                        */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Machine readable output for 'pmset -g log|assertions|ps -jsonl|-csv'.
+ * Each export has a fixed list of columns; every record has every column,
+ * in that order, with missing values written as null (JSON) or empty (CSV).
+ * Values are formatted straight into a fixed size buffer which is written to
+ * stdout whenever it fills up, so memory use doesn't depend on how many
+ * records are exported.
+ */
+typedef enum {
+    kExportNone = 0,
+    kExportJSONL,
+    kExportCSV
+} ExportFormat;
+
+#define kExportBufferSize   (64 * 1024)
+
+typedef struct {
+    ExportFormat        format;
+    const char * const  *columns;
+    uint32_t            columnCount;
+    uint32_t            column;         // next column in the current record
+    size_t              len;
+    char                buf[kExportBufferSize];
+} ExportWriter;
+
+static ExportFormat export_format_from_arg(const char *arg)
+{
+    if (!arg) {
+        return kExportNone;
+    }
+    if (!strcmp(arg, "-jsonl")) {
+        return kExportJSONL;
+    }
+    if (!strcmp(arg, "-csv")) {
+        return kExportCSV;
+    }
+    return kExportNone;
+}
+
+static void export_flush(ExportWriter *w)
+{
+    if (w->len) {
+        fwrite(w->buf, 1, w->len, stdout);
+        w->len = 0;
+    }
+    fflush(stdout);
+}
+
+static void export_bytes(ExportWriter *w, const char *bytes, size_t len)
+{
+    while (len) {
+        size_t space = sizeof(w->buf) - w->len;
+        size_t n = (len < space) ? len : space;
+
+        memcpy(w->buf + w->len, bytes, n);
+        w->len += n;
+        bytes += n;
+        len -= n;
+        if (w->len == sizeof(w->buf)) {
+            fwrite(w->buf, 1, w->len, stdout);
+            w->len = 0;
+        }
+    }
+}
+
+static void export_char(ExportWriter *w, char c)
+{
+    export_bytes(w, &c, 1);
+}
+
+static void export_begin(ExportWriter *w, ExportFormat format, const char * const *columns, uint32_t columnCount)
+{
+    w->format = format;
+    w->columns = columns;
+    w->columnCount = columnCount;
+    w->column = 0;
+    w->len = 0;
+
+    if (format == kExportCSV) {
+        for (uint32_t i = 0; i < columnCount; i++) {
+            if (i) {
+                export_char(w, ',');
+            }
+            export_bytes(w, columns[i], strlen(columns[i]));
+        }
+        export_char(w, '\n');
+    }
+}
+
+/* Starts the next column, and returns false once all columns have been written */
+static bool export_next_column(ExportWriter *w)
+{
+    if (w->column >= w->columnCount) {
+        return false;
+    }
+    if (w->format == kExportJSONL) {
+        export_bytes(w, w->column ? ",\"" : "{\"", 2);
+        export_bytes(w, w->columns[w->column], strlen(w->columns[w->column]));
+        export_bytes(w, "\":", 2);
+    } else if (w->column) {
+        export_char(w, ',');
+    }
+    w->column++;
+    return true;
+}
+
+static void export_null(ExportWriter *w)
+{
+    if (export_next_column(w) && w->format == kExportJSONL) {
+        export_bytes(w, "null", 4);
+    }
+}
+
+static void export_string(ExportWriter *w, const char *str)
+{
+    const char  *run;
+    bool        quote;
+    char        esc[8];
+
+    if (!str) {
+        export_null(w);
+        return;
+    }
+    if (!export_next_column(w)) {
+        return;
+    }
+
+    if (w->format == kExportJSONL) {
+        export_char(w, '"');
+        for (run = str; *str; str++) {
+            unsigned char c = (unsigned char)*str;
+            if (c != '"' && c != '\\' && c >= 0x20) {
+                continue;
+            }
+            export_bytes(w, run, str - run);
+            if (c == '"' || c == '\\') {
+                esc[0] = '\\';
+                esc[1] = (char)c;
+                export_bytes(w, esc, 2);
+            } else if (c == '\n') {
+                export_bytes(w, "\\n", 2);
+            } else if (c == '\t') {
+                export_bytes(w, "\\t", 2);
+            } else {
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                export_bytes(w, esc, 6);
+            }
+            run = str + 1;
+        }
+        export_bytes(w, run, str - run);
+        export_char(w, '"');
+        return;
+    }
+
+    // CSV: quote fields that contain a separator, quote or line break, and double embedded quotes
+    quote = (strpbrk(str, ",\"\r\n") != NULL);
+    if (!quote) {
+        export_bytes(w, str, strlen(str));
+        return;
+    }
+    export_char(w, '"');
+    for (run = str; *str; str++) {
+        if (*str == '"') {
+            export_bytes(w, run, str - run + 1);
+            run = str;
+        }
+    }
+    export_bytes(w, run, str - run);
+    export_char(w, '"');
+}
+
+static void export_int(ExportWriter *w, long long val)
+{
+    char    num[24];
+    int     len;
+
+    if (!export_next_column(w)) {
+        return;
+    }
+    len = snprintf(num, sizeof(num), "%lld", val);
+    export_bytes(w, num, len);
+}
+
+static void export_bool(ExportWriter *w, bool val)
+{
+    if (!export_next_column(w)) {
+        return;
+    }
+    if (val) {
+        export_bytes(w, "true", 4);
+    } else {
+        export_bytes(w, "false", 5);
+    }
+}
+
+static void export_cfstring(ExportWriter *w, CFTypeRef val)
+{
+    const char  *ptr;
+    char        stackbuf[256];
+    char        *heapbuf = NULL;
+    CFIndex     max;
+
+    if (!isA_CFString(val)) {
+        export_null(w);
+        return;
+    }
+    if ((ptr = CFStringGetCStringPtr(val, kCFStringEncodingUTF8))) {
+        export_string(w, ptr);
+    } else if (CFStringGetCString(val, stackbuf, sizeof(stackbuf), kCFStringEncodingUTF8)) {
+        export_string(w, stackbuf);
+    } else {
+        max = CFStringGetMaximumSizeForEncoding(CFStringGetLength(val), kCFStringEncodingUTF8) + 1;
+        heapbuf = malloc(max);
+        if (heapbuf && CFStringGetCString(val, heapbuf, max, kCFStringEncodingUTF8)) {
+            export_string(w, heapbuf);
+        } else {
+            export_null(w);
+        }
+        free(heapbuf);
+    }
+}
+
+static void export_cfnumber(ExportWriter *w, CFTypeRef val)
+{
+    long long   num = 0;
+
+    if (!isA_CFNumber(val) || !CFNumberGetValue(val, kCFNumberLongLongType, &num)) {
+        export_null(w);
+        return;
+    }
+    export_int(w, num);
+}
+
+static void export_cfbool(ExportWriter *w, CFTypeRef val)
+{
+    if (!isA_CFBoolean(val)) {
+        export_null(w);
+        return;
+    }
+    export_bool(w, CFBooleanGetValue(val));
+}
+
+static void export_record_end(ExportWriter *w)
+{
+    // Pad records that skipped trailing columns
+    while (w->column < w->columnCount) {
+        export_null(w);
+    }
+    if (w->format == kExportJSONL) {
+        export_char(w, '}');
+    }
+    export_char(w, '\n');
+    w->column = 0;
+}
+
+static ExportWriter gExportWriter;
+
+static const char * const kPSExportColumns[] = {
+    "time", "id", "name", "type", "transport", "state", "present",
+    "current_capacity", "max_capacity", "charging", "charged",
+    "time_to_empty", "time_to_full", "health"
+};
+
+static void export_power_sources(CFTypeRef ps_info, ExportFormat format)
+{
+    ExportWriter        *w = &gExportWriter;
+    CFArrayRef          list = NULL;
+    CFDictionaryRef     one_ps = NULL;
+    long long           now = (long long)(CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970);
+
+    export_begin(w, format, kPSExportColumns, ARRAY_SIZE(kPSExportColumns));
+
+    list = IOPSCopyPowerSourcesList(ps_info);
+    for (CFIndex i = 0; list && i < CFArrayGetCount(list); i++) {
+        one_ps = IOPSGetPowerSourceDescription(ps_info, CFArrayGetValueAtIndex(list, i));
+        if (!one_ps) {
+            continue;
+        }
+        export_int(w, now);
+        export_cfnumber(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSPowerSourceIDKey)));
+        export_cfstring(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSNameKey)));
+        export_cfstring(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSTypeKey)));
+        export_cfstring(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSTransportTypeKey)));
+        export_cfstring(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSPowerSourceStateKey)));
+        export_cfbool(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSIsPresentKey)));
+        export_cfnumber(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSCurrentCapacityKey)));
+        export_cfnumber(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSMaxCapacityKey)));
+        export_cfbool(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSIsChargingKey)));
+        export_cfbool(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSIsChargedKey)));
+        export_cfnumber(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSTimeToEmptyKey)));
+        export_cfnumber(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSTimeToFullChargeKey)));
+        export_cfstring(w, CFDictionaryGetValue(one_ps, CFSTR(kIOPSBatteryHealthKey)));
+        export_record_end(w);
+    }
+    if (list) {
+        CFRelease(list);
+    }
+    export_flush(w);
+}
+
+static const char * const kAssertionExportColumns[] = {
+    "time", "pid", "process", "type", "name", "id", "created",
+    "timed_out", "suspended", "on_behalf_of_pid", "details"
+};
+
+static void export_assertions(CFDictionaryRef assertions_info, ExportFormat format)
+{
+    ExportWriter        *w = &gExportWriter;
+    CFIndex             process_count = 0;
+    CFNumberRef         *pids = NULL;
+    CFArrayRef          *assertions = NULL;
+    long long           now = (long long)(CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970);
+    char                pid_name_buf[100];
+
+    export_begin(w, format, kAssertionExportColumns, ARRAY_SIZE(kAssertionExportColumns));
+
+    if (isA_CFDictionary(assertions_info)) {
+        process_count = CFDictionaryGetCount(assertions_info);
+    }
+    if (process_count) {
+        pids = malloc(sizeof(CFNumberRef) * process_count);
+        assertions = malloc(sizeof(CFArrayRef) * process_count);
+    }
+    if (!pids || !assertions) {
+        goto exit;
+    }
+    CFDictionaryGetKeysAndValues(assertions_info, (const void **)pids, (const void **)assertions);
+
+    for (CFIndex i = 0; i < process_count; i++) {
+        int the_pid = 0;
+
+        if (!isA_CFNumber(pids[i]) || !isA_CFArray(assertions[i])) {
+            continue;
+        }
+        CFNumberGetValue(pids[i], kCFNumberIntType, &the_pid);
+
+        for (CFIndex j = 0; j < CFArrayGetCount(assertions[i]); j++) {
+            CFDictionaryRef tmp_dict = CFArrayGetValueAtIndex(assertions[i], j);
+            CFTypeRef       val;
+
+            if (!isA_CFDictionary(tmp_dict)) {
+                continue;
+            }
+            export_int(w, now);
+            export_int(w, the_pid);
+
+            val = CFDictionaryGetValue(tmp_dict, kIOPMAssertionProcessNameKey);
+            if (isA_CFString(val)) {
+                export_cfstring(w, val);
+            } else {
+                pid_name_buf[0] = 0;
+                proc_name(the_pid, pid_name_buf, sizeof(pid_name_buf));
+                export_string(w, pid_name_buf);
+            }
+
+            export_cfstring(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionTypeKey));
+            export_cfstring(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionNameKey));
+            export_cfnumber(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionGlobalUniqueIDKey));
+
+            val = CFDictionaryGetValue(tmp_dict, kIOPMAssertionCreateDateKey);
+            if (isA_CFDate(val)) {
+                export_int(w, (long long)(CFDateGetAbsoluteTime(val) + kCFAbsoluteTimeIntervalSince1970));
+            } else {
+                export_null(w);
+            }
+
+            export_bool(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionTimedOutDateKey) != NULL);
+            export_bool(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionIsStateSuspendedKey) == kCFBooleanTrue);
+            export_cfnumber(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionOnBehalfOfPID));
+            export_cfstring(w, CFDictionaryGetValue(tmp_dict, kIOPMAssertionDetailsKey));
+            export_record_end(w);
+        }
+    }
+
+exit:
+    free(pids);
+    free(assertions);
+    export_flush(w);
+}
+
 /******************************************************************************/
 /*                                                                            */
 /*     PS LOGGING                                                             */
@@ -2158,6 +2581,7 @@ static void show_power_sources(char **argv, int which)
     int                 rawExternalConnected = -1;
     int                 _id = 0;
     bool                xml = false;
+    ExportFormat        export_format = kExportNone;
 #if !TARGET_OS_OSX
     IOReturn            status = kIOReturnSuccess;
 #endif
@@ -2195,6 +2619,11 @@ static void show_power_sources(char **argv, int which)
     }
 #endif
 
+    if ((export_format = export_format_from_arg(argv ? argv[0] : NULL))) {
+        export_power_sources(ps_info, export_format);
+        goto exit;
+    }
+
     if (isBatteryPollingStopped()) {
         printf("* Battery Polling is Stopped\n");
     }
@@ -3222,6 +3651,16 @@ static void show_assertions(char **argv, const char *decorate)
 {
     CFDictionaryRef         assertions_info = NULL;
     IOReturn                ret;
+    ExportFormat            export_format;
+
+    if ((export_format = export_format_from_arg(argv ? argv[0] : NULL))) {
+        IOPMCopyAssertionsByProcess(&assertions_info);
+        export_assertions(assertions_info, export_format);
+        if (assertions_info) {
+            CFRelease(assertions_info);
+        }
+        return;
+    }
 
     print_pretty_date(CFAbsoluteTimeGetCurrent(), decorate?false:true);
     if (decorate) {
@@ -4078,6 +4517,392 @@ static void listen_for_everything(void)
     // should never return from CFRunLoopRun
 }
 
+/******************************************************************************/
+/*                                                                            */
+/*     TAIL MODE                                                              */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * 'pmset -g tail [-sources <name>,...] [-binary]'
+ *
+ * Logs events from all PM notification sources as one ordered stream. Every
+ * source delivers onto gTail.queue, so events are serialized in the order
+ * they arrive. Each event is stamped with mach_continuous_time(), which keeps
+ * counting while the system is asleep, and with the wall clock. Handlers
+ * only read the notification's state; nothing is polled, and sources that
+ * are filtered out are never registered.
+ *
+ * With -binary, a TailStreamHeader is written followed by one TailRecord
+ * per event.
+ */
+typedef enum {
+    kTailSourcePower = 0,           // IOPMConnection capability changes
+    kTailSourceSleepWake,           // IORegisterForSystemPower messages
+    kTailSourcePS,
+    kTailSourceThermal,
+    kTailSourceSysLoad,
+    kTailSourceUserActivity,
+    kTailSourceAssertions,
+    kTailSourcePrefs,
+    kTailSourceSleepServices,
+    kTailSourceCount
+} TailSource;
+
+static const char * const kTailSourceNames[kTailSourceCount] = {
+    "power", "sleepwake", "ps", "thermal", "sysload",
+    "useractivity", "assertions", "prefs", "sleepservices"
+};
+
+typedef enum {
+    kTailEventCapabilities = 0,     // value: IOPMCapabilityBits
+    kTailEventCanSleep,
+    kTailEventWillSleep,
+    kTailEventWillPowerOn,
+    kTailEventHasPoweredOn,
+    kTailEventPSChange,             // value for notify events: notify_get_state()
+    kTailEventPSTimeRemaining,
+    kTailEventPSLowBattery,
+    kTailEventPSAttach,
+    kTailEventThermalWarning,
+    kTailEventPerformanceWarning,
+    kTailEventCPUPower,
+    kTailEventSysLoad,
+    kTailEventUserActivity,         // value: user activity levels
+    kTailEventAssertions,
+    kTailEventPrefs,
+    kTailEventSleepServices,
+    kTailEventCount
+} TailEvent;
+
+static const char * const kTailEventNames[kTailEventCount] = {
+    "Capabilities", "CanSleep", "WillSleep", "WillPowerOn", "HasPoweredOn",
+    "PowerSource", "TimeRemaining", "LowBattery", "Attach",
+    "ThermalWarning", "PerformanceWarning", "CPUPower",
+    "SystemLoad", "UserActivity", "AssertionsChanged", "PrefsChanged", "SleepServices"
+};
+
+#define kTailStreamMagic        0x504d544c  /* 'PMTL' */
+#define kTailStreamVersion      1
+
+typedef struct {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    recordSize;         // sizeof(TailRecord)
+    uint64_t    continuousNs;       // when the stream started
+    uint64_t    wallUs;
+} TailStreamHeader;
+
+typedef struct {
+    uint64_t    continuousNs;
+    uint64_t    wallUs;             // microseconds since 1970
+    uint16_t    source;             // TailSource
+    uint16_t    event;              // TailEvent
+    uint32_t    reserved;
+    uint64_t    value;
+} TailRecord;
+
+static struct {
+    dispatch_queue_t            queue;
+    uint32_t                    sources;    // bit per TailSource
+    bool                        binary;
+    mach_timebase_info_data_t   timebase;
+    io_connect_t                ackPort;
+    bool                        assertionNotify;    // registered with powerd for assertion changes
+} gTail;
+
+static void tail_write(const void *buf, size_t len)
+{
+    const uint8_t   *p = buf;
+    ssize_t         written;
+
+    while (len) {
+        written = write(STDOUT_FILENO, p, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nobody is reading any more
+            exit(EX_IOERR);
+        }
+        p += written;
+        len -= written;
+    }
+}
+
+static uint64_t tail_continuous_ns(void)
+{
+    return mach_continuous_time() * gTail.timebase.numer / gTail.timebase.denom;
+}
+
+static void tail_emit(TailSource source, TailEvent event, uint64_t value)
+{
+    TailRecord      rec;
+    struct timeval  tv;
+    struct tm       tm;
+    char            date[32];
+    char            detail[128];
+    char            line[256];
+    int             len;
+
+    gettimeofday(&tv, NULL);
+
+    bzero(&rec, sizeof(rec));
+    rec.continuousNs = tail_continuous_ns();
+    rec.wallUs = (uint64_t)tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+    rec.source = source;
+    rec.event = event;
+    rec.value = value;
+
+    if (gTail.binary) {
+        tail_write(&rec, sizeof(rec));
+        return;
+    }
+
+    if (event == kTailEventCapabilities) {
+        IOPMGetCapabilitiesDescription(detail, sizeof(detail), (IOPMCapabilityBits)value);
+    } else {
+        snprintf(detail, sizeof(detail), "%llu", value);
+    }
+    localtime_r(&tv.tv_sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+    len = snprintf(line, sizeof(line), "%llu.%09llu %s.%06d %-13s %-18s %s\n",
+                   rec.continuousNs / NSEC_PER_SEC, rec.continuousNs % NSEC_PER_SEC,
+                   date, (int)tv.tv_usec,
+                   kTailSourceNames[source], kTailEventNames[event], detail);
+    if (len > 0) {
+        tail_write(line, MIN((size_t)len, sizeof(line) - 1));
+    }
+}
+
+static void tail_register_notify(TailSource source, TailEvent event, const char *name)
+{
+    int         token;
+    uint32_t    status;
+
+    status = notify_register_dispatch(name, &token, gTail.queue, ^(int t) {
+        uint64_t state = 0;
+
+        notify_get_state(t, &state);
+        tail_emit(source, event, state);
+    });
+    if (NOTIFY_STATUS_OK != status) {
+        fprintf(stderr, "Registration failed for \"%s\" with (%u)\n", name, status);
+    }
+}
+
+static void tail_pm_connection_handler(
+    void *param,
+    IOPMConnection                      connection,
+    IOPMConnectionMessageToken          token,
+    IOPMSystemPowerStateCapabilities    capabilities)
+{
+    tail_emit(kTailSourcePower, kTailEventCapabilities, capabilities);
+    IOPMConnectionAcknowledgeEvent(connection, token);
+}
+
+static void tail_sleep_wake_callback(
+    void *refcon,
+    io_service_t y __unused,
+    natural_t messageType,
+    void * messageArgument)
+{
+    switch (messageType) {
+    case kIOMessageCanSystemSleep:
+        tail_emit(kTailSourceSleepWake, kTailEventCanSleep, 0);
+        IOAllowPowerChange(gTail.ackPort, (long)messageArgument);
+        break;
+    case kIOMessageSystemWillSleep:
+        tail_emit(kTailSourceSleepWake, kTailEventWillSleep, 0);
+        IOAllowPowerChange(gTail.ackPort, (long)messageArgument);
+        break;
+    case kIOMessageSystemWillPowerOn:
+        tail_emit(kTailSourceSleepWake, kTailEventWillPowerOn, 0);
+        break;
+    case kIOMessageSystemHasPoweredOn:
+        tail_emit(kTailSourceSleepWake, kTailEventHasPoweredOn, 0);
+        break;
+    }
+}
+
+static void tail_install_sources(void)
+{
+    uint32_t s = gTail.sources;
+
+    if (s & (1 << kTailSourcePower)) {
+        IOPMConnection connection = NULL;
+        IOReturn ret = IOPMConnectionCreate(CFSTR("pmset tail"),
+                                            kIOPMEarlyWakeNotification
+                                            | kIOPMCapabilityCPU
+                                            | kIOPMCapabilityDisk
+                                            | kIOPMCapabilityNetwork
+                                            | kIOPMCapabilityAudio
+                                            | kIOPMCapabilityVideo
+                                            | kIOPMCapabilityPushServiceTask
+                                            | kIOPMCapabilityBackgroundTask
+                                            | kIOPMCapabilitySilentRunning,
+                                            &connection);
+        if (kIOReturnSuccess == ret) {
+            ret = IOPMConnectionSetNotification(connection, NULL,
+                                                (IOPMEventHandlerType)tail_pm_connection_handler);
+        }
+        if (kIOReturnSuccess == ret) {
+            ret = IOPMConnectionSetDispatchQueue(connection, gTail.queue);
+        }
+        if (kIOReturnSuccess != ret) {
+            fprintf(stderr, "IOPMConnection setup failed: 0x%08x\n", ret);
+        }
+    }
+
+    if (s & (1 << kTailSourceSleepWake)) {
+        IONotificationPortRef   notify = NULL;
+        io_object_t             notifier = IO_OBJECT_NULL;
+
+        gTail.ackPort = IORegisterForSystemPower(NULL, &notify, tail_sleep_wake_callback, &notifier);
+        if (notify && (MACH_PORT_NULL != gTail.ackPort)) {
+            IONotificationPortSetDispatchQueue(notify, gTail.queue);
+        } else {
+            fprintf(stderr, "IORegisterForSystemPower failed\n");
+        }
+    }
+
+    if (s & (1 << kTailSourcePS)) {
+        tail_register_notify(kTailSourcePS, kTailEventPSChange, kIOPSNotifyPowerSource);
+        tail_register_notify(kTailSourcePS, kTailEventPSTimeRemaining, kIOPSNotifyTimeRemaining);
+        tail_register_notify(kTailSourcePS, kTailEventPSLowBattery, kIOPSNotifyLowBattery);
+        tail_register_notify(kTailSourcePS, kTailEventPSAttach, kIOPSNotifyAttach);
+    }
+
+    if (s & (1 << kTailSourceThermal)) {
+        tail_register_notify(kTailSourceThermal, kTailEventThermalWarning, kIOPMThermalWarningNotificationKey);
+        tail_register_notify(kTailSourceThermal, kTailEventPerformanceWarning, kIOPMPerformanceWarningNotificationKey);
+        tail_register_notify(kTailSourceThermal, kTailEventCPUPower, kIOPMCPUPowerNotificationKey);
+    }
+
+    if (s & (1 << kTailSourceSysLoad)) {
+        tail_register_notify(kTailSourceSysLoad, kTailEventSysLoad, kIOSystemLoadAdvisoryNotifyName);
+    }
+
+    if (s & (1 << kTailSourceUserActivity)) {
+        if (!IOPMScheduleUserActivityLevelNotification(gTail.queue, ^(uint64_t levels, uint64_t most) {
+                tail_emit(kTailSourceUserActivity, kTailEventUserActivity, levels);
+            })) {
+            fprintf(stderr, "IOPMScheduleUserActivityLevelNotification failed\n");
+        }
+    }
+
+    if (s & (1 << kTailSourceAssertions)) {
+        // powerd only posts assertion changes while some client is registered
+        if (kIOReturnSuccess == IOPMAssertionNotify(kIOPMAssertionsAnyChangedNotifyString, kIOPMNotifyRegister)) {
+            gTail.assertionNotify = true;
+        } else {
+            fprintf(stderr, "IOPMAssertionNotify registration failed\n");
+        }
+        tail_register_notify(kTailSourceAssertions, kTailEventAssertions, kIOPMAssertionsAnyChangedNotifyString);
+    }
+
+    if (s & (1 << kTailSourcePrefs)) {
+        if (!IOPMRegisterPrefsChangeNotification(gTail.queue, ^(void) {
+                tail_emit(kTailSourcePrefs, kTailEventPrefs, 0);
+            })) {
+            fprintf(stderr, "IOPMRegisterPrefsChangeNotification failed\n");
+        }
+    }
+
+    if (s & (1 << kTailSourceSleepServices)) {
+        tail_register_notify(kTailSourceSleepServices, kTailEventSleepServices, kIOPMSleepServiceActiveNotifyName);
+    }
+}
+
+static void tail_remove_sources(void)
+{
+    if (gTail.assertionNotify) {
+        IOPMAssertionNotify(kIOPMAssertionsAnyChangedNotifyString, kIOPMNotifyDeRegister);
+        gTail.assertionNotify = false;
+    }
+}
+
+static void tail_exit_on_signal(int sig)
+{
+    dispatch_source_t src;
+
+    signal(sig, SIG_IGN);
+    src = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, sig, 0, gTail.queue);
+    dispatch_source_set_event_handler(src, ^{
+        tail_remove_sources();
+        exit(0);
+    });
+    dispatch_resume(src);
+}
+
+static void tail_pm_events(char **argv)
+{
+    gTail.sources = (1 << kTailSourceCount) - 1;
+
+    for (int i = 0; argv && argv[i]; i++) {
+        if (!strcmp(argv[i], "-binary")) {
+            gTail.binary = true;
+        }
+        else if (!strcmp(argv[i], "-sources") && argv[i+1]) {
+            char *list = strdup(argv[++i]);
+            char *next = list;
+            char *name;
+
+            gTail.sources = 0;
+            while (list && (name = strsep(&next, ","))) {
+                int j;
+                for (j = 0; j < kTailSourceCount; j++) {
+                    if (!strcmp(name, kTailSourceNames[j])) {
+                        gTail.sources |= (1 << j);
+                        break;
+                    }
+                }
+                if (j == kTailSourceCount) {
+                    fprintf(stderr, "Unknown source \"%s\". Valid sources are:", name);
+                    for (j = 0; j < kTailSourceCount; j++) {
+                        fprintf(stderr, " %s", kTailSourceNames[j]);
+                    }
+                    fprintf(stderr, "\n");
+                    free(list);
+                    return;
+                }
+            }
+            free(list);
+        }
+    }
+
+    mach_timebase_info(&gTail.timebase);
+    gTail.queue = dispatch_queue_create("com.apple.pmset.tail", DISPATCH_QUEUE_SERIAL);
+
+    if (gTail.binary) {
+        TailStreamHeader    hdr;
+        struct timeval      tv;
+
+        gettimeofday(&tv, NULL);
+        bzero(&hdr, sizeof(hdr));
+        hdr.magic = kTailStreamMagic;
+        hdr.version = kTailStreamVersion;
+        hdr.recordSize = sizeof(TailRecord);
+        hdr.continuousNs = tail_continuous_ns();
+        hdr.wallUs = (uint64_t)tv.tv_sec * USEC_PER_SEC + tv.tv_usec;
+        tail_write(&hdr, sizeof(hdr));
+    } else {
+        printf("pmset is in tail mode now. Hit ctrl-c to exit.\n");
+        fflush(stdout);
+    }
+
+    // Every source delivers on gTail.queue. Installing them from it keeps
+    // the first events from being emitted until all of them are installed.
+    dispatch_sync(gTail.queue, ^{
+        tail_install_sources();
+    });
+    tail_exit_on_signal(SIGINT);
+    tail_exit_on_signal(SIGTERM);
+
+    dispatch_main();
+}
+
 static void log_thermal_events(void)
 {
     int             powerConstraintNotifyToken = 0;
@@ -6263,10 +7088,251 @@ static IOReturn _pm_disconnect(mach_port_t connection)
 /*                                                                            */
 /******************************************************************************/
 
+static void eventLogUnmapSegment(PMEventLogReader *reader)
+{
+    if (reader->idx) {
+        munmap((void *)reader->idx, reader->idxLen);
+    }
+    if (reader->str) {
+        munmap((void *)reader->str, reader->strLen);
+    }
+    reader->idx = NULL;
+    reader->str = NULL;
+    reader->recIdx = 0;
+    reader->recCount = 0;
+}
+
+static const void *eventLogMapFile(uint32_t seq, const char *suffix, size_t *len)
+{
+    char        path[PATH_MAX];
+    struct stat st;
+    void        *map;
+    int         fd;
+
+    snprintf(path, sizeof(path), "%s/%u.%s", kPMEventLogDir, seq, suffix);
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    *len = (size_t)st.st_size;
+    return map;
+}
+
+static const PMEventLogRecord *eventLogRecord(PMEventLogReader *reader, uint32_t i)
+{
+    return (const PMEventLogRecord *)(reader->idx + sizeof(PMEventLogSegmentHeader) + i * sizeof(PMEventLogRecord));
+}
+
+static bool eventLogMapSegment(PMEventLogReader *reader, uint32_t segIdx)
+{
+    const PMEventLogSegmentHeader *hdr;
+
+    eventLogUnmapSegment(reader);
+    reader->segIdx = segIdx;
+
+    // Map the index first. Everything its records refer to is already in the string file.
+    reader->idx = eventLogMapFile(reader->segs[segIdx], kPMEventLogIndexSuffix, &reader->idxLen);
+    reader->str = eventLogMapFile(reader->segs[segIdx], kPMEventLogStringSuffix, &reader->strLen);
+    if (!reader->idx || !reader->str
+        || reader->idxLen < sizeof(*hdr) || reader->strLen < sizeof(uint32_t)) {
+        goto fail;
+    }
+
+    hdr = (const PMEventLogSegmentHeader *)reader->idx;
+    if (hdr->magic != kPMEventLogMagic || hdr->version != kPMEventLogVersion
+        || hdr->recordSize != sizeof(PMEventLogRecord)
+        || *(const uint32_t *)reader->str != kPMEventLogMagic) {
+        goto fail;
+    }
+    reader->recCount = (uint32_t)((reader->idxLen - sizeof(*hdr)) / sizeof(PMEventLogRecord));
+    return true;
+
+fail:
+    eventLogUnmapSegment(reader);
+    return false;
+}
+
+/* Returns the index of the first record at or after 'time' in the mapped segment */
+static uint32_t eventLogLowerBound(PMEventLogReader *reader, uint64_t time)
+{
+    uint32_t lo = 0;
+    uint32_t hi = reader->recCount;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (eventLogRecord(reader, mid)->sortTime < time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int compareEventLogSeq(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static void eventLogClose(PMEventLogReader *reader)
+{
+    if (!reader) {
+        return;
+    }
+    eventLogUnmapSegment(reader);
+    for (int i = 0; i < kEventLogMsgPoolSize; i++) {
+        if (reader->msgPool[i]) {
+            asl_release(reader->msgPool[i]);
+        }
+    }
+    free(reader);
+}
+
+/*
+ * Opens the PM event log, positioned at the first message logged at or after
+ * 'startTime' (seconds since 1970). Returns NULL if there's no usable event log,
+ * or if it doesn't reach back to 'startTime'; the caller then falls back to the
+ * ASL store.
+ */
+static PMEventLogReader *eventLogOpen(uint64_t startTime)
+{
+    PMEventLogReader        *reader = NULL;
+    DIR                     *dir;
+    struct dirent           *entry;
+    uint32_t                i;
+
+    dir = opendir(kPMEventLogDir);
+    if (!dir) {
+        return NULL;
+    }
+    reader = calloc(1, sizeof(PMEventLogReader));
+    if (!reader) {
+        closedir(dir);
+        return NULL;
+    }
+    while ((entry = readdir(dir)) && reader->segCount < ARRAY_SIZE(reader->segs)) {
+        char            *end = NULL;
+        unsigned long   seq = strtoul(entry->d_name, &end, 10);
+
+        if (end != entry->d_name && end && *end == '.' && !strcmp(end + 1, kPMEventLogIndexSuffix)) {
+            reader->segs[reader->segCount++] = (uint32_t)seq;
+        }
+    }
+    closedir(dir);
+    qsort(reader->segs, reader->segCount, sizeof(reader->segs[0]), compareEventLogSeq);
+
+    for (i = 0; i < reader->segCount; i++) {
+        if (eventLogMapSegment(reader, i)) {
+            break;
+        }
+    }
+    if (i == reader->segCount
+        || ((const PMEventLogSegmentHeader *)reader->idx)->createTime > startTime) {
+        eventLogClose(reader);
+        return NULL;
+    }
+
+    // Skip whole segments that end before startTime, then binary search the first one that doesn't
+    for (; i < reader->segCount; i++) {
+        if ((reader->idx || eventLogMapSegment(reader, i)) && reader->recCount
+            && eventLogRecord(reader, reader->recCount - 1)->sortTime >= startTime) {
+            reader->recIdx = eventLogLowerBound(reader, startTime);
+            break;
+        }
+        eventLogUnmapSegment(reader);
+    }
+
+    return reader;
+}
+
+static const char *eventLogString(PMEventLogReader *reader, uint32_t offset)
+{
+    if (!offset || offset >= reader->strLen
+        || !memchr(reader->str + offset, 0, reader->strLen - offset)) {
+        return NULL;
+    }
+    return reader->str + offset;
+}
+
+static asl_object_t eventLogCreateMsg(PMEventLogReader *reader, const PMEventLogRecord *rec)
+{
+    asl_object_t    m;
+    uint32_t        pair[2];
+    char            buf[32];
+
+    if (rec->pairCount > kPMEventLogMaxPairs || rec->pairs >= reader->strLen
+        || reader->strLen - rec->pairs < rec->pairCount * sizeof(pair)) {
+        return NULL;
+    }
+
+    m = asl_new(ASL_TYPE_MSG);
+    if (!m) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < rec->pairCount; i++) {
+        memcpy(pair, reader->str + rec->pairs + i * sizeof(pair), sizeof(pair));
+
+        const char *key = eventLogString(reader, pair[0]);
+        const char *val = eventLogString(reader, pair[1]);
+        if (key && val) {
+            asl_set(m, key, val);
+        }
+    }
+    snprintf(buf, sizeof(buf), "%llu", rec->time);
+    asl_set(m, ASL_KEY_TIME, buf);
+    snprintf(buf, sizeof(buf), "%u", rec->nsec);
+    asl_set(m, ASL_KEY_TIME_NSEC, buf);
+
+    return m;
+}
+
+static asl_object_t eventLogNext(PMEventLogReader *reader)
+{
+    asl_object_t m;
+
+    do {
+        while (reader->recIdx >= reader->recCount) {
+            if (reader->segIdx + 1 >= reader->segCount) {
+                return NULL;
+            }
+            eventLogMapSegment(reader, reader->segIdx + 1);
+        }
+        m = eventLogCreateMsg(reader, eventLogRecord(reader, reader->recIdx++));
+    } while (!m);
+
+    if (reader->msgPool[reader->poolIdx]) {
+        asl_release(reader->msgPool[reader->poolIdx]);
+    }
+    reader->msgPool[reader->poolIdx] = m;
+    reader->poolIdx = (reader->poolIdx + 1) % kEventLogMsgPoolSize;
+
+    return m;
+}
+
+static asl_object_t _pmlog_next(PMLogSource *source)
+{
+    if (source->eventLog) {
+        return eventLogNext(source->eventLog);
+    }
+    return asl_next(source->response);
+}
+
 /*
  * Cache the message in a temp ring buffer.
  */
-static asl_object_t _cacheAndGetMsg(asl_object_t pmresponse)
+static asl_object_t _cacheAndGetMsg(PMLogSource *source)
 {
    asl_object_t msg = NULL;
 
@@ -6279,7 +7345,7 @@ static asl_object_t _cacheAndGetMsg(asl_object_t pmresponse)
    if (((msgCache->writeIdx+1) % RING_SIZE) == msgCache->readIdx)
       return NULL; /* overflow */
 
-   msg = asl_next(pmresponse);
+   msg = _pmlog_next(source);
    if (!msg) return NULL;
 
    msgCache->msgRing[msgCache->writeIdx] = msg;
@@ -6288,14 +7354,14 @@ static asl_object_t _cacheAndGetMsg(asl_object_t pmresponse)
    return  msg;
 }
 
-static asl_object_t _my_next_response(asl_object_t pmresponse)
+static asl_object_t _my_next_response(PMLogSource *source)
 {
     asl_object_t   next_msg = 0;
 
     /*
      * _my_next_response returns messages from our cache
      * until there aren't any more messages in it.
-     * Then it returns messages from the PM ASL store, via pmresponse.
+     * Then it returns messages from the PM event log or ASL store.
      */
     if (msgCache && (msgCache->readIdx != msgCache->writeIdx))
     {
@@ -6304,10 +7370,10 @@ static asl_object_t _my_next_response(asl_object_t pmresponse)
     }
 
     /*
-     * If the cache is empty, then we pull messages straight from the ASL store.
+     * If the cache is empty, then we pull messages straight from the source.
      */
     if (0 == next_msg) {
-        next_msg = asl_next(pmresponse);
+        next_msg = _pmlog_next(source);
     }
 
     return next_msg;
@@ -6322,7 +7388,7 @@ static asl_object_t _my_next_response(asl_object_t pmresponse)
  * Sleep -> DarkWake
  */
 
-static int32_t _getNextWakeTime(asl_object_t pmresponse)
+static int32_t _getNextWakeTime(PMLogSource *source)
 {
    const char *domain = NULL;
    const char *timeStr = NULL;
@@ -6331,7 +7397,7 @@ static int32_t _getNextWakeTime(asl_object_t pmresponse)
 
    do {
 
-      if ((next = _cacheAndGetMsg(pmresponse)) == NULL) break;
+      if ((next = _cacheAndGetMsg(source)) == NULL) break;
 
       domain = asl_get(next, kPMASLDomainKey);
       if (!domain) break;
@@ -6363,7 +7429,7 @@ static int32_t _getNextWakeTime(asl_object_t pmresponse)
  * DarkWake -> Sleep
  * DarkWake -> Wake
  */
-static int32_t _getNextSleepTime(asl_object_t pmresponse, const char *curr_domain)
+static int32_t _getNextSleepTime(PMLogSource *source, const char *curr_domain)
 {
    const char *domain = NULL;
    const char *timeStr = NULL;
@@ -6373,7 +7439,7 @@ static int32_t _getNextSleepTime(asl_object_t pmresponse, const char *curr_domai
    do {
 
 
-      if ((next = _cacheAndGetMsg(pmresponse)) == NULL) break;
+      if ((next = _cacheAndGetMsg(source)) == NULL) break;
       domain = asl_get(next, kPMASLDomainKey);
       if (!domain) continue;
 
@@ -6712,6 +7778,38 @@ static void printSleepWakeMsg(asl_object_t m, int logType)
 
 #define kFilterDurationInSec (7 * 24 * 60 * 60)
 
+static const char * const kLogExportColumns[] = {
+    "time", "domain", "uuid", "message", "signature", "delay", "value"
+};
+
+/* Streams every message from 'source' as one record, without the
+ * sleep/wake pairing done by show_log_text() and show_log_json().
+ */
+static void export_log(PMLogSource *source, ExportFormat format)
+{
+    ExportWriter    *w = &gExportWriter;
+    asl_object_t    m;
+    const char      *val;
+
+    export_begin(w, format, kLogExportColumns, ARRAY_SIZE(kLogExportColumns));
+
+    while ((m = _pmlog_next(source))) {
+        if ((val = asl_get(m, ASL_KEY_TIME))) {
+            export_int(w, strtoll(val, NULL, 10));
+        } else {
+            export_null(w);
+        }
+        export_string(w, asl_get(m, kPMASLDomainKey));
+        export_string(w, asl_get(m, kPMASLUUIDKey));
+        export_string(w, asl_get(m, ASL_KEY_MSG));
+        export_string(w, asl_get(m, kPMASLSignatureKey));
+        export_string(w, asl_get(m, kPMASLDelayKey));
+        export_string(w, asl_get(m, kPMASLValueKey));
+        export_record_end(w);
+    }
+    export_flush(w);
+}
+
 /* All PM messages in ASL log */
 static void show_log(char **argv)
 {
@@ -6719,26 +7817,64 @@ static void show_log(char **argv)
     asl_object_t        filtered_response = NULL;
     bool                filter_logs = true;
     bool                json = false;
+    bool                use_event_log = true;
     char                *store = kPMASLStorePath;
+    unsigned long long  start_sec;
+    PMLogSource         source = { 0 };
+    ExportFormat        export_format = kExportNone;
 
-    if (argv[0]) {
-        if (!strcmp(argv[0],"-json")) {
+    for (int i = 0; argv[i]; i++) {
+        if (!strcmp(argv[i],"-json")) {
             json = true;
         }
-        else if (!strcmp(argv[0], "-all")) {
+        else if (!strcmp(argv[i], "-all")) {
             filter_logs = false;
         }
-        else if ((!strcmp(argv[0], "-f")) && argv[1]) {
-            store = argv[1];
+        else if ((!strcmp(argv[i], "-f")) && argv[i+1]) {
+            store = argv[++i];
+            use_event_log = false;
+        }
+        else if (export_format_from_arg(argv[i])) {
+            export_format = export_format_from_arg(argv[i]);
         }
     }
 
+    start_sec = ((unsigned long long)CFAbsoluteTimeGetCurrent()) +
+        kCFAbsoluteTimeIntervalSince1970 - kFilterDurationInSec;
+
+    /*
+     * Prefer powerd's event log, which can seek straight to the start of the
+     * window. It only keeps a bounded history, so '-all' and windows it doesn't
+     * fully cover still go to the ASL store.
+     */
+    if (use_event_log && filter_logs) {
+        source.eventLog = eventLogOpen(start_sec);
+    }
+    if (source.eventLog) {
+        if (export_format) {
+            export_log(&source, export_format);
+            eventLogClose(source.eventLog);
+            return;
+        }
+        printf("PM event log: %s\n", kPMEventLogDir);
+        if (json) {
+            show_log_json(&source);
+        }
+        else {
+            show_log_text(&source);
+        }
+        eventLogClose(source.eventLog);
+        return;
+    }
+
     response = open_pm_asl_store(store);
 
     if (!response) {
-        printf("Error - no messages found in PM ASL data store at: %s\n", store);
+        if (!export_format) {
+            printf("Error - no messages found in PM ASL data store at: %s\n", store);
+        }
         return;
-    } else
+    } else if (!export_format)
         printf("PM ASL data store: %s\n", store);
 
     if (filter_logs){
@@ -6749,9 +7885,7 @@ static void show_log(char **argv)
             printf("Error - unable to create query filter for PM ASL data store at: %s\n", store);
             return;
         }
-        unsigned long long duration_sec = ((unsigned long long)CFAbsoluteTimeGetCurrent()) +
-            kCFAbsoluteTimeIntervalSince1970 - kFilterDurationInSec;
-        snprintf(timestr, sizeof(timestr), "%llu", duration_sec);
+        snprintf(timestr, sizeof(timestr), "%llu", start_sec);
 
         asl_set_query(cq, ASL_KEY_TIME, timestr, ASL_QUERY_OP_GREATER_EQUAL);
         filtered_response = asl_search(response, cq);
@@ -6762,11 +7896,15 @@ static void show_log(char **argv)
         filtered_response = response;
     }
 
-    if (json) {
-        show_log_json(filtered_response);
+    source.response = filtered_response;
+    if (export_format) {
+        export_log(&source, export_format);
+    }
+    else if (json) {
+        show_log_json(&source);
     }
     else {
-        show_log_text(filtered_response);
+        show_log_text(&source);
     }
 
     asl_release(filtered_response);
@@ -6774,7 +7912,7 @@ static void show_log(char **argv)
 }
 
 /* All PM messages in ASL log in text format */
-static void show_log_text(asl_object_t response)
+static void show_log_text(PMLogSource *source)
 {
     asl_object_t        m = NULL;
     char                uuid[100];
@@ -6785,7 +7923,7 @@ static void show_log_text(asl_object_t response)
 
     uuid[0] = 0;
 
-    while ((m = _my_next_response(response))) {
+    while ((m = _my_next_response(source))) {
 
         const char  *val = NULL;
         int32_t     print_duration_time = -1;
@@ -6882,7 +8020,7 @@ static void show_log_text(asl_object_t response)
 
 
             if (!strncmp(kPMASLDomainPMSleep, domain, sizeof(kPMASLDomainPMSleep) )) {
-                if ( (print_duration_time = _getNextWakeTime(response)) != -1) {
+                if ( (print_duration_time = _getNextWakeTime(source)) != -1) {
                     print_duration_time -= time_read;
                 }
                 sleepWake = true;
@@ -6894,7 +8032,7 @@ static void show_log_text(asl_object_t response)
             else if (!strncmp(kPMASLDomainPMWake, domain, sizeof(kPMASLDomainPMWake)) ||
                      !strncmp(kPMASLDomainPMDarkWake, domain, sizeof(kPMASLDomainPMDarkWake))) {
                 isAwakening = true;
-                if ( (print_duration_time = _getNextSleepTime(response, domain)) != -1) {
+                if ( (print_duration_time = _getNextSleepTime(source, domain)) != -1) {
                     print_duration_time -= time_read;
                 }
                 sleepWake = true;
@@ -6959,7 +8097,7 @@ static void show_log_text(asl_object_t response)
 }
 
 /* All PM messages in ASL log in json format */
-static void show_log_json(asl_object_t response)
+static void show_log_json(PMLogSource *source)
 {
     asl_object_t        m = NULL;
     char                uuid[100];
@@ -6973,7 +8111,7 @@ static void show_log_json(asl_object_t response)
     // Initialize the output
     printf("[");
 
-    while ((m = _my_next_response(response))) {
+    while ((m = _my_next_response(source))) {
 
         const char  *val = NULL;
         int32_t     print_duration_time = -1;
@@ -7060,7 +8198,7 @@ static void show_log_json(asl_object_t response)
             }
 
             if (!strncmp(kPMASLDomainPMSleep, val, sizeof(kPMASLDomainPMSleep))) {
-                if ( (print_duration_time = _getNextWakeTime(response)) != -1) {
+                if ( (print_duration_time = _getNextWakeTime(source)) != -1) {
                     print_duration_time -= time_read;
                 }
                 sleepWake = true;
@@ -7068,7 +8206,7 @@ static void show_log_json(asl_object_t response)
             else if (!strncmp(kPMASLDomainPMWake, val, sizeof(kPMASLDomainPMWake)) ||
                      !strncmp(kPMASLDomainPMDarkWake, val, sizeof(kPMASLDomainPMDarkWake))) {
                 isAwakening = true;
-                if ( (print_duration_time = _getNextSleepTime(response, val)) != -1) {
+                if ( (print_duration_time = _getNextSleepTime(source, val)) != -1) {
                     print_duration_time -= time_read;
                 }
                 sleepWake = true;
@@ -8310,6 +9448,108 @@ static void show_rdStats(char **argv)
 
 }
 
+/* show_response_times
+ * Prints powerd's per-client PM connection response latency histograms.
+ * With "-binary", writes the raw PMResponseLatencyHeader/Record blob to
+ * stdout instead, for collection tools.
+ */
+static void show_response_times(char **argv)
+{
+    xpc_connection_t            connection = NULL;
+    xpc_object_t                msg = NULL;
+    xpc_object_t                reply = NULL;
+    const uint8_t               *blob = NULL;
+    size_t                      len = 0;
+    PMResponseLatencyHeader     header;
+    const PMResponseLatencyRecord *records;
+    bool                        binary = false;
+    static const char           *transitionNames[kPMResponseTransitionCount] = {
+                                    "Sleep", "DarkWake", "Wake", "Other" };
+    int                         i, t, b;
+
+    if (argv && argv[0] && !strcmp(argv[0], "-binary")) {
+        binary = true;
+    }
+
+    connection = xpc_connection_create_mach_service(POWERD_XPC_ID, NULL, 0);
+    if (!connection) {
+        fprintf(stderr, "Failed to open connection to powerd\n");
+        return;
+    }
+    xpc_connection_set_event_handler(connection, ^(xpc_object_t event) { });
+    xpc_connection_resume(connection);
+
+    msg = xpc_dictionary_create(NULL, NULL, 0);
+    if (!msg) {
+        fprintf(stderr, "Failed to create xpc message\n");
+        goto exit;
+    }
+    xpc_dictionary_set_bool(msg, kPMResponseLatencyCopyMsg, true);
+
+    reply = xpc_connection_send_message_with_reply_sync(connection, msg);
+    if (!reply || (xpc_get_type(reply) != XPC_TYPE_DICTIONARY)) {
+        fprintf(stderr, "No response from powerd\n");
+        goto exit;
+    }
+
+    blob = xpc_dictionary_get_data(reply, kPMResponseLatencyDataKey, &len);
+    if (!blob || (len < sizeof(header))) {
+        fprintf(stderr, "Response latency data is not available\n");
+        goto exit;
+    }
+
+    if (binary) {
+        fwrite(blob, 1, len, stdout);
+        goto exit;
+    }
+
+    memcpy(&header, blob, sizeof(header));
+    if ((header.magic != kPMResponseLatencyMagic)
+        || (header.version != kPMResponseLatencyVersion)
+        || (header.bucketCount != kPMResponseLatencyBucketCount)
+        || (header.transitionCount != kPMResponseTransitionCount)
+        || (len < sizeof(header) + header.recordCount * sizeof(PMResponseLatencyRecord))) {
+        fprintf(stderr, "Unrecognized response latency data\n");
+        goto exit;
+    }
+    records = (const PMResponseLatencyRecord *)(blob + sizeof(header));
+
+    printf("Response times to PM connection notifications (ms, by log2 bucket)\n");
+    printf("%-32s %-9s %7s %8s %7s  %s\n", "Client", "Event", "Count", "TimedOut", "Max", "Histogram");
+    for (i = 0; i < header.recordCount; i++) {
+        for (t = 0; t < kPMResponseTransitionCount; t++) {
+            uint32_t count = 0;
+
+            for (b = 0; b < kPMResponseLatencyBucketCount; b++) {
+                count += records[i].counts[t][b];
+            }
+            if (!count && !records[i].timeouts[t]) {
+                continue;
+            }
+
+            printf("%-32.*s %-9s %7u %8u %7u ", kPMResponseLatencyNameLen, records[i].name,
+                   transitionNames[t], count, records[i].timeouts[t], records[i].maxMS[t]);
+            for (b = 0; b < kPMResponseLatencyBucketCount; b++) {
+                if (records[i].counts[t][b]) {
+                    printf(" %s%u:%u", (b == kPMResponseLatencyBucketCount - 1) ? ">=" : "<",
+                           (b == kPMResponseLatencyBucketCount - 1) ?
+                                PMResponseLatencyBucketFloor(b) : PMResponseLatencyBucketFloor(b + 1),
+                           records[i].counts[t][b]);
+                }
+            }
+            printf("\n");
+        }
+    }
+
+exit:
+    if (reply)
+        xpc_release(reply);
+    if (msg)
+        xpc_release(msg);
+    xpc_connection_cancel(connection);
+    xpc_release(connection);
+}
+
 static void cancelAggregates( int param )
 {
     IOPMSetAssertionActivityAggregate(false);
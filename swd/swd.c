@@ -37,18 +37,53 @@
 #include <zlib.h>
 #include <os/log.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #define SLEEP_WAKE_FILENAMETOKEN "Sleep Wake Failure"
 
+#define DIAGNOSTIC_REPORTS_DIR "/Library/Logs/DiagnosticReports"
+
+#define SPINDUMP_PATH "/usr/sbin/spindump"
+
 #define PANIC_FILE "/var/db/PanicReporter/current.panic"
 
 #define STACKSHOT_TEMP_FILE "/tmp/sw_stackshot"
 
 #define STACKSHOT_KCDATA_FORMAT  0x10000
 
+#define IO_CHUNK_SIZE (64 * 1024)
+
+extern char **environ;
+
+/*
+ * Writes all 'len' bytes of 'buf' to 'fd', retrying after short writes
+ * and EINTR. Returns the number of bytes written.
+ */
+static ssize_t write_fully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < len) {
+        n = write(fd, p + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
 ssize_t uncompress_stackshot(char *gz_fname, char *fname_out)
 {
-    char buf[512];
+    char *buf = NULL;
     int fd = -1;
     int bytes_read = -1;
     ssize_t bytes_saved, total_bytes;
@@ -59,27 +94,35 @@ ssize_t uncompress_stackshot(char *gz_fname, char *fname_out)
         os_log_error(OS_LOG_DEFAULT, "Failed to open compressed file %s\n", gz_fname);
         goto exit;
     }
+    gzbuffer(gz, IO_CHUNK_SIZE);
 
-    fd = open(fname_out, O_CREAT|O_RDWR, 0600);
+    buf = malloc(IO_CHUNK_SIZE);
+    if (!buf) {
+        goto exit;
+    }
+
+    fd = open(fname_out, O_CREAT|O_TRUNC|O_WRONLY, 0600);
     if (fd == -1) {
         os_log_error(OS_LOG_DEFAULT, "Failed to open temp file to save uncompressed stackshot. errno:%d\n", errno);
         goto exit;
     }
-    while((bytes_read = gzread(gz, buf, sizeof(buf))) > 0) {
-        bytes_saved = write(fd, buf, bytes_read);
+    while((bytes_read = gzread(gz, buf, IO_CHUNK_SIZE)) > 0) {
+        bytes_saved = write_fully(fd, buf, bytes_read);
         if (bytes_saved != bytes_read) {
             os_log_error(OS_LOG_DEFAULT, "Failed to save uncompressed data to temp file. error:%d\n", errno);
+            total_bytes = 0;
             break;
         }
         total_bytes += bytes_saved;
-        os_log_debug(OS_LOG_DEFAULT, "Saved %ld uncompressed bytes to temp file %s\n", bytes_saved, fname_out);
     }
     if (bytes_read == -1) {
         int errnum = 0;
         const char *errstr = gzerror(gz, &errnum);
         os_log_error(OS_LOG_DEFAULT, "Failed to uncompress stackshot data due to error:%s(%d)",
                 errstr, errnum);
+        total_bytes = 0;
     }
+    os_log_debug(OS_LOG_DEFAULT, "Saved %ld uncompressed bytes to temp file %s\n", total_bytes, fname_out);
 
 exit:
     if (gz) {
@@ -88,28 +131,144 @@ exit:
     if (fd != -1) {
         close(fd);
     }
+    if (buf) {
+        free(buf);
+    }
     return total_bytes;
 }
 
-void process_logfiles(char *gz_stacksfile, char *logfile, int compressed)
+/*
+ * Runs spindump on the sleep/wake failure data, and copies the path of
+ * the report it writes, as printed on its output, to 'report'.
+ * Returns true if a report path was found.
+ */
+static bool run_spindump(char *stacksfile, char *logfile, char *report, size_t report_len)
+{
+    char *args[6];
+    int n = 0;
+    int pipefd[2] = { -1, -1 };
+    int status = 0;
+    pid_t pid = -1;
+    posix_spawn_file_actions_t actions;
+    FILE *out = NULL;
+    char *line = NULL;
+    size_t linecap = 0;
+    bool found = false;
+
+    /*
+     * We need to differentiate Sleep/Wake failure from AppleOSXWatchdog failure. Indeed,
+     * currently spindump has a different interface for both watchdogs.
+     */
+    args[n++] = "spindump";
+    if (stacksfile) {
+        args[n++] = "-sleepwakefailure_stackshot_file";
+        args[n++] = stacksfile;
+    }
+    args[n++] = "-sleepwakefailure_data_file";
+    args[n++] = logfile;
+    args[n] = NULL;
+
+    if (pipe(pipefd) != 0) {
+        os_log_error(OS_LOG_DEFAULT, "Failed to create pipe for spindump. errno:%d\n", errno);
+        return false;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+
+    // Invoke spindump.
+    status = posix_spawn(&pid, SPINDUMP_PATH, &actions, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+    if (status != 0) {
+        os_log_error(OS_LOG_DEFAULT, "Failed to launch spindump. error:%d\n", status);
+        close(pipefd[0]);
+        return false;
+    }
+
+    // Pick the report path out of spindump's output as it goes
+    out = fdopen(pipefd[0], "r");
+    if (out) {
+        while (getline(&line, &linecap, out) > 0) {
+            char *path = strstr(line, DIAGNOSTIC_REPORTS_DIR "/" SLEEP_WAKE_FILENAMETOKEN);
+            if (path && !found) {
+                path[strcspn(path, "\r\n")] = '\0';
+                strlcpy(report, path, report_len);
+                found = true;
+            }
+            os_log_debug(OS_LOG_DEFAULT, "spindump: %{public}s", line);
+        }
+        free(line);
+        fclose(out);
+    } else {
+        close(pipefd[0]);
+    }
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        os_log_error(OS_LOG_DEFAULT, "spindump returned non zero exit status 0x%x\n", status);
+    }
+
+    return found;
+}
+
+/*
+ * Fallback for when spindump's output didn't name the report: returns the most
+ * recently created Sleep Wake Failure report in DIAGNOSTIC_REPORTS_DIR.
+ */
+static bool find_newest_report(char *report, size_t report_len)
 {
-    struct stat stacks;
-    struct stat logs;
-    char cmd[200];
     DIR *dirp;
     struct dirent *dp;
-    char fname[128], swfile[128];
+    char fname[PATH_MAX];
+    struct stat fstats;
     long crtime = 0;
+
+    dirp = opendir(DIAGNOSTIC_REPORTS_DIR);
+    if (dirp == NULL) {
+        return false;
+    }
+
+    while ((dp = readdir(dirp)) != NULL) {
+        char *filename      = SLEEP_WAKE_FILENAMETOKEN;
+        size_t filename_len = sizeof(SLEEP_WAKE_FILENAMETOKEN);
+
+        if ((strnstr(dp->d_name, filename, filename_len) == dp->d_name)
+                    && (dp->d_type == DT_REG)) {
+            snprintf(fname, sizeof(fname), DIAGNOSTIC_REPORTS_DIR "/%s", dp->d_name);
+            if (stat(fname, &fstats) != 0) {
+                continue;
+            }
+
+            if (S_ISREG(fstats.st_mode) && (crtime < fstats.st_birthtime)) {
+                crtime = fstats.st_birthtime;
+                strlcpy(report, fname, report_len);
+            }
+        }
+    }
+    closedir(dirp);
+
+    return (crtime != 0);
+}
+
+void process_logfiles(char *gz_stacksfile, char *logfile, int compressed)
+{
+    struct stat stacks;
+    struct stat logs;
+    char swfile[PATH_MAX];
     struct stat fstats, pfstat;
     struct timeval sleeptime, boottime;
     size_t size;
     bool stacksExist = true;
+    bool reportFound = false;
     char stacksfile[128];
 
 
     if ((lstat(logfile, &logs) != 0) || !S_ISREG(logs.st_mode) || (logs.st_size == 0))
         return;
 
+    stacksfile[0] = '\0';
     if ((lstat(gz_stacksfile, &stacks) != 0) || !S_ISREG(stacks.st_mode) || (stacks.st_size == 0)) {
         stacksExist = false;
     }
@@ -124,27 +283,13 @@ void process_logfiles(char *gz_stacksfile, char *logfile, int compressed)
             unlink(kSleepWakeStacksFilename);
         }
     }
-    
-    /*
-     * We need to differentiate Sleep/Wake failure from AppleOSXWatchdog failure. Indeed,
-     * currently spindump has a different interface for both watchdogs.
-     */
-    
-    snprintf(cmd, sizeof(cmd),
-             "/usr/sbin/spindump %s %s -sleepwakefailure_data_file %s",
-             (stacksExist) ? "-sleepwakefailure_stackshot_file" : "",
-             (stacksExist) ? stacksfile : "",
-             logfile);
-    
-    // Invoke spindump.
-    int err = system(cmd);
-    if (err) {
-        os_log_error(OS_LOG_DEFAULT, "spindump cmd %s returned non zero exit code %d\n", cmd, err);
-    }
 
+    reportFound = run_spindump(stacksExist ? stacksfile : NULL, logfile, swfile, sizeof(swfile));
 
     unlink(gz_stacksfile);
-    unlink(stacksfile);
+    if (stacksfile[0]) {
+        unlink(stacksfile);
+    }
     unlink(logfile);
 
 
@@ -155,36 +300,17 @@ void process_logfiles(char *gz_stacksfile, char *logfile, int compressed)
 
     // For RD_LOG files, trigger a pop-up dialog to report that
     // system has rebooted due to Sleep Wake failure.
-    //
-    // Look for most recently created Sleep Wake Failure file
-    dirp = opendir("/Library/Logs/DiagnosticReports");
-    if (dirp == NULL) {
-        return ;
-    }
-
-    while ((dp = readdir(dirp)) != NULL) {
-        char *filename      = SLEEP_WAKE_FILENAMETOKEN;
-        size_t filename_len = sizeof(SLEEP_WAKE_FILENAMETOKEN);
-        
-        if ((strnstr(dp->d_name, filename, filename_len) == dp->d_name)
-                    && (dp->d_type == DT_REG)) {
-            snprintf(fname, sizeof(fname), "/Library/Logs/DiagnosticReports/%s", dp->d_name);
-            stat(fname, &fstats);
-
-            if (S_ISREG(fstats.st_mode) && (crtime < fstats.st_birthtime)) {
-                crtime = fstats.st_birthtime;
-                strncpy(swfile, fname, sizeof(swfile));
-            }
-        }
+    if (!reportFound) {
+        reportFound = find_newest_report(swfile, sizeof(swfile));
     }
 
     // Check for existence of SleepWakeFailure log file
-    if (crtime == 0)
-        return;     
+    if (!reportFound || (stat(swfile, &fstats) != 0) || !S_ISREG(fstats.st_mode))
+        return;
 
     // Due diligence check to make sure this file is generated after system boot
     size = sizeof(boottime);
-    if ((sysctlbyname("kern.boottime", &boottime, &size, NULL, 0) != 0) || (boottime.tv_sec > crtime))
+    if ((sysctlbyname("kern.boottime", &boottime, &size, NULL, 0) != 0) || (boottime.tv_sec > fstats.st_birthtime))
         return;
 
     // If panic file link already exists, skip linking this Sleep Wake failure file
@@ -219,27 +345,41 @@ ssize_t take_stackshot(char *stackshot_filename) {
     ret = stackshot_capture_with_config(config);
     if (ret) {
         os_log_error(OS_LOG_DEFAULT, "stackshot capture returned error %d for pid %d\n", ret, pid);
-        return bytes_saved;
+        goto exit;
     }
 
     buffer = stackshot_config_get_stackshot_buffer(config);
     if (!buffer) {
         os_log_error(OS_LOG_DEFAULT, "stackshot buffer returned NULL\n");
-        return bytes_saved;
+        goto exit;
     }
     buffer_size = stackshot_config_get_stackshot_size(config);
     if (!buffer_size) {
         os_log_error(OS_LOG_DEFAULT, "stackshot buffer size returned %d\n", buffer_size);
-        return bytes_saved;
+        goto exit;
     }
-    fd = open(stackshot_filename, O_CREAT|O_RDWR, 0600);
+    fd = open(stackshot_filename, O_CREAT|O_TRUNC|O_WRONLY, 0600);
     if (fd == -1) {
         os_log_error(OS_LOG_DEFAULT, "Failed to open temp file to save stackshot. errno: %d\n", errno);
-        return bytes_saved;
+        goto exit;
     }
 
-    bytes_saved = write(fd, buffer, buffer_size);
+    bytes_saved = write_fully(fd, buffer, buffer_size);
+    if ((size_t)bytes_saved != buffer_size) {
+        // A truncated stackshot can't be decoded; don't hand it to spindump
+        os_log_error(OS_LOG_DEFAULT, "Saved only %ld of %u stackshot bytes. errno: %d\n",
+                     bytes_saved, buffer_size, errno);
+        bytes_saved = 0;
+        unlink(stackshot_filename);
+        goto exit;
+    }
     os_log_info(OS_LOG_DEFAULT, "Saved %ld bytes to stackshot file %s\n", bytes_saved, stackshot_filename);
+
+exit:
+    if (fd != -1) {
+        close(fd);
+    }
+    stackshot_config_dealloc(config);
     return bytes_saved;
 
 }
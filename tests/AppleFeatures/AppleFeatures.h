@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for the SDK header, for the tests in this directory.
+ * AppleSmartBatteryCommands.h includes it first, so it also declares the
+ * few kernel types that header uses.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int         IOReturn;
+typedef uint64_t    IOByteCount;
+
+#ifdef __cplusplus
+class OSObject;
+#else
+typedef struct OSObject OSObject;
+#endif
@@ -0,0 +1,176 @@
+/*
+ * AppleBatteryAuthCertCacheKey: certificate cache keyed by battery serial
+ * and GG reset count, driven the way AppleBatteryAuth::_copyCachedCert()
+ * and _cacheCert() drive it, against a fake SMC that counts reads.
+ */
+#include <string>
+#include "TestHarness.h"
+#include "AppleBatteryAuthCertCache.h"
+
+// SMC side of the battery: certificate segments and the GG reset count
+struct FakeSmc {
+    bool        installed = true;
+    std::string serial = "F5D1234567890";
+    uint16_t    resetCount = 3;
+    bool        resetCountFails = false;
+    bool        resetDuringTransfer = false;
+    int         certSegmentReads = 0;
+    int         resetCountReads = 0;
+
+    bool readResetCount(uint16_t *count)
+    {
+        resetCountReads++;
+        if (resetCountFails) {
+            return false;
+        }
+        *count = resetCount;
+        return true;
+    }
+
+    std::string readCertificate()
+    {
+        // 4 BATC/BATD round trips for a ~500 byte certificate
+        certSegmentReads += 4;
+        if (resetDuringTransfer) {
+            resetCount++;
+            resetDuringTransfer = false;
+        }
+        return "cert:" + serial + ":" + std::to_string(resetCount);
+    }
+};
+
+// The driver side: mirrors the GetCert path of AppleBatteryAuth
+struct Driver {
+    explicit Driver(FakeSmc *s) : smc(s) {}
+
+    FakeSmc                         *smc;
+    AppleBatteryAuthCertCacheKey    key;
+    std::string                     cached;
+
+    std::string getCert()
+    {
+        uint16_t cnt = 0;
+        bool valid = smc->readResetCount(&cnt);
+
+        if (!key.validate(smc->installed ? smc->serial.c_str() : NULL, valid, cnt)) {
+            cached.clear();
+        }
+        if (!cached.empty()) {
+            return cached;
+        }
+
+        std::string cert = smc->readCertificate();
+
+        valid = smc->readResetCount(&cnt);
+        if (key.mayStore(valid, cnt)) {
+            cached = cert;
+        }
+        return cert;
+    }
+};
+
+static void testRepeatRequestsServedFromCache(void)
+{
+    FakeSmc smc;
+    Driver drv(&smc);
+
+    std::string first = drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 4);
+    for (int i = 0; i < 10; i++) {
+        T_EXPECT(drv.getCert() == first);
+    }
+    T_EXPECT_EQ(smc.certSegmentReads, 4);
+}
+
+static void testResetCountChangeInvalidates(void)
+{
+    FakeSmc smc;
+    Driver drv(&smc);
+
+    drv.getCert();
+    smc.resetCount++;
+    T_EXPECT(drv.getCert() == "cert:F5D1234567890:4");
+    T_EXPECT_EQ(smc.certSegmentReads, 8);
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 8);
+}
+
+static void testBatterySwapInvalidates(void)
+{
+    FakeSmc smc;
+    Driver drv(&smc);
+
+    drv.getCert();
+    smc.installed = false;
+    drv.getCert();
+    T_EXPECT(!drv.key.valid());
+    T_EXPECT_EQ(smc.certSegmentReads, 8);
+
+    smc.installed = true;
+    smc.serial = "F5D0000000001";
+    T_EXPECT(drv.getCert() == "cert:F5D0000000001:3");
+    T_EXPECT_EQ(smc.certSegmentReads, 12);
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 12);
+}
+
+static void testResetDuringTransferNotCached(void)
+{
+    FakeSmc smc;
+    Driver drv(&smc);
+
+    smc.resetDuringTransfer = true;
+    drv.getCert();
+    T_EXPECT(drv.cached.empty());
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 8);
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 8);
+}
+
+static void testUnreadableResetCountNeverCached(void)
+{
+    FakeSmc smc;
+    Driver drv(&smc);
+
+    // A failed read must not look like a reset count of 0
+    smc.resetCount = 0;
+    smc.resetCountFails = true;
+    for (int i = 0; i < 3; i++) {
+        drv.getCert();
+    }
+    T_EXPECT_EQ(smc.certSegmentReads, 12);
+    T_EXPECT(!drv.key.valid());
+
+    // Reads failing after the cache was filled drop it
+    smc.resetCountFails = false;
+    drv.getCert();
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 16);
+    smc.resetCountFails = true;
+    drv.getCert();
+    T_EXPECT_EQ(smc.certSegmentReads, 20);
+    T_EXPECT(drv.cached.empty());
+}
+
+static void testOverlongSerial(void)
+{
+    AppleBatteryAuthCertCacheKey key;
+    std::string serial(100, 'x');
+
+    T_EXPECT(!key.validate(serial.c_str(), true, 1));
+    T_EXPECT(!key.valid());
+    T_EXPECT(!key.mayStore(true, 1));
+}
+
+int main(void)
+{
+    T_RUN(testRepeatRequestsServedFromCache);
+    T_RUN(testResetCountChangeInvalidates);
+    T_RUN(testBatterySwapInvalidates);
+    T_RUN(testResetDuringTransferNotCached);
+    T_RUN(testUnreadableResetCountNeverCached);
+    T_RUN(testOverlongSerial);
+
+    return T_RESULT();
+}
@@ -0,0 +1,73 @@
+/*
+ * AppleBatteryAuthHistogram: bucketing of the battery auth latency
+ * histograms.
+ */
+#include "TestHarness.h"
+#include "AppleBatteryAuthHistogram.h"
+
+static const AppleBatteryAuthHistogram latency(kBattAuthLatencySegments, kBattAuthLatencySegmentCount);
+
+static void testLatencyLayout(void)
+{
+    T_EXPECT_EQ(latency.buckets(), 28);
+
+    // 10ms buckets up to 100ms
+    T_EXPECT_EQ(latency.bucketFor(0), 0);
+    T_EXPECT_EQ(latency.bucketFor(9), 0);
+    T_EXPECT_EQ(latency.bucketFor(10), 1);
+    T_EXPECT_EQ(latency.bucketFor(99), 9);
+
+    // 100ms buckets up to 1s
+    T_EXPECT_EQ(latency.bucketFor(100), 10);
+    T_EXPECT_EQ(latency.bucketFor(199), 10);
+    T_EXPECT_EQ(latency.bucketFor(999), 18);
+
+    // 1s buckets up to 10s; SMC_RESP_TIMEOUT (5s) is in the middle
+    T_EXPECT_EQ(latency.bucketFor(1000), 19);
+    T_EXPECT_EQ(latency.bucketFor(5000), 23);
+    T_EXPECT_EQ(latency.bucketFor(9999), 27);
+}
+
+static void testOutOfRange(void)
+{
+    T_EXPECT_EQ(latency.bucketFor(-1), 0);
+    T_EXPECT_EQ(latency.bucketFor(INT64_MIN), 0);
+    T_EXPECT_EQ(latency.bucketFor(10000), 27);
+    T_EXPECT_EQ(latency.bucketFor(INT64_MAX), 27);
+}
+
+static void testLowerBounds(void)
+{
+    T_EXPECT_EQ(latency.lowerBound(0), 0);
+    T_EXPECT_EQ(latency.lowerBound(9), 90);
+    T_EXPECT_EQ(latency.lowerBound(10), 100);
+    T_EXPECT_EQ(latency.lowerBound(18), 900);
+    T_EXPECT_EQ(latency.lowerBound(19), 1000);
+    T_EXPECT_EQ(latency.lowerBound(27), 9000);
+    T_EXPECT_EQ(latency.lowerBound(28), -1);
+    T_EXPECT_EQ(latency.lowerBound(-1), -1);
+
+    // Every bucket's lower bound maps back onto it
+    for (int b = 0; b < latency.buckets(); b++) {
+        T_EXPECT_EQ(latency.bucketFor(latency.lowerBound(b)), b);
+    }
+}
+
+static void testEmpty(void)
+{
+    AppleBatteryAuthHistogram empty(NULL, 0);
+
+    T_EXPECT_EQ(empty.buckets(), 0);
+    T_EXPECT_EQ(empty.bucketFor(5), -1);
+    T_EXPECT_EQ(empty.lowerBound(0), -1);
+}
+
+int main(void)
+{
+    T_RUN(testLatencyLayout);
+    T_RUN(testOutOfRange);
+    T_RUN(testLowerBounds);
+    T_RUN(testEmpty);
+
+    return T_RESULT();
+}
@@ -0,0 +1,282 @@
+/*
+ * AppleBatteryAuthCmdQueue and AppleBatteryAuthPollBackoff, and the end to
+ * end latency of a GetInfo + GetCert + GetSignature sequence against a fake
+ * SMC, submitted back to back the way the auth relay does.
+ *
+ * The old driver took one command at a time, so the caller retried the
+ * next one until it was accepted, and polled the signing status every 3 s.
+ * The fake SMC runs in simulated time, in ms.
+ */
+#include "TestHarness.h"
+#include "AppleBatteryAuthQueue.h"
+
+#define kSmcRoundTripMs     4       // 'BATC' write, notification, 'BATD' read
+#define kCertSegments       10      // GetCert0..GetCert9
+#define kChallengeSettleMs  550     // _getInfo() sleeps this long after SetChallenge
+#define kStatusTimeoutMs    20000   // _veridianPollAuthStatus(20)
+#define kPollMinDelayMs     10      // AppleBatteryAuth.cpp
+#define kPollMaxDelayMs     3000
+#define kLegacyPollMs       3000    // the old fixed POLL_DELAY_SECS
+#define kLegacyRetryMs      100     // caller's retry interval after kIOReturnBusy
+
+enum { kCmdGetInfo, kCmdGetCert, kCmdGetSignature };
+
+struct Cmd {
+    int         id;
+    uint64_t    done;       // completion time
+};
+
+// Veridian auth chip behind the SMC
+struct FakeSmc {
+    explicit FakeSmc(unsigned int signMs) : signMs(signMs), now(0), signedAt(0), roundTrips(0), statusPolls(0) {}
+
+    unsigned int    signMs;
+    uint64_t        now;
+    uint64_t        signedAt;
+    unsigned int    roundTrips;
+    unsigned int    statusPolls;
+
+    void roundTrip(void)
+    {
+        now += kSmcRoundTripMs;
+        roundTrips++;
+    }
+
+    bool statusOk(void)
+    {
+        roundTrip();
+        statusPolls++;
+        return now >= signedAt;
+    }
+
+    // What _battAuthThreadGated() does for @id; @minPollMs and @maxPollMs
+    // pick the status polling policy
+    bool run(int id, unsigned int minPollMs, unsigned int maxPollMs)
+    {
+        switch (id) {
+            case kCmdGetInfo:
+                roundTrip();
+                return true;
+
+            case kCmdGetCert:
+                roundTrip();                        // GetCertLength
+                for (int i = 0; i < kCertSegments; i++) {
+                    roundTrip();
+                }
+                return true;
+
+            case kCmdGetSignature: {
+                AppleBatteryAuthPollBackoff backoff(kStatusTimeoutMs, minPollMs, maxPollMs);
+                unsigned int delay;
+                bool ok = false;
+
+                roundTrip();                        // SetChallenge, signing starts
+                signedAt = now + signMs;
+                now += kChallengeSettleMs;
+                while (!ok && backoff.next(&delay)) {
+                    now += delay;
+                    ok = statusOk();
+                }
+                if (!ok) {
+                    return false;
+                }
+                roundTrip();                        // GetNonce
+                roundTrip();                        // GetSignature
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+static const int sequence[] = { kCmdGetInfo, kCmdGetCert, kCmdGetSignature };
+#define kSequenceLength (sizeof(sequence) / sizeof(sequence[0]))
+
+// Queued commands, drained in order by one thread call, backoff polling
+static uint64_t runQueued(FakeSmc &smc, Cmd *cmds)
+{
+    AppleBatteryAuthCmdQueue<Cmd> queue;
+    bool kick, kicked = false;
+    Cmd *cmd;
+
+    queue.init();
+    for (size_t i = 0; i < kSequenceLength; i++) {
+        cmds[i].id = sequence[i];
+        T_EXPECT(queue.push(&cmds[i], &kick));
+        kicked |= kick;
+        T_EXPECT(!kick || i == 0);
+    }
+    T_EXPECT(kicked);
+
+    while ((cmd = queue.pop())) {
+        T_EXPECT(smc.run(cmd->id, kPollMinDelayMs, kPollMaxDelayMs));
+        cmd->done = smc.now;
+    }
+
+    return smc.now;
+}
+
+// One command at a time, the caller retrying on busy, fixed 3 s polls
+static uint64_t runLegacy(FakeSmc &smc, Cmd *cmds)
+{
+    uint64_t submit = 0;
+
+    for (size_t i = 0; i < kSequenceLength; i++) {
+        cmds[i].id = sequence[i];
+        // rejected with kIOReturnBusy until the previous command finished
+        while (submit < smc.now) {
+            submit += kLegacyRetryMs;
+        }
+        smc.now = submit;
+        T_EXPECT(smc.run(cmds[i].id, kLegacyPollMs, kLegacyPollMs));
+        cmds[i].done = smc.now;
+    }
+
+    return smc.now;
+}
+
+static void testQueueOrderAndKick(void)
+{
+    AppleBatteryAuthCmdQueue<Cmd> queue;
+    Cmd cmds[3];
+    bool kick;
+
+    queue.init();
+    T_EXPECT(queue.push(&cmds[0], &kick));
+    T_EXPECT(kick);
+    T_EXPECT(queue.push(&cmds[1], &kick));
+    T_EXPECT(!kick);
+
+    T_EXPECT(queue.pop() == &cmds[0]);
+    // submitted while the thread is draining: no second kick
+    T_EXPECT(queue.push(&cmds[2], &kick));
+    T_EXPECT(!kick);
+    T_EXPECT(queue.pop() == &cmds[1]);
+    T_EXPECT(queue.pop() == &cmds[2]);
+    T_EXPECT(queue.draining());
+    T_EXPECT(queue.pop() == NULL);
+    T_EXPECT(!queue.draining());
+
+    // the thread stopped, the next command starts it again
+    T_EXPECT(queue.push(&cmds[0], &kick));
+    T_EXPECT(kick);
+}
+
+static void testQueueFull(void)
+{
+    AppleBatteryAuthCmdQueue<Cmd> queue;
+    Cmd cmds[BATT_AUTH_QUEUE_DEPTH + 1];
+    bool kick;
+
+    queue.init();
+    for (int i = 0; i < BATT_AUTH_QUEUE_DEPTH; i++) {
+        T_EXPECT(queue.push(&cmds[i], &kick));
+    }
+    T_EXPECT(!queue.push(&cmds[BATT_AUTH_QUEUE_DEPTH], &kick));
+    T_EXPECT(!kick);
+    T_EXPECT_EQ(queue.count(), BATT_AUTH_QUEUE_DEPTH);
+
+    // wraps around once entries are taken
+    T_EXPECT(queue.pop() == &cmds[0]);
+    T_EXPECT(queue.push(&cmds[BATT_AUTH_QUEUE_DEPTH], &kick));
+    for (int i = 1; i <= BATT_AUTH_QUEUE_DEPTH; i++) {
+        T_EXPECT(queue.pop() == &cmds[i]);
+    }
+    T_EXPECT(queue.pop() == NULL);
+}
+
+static void testQueueFlush(void)
+{
+    AppleBatteryAuthCmdQueue<Cmd> queue;
+    Cmd cmds[2];
+    bool kick;
+    int n = 0;
+
+    queue.init();
+    queue.push(&cmds[0], &kick);
+    queue.push(&cmds[1], &kick);
+    while (queue.flush()) {
+        n++;
+    }
+    T_EXPECT_EQ(n, 2);
+    T_EXPECT_EQ(queue.count(), 0);
+}
+
+static void testBackoff(void)
+{
+    AppleBatteryAuthPollBackoff backoff(20000, 10, 3000);
+    const unsigned int expect[] = { 10, 20, 40, 80, 160, 320, 640, 1280, 2560, 3000, 3000 };
+    unsigned int delay, total = 0, n = 0;
+
+    for (size_t i = 0; i < sizeof(expect) / sizeof(expect[0]); i++) {
+        T_EXPECT(backoff.next(&delay));
+        T_EXPECT_EQ(delay, expect[i]);
+    }
+
+    // the rest of the timeout, the last delay cut short
+    AppleBatteryAuthPollBackoff full(20000, 10, 3000);
+    while (full.next(&delay)) {
+        T_EXPECT(delay <= 3000);
+        total += delay;
+        n++;
+    }
+    T_EXPECT_EQ(total, 20000);
+    T_EXPECT_EQ(full.elapsed(), 20000);
+    T_EXPECT_EQ(n, 14);
+}
+
+// The old 3 s fixed polling is a backoff from 3000 to 3000
+static void testBackoffFixed(void)
+{
+    AppleBatteryAuthPollBackoff backoff(20000, 3000, 3000);
+    unsigned int delay, n = 0;
+
+    while (backoff.next(&delay)) {
+        n++;
+    }
+    T_EXPECT_EQ(n, 7);      // DIV_ROUND_UP(20, 3)
+}
+
+static void testSequenceLatency(void)
+{
+    const unsigned int signTimes[] = { 50, 200, 1000, 2500 };
+
+    for (size_t i = 0; i < sizeof(signTimes) / sizeof(signTimes[0]); i++) {
+        FakeSmc legacy(signTimes[i]), queued(signTimes[i]);
+        Cmd legacyCmds[kSequenceLength], queuedCmds[kSequenceLength];
+        uint64_t tLegacy = runLegacy(legacy, legacyCmds);
+        uint64_t tQueued = runQueued(queued, queuedCmds);
+        // every SMC round trip back to back, and the signature read the
+        // moment signing is done
+        uint64_t ideal = (2 + kCertSegments + 4) * kSmcRoundTripMs + kChallengeSettleMs;
+
+        if (signTimes[i] > kChallengeSettleMs) {
+            ideal += signTimes[i] - kChallengeSettleMs;
+        }
+
+        printf("    sign %4u ms: queued %5llu ms (%u status polls)  legacy %5llu ms (%u status polls)  ideal %5llu ms\n",
+               signTimes[i], (unsigned long long)tQueued, queued.statusPolls,
+               (unsigned long long)tLegacy, legacy.statusPolls, (unsigned long long)ideal);
+
+        T_EXPECT(tQueued < tLegacy);
+        T_EXPECT(queuedCmds[0].done < queuedCmds[1].done);
+        T_EXPECT(queuedCmds[1].done < queuedCmds[2].done);
+        // doubling overshoots the end of signing by less than the wait itself
+        T_EXPECT(tQueued < ideal + (signTimes[i] > kChallengeSettleMs ? signTimes[i] : 0) + 4 * kSmcRoundTripMs
+                 + kPollMinDelayMs);
+        // and doesn't poll much more than the fixed interval did
+        T_EXPECT(queued.statusPolls <= legacy.statusPolls + 8);
+    }
+}
+
+int main(void)
+{
+    T_RUN(testQueueOrderAndKick);
+    T_RUN(testQueueFull);
+    T_RUN(testQueueFlush);
+    T_RUN(testBackoff);
+    T_RUN(testBackoffFixed);
+    T_RUN(testSequenceLatency);
+
+    return T_RESULT();
+}
@@ -0,0 +1,122 @@
+/*
+ * AppleGasGaugeUpdateCursor: range selection, seeking and segmenting of a
+ * mapped gas gauge image.
+ */
+#include "TestHarness.h"
+#include "AppleGasGaugeUpdateCursor.h"
+
+static uint8_t image[100];
+
+static void testSelectRejectsOverflow(void)
+{
+    AppleGasGaugeUpdateCursor c(image, sizeof(image));
+
+    T_EXPECT(c.select(0, sizeof(image)));
+    T_EXPECT(c.select(sizeof(image), 0));
+    T_EXPECT(!c.select(sizeof(image) + 1, 0));
+    T_EXPECT(!c.select(10, sizeof(image)));
+
+    // offset + length wraps around to a small value
+    T_EXPECT(!c.select(10, UINT64_MAX - 5));
+    T_EXPECT(!c.select(UINT64_MAX, 2));
+
+    // A failed select leaves the previous range in place
+    T_EXPECT(c.select(20, 30));
+    T_EXPECT(!c.select(90, 20));
+    T_EXPECT_EQ(c.length(), 30);
+    T_EXPECT(c.bytes() == image + 20);
+}
+
+static void testNullImage(void)
+{
+    AppleGasGaugeUpdateCursor c(NULL, 100);
+    const uint8_t *seg;
+    size_t len;
+
+    T_EXPECT_EQ(c.length(), 0);
+    T_EXPECT(c.bytes() == NULL);
+    T_EXPECT(!c.select(0, 0));
+    T_EXPECT(!c.next(32, &seg, &len));
+}
+
+static void testSeek(void)
+{
+    AppleGasGaugeUpdateCursor c(image, sizeof(image));
+
+    T_EXPECT(c.select(10, 50));
+    T_EXPECT(c.seek(0));
+    T_EXPECT(c.seek(50));
+    T_EXPECT_EQ(c.remaining(), 0);
+    T_EXPECT(!c.seek(51));
+    T_EXPECT(!c.seek(UINT64_MAX));
+    T_EXPECT_EQ(c.position(), 50);
+
+    T_EXPECT(c.seek(17));
+    T_EXPECT_EQ(c.position(), 17);
+    T_EXPECT_EQ(c.remaining(), 33);
+}
+
+static void testShortLastSegment(void)
+{
+    AppleGasGaugeUpdateCursor c(image, sizeof(image));
+    const uint8_t *seg;
+    size_t len, total = 0;
+    int segments = 0;
+
+    // 70 bytes starting at a misaligned offset: 32 + 32 + 6
+    T_EXPECT(c.select(3, 70));
+    while (c.next(32, &seg, &len)) {
+        T_EXPECT(seg == image + 3 + total);
+        total += len;
+        segments++;
+        if (segments < 3) {
+            T_EXPECT_EQ(len, 32);
+        }
+    }
+    T_EXPECT_EQ(segments, 3);
+    T_EXPECT_EQ(len, 6);
+    T_EXPECT_EQ(total, 70);
+    T_EXPECT_EQ(c.remaining(), 0);
+    T_EXPECT(!c.next(32, &seg, &len));
+}
+
+static void testOversizedSegment(void)
+{
+    AppleGasGaugeUpdateCursor c(image, sizeof(image));
+    const uint8_t *seg;
+    size_t len;
+
+    T_EXPECT(c.select(40, 25));
+    T_EXPECT(c.next(SIZE_MAX, &seg, &len));
+    T_EXPECT(seg == image + 40);
+    T_EXPECT_EQ(len, 25);
+    T_EXPECT(!c.next(SIZE_MAX, &seg, &len));
+}
+
+static void testZeroLengthNext(void)
+{
+    AppleGasGaugeUpdateCursor c(image, sizeof(image));
+    const uint8_t *seg = NULL;
+    size_t len = 123;
+
+    T_EXPECT(!c.next(0, &seg, &len));
+    T_EXPECT(seg == NULL);
+    T_EXPECT_EQ(len, 123);
+    T_EXPECT_EQ(c.position(), 0);
+
+    // An empty range has no segments
+    T_EXPECT(c.select(50, 0));
+    T_EXPECT(!c.next(32, &seg, &len));
+}
+
+int main(void)
+{
+    T_RUN(testSelectRejectsOverflow);
+    T_RUN(testNullImage);
+    T_RUN(testSeek);
+    T_RUN(testShortLastSegment);
+    T_RUN(testOversizedSegment);
+    T_RUN(testZeroLengthNext);
+
+    return T_RESULT();
+}
@@ -0,0 +1,388 @@
+/*
+ * Resuming an interrupted image transfer: AppleGasGaugeUpdateCheckResume
+ * on its own, and a client that keeps getting cut off in the middle of a
+ * transfer to a simulated updater, which also resets and sleeps. Whatever
+ * happens, the updater has to end up with the image that was sent.
+ *
+ * Client mirrors what AppleGasGaugeUpdate does around the checkpoint in
+ * _startUpdateGated() and _writeDataGated().
+ */
+#include <stdlib.h>
+#include "TestHarness.h"
+#include "AppleGasGaugeUpdateTransfer.h"
+#include "AppleGasGaugeUpdateResume.h"
+#include "SimulatedGasGaugeUpdater.h"
+
+#define kChunkLen   32
+#define kDataOp     0x02
+#define kImageType  4
+#define kBatteryId  0x5a5a1234
+
+static uint8_t image[6000];
+
+struct Client;
+
+struct ClientPort {
+    SimulatedGasGaugeUpdater    *sim;
+    Client                      *client;
+
+    int stage(const uint8_t *chunk, size_t length, uint64_t offset)
+    {
+        return sim->stage(chunk, length, offset);
+    }
+    int command(uint8_t op, uint64_t offset)
+    {
+        return sim->command(op, offset);
+    }
+    bool notifiedReady(uint8_t op)
+    {
+        return sim->notifiedReady(op);
+    }
+    int waitNotification(uint8_t op, unsigned int ms, bool *ready)
+    {
+        return sim->waitNotification(op, ms, ready);
+    }
+    void sleep(unsigned int ms)
+    {
+        sim->sleep(ms);
+    }
+    int pollReady(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms)
+    {
+        return sim->pollReady(op, timeout_ms, retry_ms);
+    }
+    void acked(uint64_t offset, size_t length);
+};
+
+struct Client {
+    explicit Client(SimulatedGasGaugeUpdater &sim)
+        : sim(sim), sleepCount(0), resumed(0), restarted(0), bytesSent(0),
+          lastCheck(kGgResumeNoCheckpoint)
+    {
+        memset(&cp, 0, sizeof(cp));
+        memset(sessionNonce, 0, sizeof(sessionNonce));
+    }
+
+    SimulatedGasGaugeUpdater            &sim;
+    struct AppleGasGaugeUpdateCheckpoint cp;
+    uint8_t                             sessionNonce[kGgNonceLength];
+    uint32_t                            sleepCount;     // the kext's _ggSleepCount
+    uint32_t                            resumed;
+    uint32_t                            restarted;
+    uint64_t                            bytesSent;
+    enum AppleGasGaugeUpdateResumeCheck lastCheck;
+
+    void readResumeState(struct AppleGasGaugeUpdateResumeState *st)
+    {
+        memset(st, 0, sizeof(*st));
+        // a reset or woken updater is ready again, for the same battery
+        sim.settle();
+        st->ready = true;
+        st->batteryIdValid = true;
+        st->batteryId = kBatteryId;
+        st->sleepCount = sleepCount;
+        st->progressValid = sim.progress(&st->progress);
+        st->nonceValid = true;
+        sim.nonce(st->nonce);
+    }
+
+    bool updaterHoldsCheckpoint(void)
+    {
+        struct AppleGasGaugeUpdateResumeState st;
+
+        readResumeState(&st);
+        lastCheck = AppleGasGaugeUpdateCheckResume(&cp, &st);
+        if (lastCheck != kGgResumeOK) {
+            memset(&cp, 0, sizeof(cp));
+            return false;
+        }
+        return true;
+    }
+
+    void startUpdate(void)
+    {
+        if (cp.valid && updaterHoldsCheckpoint()) {
+            return;
+        }
+        sim.startUpdate();
+        sim.nonce(sessionNonce);
+    }
+
+    int writeImage(void)
+    {
+        ClientPort port = { &sim, this };
+        AppleGasGaugeUpdateTransfer<ClientPort> xfer(port, sim.windowed ? 2 : 1, kChunkLen);
+        AppleGasGaugeUpdateCursor cursor(image, sizeof(image));
+        uint64_t offset = 0;
+        int ret;
+
+        if (cp.valid && updaterHoldsCheckpoint()) {
+            offset = cp.ackedOffset;
+            resumed++;
+        } else {
+            memset(&cp, 0, sizeof(cp));
+            sim.startImage(kImageType);
+            cp.valid = true;
+            cp.batteryId = kBatteryId;
+            cp.type = kImageType;
+            cp.dataLength = sizeof(image);
+            cp.sleepCount = sleepCount;
+            memcpy(cp.nonce, sessionNonce, sizeof(cp.nonce));
+            restarted++;
+        }
+
+        cursor.seek(offset);
+        ret = xfer.run(cursor, kDataOp);
+        if (!ret) {
+            memset(&cp, 0, sizeof(cp));
+        }
+        return ret;
+    }
+};
+
+void ClientPort::acked(uint64_t offset, size_t length)
+{
+    if (client->cp.valid && client->cp.ackedOffset == offset) {
+        client->cp.ackedOffset = offset + length;
+    }
+    client->bytesSent += length;
+}
+
+static bool sameImage(const SimulatedGasGaugeUpdater &sim)
+{
+    return sim.image.size() == sizeof(image)
+        && !memcmp(sim.image.data(), image, sizeof(image));
+}
+
+// Cut the client off at the @n'th port call of its first transfer, let
+// @between happen, and finish the update
+static void interruptOnce(SimulatedGasGaugeUpdater &sim, Client &client, uint32_t n,
+                          void (*between)(SimulatedGasGaugeUpdater &, Client &))
+{
+    client.startUpdate();
+    sim.dropIn = n;
+    T_EXPECT(client.writeImage() != 0);
+    T_EXPECT(client.cp.ackedOffset > 0);
+
+    if (between) {
+        between(sim, client);
+    }
+
+    client.startUpdate();
+    T_EXPECT_EQ(client.writeImage(), 0);
+    T_EXPECT(sameImage(sim));
+    T_EXPECT_EQ(sim.overruns, 0);
+}
+
+static void gaugeReset(SimulatedGasGaugeUpdater &sim, Client &client)
+{
+    (void)client;
+    sim.loseSession();
+}
+
+static void systemSleep(SimulatedGasGaugeUpdater &sim, Client &client)
+{
+    client.sleepCount++;
+    sim.loseSession();
+}
+
+static void testCheckResume(void)
+{
+    struct AppleGasGaugeUpdateCheckpoint cp;
+    struct AppleGasGaugeUpdateResumeState st;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.valid = true;
+    cp.batteryId = kBatteryId;
+    cp.type = kImageType;
+    cp.dataLength = 1000;
+    cp.ackedOffset = 320;
+    cp.sleepCount = 3;
+    cp.nonce[0] = 7;
+
+    memset(&st, 0, sizeof(st));
+    st.ready = true;
+    st.batteryIdValid = true;
+    st.batteryId = kBatteryId;
+    st.sleepCount = 3;
+    st.progressValid = true;
+    st.progress.type = kImageType;
+    st.progress.received = 320;
+    st.nonceValid = true;
+    st.nonce[0] = 7;
+
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeOK);
+
+    // Ready and the same battery is what an idle or reset updater reports too
+    st.progress.received = 0;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeProgressMismatch);
+    // programmed a chunk that was never acknowledged
+    st.progress.received = 352;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeProgressMismatch);
+    st.progress.received = 320;
+    st.progress.type = kImageType + 1;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeProgressMismatch);
+    st.progress.type = kImageType;
+
+    st.progressValid = false;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeNoProgress);
+    st.progressValid = true;
+
+    st.nonce[0] = 8;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeSessionChanged);
+    st.nonce[0] = 7;
+    st.nonceValid = false;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeSessionChanged);
+    st.nonceValid = true;
+
+    st.sleepCount = 4;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeSlept);
+    st.sleepCount = 3;
+
+    st.batteryId = kBatteryId + 1;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeBatteryChanged);
+    st.batteryId = kBatteryId;
+    st.batteryIdValid = false;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeBatteryChanged);
+    st.batteryIdValid = true;
+
+    st.ready = false;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeNotReady);
+    st.ready = true;
+
+    cp.ackedOffset = 0;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeNoCheckpoint);
+    cp.ackedOffset = cp.dataLength;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeNoCheckpoint);
+    cp.ackedOffset = 320;
+    cp.valid = false;
+    T_EXPECT_EQ(AppleGasGaugeUpdateCheckResume(&cp, &st), kGgResumeNoCheckpoint);
+}
+
+// Cut off while sending a command: the updater still holds exactly the
+// acknowledged prefix, so only the rest is sent
+static void testDropResumes(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Client client(sim);
+
+    // stage + command + wait per chunk after the first stage: the 2nd
+    // command of the 50th chunk
+    interruptOnce(sim, client, 1 + 3 * 49 + 1, NULL);
+    T_EXPECT_EQ(client.resumed, 1);
+    T_EXPECT_EQ(client.restarted, 1);
+    T_EXPECT_EQ(client.bytesSent, sizeof(image));
+}
+
+static void testResetRestarts(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Client client(sim);
+
+    interruptOnce(sim, client, 1 + 3 * 49 + 1, gaugeReset);
+    T_EXPECT_EQ(client.lastCheck, kGgResumeProgressMismatch);
+    T_EXPECT_EQ(client.resumed, 0);
+    T_EXPECT_EQ(client.restarted, 2);
+}
+
+static void testSleepRestarts(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Client client(sim);
+
+    interruptOnce(sim, client, 1 + 3 * 49 + 1, systemSleep);
+    T_EXPECT_EQ(client.lastCheck, kGgResumeSlept);
+    T_EXPECT_EQ(client.resumed, 0);
+}
+
+// Without 'BFUP' nothing proves the updater still holds the prefix
+static void testNoProgressKeyRestarts(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Client client(sim);
+
+    sim.hasProgress = false;
+    interruptOnce(sim, client, 1 + 3 * 49 + 1, NULL);
+    T_EXPECT_EQ(client.lastCheck, kGgResumeNoProgress);
+    T_EXPECT_EQ(client.resumed, 0);
+}
+
+// Cut off while waiting for the updater: it programmed a chunk that was
+// never acknowledged, and the transfer starts over
+static void testDropAfterUnackedChunkRestarts(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Client client(sim);
+
+    interruptOnce(sim, client, 1 + 3 * 49 + 3, NULL);
+    T_EXPECT_EQ(client.lastCheck, kGgResumeProgressMismatch);
+    T_EXPECT_EQ(client.resumed, 0);
+}
+
+// Random drops, resets and sleeps, until the update goes through
+static void testRandomSessionDrops(void)
+{
+    const int runs = 300;
+    uint64_t resumed = 0, restarted = 0, sent = 0;
+    int bad = 0;
+
+    srand(42);
+    for (int run = 0; run < runs; run++) {
+        SimulatedGasGaugeUpdater sim((run & 1) != 0, 8000);
+        Client client(sim);
+        int attempts = 0;
+
+        for (;;) {
+            client.startUpdate();
+            sim.dropIn = (rand() % 4) ? 1 + rand() % 600 : 0;
+            if (!client.writeImage()) {
+                break;
+            }
+            T_EXPECT(++attempts < 100);
+            if (attempts >= 100) {
+                break;
+            }
+
+            switch (rand() % 5) {
+                case 0:
+                    gaugeReset(sim, client);
+                    break;
+                case 1:
+                    systemSleep(sim, client);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (!sameImage(sim) || sim.overruns) {
+            bad++;
+        }
+        resumed += client.resumed;
+        restarted += client.restarted;
+        sent += client.bytesSent;
+    }
+
+    T_EXPECT_EQ(bad, 0);
+    T_EXPECT(resumed > 0);
+    printf("    %d runs: %llu resumed, %llu restarted, %.2f images sent per update\n",
+           runs, (unsigned long long)resumed, (unsigned long long)restarted,
+           (double)sent / sizeof(image) / runs);
+}
+
+int main(void)
+{
+    srand(42);
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)rand();
+    }
+
+    T_RUN(testCheckResume);
+    T_RUN(testDropResumes);
+    T_RUN(testResetRestarts);
+    T_RUN(testSleepRestarts);
+    T_RUN(testNoProgressKeyRestarts);
+    T_RUN(testDropAfterUnackedChunkRestarts);
+    T_RUN(testRandomSessionDrops);
+
+    return T_RESULT();
+}
@@ -0,0 +1,143 @@
+/*
+ * AppleGasGaugeUpdateTransfer against a simulated SMC updater: the image
+ * reaches the gauge intact with and without a 'BFUW' window, the
+ * notification shortcut is only taken for windowed updaters, and the
+ * throughput of each configuration.
+ */
+#include <stdlib.h>
+#include "TestHarness.h"
+#include "AppleGasGaugeUpdateTransfer.h"
+#include "SimulatedGasGaugeUpdater.h"
+
+#define kChunkLen   32
+#define kDataOp     0x02
+
+static uint8_t image[4000];     // not a multiple of kChunkLen
+
+struct Result {
+    int                                 ret;
+    AppleGasGaugeUpdateTransferStats    stats;
+};
+
+static Result transfer(SimulatedGasGaugeUpdater &sim, uint8_t window, const char *name)
+{
+    AppleGasGaugeUpdateTransfer<SimulatedGasGaugeUpdater> xfer(sim, window, kChunkLen);
+    AppleGasGaugeUpdateCursor cursor(image, sizeof(image));
+    Result r;
+
+    r.ret = xfer.run(cursor, kDataOp);
+    r.stats = xfer.stats();
+
+    printf("    %-28s %8.0f B/s  %4u notified  %4u polled  %u overruns\n",
+           name, sim.ackedOffset * 1e6 / (double)sim.now,
+           r.stats.notified, r.stats.polled, sim.overruns);
+
+    return r;
+}
+
+static bool sameImage(const SimulatedGasGaugeUpdater &sim)
+{
+    return sim.image.size() == sizeof(image)
+        && !memcmp(sim.image.data(), image, sizeof(image));
+}
+
+static void testLegacyUpdater(void)
+{
+    SimulatedGasGaugeUpdater sim(false, 8000);
+    Result r = transfer(sim, 1, "legacy, window 1");
+
+    T_EXPECT_EQ(r.ret, 0);
+    T_EXPECT(sameImage(sim));
+    T_EXPECT_EQ(sim.overruns, 0);
+    T_EXPECT_EQ(sim.ackedOffset, sizeof(image));
+    // its early ready notification is never trusted
+    T_EXPECT_EQ(r.stats.notified, 0);
+    T_EXPECT_EQ(r.stats.polled, (sizeof(image) + kChunkLen - 1) / kChunkLen);
+}
+
+// Why the shortcut is gated on 'BFUW': a legacy updater reports ready
+// before it's done, so trusting it overruns the updater
+static void testShortcutOverrunsLegacyUpdater(void)
+{
+    SimulatedGasGaugeUpdater sim(false, 8000);
+
+    transfer(sim, 2, "legacy, window 2 (unsafe)");
+    T_EXPECT(sim.overruns > 0);
+    T_EXPECT(!sameImage(sim));
+}
+
+static void testWindowedUpdater(void)
+{
+    SimulatedGasGaugeUpdater legacy(false, 8000);
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Result r;
+
+    transfer(legacy, 1, "legacy, window 1");
+    r = transfer(sim, 2, "windowed, window 2");
+
+    T_EXPECT_EQ(r.ret, 0);
+    T_EXPECT(sameImage(sim));
+    T_EXPECT_EQ(sim.overruns, 0);
+    T_EXPECT_EQ(sim.ackedOffset, sizeof(image));
+    T_EXPECT_EQ(r.stats.polled, 0);
+    // no settle time, no status round trips, next chunk staged while busy
+    T_EXPECT(sim.now < legacy.now * 2 / 3);
+}
+
+// A windowed updater that also speaks the old protocol is still fine
+// with legacy pacing
+static void testWindowedUpdaterWithoutWindow(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Result r = transfer(sim, 1, "windowed, window 1");
+
+    T_EXPECT_EQ(r.ret, 0);
+    T_EXPECT(sameImage(sim));
+    T_EXPECT_EQ(r.stats.notified, 0);
+}
+
+// Completion notifications that don't arrive within the settle time fall
+// back to polling, which overwrites 'BFUD'; the staged chunk must be sent
+// again
+static void testSlowWindowedUpdaterFallsBackToPolling(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 40000);
+    Result r = transfer(sim, 2, "windowed, slow gauge");
+
+    T_EXPECT_EQ(r.ret, 0);
+    T_EXPECT(sameImage(sim));
+    T_EXPECT_EQ(sim.overruns, 0);
+    T_EXPECT_EQ(r.stats.notified, 0);
+    T_EXPECT_EQ(r.stats.polled, (sizeof(image) + kChunkLen - 1) / kChunkLen);
+}
+
+// An updater that never gets ready fails the transfer where it stopped
+static void testStuckUpdaterFails(void)
+{
+    SimulatedGasGaugeUpdater sim(true, 8000);
+    Result r;
+
+    sim.programUS = 10 * 1000 * 1000;
+    r = transfer(sim, 2, "windowed, stuck gauge");
+
+    T_EXPECT(r.ret != 0);
+    T_EXPECT_EQ(sim.commands, 1);
+    T_EXPECT_EQ(sim.ackedOffset, 0);
+}
+
+int main(void)
+{
+    srand(41);
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)rand();
+    }
+
+    T_RUN(testLegacyUpdater);
+    T_RUN(testShortcutOverrunsLegacyUpdater);
+    T_RUN(testWindowedUpdater);
+    T_RUN(testWindowedUpdaterWithoutWindow);
+    T_RUN(testSlowWindowedUpdaterFallsBackToPolling);
+    T_RUN(testStuckUpdaterFails);
+
+    return T_RESULT();
+}
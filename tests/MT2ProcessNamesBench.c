@@ -0,0 +1,195 @@
+/*
+ * mt2 per-process counting benchmark: the cost of recording one
+ * BackgroundTask raise during dark wake, the way mt2RecordAssertionEvent()
+ * used to do it and the way it does now.
+ *
+ *  - by name: an "already recorded this dark wake" set and a count
+ *    dictionary, both keyed by the process name and hashed and compared on
+ *    every event, like the CFSet and CFDictionary it replaced.
+ *  - interned: the ID cached in ProcessInfo, a bitset and a flat counter
+ *    array. A process's name is interned on its first event of each
+ *    reporting period.
+ *
+ * Both paths see the same events and have to publish the same counts.
+ *
+ *   make -C tests bench
+ *   ./build/MT2ProcessNamesBench [events]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "MT2ProcessNames.h"
+
+#define kProcesses          160         // processes taking assertions in dark wake
+#define kEventsPerDarkWake  40
+#define kEventsPerPeriod    (1000 * kEventsPerDarkWake)
+#define kSlots              (2 * kMT2MaxProcessNames)
+
+/* By name */
+
+typedef struct {
+    char        *key[kSlots];
+    uint32_t    value[kSlots];
+    uint32_t    used[kSlots];
+    uint32_t    count;
+} NameMap;
+
+static uint32_t *nameMapSlot(NameMap *m, const char *key, int add)
+{
+    uint32_t    slot = mt2ProcessNameHash(key, strlen(key)) & (kSlots - 1);
+
+    while (m->key[slot]) {
+        if (!strcmp(m->key[slot], key)) {
+            return &m->value[slot];
+        }
+        slot = (slot + 1) & (kSlots - 1);
+    }
+    if (!add) {
+        return NULL;
+    }
+    m->key[slot] = strdup(key);
+    m->value[slot] = 0;
+    m->used[m->count++] = slot;
+    return &m->value[slot];
+}
+
+static void nameMapClear(NameMap *m)
+{
+    for (uint32_t i = 0; i < m->count; i++) {
+        free(m->key[m->used[i]]);
+        m->key[m->used[i]] = NULL;
+    }
+    m->count = 0;
+}
+
+static NameMap  recordedByName, countsByName;
+
+static void recordByName(const char *name)
+{
+    if (!nameMapSlot(&recordedByName, name, 0)) {
+        (*nameMapSlot(&countsByName, name, 1))++;
+        nameMapSlot(&recordedByName, name, 1);
+    }
+}
+
+/* Interned */
+
+typedef struct {
+    const char          *name;
+    MT2ProcessNameRef   mt2Name;
+} Proc;
+
+static MT2ProcessNames  names;
+static uint32_t         counts[kMT2MaxProcessNames];
+static uint64_t         recorded[kMT2MaxProcessNames / 64];
+static unsigned int     interned;
+
+static const char *procName(void *context, char *buf, size_t len)
+{
+    interned++;
+    snprintf(buf, len, "%s", ((Proc *)context)->name);
+    return buf;
+}
+
+static void recordInterned(Proc *proc)
+{
+    uint16_t    nameID = mt2ProcessNamesLookup(&names, &proc->mt2Name, procName, proc);
+    uint64_t    *word = &recorded[nameID / 64];
+    uint64_t    bit = 1ULL << (nameID % 64);
+
+    if (!(*word & bit)) {
+        *word |= bit;
+        counts[nameID]++;
+    }
+}
+
+/* Driver */
+
+static Proc     procs[kProcesses];
+static char     procNames[kProcesses][kMT2ProcessNameLen];
+
+static double nowNS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Publishing: both paths must agree, then start the next period
+static int publish(void)
+{
+    int         mismatches = 0;
+    uint32_t    *byName;
+
+    for (int i = 0; i < kProcesses; i++) {
+        uint16_t id = procs[i].mt2Name.generation == names.generation ? procs[i].mt2Name.id : 0;
+        uint32_t n = id ? counts[id] : 0;
+
+        byName = nameMapSlot(&countsByName, procs[i].name, 0);
+        if ((byName ? *byName : 0) != n) {
+            mismatches++;
+        }
+    }
+
+    nameMapClear(&countsByName);
+    nameMapClear(&recordedByName);
+    memset(counts, 0, sizeof(counts));
+    memset(recorded, 0, sizeof(recorded));
+    mt2ProcessNamesReset(&names);
+
+    return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+    long        events = (argc > 1) ? atol(argv[1]) : 4000000;
+    uint16_t    *trace = malloc(events * sizeof(*trace));
+    double      start, byNameNS = 0, internedNS = 0;
+    int         mismatches = 0;
+
+    srand(48);
+    for (int i = 0; i < kProcesses; i++) {
+        snprintf(procNames[i], sizeof(procNames[i]), "com.apple.proc.%d.agent", i * 7919);
+        procs[i].name = procNames[i];
+    }
+    // a few processes take most of the assertions
+    for (long e = 0; e < events; e++) {
+        trace[e] = (uint16_t)((rand() % 4) ? rand() % 16 : rand() % kProcesses);
+    }
+    mt2ProcessNamesReset(&names);
+
+    for (long e = 0; e < events; e += kEventsPerDarkWake) {
+        long end = (e + kEventsPerDarkWake < events) ? e + kEventsPerDarkWake : events;
+
+        start = nowNS();
+        for (long i = e; i < end; i++) {
+            recordByName(procs[trace[i]].name);
+        }
+        nameMapClear(&recordedByName);              // mt2DarkWakeEnded()
+        byNameNS += nowNS() - start;
+
+        start = nowNS();
+        for (long i = e; i < end; i++) {
+            recordInterned(&procs[trace[i]]);
+        }
+        memset(recorded, 0, sizeof(recorded));      // mt2DarkWakeEnded()
+        internedNS += nowNS() - start;
+
+        if (end % kEventsPerPeriod == 0 || end == events) {
+            mismatches += publish();
+        }
+    }
+
+    printf("    %ld events, %d processes, %d per dark wake\n", events, kProcesses, kEventsPerDarkWake);
+    printf("    by name   %6.1f ns/event\n", byNameNS / events);
+    printf("    interned  %6.1f ns/event  (%u names interned)\n", internedNS / events, interned);
+    printf("    speedup   %6.1fx\n", byNameNS / internedNS);
+
+    free(trace);
+    if (mismatches) {
+        fprintf(stderr, "%d counts differ between the two paths\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
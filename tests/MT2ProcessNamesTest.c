@@ -0,0 +1,129 @@
+/*
+ * MT2ProcessNames: names intern to stable IDs within a reporting period,
+ * cached IDs are refreshed lazily after a reset, and a reset frees the room
+ * that a full table had used up.
+ */
+#include <stdio.h>
+#include "TestHarness.h"
+#include "MT2ProcessNames.h"
+
+static MT2ProcessNames table;
+
+static int conversions;
+
+static const char *nameOf(void *context, char *buf, size_t len)
+{
+    conversions++;
+    if (!context) {
+        return NULL;
+    }
+    snprintf(buf, len, "%s", (const char *)context);
+    return buf;
+}
+
+static void testInternIsStable(void)
+{
+    uint16_t a, b;
+
+    mt2ProcessNamesReset(&table);
+    a = mt2ProcessNamesIntern(&table, "apsd");
+    b = mt2ProcessNamesIntern(&table, "backupd");
+
+    T_EXPECT(a != kMT2UnknownProcessID);
+    T_EXPECT(b != kMT2UnknownProcessID);
+    T_EXPECT(a != b);
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, "apsd"), a);
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, "backupd"), b);
+    T_EXPECT_EQ(mt2ProcessNamesCount(&table), 3);
+    T_EXPECT(!strcmp(mt2ProcessNamesGet(&table, a), "apsd"));
+    T_EXPECT(!strcmp(mt2ProcessNamesGet(&table, kMT2UnknownProcessID), "Unknown"));
+    T_EXPECT(mt2ProcessNamesGet(&table, 3) == NULL);
+
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, NULL), kMT2UnknownProcessID);
+}
+
+// Names longer than kProcNameBufLen are compared on what fits
+static void testLongNames(void)
+{
+    char longer[2 * kMT2ProcessNameLen];
+    uint16_t id;
+
+    memset(longer, 'x', sizeof(longer) - 1);
+    longer[sizeof(longer) - 1] = '\0';
+
+    mt2ProcessNamesReset(&table);
+    id = mt2ProcessNamesIntern(&table, longer);
+    longer[kMT2ProcessNameLen] = '\0';
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, longer), id);
+    T_EXPECT_EQ(strlen(mt2ProcessNamesGet(&table, id)), kMT2ProcessNameLen - 1);
+    longer[kMT2ProcessNameLen - 2] = '\0';
+    T_EXPECT(mt2ProcessNamesIntern(&table, longer) != id);
+}
+
+static void testFullTableUntilReset(void)
+{
+    char name[kMT2ProcessNameLen];
+    int i;
+
+    mt2ProcessNamesReset(&table);
+    for (i = 1; i < kMT2MaxProcessNames; i++) {
+        snprintf(name, sizeof(name), "proc%d", i);
+        T_EXPECT_EQ(mt2ProcessNamesIntern(&table, name), i);
+    }
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, "late"), kMT2UnknownProcessID);
+    // names already in the table still resolve
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, "proc7"), 7);
+
+    // the next period starts empty, so "late" gets its own ID
+    mt2ProcessNamesReset(&table);
+    T_EXPECT_EQ(mt2ProcessNamesIntern(&table, "late"), 1);
+    T_EXPECT_EQ(mt2ProcessNamesCount(&table), 2);
+}
+
+static void testLookupIsLazy(void)
+{
+    MT2ProcessNameRef apsd = { 0, 0 }, anon = { 0, 0 };
+    uint16_t id;
+
+    mt2ProcessNamesReset(&table);
+    conversions = 0;
+
+    id = mt2ProcessNamesLookup(&table, &apsd, nameOf, "apsd");
+    T_EXPECT(id != kMT2UnknownProcessID);
+    T_EXPECT_EQ(mt2ProcessNamesLookup(&table, &apsd, nameOf, "apsd"), id);
+    T_EXPECT_EQ(mt2ProcessNamesLookup(&table, &anon, nameOf, NULL), kMT2UnknownProcessID);
+    T_EXPECT_EQ(mt2ProcessNamesLookup(&table, &anon, nameOf, NULL), kMT2UnknownProcessID);
+    T_EXPECT_EQ(conversions, 2);
+
+    // after a publish the cached IDs are stale and get interned again
+    mt2ProcessNamesIntern(&table, "first");
+    mt2ProcessNamesReset(&table);
+    mt2ProcessNamesIntern(&table, "first");
+    id = mt2ProcessNamesLookup(&table, &apsd, nameOf, "apsd");
+    T_EXPECT_EQ(conversions, 3);
+    T_EXPECT(!strcmp(mt2ProcessNamesGet(&table, id), "apsd"));
+}
+
+// A zeroed table, as a static one starts out, behaves like a reset one
+static void testZeroedTable(void)
+{
+    static MT2ProcessNames zeroed;
+    MT2ProcessNameRef ref = { 0, 0 };
+
+    T_EXPECT_EQ(mt2ProcessNamesCount(&zeroed), 0);
+    conversions = 0;
+    T_EXPECT_EQ(mt2ProcessNamesLookup(&zeroed, &ref, nameOf, "apsd"), 1);
+    T_EXPECT_EQ(conversions, 1);
+    T_EXPECT_EQ(mt2ProcessNamesCount(&zeroed), 2);
+}
+
+int main(void)
+{
+    T_RUN(testInternIsStable);
+    T_RUN(testLongNames);
+    T_RUN(testFullTableUntilReset);
+    T_RUN(testLookupIsLazy);
+    T_RUN(testZeroedTable);
+
+    return T_RESULT();
+}
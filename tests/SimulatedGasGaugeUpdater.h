@@ -0,0 +1,211 @@
+/*
+ * Simulated SMC gas gauge updater, driven through the Port interface of
+ * AppleGasGaugeUpdateTransfer. Time is simulated, in microseconds.
+ *
+ * Each 'BFUC' data command latches the chunk in 'BFUD' and keeps the
+ * updater busy for programUS. A legacy updater reports ready in the command
+ * notification right away, before it has programmed the chunk, and posts
+ * nothing when it's done. A windowed updater reports its real status and
+ * posts a completion notification when it's done, and it double buffers
+ * 'BFUD' so the next chunk can be staged while it's busy.
+ *
+ * Anything sent while the updater can't take it is counted in overruns and
+ * corrupts the image.
+ *
+ * The updater keeps one session, with a nonce, per 'start update'. A reset
+ * or a system sleep loses the session: the image received so far is gone
+ * and the nonce changes, but the updater reports ready again. Setting
+ * dropIn fails the dropIn'th port call from now on, the way a client going
+ * away interrupts a transfer without touching the updater.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "AppleGasGaugeUpdateResume.h"
+
+#define kSimDropped     1
+#define kSimTimeout     2
+
+struct SimulatedGasGaugeUpdater {
+    SimulatedGasGaugeUpdater(bool windowed, uint32_t programUS)
+        : windowed(windowed), smcWriteUS(600), notifyUS(400), programUS(programUS),
+          now(0), busyUntil(0), completionPending(false), bfudLen(0),
+          lastOp(0), lastReady(false), overruns(0), commands(0), ackedOffset(0),
+          sessionNonce(1), imageType(0), hasProgress(true), dropIn(0) {}
+
+    bool                    windowed;
+    uint32_t                smcWriteUS;     // one SMC key write or read
+    uint32_t                notifyUS;       // SMC notification latency
+    uint32_t                programUS;      // gauge programming one chunk
+
+    uint64_t                now;
+    uint64_t                busyUntil;
+    bool                    completionPending;
+    uint8_t                 bfud[32];
+    size_t                  bfudLen;        // 0 once a status read overwrote it
+    uint8_t                 lastOp;
+    bool                    lastReady;
+
+    std::vector<uint8_t>    image;          // what the gauge has programmed
+    uint32_t                overruns;
+    uint32_t                commands;
+    uint64_t                ackedOffset;
+
+    uint32_t                sessionNonce;
+    uint8_t                 imageType;
+    bool                    hasProgress;    // publishes 'BFUP'
+    uint32_t                dropIn;
+
+    bool dropped()
+    {
+        return dropIn && !--dropIn;
+    }
+
+    void settle()
+    {
+        if (now < busyUntil) {
+            now = busyUntil;
+        }
+        completionPending = false;
+    }
+
+    // 'start update': a new session
+    void startUpdate()
+    {
+        settle();
+        sessionNonce++;
+        image.clear();
+        imageType = 0;
+    }
+
+    void startImage(uint8_t type)
+    {
+        settle();
+        image.clear();
+        imageType = type;
+    }
+
+    // Gauge reset or system sleep
+    void loseSession()
+    {
+        startUpdate();
+    }
+
+    void nonce(uint8_t *out) const
+    {
+        memset(out, 0, kGgNonceLength);
+        memcpy(out, &sessionNonce, sizeof(sessionNonce));
+    }
+
+    bool progress(struct AppleGasGaugeUpdateProgress *p) const
+    {
+        memset(p, 0, sizeof(*p));
+        p->type = imageType;
+        p->received = (uint32_t)image.size();
+        return hasProgress;
+    }
+
+    bool busy() const { return now < busyUntil; }
+
+    // Port interface
+    int stage(const uint8_t *chunk, size_t length, uint64_t offset)
+    {
+        (void)offset;
+        if (dropped()) {
+            return kSimDropped;
+        }
+        now += smcWriteUS;
+        if (!windowed && busy()) {
+            // a legacy updater is still reading 'BFUD'
+            overruns++;
+        }
+        memcpy(bfud, chunk, length);
+        bfudLen = length;
+        return 0;
+    }
+
+    int command(uint8_t op, uint64_t offset)
+    {
+        if (dropped()) {
+            return kSimDropped;
+        }
+        now += smcWriteUS;
+        commands++;
+        if (busy() || !bfudLen || offset != image.size()) {
+            overruns++;
+            image.push_back(0xee);
+        } else {
+            image.insert(image.end(), bfud, bfud + bfudLen);
+        }
+        busyUntil = now + programUS;
+        completionPending = windowed;
+
+        now += notifyUS;
+        lastOp = op;
+        lastReady = windowed ? !busy() : true;
+        if (windowed && lastReady) {
+            completionPending = false;
+        }
+        return 0;
+    }
+
+    bool notifiedReady(uint8_t op)
+    {
+        return lastOp == op && lastReady;
+    }
+
+    int waitNotification(uint8_t op, unsigned int ms, bool *ready)
+    {
+        uint64_t deadline = now + ms * 1000ull;
+
+        *ready = false;
+        if (dropped()) {
+            return kSimDropped;
+        }
+        if (completionPending && busyUntil + notifyUS <= deadline) {
+            now = (busyUntil + notifyUS > now) ? busyUntil + notifyUS : now;
+            completionPending = false;
+            lastOp = op;
+            lastReady = true;
+            *ready = true;
+            return 0;
+        }
+        now = deadline;
+        return 0;
+    }
+
+    void sleep(unsigned int ms)
+    {
+        now += ms * 1000ull;
+    }
+
+    int pollReady(uint8_t op, unsigned int timeout_ms, unsigned int retry_ms)
+    {
+        uint64_t deadline = now + timeout_ms * 1000ull;
+
+        (void)op;
+        if (dropped()) {
+            return kSimDropped;
+        }
+        for (;;) {
+            // 'BFUC' status command, its notification, 'BFUD' read
+            now += 2 * smcWriteUS + notifyUS;
+            bfudLen = 0;
+            if (!busy()) {
+                completionPending = false;
+                return 0;
+            }
+            if (now >= deadline) {
+                return kSimTimeout;
+            }
+            now += retry_ms * 1000ull;
+        }
+    }
+
+    void acked(uint64_t offset, size_t length)
+    {
+        ackedOffset = offset + length;
+    }
+};
@@ -0,0 +1,232 @@
+/*
+ * SleepWakeJournal: every record type survives the encoder and decoder,
+ * slots that don't hold the expected entry are rejected, and the ring hands
+ * records back oldest first across wraparound, dropping the oldest when it
+ * falls a full ring behind.
+ */
+#include <stdio.h>
+#include "TestHarness.h"
+#include "SleepWakeJournal.h"
+
+static SleepWakeJournal journal;
+
+static void initRecord(SleepWakeJournalRecord *rec, uint32_t type, int n)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->type = type;
+    rec->time.tv_sec = 1500000000 + n;
+    rec->time.tv_nsec = n * 1000;
+    snprintf(rec->uuid, sizeof(rec->uuid), "5A1B2C3D-0000-4000-8000-%012d", n);
+    snprintf(rec->sig, sizeof(rec->sig), "Success");
+}
+
+static void fillSleep(SleepWakeJournalRecord *rec, int n)
+{
+    initRecord(rec, kJournalSleep, n);
+    rec->u.sleep.sleepType = 1;
+    rec->u.sleep.success = true;
+    rec->u.sleep.onAC = (n & 1);
+    rec->u.sleep.tcpKeepAliveSupported = true;
+    rec->u.sleep.battPct = (uint32_t)(n % 101);
+    snprintf(rec->u.sleep.reason, sizeof(rec->u.sleep.reason), "Idle Sleep");
+    snprintf(rec->u.sleep.tcpKeepAlive, sizeof(rec->u.sleep.tcpKeepAlive), "active");
+}
+
+static void fillWake(SleepWakeJournalRecord *rec, int n)
+{
+    initRecord(rec, kJournalWake, n);
+    rec->u.wake.wakeType = 2;
+    rec->u.wake.capabilities = 0x1f;
+    rec->u.wake.success = true;
+    rec->u.wake.battPct = 80;
+    rec->u.wake.darkWakeCnt = n;
+    rec->u.wake.claimCount = kJournalClaimsMax;
+    snprintf(rec->u.wake.sleepType, sizeof(rec->u.wake.sleepType), "Standby");
+    snprintf(rec->u.wake.detail, sizeof(rec->u.wake.detail), "EC.LidOpen/Lid Open");
+    for (int i = 0; i < kJournalClaimsMax; i++) {
+        snprintf(rec->u.wake.claimReason[i], kJournalClaimLen, "XHC%d", i);
+        snprintf(rec->u.wake.claimDetails[i], kJournalClaimLen, "port %d", i);
+    }
+}
+
+static void fillHibernate(SleepWakeJournalRecord *rec, int n)
+{
+    initRecord(rec, kJournalHibernateStats, n);
+    rec->u.hibernate.sleepCntSinceBoot = n;
+    rec->u.hibernate.sleepCntSinceFailure = n / 2;
+    rec->u.hibernate.standbyDelayHigh = 86400;
+}
+
+static void fillAppWake(SleepWakeJournalRecord *rec, int n)
+{
+    initRecord(rec, kJournalAppWakeReason, n);
+    rec->u.appWake.hasIdent = true;
+    snprintf(rec->u.appWake.ident, sizeof(rec->u.appWake.ident), "com.apple.apsd");
+    snprintf(rec->u.appWake.reason, sizeof(rec->u.appWake.reason), "push %d", n);
+}
+
+static void (* const fill[])(SleepWakeJournalRecord *, int) = {
+    fillSleep, fillWake, fillHibernate, fillAppWake
+};
+#define kFillCount  (sizeof(fill) / sizeof(fill[0]))
+
+// Distinguishes the n-th record of the tests below
+static int recordNumber(const SleepWakeJournalRecord *rec)
+{
+    return (int)(rec->time.tv_sec - 1500000000);
+}
+
+static void testRoundTrip(void)
+{
+    uint8_t                 slot[kJournalSlotLen];
+    SleepWakeJournalRecord  rec, out;
+    size_t                  len, wakeLen = 0, hibernateLen = 0;
+
+    for (size_t i = 0; i < kFillCount; i++) {
+        fill[i](&rec, (int)i + 7);
+        len = sleepWakeJournalEncode(&rec, 42, slot, sizeof(slot));
+        T_EXPECT(len > 0);
+        T_EXPECT(len <= kJournalSlotLen);
+        T_EXPECT(sleepWakeJournalDecode(slot, len, 42, &out));
+        T_EXPECT(!memcmp(&rec, &out, sizeof(rec)));
+
+        if (rec.type == kJournalWake) {
+            wakeLen = len;
+        } else if (rec.type == kJournalHibernateStats) {
+            hibernateLen = len;
+        }
+    }
+    // only the part of the union a record uses is stored
+    T_EXPECT(hibernateLen < wakeLen / 4);
+}
+
+static void testDecodeRejects(void)
+{
+    uint8_t                     slot[kJournalSlotLen];
+    SleepWakeJournalSlotHeader  hdr;
+    SleepWakeJournalRecord      rec, out;
+    size_t                      len;
+
+    fillSleep(&rec, 1);
+    len = sleepWakeJournalEncode(&rec, 5, slot, sizeof(slot));
+
+    // a slot overwritten by a later entry, or truncated
+    T_EXPECT(!sleepWakeJournalDecode(slot, len, 4, &out));
+    T_EXPECT(!sleepWakeJournalDecode(slot, len - 1, 5, &out));
+    T_EXPECT(!sleepWakeJournalDecode(slot, sizeof(hdr) - 1, 5, &out));
+
+    // a length that doesn't match the type
+    memcpy(&hdr, slot, sizeof(hdr));
+    hdr.type = kJournalHibernateStats;
+    memcpy(slot, &hdr, sizeof(hdr));
+    T_EXPECT(!sleepWakeJournalDecode(slot, len, 5, &out));
+
+    // unknown types are neither encoded nor decoded
+    hdr.type = 99;
+    memcpy(slot, &hdr, sizeof(hdr));
+    T_EXPECT(!sleepWakeJournalDecode(slot, len, 5, &out));
+    rec.type = 0;
+    T_EXPECT_EQ(sleepWakeJournalEncode(&rec, 5, slot, sizeof(slot)), 0);
+
+    // too small a buffer
+    fillSleep(&rec, 1);
+    T_EXPECT_EQ(sleepWakeJournalEncode(&rec, 5, slot, len - 1), 0);
+}
+
+// Unterminated strings come back terminated
+static void testDecodeTerminates(void)
+{
+    uint8_t                 slot[kJournalSlotLen];
+    SleepWakeJournalRecord  rec, out;
+    size_t                  len;
+
+    fillAppWake(&rec, 1);
+    memset(rec.sig, 'S', sizeof(rec.sig));
+    memset(rec.u.appWake.reason, 'R', sizeof(rec.u.appWake.reason));
+    len = sleepWakeJournalEncode(&rec, 0, slot, sizeof(slot));
+
+    T_EXPECT(sleepWakeJournalDecode(slot, len, 0, &out));
+    T_EXPECT_EQ(strlen(out.sig), sizeof(out.sig) - 1);
+    T_EXPECT_EQ(strlen(out.u.appWake.reason), sizeof(out.u.appWake.reason) - 1);
+}
+
+// Posting and taking in bursts that move the ring around it many times
+static void testOrderAcrossWraparound(void)
+{
+    SleepWakeJournalRecord  rec, out;
+    int                     posted = 0, taken = 0;
+
+    memset(&journal, 0, sizeof(journal));
+
+    for (int round = 0; round < 50; round++) {
+        int burst = 1 + (round * 7) % (kSleepWakeJournalDepth - 1);
+
+        for (int i = 0; i < burst; i++, posted++) {
+            fill[posted % kFillCount](&rec, posted);
+            T_EXPECT(sleepWakeJournalPost(&journal, &rec));
+        }
+        while (sleepWakeJournalTake(&journal, &out)) {
+            fill[taken % kFillCount](&rec, taken);
+            T_EXPECT_EQ(recordNumber(&out), taken);
+            T_EXPECT(!memcmp(&rec, &out, sizeof(rec)));
+            taken++;
+        }
+    }
+
+    T_EXPECT_EQ(taken, posted);
+    T_EXPECT(journal.head > 10 * kSleepWakeJournalDepth);
+    T_EXPECT_EQ(journal.dropped, 0);
+}
+
+// Falling behind drops the oldest records, the rest still come out in order
+static void testOverflowDropsOldest(void)
+{
+    SleepWakeJournalRecord  rec, out;
+    int                     total = 3 * kSleepWakeJournalDepth + 5;
+    int                     next = total - kSleepWakeJournalDepth;
+
+    memset(&journal, 0, sizeof(journal));
+    for (int i = 0; i < total; i++) {
+        fillHibernate(&rec, i);
+        sleepWakeJournalPost(&journal, &rec);
+    }
+    T_EXPECT_EQ(journal.dropped, total - kSleepWakeJournalDepth);
+
+    while (sleepWakeJournalTake(&journal, &out)) {
+        T_EXPECT_EQ(out.u.hibernate.sleepCntSinceBoot, next);
+        next++;
+    }
+    T_EXPECT_EQ(next, total);
+}
+
+// A slot that doesn't decode is skipped and counted, not rendered
+static void testCorruptSlotSkipped(void)
+{
+    SleepWakeJournalRecord  rec, out;
+
+    memset(&journal, 0, sizeof(journal));
+    for (int i = 0; i < 3; i++) {
+        fillHibernate(&rec, i);
+        sleepWakeJournalPost(&journal, &rec);
+    }
+    journal.slots[1][0] ^= 0xff;
+
+    T_EXPECT(sleepWakeJournalTake(&journal, &out));
+    T_EXPECT_EQ(out.u.hibernate.sleepCntSinceBoot, 0);
+    T_EXPECT(sleepWakeJournalTake(&journal, &out));
+    T_EXPECT_EQ(out.u.hibernate.sleepCntSinceBoot, 2);
+    T_EXPECT(!sleepWakeJournalTake(&journal, &out));
+    T_EXPECT_EQ(journal.dropped, 1);
+}
+
+int main(void)
+{
+    T_RUN(testRoundTrip);
+    T_RUN(testDecodeRejects);
+    T_RUN(testDecodeTerminates);
+    T_RUN(testOrderAcrossWraparound);
+    T_RUN(testOverflowDropsOldest);
+    T_RUN(testCorruptSlotSkipped);
+
+    return T_RESULT();
+}
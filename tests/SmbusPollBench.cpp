@@ -0,0 +1,161 @@
+/*
+ * Battery poll benchmark: runs the SMBus reads of a full battery poll
+ * through SmbusTransactionMachine against SmbusSimulatedBatteryModel, the
+ * same pair SmbusHandler and SmbusSimulatedBattery wrap in the kext, under
+ * a few fault scenarios.
+ *
+ * Poll durations are in simulated time: the model's per-command latency
+ * plus the retry delays, which is what a poll costs on the bus. Host ns/poll
+ * is the CPU cost of the state machine itself.
+ *
+ *   make -C tests bench
+ *   ./build/SmbusPollBench [polls]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "SmbusTransactionMachine.h"
+#include "SmbusSimulatedBatteryModel.h"
+
+// Same table as SmbusHandler.cpp
+static const uint32_t delaysUS[] = { 10, 100, 1000, 10000, 250000 };
+
+// The SMBus reads of a kFull poll, in AppleSmartBattery's command table order
+static const struct {
+    uint8_t         address;
+    uint8_t         command;
+    ASBMgrOpType    opType;
+} pollCommands[] = {
+    { kSMBusBatteryAddr,    kBVoltageCmd,                   kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBCurrentCmd,                   kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBAverageCurrentCmd,            kASBMSMBUSReadWord },
+    { kSMBusManagerAddr,    kMStateContCmd,                 kASBMSMBUSReadWord },
+    { kSMBusManagerAddr,    kMStateCmd,                     kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBBatteryStatusCmd,             kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBExtendedOperationStatusCmd,   kASBMSMBUSExtendedReadWord },
+    { kSMBusBatteryAddr,    kBMaxErrorCmd,                  kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBRunTimeToEmptyCmd,            kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBTemperatureCmd,               kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBCycleCountCmd,                kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBAverageTimeToEmptyCmd,        kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBExtendedPFStatusCmd,          kASBMSMBUSExtendedReadWord },
+    { kSMBusBatteryAddr,    kBAverageTimeToFullCmd,         kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBRemainingCapacityCmd,         kASBMSMBUSReadWord },
+    { kSMBusBatteryAddr,    kBFullChargeCapacityCmd,        kASBMSMBUSReadWord },
+};
+#define kPollCommandCount   (sizeof(pollCommands) / sizeof(pollCommands[0]))
+
+struct Scenario {
+    const char      *name;
+    SmbusSimFaults  faults;
+};
+
+// SmbusSimulatedBattery reports injected errors as kIOSMBusStatusDeviceError
+// by default, which SmbusHandler::classifyStatus() retries
+static SmbusAttemptResult classify(SmbusSimResult r)
+{
+    switch (r) {
+        case kSmbusSimOK:           return kSmbusAttemptOK;
+        case kSmbusSimUnsupported:  return kSmbusAttemptFatal;
+        default:                    return kSmbusAttemptRetry;
+    }
+}
+
+static uint64_t hostNS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(const Scenario &sc, int polls)
+{
+    SmbusSimulatedBatteryModel  *model = new SmbusSimulatedBatteryModel;
+    SmbusTransactionMachine     *machine = new SmbusTransactionMachine;
+    std::vector<uint64_t>       durations;
+    uint64_t                    failed = 0, retries = 0, demotions = 0;
+    uint64_t                    start, hostTotal;
+    uint8_t                     rx[MAX_SMBUS_DATA_SIZE];
+    uint8_t                     count;
+    uint16_t                    state;
+
+    model->init();
+    model->faults() = sc.faults;
+    machine->init(delaysUS, sizeof(delaysUS) / sizeof(delaysUS[0]));
+    durations.reserve(polls);
+
+    start = hostNS();
+    for (int p = 0; p < polls; p++) {
+        uint64_t us = 0;
+
+        for (unsigned i = 0; i < kPollCommandCount; i++) {
+            SmbusTransactionStep    step;
+            uint32_t                delay;
+
+            machine->start(pollCommands[i].opType, pollCommands[i].address,
+                           pollCommands[i].command, false, NULL);
+            do {
+                const SmbusBusTransfer &t = machine->transfer();
+
+                us += model->latencyUS(t.command);
+                step = machine->complete(classify(model->execute(t, rx, &count)), rx, &delay);
+                if (kSmbusStepRetry == step) {
+                    us += delay;
+                    retries++;
+                }
+            } while ((kSmbusStepRetry == step) || (kSmbusStepSubmit == step));
+
+            if (kSmbusStepFailed == step) {
+                failed++;
+            }
+            if (kSmbusBudgetDemoted == machine->budgetChange()) {
+                demotions++;
+            }
+        }
+        // Alarms only restart the poll in the kext; drain them here
+        model->takeAlarm(&state);
+        durations.push_back(us);
+    }
+    hostTotal = hostNS() - start;
+
+    std::sort(durations.begin(), durations.end());
+    printf("%-14s %6d polls  %6.2f xfers/poll  p50 %8.2f ms  p99 %8.2f ms  "
+           "%6.3f retries/poll  %6llu failed reads  %3llu demotions  %6.0f host ns/poll\n",
+           sc.name, polls,
+           (double)model->stats().transactions / polls,
+           durations[(size_t)polls * 50 / 100] / 1000.0,
+           durations[(size_t)polls * 99 / 100] / 1000.0,
+           (double)retries / polls,
+           (unsigned long long)failed,
+           (unsigned long long)demotions,
+           (double)hostTotal / polls);
+
+    delete machine;
+    delete model;
+}
+
+int main(int argc, char **argv)
+{
+    int polls = (argc > 1) ? atoi(argv[1]) : 5000;
+    // nakEvery, errorCmd, errorCount, removeAfter, insertAfter
+    const Scenario scenarios[] = {
+        { "clean",      { 0,    0,                  0,      0,      0 } },
+        { "nak-1/50",   { 50,   0,                  0,      0,      0 } },
+        { "nak-1/7",    { 7,    0,                  0,      0,      0 } },
+        { "temp-stuck", { 0,    kBTemperatureCmd,   ~0u,    0,      0 } },
+        { "removal",    { 0,    0,                  0,      20000,  20000 } },
+    };
+
+    if (polls <= 0) {
+        fprintf(stderr, "usage: %s [polls]\n", argv[0]);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        run(scenarios[i], polls);
+    }
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * SmbusRetryPolicy: scripted transaction status sequences driven through
+ * the policy the way SmbusHandler::smbusCompletion() drives it.
+ */
+#include <vector>
+#include "TestHarness.h"
+#include "SmbusRetryPolicy.h"
+
+// Same table as SmbusHandler.cpp
+static const uint32_t delaysUS[] = { 10, 100, 1000, 10000, 250000 };
+#define kDelayCount     5
+
+// Smart battery and manager addresses; both use command 0x01 for
+// unrelated registers (RemainingCapacityAlarm and the manager state)
+#define kBattery        0x0b
+#define kManager        0x0a
+#define kCmd            0x01
+
+#define OK      kSmbusAttemptOK
+#define RETRY   kSmbusAttemptRetry
+#define FATAL   kSmbusAttemptFatal
+
+struct Poll {
+    int         attempts;
+    uint32_t    waitedUS;
+    bool        success;
+    SmbusBudgetChange change;
+};
+
+// One poll of (address, command): each attempt takes the next result from
+// the script, which repeats its last entry once exhausted
+static Poll runPoll(SmbusRetryPolicy *p, uint8_t address, uint8_t command,
+                    const std::vector<SmbusAttemptResult> &script)
+{
+    Poll        poll = { 0, 0, false, kSmbusBudgetUnchanged };
+    uint32_t    delay;
+    SmbusAttemptResult result;
+
+    p->begin(address, command);
+    do {
+        result = script[poll.attempts < (int)script.size() ? poll.attempts : script.size() - 1];
+        poll.attempts++;
+        delay = p->nextRetryUS(result);
+        poll.waitedUS += delay;
+    } while (delay);
+
+    poll.success = (OK == result);
+    poll.change = p->finish(poll.success);
+    return poll;
+}
+
+static void testFirstAttemptSucceeds(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+
+    Poll r = runPoll(p, kBattery, kCmd, { OK });
+    T_EXPECT_EQ(r.attempts, 1);
+    T_EXPECT_EQ(r.waitedUS, 0);
+    T_EXPECT(r.success);
+    T_EXPECT_EQ(p->budget(kBattery, kCmd).successes, 1);
+    delete p;
+}
+
+static void testRetriesWalkTheDelayTable(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+
+    Poll r = runPoll(p, kBattery, kCmd, { RETRY, RETRY, OK });
+    T_EXPECT_EQ(r.attempts, 3);
+    T_EXPECT_EQ(r.waitedUS, 10 + 100);
+    T_EXPECT(r.success);
+    T_EXPECT_EQ(p->retryAttempts(), 0);
+
+    // Full table, then give up
+    r = runPoll(p, kBattery, kCmd, { RETRY });
+    T_EXPECT_EQ(r.attempts, kDelayCount + 1);
+    T_EXPECT_EQ(r.waitedUS, 10 + 100 + 1000 + 10000 + 250000);
+    T_EXPECT(!r.success);
+    T_EXPECT_EQ(p->budget(kBattery, kCmd).failures, 1);
+    delete p;
+}
+
+static void testFatalIsNotRetried(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+
+    Poll r = runPoll(p, kBattery, kCmd, { RETRY, FATAL });
+    T_EXPECT_EQ(r.attempts, 2);
+    T_EXPECT_EQ(r.waitedUS, 10);
+    T_EXPECT(!r.success);
+    delete p;
+}
+
+static void testDemoteProbeAndPromote(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+    Poll r;
+
+    for (int i = 0; i < kSmbusDemoteAfterFailures; i++) {
+        r = runPoll(p, kBattery, kCmd, { RETRY });
+        T_EXPECT_EQ(r.attempts, kDelayCount + 1);
+    }
+    T_EXPECT_EQ(r.change, kSmbusBudgetDemoted);
+    T_EXPECT(p->budget(kBattery, kCmd).demoted);
+
+    // One attempt per poll until the probe
+    for (int i = 1; i < kSmbusDemotedProbeInterval; i++) {
+        r = runPoll(p, kBattery, kCmd, { RETRY });
+        T_EXPECT_EQ(r.attempts, 1);
+        T_EXPECT_EQ(r.waitedUS, 0);
+        T_EXPECT_EQ(r.change, kSmbusBudgetUnchanged);
+    }
+
+    // The probe gets the full table again, and a success promotes
+    r = runPoll(p, kBattery, kCmd, { RETRY, RETRY, RETRY, OK });
+    T_EXPECT_EQ(r.attempts, 4);
+    T_EXPECT_EQ(r.change, kSmbusBudgetPromoted);
+    T_EXPECT(!p->budget(kBattery, kCmd).demoted);
+
+    r = runPoll(p, kBattery, kCmd, { RETRY, OK });
+    T_EXPECT_EQ(r.attempts, 2);
+    delete p;
+}
+
+static void testSuccessBetweenFailuresKeepsRetries(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+
+    runPoll(p, kBattery, kCmd, { RETRY });
+    runPoll(p, kBattery, kCmd, { RETRY });
+    runPoll(p, kBattery, kCmd, { OK });
+    runPoll(p, kBattery, kCmd, { RETRY });
+    T_EXPECT(!p->budget(kBattery, kCmd).demoted);
+    T_EXPECT_EQ(p->budget(kBattery, kCmd).consecutiveFailures, 1);
+    delete p;
+}
+
+static void testBudgetsAreKeyedByAddress(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+    Poll r;
+
+    for (int i = 0; i < kSmbusDemoteAfterFailures; i++) {
+        runPoll(p, kBattery, kCmd, { RETRY });
+    }
+    T_EXPECT(p->budget(kBattery, kCmd).demoted);
+    T_EXPECT(!p->budget(kManager, kCmd).demoted);
+
+    // The manager's register with the same command code still retries
+    r = runPoll(p, kManager, kCmd, { RETRY, OK });
+    T_EXPECT_EQ(r.attempts, 2);
+    T_EXPECT_EQ(p->budget(kManager, kCmd).successes, 1);
+    T_EXPECT_EQ(p->budget(kBattery, kCmd).successes, 0);
+
+    // ...and its success doesn't promote the battery's
+    T_EXPECT(p->budget(kBattery, kCmd).demoted);
+    delete p;
+}
+
+static void testResetRestartsTheTable(void)
+{
+    SmbusRetryPolicy *p = new SmbusRetryPolicy;
+    p->init(delaysUS, kDelayCount);
+
+    // Extended read: the select write retries, then the read starts over
+    p->begin(kBattery, 0x54);
+    T_EXPECT_EQ(p->nextRetryUS(RETRY), 10);
+    T_EXPECT_EQ(p->nextRetryUS(OK), 0);
+    p->reset();
+    T_EXPECT_EQ(p->nextRetryUS(RETRY), 10);
+    T_EXPECT_EQ(p->retryAttempts(), 1);
+    T_EXPECT_EQ(p->finish(true), kSmbusBudgetUnchanged);
+    delete p;
+}
+
+int main(void)
+{
+    T_RUN(testFirstAttemptSucceeds);
+    T_RUN(testRetriesWalkTheDelayTable);
+    T_RUN(testFatalIsNotRetried);
+    T_RUN(testDemoteProbeAndPromote);
+    T_RUN(testSuccessBetweenFailuresKeepsRetries);
+    T_RUN(testBudgetsAreKeyedByAddress);
+    T_RUN(testResetRestartsTheTable);
+    return T_RESULT();
+}
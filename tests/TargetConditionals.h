@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for the SDK header, for the tests in this directory.
+ */
+#pragma once
+
+#define TARGET_OS_OSX_X86   0
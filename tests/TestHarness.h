@@ -0,0 +1,37 @@
+/*
+ * Minimal assertion helpers for the host-side unit tests in this directory.
+ * Usable from C and C++; each test program includes it once.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int gTestFailures = 0;
+
+#define T_EXPECT(cond)                                                      \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #cond); \
+            gTestFailures++;                                                \
+        }                                                                   \
+    } while (0)
+
+#define T_EXPECT_EQ(a, b)                                                   \
+    do {                                                                    \
+        long long _a = (long long)(a), _b = (long long)(b);                 \
+        if (_a != _b) {                                                     \
+            fprintf(stderr, "%s:%d: expected %s == %s (%lld != %lld)\n",    \
+                    __FILE__, __LINE__, #a, #b, _a, _b);                    \
+            gTestFailures++;                                                \
+        }                                                                   \
+    } while (0)
+
+#define T_RUN(fn)                                                           \
+    do {                                                                    \
+        int _before = gTestFailures;                                        \
+        fn();                                                               \
+        printf("%s %s\n", (gTestFailures == _before) ? "PASS" : "FAIL", #fn); \
+    } while (0)
+
+#define T_RESULT()  (gTestFailures ? 1 : 0)